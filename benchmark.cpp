@@ -0,0 +1,189 @@
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <algorithm>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+// The next line will cancel CHECK_XXX macro used in header files,
+// but have no effect on these in src files.
+#define CANCEL_CHECK
+
+#include "utils/base_config.h"
+#include "exp/function.h"
+#include "tensor/tensor.h"
+#include "tensor/grad_engine.h"
+#include "nn/module.h"
+#include "utils/thread_pool.h"
+#include "data/data.h"
+#include "data/convert.h"
+
+using st::index_t;
+using st::data_t;
+
+// Best of n_repeats runs, in milliseconds.
+double benchmark(const std::function<void(void)>& kernel, int n_repeats=5) {
+    using namespace std::chrono;
+    double best = 0;
+    for(int i = 0; i < n_repeats; ++i) {
+        steady_clock::time_point start_tp = steady_clock::now();
+        kernel();
+        steady_clock::time_point end_tp = steady_clock::now();
+        double ms = duration_cast<duration<double, std::milli>>(end_tp - start_tp).count();
+        best = i == 0 ? ms : std::min(best, ms);
+    }
+    return best;
+}
+
+void report(const char* name, double ms) {
+    std::cout << std::left << std::setw(32) << name
+              << std::right << std::setw(10) << std::fixed << std::setprecision(3)
+              << ms << " ms" << std::endl;
+}
+
+void fill(st::Tensor& t) {
+    st::Tensor flat = t.view({t.size().dsize()});
+    for(index_t i = 0; i < flat.size(0); ++i)
+        flat[{i}] = std::sin(i * 0.37);
+}
+
+void write_file(const std::string& path, const std::vector<unsigned char>& bytes) {
+    std::FILE* file = std::fopen(path.c_str(), "wb");
+    std::fwrite(bytes.data(), 1, bytes.size(), file);
+    std::fclose(file);
+}
+
+// Files of MNIST and Cifar10 of random pixels, in the working directory.
+void write_datasets(void) {
+    index_t n_mnist = 60000, n_pixels = st::data::MNIST::Img::n_pixels_;
+    std::vector<unsigned char> imgs(16 + n_mnist * n_pixels), labels(8 + n_mnist);
+    unsigned char header[8] = {0, 0, 8, 3, 0, 0, 0xea, 0x60};  // 60000
+    std::copy(header, header + 8, imgs.begin());
+    std::copy(header, header + 8, labels.begin());
+    imgs[11] = 28, imgs[15] = 28;
+    for(index_t i = 16; i < imgs.size(); ++i)
+        imgs[i] = i * 7 % 256;
+    for(index_t i = 8; i < labels.size(); ++i)
+        labels[i] = i % 10;
+    write_file("benchmark-images.idx3-ubyte", imgs);
+    write_file("benchmark-labels.idx1-ubyte", labels);
+
+    index_t record_size = 1 + st::data::Cifar10::Img::n_pixels_;
+    std::vector<unsigned char> records(10000 * record_size);
+    for(index_t i = 0; i < records.size(); ++i)
+        records[i] = i % record_size == 0 ? i / record_size % 10 : i * 13 % 256;
+    for(int k = 1; k <= 5; ++k)
+        write_file("data_batch_" + std::to_string(k) + ".bin", records);
+}
+
+void remove_datasets(void) {
+    std::remove("benchmark-images.idx3-ubyte");
+    std::remove("benchmark-labels.idx1-ubyte");
+    for(int k = 1; k <= 5; ++k)
+        std::remove(("data_batch_" + std::to_string(k) + ".bin").c_str());
+}
+
+// Hot kernels of forward and backward, and loading of datasets. Build it
+// with `make benchmark`, and `make benchmark INDEX_64BIT=1` to compare the
+// width of index_t, or `make benchmark SIMD=1` for the AVX2 paths.
+int main() {
+    std::cout << "index_t: " << sizeof(index_t) * 8 << " bits" << std::endl;
+
+    st::Tensor a(st::Shape{1024, 1024}), b(st::Shape{1024, 1024});
+    st::Tensor c(st::Shape{1024, 1024});
+    fill(a); fill(b);
+    report("elementwise a * b + a", benchmark([&]() { c = a * b + a; }));
+    report("uncontiguous transpose(a)", benchmark([&]() {
+        st::Tensor t = c.transpose(0, 1);
+        t = a;
+    }));
+    report("broadcast a + row", benchmark([&]() {
+        st::Tensor row = a.slice(0, 1, 0);
+        c = a + row;
+    }));
+    report("mean(a, 1)", benchmark([&]() { st::Tensor m = st::op::mean(a, 1); }));
+
+    st::Tensor x(st::Shape{128, 512}), w(st::Shape{256, 512});
+    fill(x); fill(w);
+    report("matrix_mul 128x512x256", benchmark([&]() {
+        st::Tensor y = st::op::matrix_mul(x, st::op::matrix_transpose(w));
+    }));
+
+    st::Tensor img(st::Shape{32, 8, 28, 28});
+    fill(img);
+    report("img2col 32x8x28x28 k3", benchmark([&]() {
+        st::Tensor col = st::op::img2col(img, {3, 3}, {1, 1}, {1, 1});
+    }));
+    report("max_pool2d 32x8x28x28 k2", benchmark([&]() {
+        st::Tensor pool = st::op::max_pool2d(img, {2, 2}, {2, 2}, {0, 0});
+    }));
+
+    // Backward of the convolutions of train_cnn, on a smaller batch. The
+    // gradients of the input and the weight of a convolution are independent,
+    // and run concurrently with more backward threads.
+    st::nn::Conv2dWithReLU conv0(3, 32, {5, 5}, {2, 2}, {2, 2});
+    st::nn::Conv2dWithReLU conv1(32, 32, {3, 3}, {1, 1}, {1, 1});
+    st::nn::MaxPool2d pool({2, 2}, {2, 2}, {0, 0});
+    st::Tensor cnn_input(st::Shape{8, 3, 32, 32});
+    fill(cnn_input);
+    auto backward_cnn = [&](index_t n_threads) {
+        st::GradEngine::set_num_threads(n_threads);
+        double best = 0;
+        for(int i = 0; i < 3; ++i) {
+            st::Tensor x1 = conv0.forward(cnn_input);
+            st::Tensor x2 = conv1.forward(x1);
+            st::Tensor x3 = pool.forward(x2);
+            st::Tensor loss = st::op::mean(st::op::mean(
+                st::op::mean(st::op::mean(x3, 3), 2), 1), 0);
+            double ms = benchmark([&]() { loss.backward(); }, 1);
+            best = i == 0 ? ms : std::min(best, ms);
+        }
+        st::GradEngine::set_num_threads(1);
+        return best;
+    };
+    index_t n_backward_threads = std::max(2u, std::thread::hardware_concurrency());
+    report("backward conv, 1 thread", backward_cnn(1));
+    std::cout << "with " << n_backward_threads << " threads:" << std::endl;
+    report("backward conv", backward_cnn(n_backward_threads));
+
+    // Loading datasets into memory, with and without a pool to split it.
+    // The conversion of one Cifar10 train set alone is compared with the
+    // division by 255 per pixel it replaced.
+    write_datasets();
+    std::vector<unsigned char> bytes(50000 * st::data::Cifar10::Img::n_pixels_);
+    for(index_t i = 0; i < bytes.size(); ++i)
+        bytes[i] = i * 13 % 256;
+    std::vector<data_t> pixels(bytes.size());
+    report("uint8 to data_t, divide", benchmark([&]() {
+        for(index_t i = 0; i < bytes.size(); ++i)
+            pixels[i] = bytes[i] / 255.0;
+    }));
+    report("uint8 to data_t, bytes_to_data", benchmark([&]() {
+        st::data::bytes_to_data(bytes.data(), bytes.size(), 1.0 / 255, 0,
+                                pixels.data());
+    }));
+    auto load_mnist = []() {
+        st::data::MNIST mnist("benchmark-images.idx3-ubyte",
+                              "benchmark-labels.idx1-ubyte", 64, false);
+    };
+    auto load_cifar10 = []() {
+        st::data::Cifar10 cifar10(".", true, 64, false, '/');
+    };
+    report("load MNIST train", benchmark(load_mnist));
+    report("load Cifar10 train", benchmark(load_cifar10));
+    {
+        index_t n_threads = std::max(2u, std::thread::hardware_concurrency()) - 1;
+        st::ThreadPool pool(n_threads);
+        st::ThreadPool* prev_pool = st::ThreadPool::set_current(&pool);
+        std::cout << "with a pool of " << n_threads << " threads:" << std::endl;
+        report("load MNIST train", benchmark(load_mnist));
+        report("load Cifar10 train", benchmark(load_cifar10));
+        st::ThreadPool::set_current(prev_pool);
+    }
+    remove_datasets();
+    return 0;
+}
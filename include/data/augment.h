@@ -0,0 +1,65 @@
+#ifndef DATA_AUGMENT_H
+#define DATA_AUGMENT_H
+
+#include <random>
+#include <vector>
+
+#include "utils/base_config.h"
+
+namespace st {
+namespace data {
+
+// Random augmentation of images of bytes in CHW layout, e.g. of Cifar10.
+//
+// An image is cropped, flipped and normalized row by row into the output,
+// so the bytes are moved once and converted once. Padding of the crop is
+// black, and cutout sets the output to 0 after normalization. The output is
+// in CHW layout, or HWC with channels_last(). A DataLoader applies it on its
+// worker threads:
+//
+//     ImageAugment augment(3, 32, 32);
+//     augment.random_crop(4).horizontal_flip().normalize(mean, std);
+//     DataLoader loader(dataset, 64, true, false, 4, 4, seed, &augment);
+class ImageAugment {
+public:
+    // Row buffers of apply. A caller which augments many images keeps one,
+    // e.g. a worker of DataLoader, so they are only allocated once.
+    struct Scratch {
+        std::vector<unsigned char> row_;
+        std::vector<data_t> converted_;
+    };
+
+    ImageAugment(index_t n_channels, index_t n_rows, index_t n_cols);
+
+    // Pad padding pixels of black on every side, and crop back to the size
+    // of the image at a random position.
+    ImageAugment& random_crop(index_t padding);
+    // Flip left and right with the probability p.
+    ImageAugment& horizontal_flip(data_t p=0.5);
+    // Set a square of size x size at a random center to 0. The square may
+    // be partly out of the image.
+    ImageAugment& cutout(index_t size);
+    // (x - mean[c]) / std[c] for the value x of a pixel of the channel c.
+    ImageAugment& normalize(const std::vector<data_t>& mean,
+                            const std::vector<data_t>& std);
+    ImageAugment& channels_last(bool enable=true);
+
+    index_t sample_size(void) const { return n_channels_ * n_rows_ * n_cols_; }
+    // Whether it only normalizes, so that it gives the same output every time.
+    bool deterministic(void) const;
+
+    // Augment the image src, whose byte b stands for b * byte_scale, to dist.
+    void apply(const unsigned char* src, data_t byte_scale, data_t* dist,
+               std::default_random_engine& engine, Scratch& scratch) const;
+private:
+    index_t n_channels_, n_rows_, n_cols_;
+    index_t padding_;
+    data_t flip_p_;
+    index_t cutout_size_;
+    std::vector<data_t> mean_, std_;
+    bool channels_last_;
+};
+
+}  // namespace data
+}  // namespace st
+#endif
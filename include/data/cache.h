@@ -0,0 +1,107 @@
+#ifndef DATA_CACHE_H
+#define DATA_CACHE_H
+
+#include <cstdint>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "utils/base_config.h"
+#include "data/data.h"
+#include "data/mapped_file.h"
+
+namespace st {
+namespace data {
+
+// A preprocessed dataset in one file, which is loaded by a single mmap.
+//
+// The file starts with a CacheHeader of 64 bytes. The samples follow it one
+// after another in the dtype of the header, and then the labels as int32,
+// both at offsets aligned to 64 bytes. Samples of uint8 are multiplied by the
+// scale of the header when they are read, and float samples are stored
+// normalized already. Numbers are in the byte order of the machine which
+// wrote the file, and a file of the other order is rejected.
+enum class CacheType : std::uint32_t { uint8 = 0, float32 = 1, float64 = 2 };
+
+struct CacheHeader {
+    static constexpr std::uint32_t kVersion = 1;
+    static constexpr std::uint32_t kByteOrder = 0x01020304;
+    static constexpr std::uint32_t kMaxDims = 4;
+    static constexpr std::uint64_t kAlignment = 64;
+
+    char magic_[8];  // "STCACHE"
+    std::uint32_t version_;
+    std::uint32_t byte_order_;
+    CacheType dtype_;
+    std::uint32_t ndim_;
+    std::uint32_t shape_[kMaxDims];  // of a sample
+    std::uint64_t n_samples_;
+    double scale_;
+    std::uint64_t reserved_;
+
+    index_t sample_size(void) const;
+    std::uint64_t dtype_size(void) const;
+    std::uint64_t samples_offset(void) const { return sizeof(CacheHeader); }
+    std::uint64_t labels_offset(void) const;
+    // Return what is wrong with the header of a file of file_size bytes, or
+    // nullptr if it's a valid cache.
+    const char* check(std::uint64_t file_size) const;
+};
+static_assert(sizeof(CacheHeader) == CacheHeader::kAlignment,
+              "CacheHeader should take 64 bytes");
+
+// Write the samples of dataset, in the order of get_sample, to a cache. As
+// uint8, a sample x is stored as x / scale, which must be an integer in
+// [0, 255]. So MNIST and Cifar10 are stored exactly with the default scale.
+void write_cache(const DatasetBase& dataset,
+                 const std::vector<index_t>& sample_shape,
+                 const std::string& path, CacheType dtype,
+                 data_t scale=1.0/255);
+// Whether path is a cache which can be loaded, e.g. to write it only once.
+bool is_cache(const std::string& path);
+// Convert n values of dtype at src to data_t, multiplying uint8 by scale.
+void decode_samples(CacheType dtype, data_t scale,
+                    const unsigned char* src, index_t n, data_t* dist);
+
+class CachedDataset : public DatasetBase {
+public:
+    CachedDataset(const std::string& path, index_t batch_size, bool shuffle);
+
+    index_t n_samples(void) const override { return n_samples_; }
+    index_t n_batchs(void) const override { return n_batchs_; }
+
+    std::pair<const data_t*, index_t> get_sample(index_t idx) const override;
+    std::tuple<index_t, const data_t*, const index_t*>
+    get_batch(index_t idx) const override;
+    using DatasetBase::shuffle;
+    void shuffle(unsigned seed) override;
+
+    index_t sample_size(void) const override { return sample_size_; }
+    index_t copy_sample(index_t idx, data_t* dist) const override;
+    bool has_bytes(void) const override { return dtype_ == CacheType::uint8; }
+    data_t byte_scale(void) const override { return scale_; }
+    index_t copy_bytes(index_t idx, unsigned char* dist) const override;
+
+    const std::vector<index_t>& sample_shape(void) const { return sample_shape_; }
+    CacheType dtype(void) const { return dtype_; }
+private:
+    index_t batch_size_, n_batchs_, n_samples_, sample_size_;
+    std::vector<index_t> sample_shape_;
+    CacheType dtype_;
+    std::uint64_t dtype_size_;
+    data_t scale_;
+
+    MappedFile file_;
+    const unsigned char* samples_;
+    const std::int32_t* labels_;
+
+    // order of samples, and the gathered batch
+    std::vector<index_t> order_;
+    bool shuffled_;
+    mutable std::vector<data_t> buffer_;
+    mutable std::vector<index_t> label_buffer_;
+};
+
+}  // namespace data
+}  // namespace st
+#endif
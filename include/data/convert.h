@@ -0,0 +1,16 @@
+#ifndef DATA_CONVERT_H
+#define DATA_CONVERT_H
+
+#include "utils/base_config.h"
+
+namespace st {
+namespace data {
+
+// dist[i] = src[i] * scale + bias for n bytes at src. It normalizes pixels,
+// and is vectorized with AVX2 if the build enables it.
+void bytes_to_data(const unsigned char* src, index_t n,
+                   data_t scale, data_t bias, data_t* dist);
+
+}  // namespace data
+}  // namespace st
+#endif
@@ -1,11 +1,13 @@
 #ifndef DATA_MNIST_H
 #define DATA_MNIST_H
 
+#include <memory>
 #include <string>
 #include <vector>
 #include <tuple>
 
 #include "utils/base_config.h"
+#include "data/mapped_file.h"
 
 
 namespace st {
@@ -19,9 +21,46 @@ public:
     virtual std::pair<const data_t*, index_t> get_sample(index_t idx) const = 0;
     virtual std::tuple<index_t, const data_t*, const index_t*> 
     get_batch(index_t idx) const = 0;
-    virtual void shuffle(void) = 0;
+
+    // Shuffle the order of samples. The same seed gives the same order.
+    void shuffle(void);
+    virtual void shuffle(unsigned seed) = 0;
+
+    // Number of elements of a sample. copy_sample copies the sample idx, in
+    // the same order as get_sample, to dist and returns its label. Unlike
+    // get_sample and get_batch, it can be called by several threads at once.
+    virtual index_t sample_size(void) const = 0;
+    virtual index_t copy_sample(index_t idx, data_t* dist) const = 0;
+
+    // Datasets which keep samples as bytes can copy them without converting,
+    // e.g. to augment them. A byte b stands for the value b * byte_scale().
+    // copy_bytes is thread-safe like copy_sample.
+    virtual bool has_bytes(void) const { return false; }
+    virtual data_t byte_scale(void) const { return 1.0 / 255; }
+    virtual index_t copy_bytes(index_t idx, unsigned char* dist) const;
+
+    // Copy n samples at indices into dist one after another, and their labels
+    // into labels. In parallel if the calling thread works for a ThreadPool.
+    void gather(const index_t* indices, index_t n, 
+                data_t* dist, index_t* labels) const;
+    // Same as gather with the indices first, first + 1, ..., first + n - 1,
+    // e.g. for a batch, without an array of them.
+    void gather_range(index_t first, index_t n,
+                      data_t* dist, index_t* labels) const;
 };
 
+// MNIST and Cifar10 shuffle a permutation of samples instead of the images.
+// Once shuffled, a batch is gathered into a buffer of the dataset, so the data
+// returned by get_sample and get_batch is valid until the next call of them.
+//
+// With memory_map, they map their files instead of reading them. The pixels
+// are kept as bytes in the files, and they are normalized only when a sample
+// or a batch is got. Only then they have bytes to copy.
+//
+// Without memory_map, the files are mapped too, and all pixels are normalized
+// at once, split by ranges of samples over the ThreadPool of the calling
+// thread if there is one. Then the files are unmapped.
+
 class MNIST : public DatasetBase {
 public:
     struct Img {
@@ -32,22 +71,41 @@ public:
     };
 
     MNIST(const std::string& img_path, const std::string& label_path, 
-          index_t batch_size, bool shuffle);
+          index_t batch_size, bool shuffle, bool memory_map=false);
     
-    index_t n_samples(void) const override { return imgs_.size(); }
+    index_t n_samples(void) const override { return n_samples_; }
     index_t n_batchs(void) const override { return n_batchs_; }
 
     std::pair<const data_t*, index_t> get_sample(index_t idx) const override;
     std::tuple<index_t, const data_t*, const index_t*> 
     get_batch(index_t idx) const override;
-    void shuffle(void) override;
+    using DatasetBase::shuffle;
+    void shuffle(unsigned seed) override;
+
+    index_t sample_size(void) const override { return Img::n_pixels_; }
+    index_t copy_sample(index_t idx, data_t* dist) const override;
+    bool has_bytes(void) const override { return memory_map_; }
+    index_t copy_bytes(index_t idx, unsigned char* dist) const override;
 private:
-    void read_mnist_images(const std::string& path);
-    void read_mnist_labels(const std::string& path);
+    void map_mnist(const std::string& img_path, const std::string& label_path);
+    // Normalize the mapped images into imgs_, and unmap the files.
+    void decode_mnist(void);
 
-    index_t batch_size_, n_batchs_;
-    std::vector<Img> imgs_;
+    index_t batch_size_, n_batchs_, n_samples_;
+    std::unique_ptr<Img[]> imgs_;
     std::vector<index_t> labels_;
+
+    // order of samples, and the gathered batch
+    std::vector<index_t> order_;
+    bool shuffled_;
+    mutable std::vector<data_t> buffer_;
+    mutable std::vector<index_t> label_buffer_;
+
+    // memory-mapped
+    bool memory_map_;
+    MappedFile img_file_, label_file_;
+    const unsigned char* pixels_;
+    const unsigned char* labels_data_;
 };
 
 
@@ -67,22 +125,41 @@ public:
 
     Cifar10(const std::string& dataset_dir, bool train,
             index_t batch_size, bool shuffle,
-            char path_sep='\\');
-    index_t n_samples(void) const override { return imgs_.size(); }
+            char path_sep='\\', bool memory_map=false);
+    index_t n_samples(void) const override { return n_samples_; }
     index_t n_batchs(void) const override { return n_batchs_; } 
 
     std::pair<const data_t*, index_t> get_sample(index_t idx) const;
     std::tuple<index_t, const data_t*, const index_t*>
     get_batch(index_t idx) const override;
-    void shuffle(void) override;
+    using DatasetBase::shuffle;
+    void shuffle(unsigned seed) override;
+
+    index_t sample_size(void) const override { return Img::n_pixels_; }
+    index_t copy_sample(index_t idx, data_t* dist) const override;
+    bool has_bytes(void) const override { return memory_map_; }
+    index_t copy_bytes(index_t idx, unsigned char* dist) const override;
 private:
     void read_cifar10(const std::string& dataset_dir, bool train,
                       char path_sep='\\');
-    void read_bin(const std::string& bin_path);
+    void map_bin(const std::string& bin_path);
+    // Normalize the mapped records into imgs_, and unmap the files.
+    void decode_records(void);
 
-    index_t batch_size_, n_batchs_;
-    std::vector<Img> imgs_;
+    index_t batch_size_, n_batchs_, n_samples_;
+    std::unique_ptr<Img[]> imgs_;
     std::vector<index_t> labels_;
+
+    // order of samples, and the gathered batch
+    std::vector<index_t> order_;
+    bool shuffled_;
+    mutable std::vector<data_t> buffer_;
+    mutable std::vector<index_t> label_buffer_;
+
+    // memory-mapped, a label and the pixels of each record
+    bool memory_map_;
+    std::vector<MappedFile> bin_files_;
+    std::vector<const unsigned char*> records_;
 };
 
 }  // namespace data
@@ -0,0 +1,120 @@
+#ifndef DATA_DATA_LOADER_H
+#define DATA_DATA_LOADER_H
+
+#include <condition_variable>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+#include "utils/base_config.h"
+#include "tensor/storage.h"
+#include "data/data.h"
+#include "data/augment.h"
+
+namespace st {
+
+class Tensor;
+
+namespace data {
+
+// Assemble batches of a dataset ahead of time on worker threads.
+//
+// Batches are filled into a ring of n_prefetch slots, whose Storages are
+// allocated once and reused. The k-th batch goes to the slot k % n_prefetch,
+// and a worker fills it as soon as the batch of the slot before it has been
+// taken and released by the next call of next(). So batches come out in
+// order, and at most n_prefetch of them are ahead of the training loop.
+//
+// Epochs follow one another without a break: after the last batch of an
+// epoch, workers go on with the next one, reshuffled if shuffle. The samples
+// are read by DatasetBase::copy_sample, so the dataset must not be shuffled
+// or changed while the loader is alive.
+//
+// A training loop may take batches by next_into instead, which points an
+// input Tensor at the batch of the slot in place. With n_prefetch = 2, this is
+// double buffering: the model computes on one slot while a worker fills the
+// other, and no batch is allocated or copied on the way.
+//
+//     Tensor input(Shape{0, 3, 32, 32});  // empty until the first batch
+//     for(...) {
+//         const index_t* labels = loader.next_into(input);
+//         Tensor output = model.forward(input);
+//         ...
+//     }
+//
+// With augment, the samples are read as bytes by DatasetBase::copy_bytes and
+// augmented on the workers. Every batch has an engine seeded by seed and its
+// number, so the batches are the same whatever worker fills them.
+class DataLoader {
+public:
+    DataLoader(const DatasetBase& dataset, index_t batch_size,
+               bool shuffle, bool drop_last,
+               index_t n_workers=2, index_t n_prefetch=4, unsigned seed=0,
+               const ImageAugment* augment=nullptr);
+    DataLoader(const DataLoader& other) = delete;
+    ~DataLoader();
+
+    index_t n_batchs(void) const { return n_batchs_; }
+    index_t batch_size(void) const { return batch_size_; }
+    index_t sample_size(void) const { return sample_size_; }
+
+    // Take the next batch as DatasetBase::get_batch does. The data is valid
+    // until the next call of next(). The first exception thrown while
+    // assembling the batch is rethrown here.
+    std::tuple<index_t, const data_t*, const index_t*> next(void);
+    // Take the next batch into input by Tensor::rebind, and return its
+    // labels. input must have a sample in every row of the dim 0, which is
+    // set to the number of samples in the batch. Its storage is replaced by the
+    // storage of the batch, so it and its views are valid until the next
+    // call, as the data of next() is.
+    const index_t* next_into(Tensor& input);
+private:
+    enum class SlotState { free, filling, ready };
+
+    struct Slot {
+        explicit Slot(index_t size) : samples_(size) {}
+
+        Storage samples_;
+        std::vector<index_t> labels_;
+        std::vector<index_t> indices_;  // of samples in the dataset
+        std::vector<unsigned char> bytes_;  // a sample to augment
+        index_t batch_number_ = 0;  // counted across epochs
+        SlotState state_ = SlotState::free;
+        std::exception_ptr error_;
+    };
+
+    // Wait for the next batch, and release the batch taken last time.
+    Slot& take_slot(void);
+    void worker_loop(void);
+    // Choose the samples of the next batch to fill. Called with mutex_ held.
+    void claim_batch(Slot& slot);
+    void augment_batch(Slot& slot, ImageAugment::Scratch& scratch);
+
+    const DatasetBase& dataset_;
+    index_t batch_size_, n_batchs_, sample_size_;
+    bool shuffle_;
+    unsigned seed_;
+    const ImageAugment* augment_;
+
+    std::vector<std::unique_ptr<Slot>> slots_;
+    std::vector<std::thread> workers_;
+
+    // Sample order of the epoch being filled.
+    std::vector<index_t> order_;
+    std::default_random_engine engine_;
+
+    // Batches are counted across epochs.
+    std::mutex mutex_;
+    std::condition_variable filled_cv_, freed_cv_;
+    index_t n_claimed_;  // batches given to workers
+    index_t n_taken_;    // batches taken by next()
+    bool stop_;
+};
+
+}  // namespace data
+}  // namespace st
+#endif
@@ -0,0 +1,44 @@
+#ifndef DATA_MAPPED_FILE_H
+#define DATA_MAPPED_FILE_H
+
+#include <cstdint>
+#include <string>
+
+#include "utils/base_config.h"
+
+namespace st {
+namespace data {
+
+// Read-only memory mapping of a whole file.
+//
+// Pages are read from the file when they are first touched, and they can be
+// dropped again by the system since they are clean. So mapping a dataset is
+// almost free, and it takes no memory of the process until it's read.
+class MappedFile {
+public:
+    MappedFile();
+    explicit MappedFile(const std::string& path);
+    MappedFile(const MappedFile& other) = delete;
+    MappedFile(MappedFile&& other);
+    ~MappedFile();
+    MappedFile& operator=(const MappedFile& other) = delete;
+    MappedFile& operator=(MappedFile&& other);
+
+    const unsigned char* data(void) const { return data_; }
+    // The size in bytes is kept in 64 bits, since a dataset file can be
+    // larger than index_t can count.
+    std::uint64_t size(void) const { return size_; }
+private:
+    void unmap(void);
+
+    const unsigned char* data_;
+    std::uint64_t size_;
+#ifdef _WIN32
+    void* file_handle_;
+    void* mapping_handle_;
+#endif
+};
+
+}  // namespace data
+}  // namespace st
+#endif
@@ -0,0 +1,53 @@
+#ifndef DATA_SHARD_H
+#define DATA_SHARD_H
+
+#include <tuple>
+#include <vector>
+
+#include "utils/base_config.h"
+#include "data/data.h"
+
+namespace st {
+namespace data {
+
+// The shard of a dataset for one of n_shards processes training in parallel.
+// The shard rank takes the samples rank, rank + n_shards, rank + 2 * n_shards
+// and so on of the dataset, n_samples / n_shards of them in each shard, so
+// that every process has the same number of batches. The few samples left
+// aren't used.
+//
+// The dataset must give its samples in the same order in every process, e.g.
+// without shuffling it, and the shard is shuffled instead. It's kept by
+// reference. Like MNIST, a batch is gathered into a buffer of the shard.
+class DatasetShard : public DatasetBase {
+public:
+    DatasetShard(const DatasetBase& dataset, index_t rank, index_t n_shards,
+                 index_t batch_size, bool shuffle);
+
+    index_t n_samples(void) const override { return n_samples_; }
+    index_t n_batchs(void) const override { return n_batchs_; }
+
+    std::pair<const data_t*, index_t> get_sample(index_t idx) const override;
+    std::tuple<index_t, const data_t*, const index_t*>
+    get_batch(index_t idx) const override;
+    using DatasetBase::shuffle;
+    void shuffle(unsigned seed) override;
+
+    index_t sample_size(void) const override { return dataset_.sample_size(); }
+    index_t copy_sample(index_t idx, data_t* dist) const override;
+    bool has_bytes(void) const override { return dataset_.has_bytes(); }
+    data_t byte_scale(void) const override { return dataset_.byte_scale(); }
+    index_t copy_bytes(index_t idx, unsigned char* dist) const override;
+private:
+    const DatasetBase& dataset_;
+    index_t batch_size_, n_batchs_, n_samples_;
+
+    // indices of the samples in dataset_, in the order of the shard
+    std::vector<index_t> order_;
+    mutable std::vector<data_t> buffer_;
+    mutable std::vector<index_t> label_buffer_;
+};
+
+}  // namespace data
+}  // namespace st
+#endif
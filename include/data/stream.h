@@ -0,0 +1,114 @@
+#ifndef DATA_STREAM_H
+#define DATA_STREAM_H
+
+#include <cstdio>
+#include <cstdint>
+#include <random>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "utils/base_config.h"
+#include "data/cache.h"
+
+namespace st {
+namespace data {
+
+// A dataset read as a stream from shard files, for datasets which don't fit
+// in memory.
+//
+// Every shard is a cache written by write_cache, and all of them have
+// samples of the same size. Shards are read one after another, in chunks of
+// about kChunkBytes, and the system is told to read the next chunk ahead and
+// to drop the pages already read. So memory in use is a chunk, the labels of
+// a shard and the shuffle buffer, whatever the size of the dataset.
+//
+// With shuffle_buffer_size > 1, the order of shards is shuffled every epoch,
+// and samples pass through a buffer of that many samples, from which one at
+// random is taken every time. The same seed gives the same sequence of epochs.
+//
+//     StreamingDataset stream(shard_paths, 64, 4096, seed);
+//     for(index_t epoch = 0; epoch < n_epochs; ++epoch)
+//         for(auto& batch: stream)  // n_samples, samples, labels
+//             ...
+class StreamingDataset {
+public:
+    using Batch = std::tuple<index_t, const data_t*, const index_t*>;
+
+    class Iterator {
+    public:
+        explicit Iterator(StreamingDataset* stream) : stream_(stream) {}
+
+        const Batch& operator*(void) const { return batch_; }
+        Iterator& operator++(void);
+        bool operator!=(const Iterator& other) const {
+            return stream_ != other.stream_;
+        }
+    private:
+        StreamingDataset* stream_;  // nullptr at the end
+        Batch batch_;
+    };
+
+    static constexpr std::uint64_t kChunkBytes = 4 << 20;
+
+    StreamingDataset(const std::vector<std::string>& shard_paths,
+                     index_t batch_size, index_t shuffle_buffer_size=0,
+                     unsigned seed=0, bool drop_last=false);
+    StreamingDataset(const StreamingDataset& other) = delete;
+    ~StreamingDataset();
+
+    index_t n_samples(void) const { return n_samples_; }
+    index_t n_batchs(void) const { return n_batchs_; }
+    index_t sample_size(void) const { return sample_size_; }
+
+    // Start a new epoch, dropping what is left of the current one.
+    void reset(void);
+    // Take the next batch of the epoch, which is valid until the next call.
+    // The batch has 0 samples at the end of the epoch.
+    Batch next_batch(void);
+
+    // begin() starts a new epoch.
+    Iterator begin(void);
+    Iterator end(void) { return Iterator(nullptr); }
+private:
+    struct Shard {
+        std::string path_;
+        CacheHeader header_;
+    };
+
+    // Take a sample through the shuffle buffer, or read it if there is none.
+    bool take_sample(data_t* dist, index_t& label);
+    // Read the next sample of the stream. Return false at its end.
+    bool read_sample(data_t* dist, index_t& label);
+    bool open_next_shard(void);
+    void read_chunk(void);
+    void close_shard(void);
+
+    std::vector<Shard> shards_;
+    index_t batch_size_, n_samples_, n_batchs_, sample_size_;
+    index_t shuffle_buffer_size_;
+    bool drop_last_;
+    std::default_random_engine engine_;
+
+    // the shard being read
+    std::vector<index_t> shard_order_;
+    index_t next_shard_;
+    std::FILE* file_;
+    const Shard* shard_;
+    std::vector<std::int32_t> shard_labels_;
+    index_t shard_pos_;  // next sample to read
+    std::vector<unsigned char> chunk_;
+    index_t chunk_begin_, chunk_end_;  // samples in the chunk
+
+    // shuffle buffer
+    std::vector<data_t> pool_;
+    std::vector<index_t> pool_labels_;
+    index_t pool_count_;
+
+    std::vector<data_t> batch_;
+    std::vector<index_t> batch_labels_;
+};
+
+}  // namespace data
+}  // namespace st
+#endif
@@ -0,0 +1,50 @@
+#ifndef DIST_LAUNCH_H
+#define DIST_LAUNCH_H
+
+#include <string>
+#include <vector>
+
+#include "utils/base_config.h"
+
+namespace st {
+namespace dist {
+
+// Fork the calling process into n_processes processes, of the ranks 0 to
+// n_processes - 1. The calling process is the rank 0, and all of them go on
+// from the constructor, so each one runs the rest of the program with its own
+// rank. The others exit when they're done with it.
+//
+// Threads aren't forked, so it must be done before any thread is started,
+// e.g. of a ThreadPool, a DataLoader or the backward of GradEngine.
+//
+//     ForkedProcesses processes(4);
+//     ShmProcessGroup group(processes.shm_name(), processes.rank(), 4);
+//     ...
+//     if(processes.rank() == 0)
+//         processes.wait();
+//
+// Only POSIX systems can fork, elsewhere n_processes must be 1.
+class ForkedProcesses {
+public:
+    explicit ForkedProcesses(index_t n_processes);
+    ForkedProcesses(const ForkedProcesses& other) = delete;
+    // The rank 0 waits for the others if it hasn't.
+    ~ForkedProcesses();
+
+    index_t rank(void) const { return rank_; }
+    index_t n_processes(void) const { return n_processes_; }
+    // A name of shared memory for these processes, unique on the machine.
+    std::string shm_name(void) const;
+
+    // In the rank 0, wait for the other processes to exit, and return the
+    // number of them which failed. Return 0 in other ranks.
+    index_t wait(void);
+private:
+    index_t rank_, n_processes_;
+    long parent_id_;
+    std::vector<long> children_;  // process ids, in the rank 0
+};
+
+}  // namespace dist
+}  // namespace st
+#endif
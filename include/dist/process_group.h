@@ -0,0 +1,39 @@
+#ifndef DIST_PROCESS_GROUP_H
+#define DIST_PROCESS_GROUP_H
+
+#include "utils/base_config.h"
+#include "utils/half.h"
+
+namespace st {
+namespace dist {
+
+// Collective communication among the processes of data-parallel training.
+//
+// Each of world_size() processes has a rank in [0, world_size()). A
+// collective must be called by all of them, in the same order and with the
+// same sizes, and it returns once this process is done with it. Collectives
+// of one group must not be called by several threads at once.
+class ProcessGroup {
+public:
+    virtual ~ProcessGroup() = default;
+
+    virtual index_t rank(void) const = 0;
+    virtual index_t world_size(void) const = 0;
+
+    // Sum the n elements at data over all processes, in place. All processes
+    // get the same values, bit for bit.
+    virtual void all_reduce(data_t* data, index_t n) = 0;
+    // all_reduce with the values compressed to half precision of type. The
+    // sum is rounded to it, and is still the same in all processes. By
+    // default the data is rounded before and after all_reduce, groups which
+    // send it over a network send a quarter of the bytes instead.
+    virtual void all_reduce_half(data_t* data, index_t n, HalfType type);
+    // Copy the n elements at data of the process root to all the others.
+    virtual void broadcast(data_t* data, index_t n, index_t root=0) = 0;
+    // Return once all processes have called it.
+    virtual void barrier(void) = 0;
+};
+
+}  // namespace dist
+}  // namespace st
+#endif
@@ -0,0 +1,85 @@
+#ifndef DIST_SHM_GROUP_H
+#define DIST_SHM_GROUP_H
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+#include "utils/base_config.h"
+#include "dist/process_group.h"
+
+namespace st {
+namespace dist {
+
+// A ProcessGroup of processes on one machine, communicating through a POSIX
+// shared memory segment.
+//
+// The segment has a buffer of `capacity` elements and a step counter for
+// every rank. A collective is cut into pieces of at most capacity elements,
+// and a piece into steps: every rank works on its own buffer and reads the
+// buffers of others, and a rank starts a step once the ranks it reads from
+// have counted the steps it depends on. So no lock is taken, and a process
+// spins only when it's ahead of its neighbours.
+//
+// all_reduce is a ring all-reduce. In the first n - 1 steps, the rank r adds
+// a chunk of its left neighbour r - 1 into its buffer, chunk r - s at the step
+// s, so every chunk goes around the ring once gathering all sums. In the last
+// n - 1 steps, the reduced chunks are copied around the ring once more. Each
+// rank reads and adds 2 * (n - 1) / n of the data, whatever the number of
+// processes.
+//
+// The rank 0 creates the segment named `name`, and the others open it. It's
+// unlinked once all have opened it, so it's freed when they're gone. Waiting
+// for a process longer than timeout_seconds throws, e.g. if it died.
+//
+//     ShmProcessGroup group("/my-training", rank, 4);
+//     group.all_reduce(grads, n);
+//
+// Only POSIX systems are supported, except that a group of a single process
+// needs no shared memory and works anywhere.
+class ShmProcessGroup : public ProcessGroup {
+public:
+    static constexpr index_t kDefaultCapacity = 1 << 20;
+
+    ShmProcessGroup(const std::string& name, index_t rank, index_t world_size,
+                    index_t capacity=kDefaultCapacity,
+                    double timeout_seconds=60);
+    ShmProcessGroup(const ShmProcessGroup& other) = delete;
+    ~ShmProcessGroup();
+
+    index_t rank(void) const override { return rank_; }
+    index_t world_size(void) const override { return world_size_; }
+    index_t capacity(void) const { return capacity_; }
+
+    void all_reduce(data_t* data, index_t n) override;
+    void broadcast(data_t* data, index_t n, index_t root=0) override;
+    void barrier(void) override;
+private:
+    struct Header;
+    struct alignas(64) Counter {
+        std::atomic<std::uint64_t> steps_;
+    };
+
+    void all_reduce_piece(data_t* data, index_t n);
+    // Wait until the rank has counted at least steps, or all ranks if rank
+    // is world_size_.
+    void wait(index_t rank, std::uint64_t steps) const;
+    void finish_step(void);
+
+    data_t* buffer(index_t rank) const { return buffers_ + rank * capacity_; }
+
+    std::string name_;
+    index_t rank_, world_size_, capacity_;
+    double timeout_seconds_;
+
+    void* segment_;
+    std::uint64_t segment_size_;
+    Header* header_;
+    Counter* counters_;
+    data_t* buffers_;
+    std::uint64_t steps_;  // counted by this rank
+};
+
+}  // namespace dist
+}  // namespace st
+#endif
@@ -0,0 +1,80 @@
+#ifndef DIST_TCP_GROUP_H
+#define DIST_TCP_GROUP_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "utils/base_config.h"
+#include "dist/process_group.h"
+
+namespace st {
+namespace dist {
+
+// A ProcessGroup of processes connected by TCP, on one machine or several.
+//
+// The rank 0 listens on master_port, and every other rank connects to it at
+// master_addr, telling the port it listens on itself. The rank 0 sends the
+// addresses of all ranks back, then each rank connects to its right
+// neighbour r + 1 and accepts its left neighbour r - 1, so the processes make
+// a ring of connections and the rendezvous ones are closed.
+//
+// all_reduce is a ring all-reduce. In the first n - 1 steps, the rank r sends
+// the chunk r - s to the right and adds the chunk r - s - 1 from the left at
+// the step s, so every chunk gathers all sums going around the ring. In the
+// last n - 1 steps, the reduced chunks go around once more. Each rank sends
+// and receives 2 * (n - 1) / n of the data, whatever the number of processes,
+// and a step sends and receives at once. all_reduce_half sends 16-bit values.
+// broadcast is pipelined along the ring by pieces.
+//
+// Values are sent in the byte order of the machine, so all machines must
+// have the same one. Waiting for a peer longer than timeout_seconds, or a
+// closed connection, throws.
+//
+//     // on every machine, with its own rank
+//     TcpProcessGroup group("10.0.0.1", 29500, rank, 8);
+//     group.all_reduce(grads, n);
+//
+// Only POSIX systems are supported, except that a group of a single process
+// needs no connection and works anywhere.
+class TcpProcessGroup : public ProcessGroup {
+public:
+    static constexpr index_t kPieceSize = 1 << 16;  // of broadcast
+
+    TcpProcessGroup(const std::string& master_addr, int master_port,
+                    index_t rank, index_t world_size,
+                    double timeout_seconds=60);
+    TcpProcessGroup(const TcpProcessGroup& other) = delete;
+    ~TcpProcessGroup();
+
+    index_t rank(void) const override { return rank_; }
+    index_t world_size(void) const override { return world_size_; }
+
+    void all_reduce(data_t* data, index_t n) override;
+    void all_reduce_half(data_t* data, index_t n, HalfType type) override;
+    void broadcast(data_t* data, index_t n, index_t root=0) override;
+    void barrier(void) override;
+
+    // A free port of this machine, e.g. for the rank 0 of processes forked
+    // afterwards. Another process may take it before it's listened on.
+    static int free_port(void);
+private:
+    // Rendezvous at the rank 0, and connect to the neighbours.
+    void connect_ring(const std::string& master_addr, int master_port);
+    // Without half_type, values are sent as data_t.
+    void ring_all_reduce(data_t* data, index_t n, const HalfType* half_type);
+    // Send to the right and receive from the left at the same time.
+    void exchange(const void* send_data, std::uint64_t send_bytes,
+                  void* recv_data, std::uint64_t recv_bytes);
+    void close_all(void);
+
+    index_t rank_, world_size_;
+    double timeout_seconds_;
+    int listen_fd_;
+    int right_fd_, left_fd_;
+    std::vector<unsigned char> send_buffer_, recv_buffer_;
+};
+
+}  // namespace dist
+}  // namespace st
+#endif
@@ -1,14 +1,21 @@
 #ifndef EXP_EXP_IMPL_H
 #define EXP_EXP_IMPL_H
 
+#include <atomic>
 #include <memory>
 #include <initializer_list>
 
 #include "utils/allocator.h"
 #include "utils/base_config.h"
 #include "utils/array.h"
+#include "utils/exception.h"
+#include "utils/thread_pool.h"
+#include "utils/grad_mode.h"
+#include "tensor/grad_engine.h"
+#include "tensor/static_graph.h"
 
 #include "exp/grad_impl.h"
+#include "exp/rewrite.h"
 #include "exp/operator/log_softmax.h"
 #include "exp/operator/nll_loss.h"
 #include "exp/operator/reduce_op.h"
@@ -28,12 +35,19 @@ template<typename Op, typename LhsImplType, typename RhsImplType> class BinaryEx
 template<typename ImplType>
 class ExpImpl {
 public:
+    ExpImpl() = default;
+    // The counters belong to the ExpImplPtrs pointing to an object, so a 
+    // copied or moved object starts from zero.
+    ExpImpl(const ExpImpl& other) {}
+
     index_t refcount(void) const { return refcount_; }
     index_t gradcount(void) const { return gradcount_; }
     friend class ExpImplPtr<ImplType>;
 private:
-    index_t refcount_ = 0;
-    index_t gradcount_ = 0;
+    // Atomic because backward may release the graph on several threads,
+    // see tensor/grad_engine.h.
+    std::atomic<index_t> refcount_{0};
+    std::atomic<index_t> gradcount_{0};
 };
 
 template<typename ImplType> 
@@ -41,17 +55,20 @@ class ExpImplPtr {
 public:
     ExpImplPtr(Alloc::NontrivialUniquePtr<ImplType>&& ptr, bool with_grad)
             : ptr_(ptr.release()), 
-              with_grad_(with_grad && static_cast<ImplType*>(ptr_)->requires_grad()) {
+              with_grad_(with_grad && GradMode::is_enabled() 
+                         && static_cast<ImplType*>(ptr_)->requires_grad()) {
         increment_counters();
     }
     ExpImplPtr(const ImplType& impl, bool with_grad)
             : ptr_(const_cast<ImplType*>(&impl)), 
-              with_grad_(with_grad && static_cast<ImplType*>(ptr_)->requires_grad()) { 
+              with_grad_(with_grad && GradMode::is_enabled() 
+                         && static_cast<ImplType*>(ptr_)->requires_grad()) { 
         increment_counters();
     }
     ExpImplPtr(const ExpImplPtr& other, bool with_grad)
             : ptr_(other.ptr_),
-              with_grad_(with_grad && static_cast<ImplType*>(ptr_)->requires_grad()) {
+              with_grad_(with_grad && GradMode::is_enabled() 
+                         && static_cast<ImplType*>(ptr_)->requires_grad()) {
         increment_counters();
     }
     ~ExpImplPtr() { decrease_refcount(); }
@@ -64,8 +81,10 @@ public:
     void invoke_backward(const GradImplType& grad) {
         auto ptr = static_cast<ImplType*>(ptr_);
         if(ptr->requires_grad()) {
-            if(with_grad_)
+            if(with_grad_) {
                 -- ptr_->gradcount_;
+                GradEngine::on_gradcount_decreased(ptr_->gradcount_);
+            }
             ptr->backward(grad);
         }
     }
@@ -77,8 +96,7 @@ private:
     }
 
     void decrease_refcount() {
-        -- ptr_->refcount_;
-        if(ptr_->refcount_ == 0)
+        if(-- ptr_->refcount_ == 0)
             delete_handler(static_cast<void*>(ptr_));
     }
 
@@ -98,13 +116,17 @@ public:
     using operand_type = OIType;
 
     explicit UnaryExpImpl(const OperandImplPtr<OIType>& ptr)
-            : operand_ptr_(ptr, true) {}
+            : operand_ptr_(ptr, true) {
+        __count_rewrites(Op(), *operand_ptr_);
+    }
 
     index_t ndim(void) const { return Op::ndim(*operand_ptr_); }
     index_t size(index_t idx) const { return Op::size(idx, *operand_ptr_); }
+    const OIType& operand(void) const { return *operand_ptr_; }
 
+    // See exp/rewrite.h
     data_t eval(IndexArray& inds) const {
-        return Op::map(inds, *operand_ptr_);
+        return __rewritten_map(Op(), inds, *operand_ptr_);
     }
 
    IndexArray size(void) const {
@@ -140,13 +162,29 @@ public:
     BinaryExpImpl(const OperandImplPtr<LhsImplType>& lhs_ptr,
                   const OperandImplPtr<RhsImplType>& rhs_ptr)
             : lhs_ptr_(lhs_ptr, true),
-              rhs_ptr_(rhs_ptr, true) {}
+              rhs_ptr_(rhs_ptr, true),
+              rewrite_(__plan_binary_rewrite<Op>(*lhs_ptr_, *rhs_ptr_)) {
+        if(rewrite_ == __BinaryRewrite::none)
+            __count_rewrites(Op(), *lhs_ptr_, *rhs_ptr_);
+    }
 
     index_t ndim(void) const { return Op::ndim(*lhs_ptr_, *rhs_ptr_); }
     index_t size(index_t idx) const { return Op::size(idx, *lhs_ptr_, *rhs_ptr_); }
+    const LhsImplType& lhs(void) const { return *lhs_ptr_; }
+    const RhsImplType& rhs(void) const { return *rhs_ptr_; }
 
+    // See exp/rewrite.h
     data_t eval(IndexArray& inds) const {
-        return Op::map(inds, *lhs_ptr_, *rhs_ptr_);
+        switch(rewrite_) {
+            case __BinaryRewrite::lhs_only:
+                return lhs_ptr_->eval(inds);
+            case __BinaryRewrite::rhs_only:
+                return rhs_ptr_->eval(inds);
+            case __BinaryRewrite::shared_operands:
+                return __map_shared_operands<Op>(inds, *lhs_ptr_);
+            default:
+                return __rewritten_map(Op(), inds, *lhs_ptr_, *rhs_ptr_);
+        }
     }
 
     IndexArray size(void) const {
@@ -164,18 +202,45 @@ public:
     void backward(const GIType& grad) {
         CHECK_EQUAL(this->gradcount(), 0, "Reused ExpImpl can't be backward.");
 
+        // See StoredGradImpl in exp/grad_impl.h
+        backward_operands(grad, std::integral_constant<bool,
+            __rereads_grad<Op>::value && !__is_stored_grad<GIType>::value>());
+    }
+
+private:
+    static constexpr index_t kParallelGrain = 4096;
+
+    template<typename GIType>
+    void backward_operands(const GIType& grad, std::true_type) {
+        StoredGradImpl stored_grad(grad);
+        backward_operands(stored_grad, std::false_type());
+    }
+
+    template<typename GIType>
+    void backward_operands(const GIType& grad, std::false_type) {
         BinaryGradImpl<typename Op::Grad::Lhs, GIType, LhsImplType, RhsImplType> 
         lhs_grad(grad, *lhs_ptr_, *rhs_ptr_);
-        lhs_ptr_.invoke_backward(lhs_grad);
-        
         BinaryGradImpl<typename Op::Grad::Rhs, GIType, LhsImplType, RhsImplType> 
         rhs_grad(grad, *lhs_ptr_, *rhs_ptr_);
-        rhs_ptr_.invoke_backward(rhs_grad);
+
+        // The two branches are independent. Run them in parallel when backward
+        // runs on a thread pool and the expression is large enough.
+        index_t dsize = 1;
+        for(index_t i = 0; i < ndim(); ++i)
+            dsize *= size(i);
+        if(dsize >= kParallelGrain && lhs_ptr_->requires_grad() 
+                && rhs_ptr_->requires_grad()) {
+            parallel_invoke([&]() { lhs_ptr_.invoke_backward(lhs_grad); },
+                            [&]() { rhs_ptr_.invoke_backward(rhs_grad); });
+        } else {
+            lhs_ptr_.invoke_backward(lhs_grad);
+            rhs_ptr_.invoke_backward(rhs_grad);
+        }
     }
 
-private:
     OperandImplPtr<LhsImplType> lhs_ptr_;
     OperandImplPtr<RhsImplType> rhs_ptr_;
+    __BinaryRewrite rewrite_;
 };
 } // namespace st
 
@@ -205,8 +270,13 @@ public:
               batch_max_cls_(
                   Alloc::unique_allocate<data_t>(
                       sizeof(data_t) * operand_ptr_->size(0))) {
-        op::LogSoftmax::precompute(*operand_ptr_, batch_sum_exp_.get(), 
-                                   batch_max_cls_.get());
+        precompute();
+        if(StaticGraph::is_capturing()) {
+            auto self_ptr = Alloc::shared_construct<ExpImplPtr<UnaryExpImpl>>(*this, false);
+            StaticGraph::record([self_ptr]() {
+                const_cast<UnaryExpImpl&>(**self_ptr).precompute();
+            });
+        }
     }
 
     index_t ndim(void) const { return op::LogSoftmax::ndim(*operand_ptr_); }
@@ -235,6 +305,11 @@ public:
         operand_ptr_.invoke_backward(out_grad);
     }
 private:
+    void precompute(void) {
+        op::LogSoftmax::precompute(*operand_ptr_, batch_sum_exp_.get(), 
+                                   batch_max_cls_.get());
+    }
+
     OperandImplPtr<OIType> operand_ptr_;
     index_t n_batch_;
     Alloc::TrivialUniquePtr<data_t> batch_sum_exp_;
@@ -431,8 +506,8 @@ public:
             (h + 2*padding_size_.first - kernel_size_.first) / stride_size_.first + 1;
         out_size_.second = 
             (w + 2*padding_size_.second - kernel_size_.second) / stride_size_.second + 1;
-        shape_.first = out_size_.first * out_size_.second * b;
-        shape_.second = c * kernel_size_.first * kernel_size_.second;
+        shape_.first = checked_mul(checked_mul(out_size_.first, out_size_.second), b);
+        shape_.second = checked_mul(checked_mul(c, kernel_size_.first), kernel_size_.second);
     }
 
     index_t ndim(void) const { return op::Img2col::ndim(*operand_ptr_); }
@@ -538,6 +613,7 @@ public:
 
     index_t ndim(void) const { return shape_.size(); }
     index_t size(index_t idx) const { return shape_[idx]; }
+    data_t value(void) const { return value_; }
     IndexArray size(void) const {
         IndexArray shape(ndim());
         for(index_t i = 0; i < shape.size(); ++i)
@@ -561,5 +637,15 @@ private:
     IndexArray shape_;
 };
 
+inline bool __same_exp(const UnaryExpImpl<op::Constant, data_t>& lhs,
+                       const UnaryExpImpl<op::Constant, data_t>& rhs) {
+    if(lhs.value() != rhs.value() || lhs.ndim() != rhs.ndim())
+        return false;
+    for(index_t i = 0; i < lhs.ndim(); ++i)
+        if(lhs.size(i) != rhs.size(i))
+            return false;
+    return true;
+}
+
 }  // namespace st
 #endif
\ No newline at end of file
@@ -9,6 +9,8 @@
 #include "utils/exception.h"
 #include "exp/exp_impl.h"
 #include "exp/exp.h"
+#include "exp/rewrite.h"
+#include "exp/materialize.h"
 
 #include "exp/operator/basic_op.h"
 #include "exp/operator/matrix_op.h"
@@ -119,13 +121,21 @@ sigmoid(const Exp<OIType>& operand) {
     return __unary_operation_function<Sigmoid, OIType>(operand);
 }
 
+// The operand itself. A Tensor built from it is a contiguous copy which
+// passes the gradient back, unlike a Tensor assigned from the operand.
+template<typename OIType>
+Exp<UnaryExpImpl<Identity, OIType>>
+identity(const Exp<OIType>& operand) {
+    return __unary_operation_function<Identity, OIType>(operand);
+}
+
 // function for matrix operation
 template<typename OIType>
 Exp<UnaryExpImpl<MatrixTranspose, OIType>>
 matrix_transpose(const Exp<OIType>& operand) {
     CHECK_EQUAL(operand.impl().ndim(), 2,
-        "Matrix Transpose is only supported for 2D Tensor, but got %dD one",
-        operand.impl().ndim());
+        "Matrix Transpose is only supported for 2D Tensor, but got %lluD one",
+        static_cast<unsigned long long>(operand.impl().ndim()));
     return __unary_operation_function<MatrixTranspose, OIType>(operand);
 }
 
@@ -133,40 +143,59 @@ template<typename OIType>
 Exp<UnaryExpImpl<BatchMatrixTranspose, OIType>>
 batch_matrix_transpose(const Exp<OIType>& operand) {
     CHECK_EQUAL(operand.impl().ndim(), 3,
-        "Batch Matrix Transpose is only supported for 3D Tensor, but got %dD one",
-        operand.impl().ndim());
+        "Batch Matrix Transpose is only supported for 3D Tensor, but got %lluD one",
+        static_cast<unsigned long long>(operand.impl().ndim()));
     return __unary_operation_function<BatchMatrixTranspose, OIType>(operand);
 }
 
+// matrix_mul and batch_matrix_mul read every element of their operands many
+// times, so an expensive operand is materialized, see exp/materialize.h.
 template<typename LhsImplType, typename RhsImplType>
-Exp<BinaryExpImpl<MatrixMul, LhsImplType, RhsImplType>>
+Exp<BinaryExpImpl<MatrixMul, __reread_operand_t<LhsImplType>, 
+                             __reread_operand_t<RhsImplType>>>
 matrix_mul(const Exp<LhsImplType>& lhs, const Exp<RhsImplType>& rhs) {
     auto& lhs_impl = lhs.impl();
     auto& rhs_impl = rhs.impl();
     CHECK_TRUE(lhs_impl.ndim() == 2 && rhs_impl.ndim() == 2, 
-        "Matrices expected, got %dD and %dD Tensor。", 
-        lhs_impl.ndim(), rhs_impl.ndim());
+        "Matrices expected, got %lluD and %lluD Tensor。", 
+        static_cast<unsigned long long>(lhs_impl.ndim()),
+        static_cast<unsigned long long>(rhs_impl.ndim()));
     CHECK_EQUAL(lhs_impl.size(1), rhs_impl.size(0), 
-        "Size mismatch, m1: [%d, %d], m2: [%d, %d].",
-        lhs_impl.size(0), lhs_impl.size(1), rhs_impl.size(0), rhs_impl.size(1));
-    return __binary_operation_function<MatrixMul, LhsImplType, RhsImplType>(lhs, rhs);
+        "Size mismatch, m1: [%llu, %llu], m2: [%llu, %llu].",
+        static_cast<unsigned long long>(lhs_impl.size(0)),
+        static_cast<unsigned long long>(lhs_impl.size(1)),
+        static_cast<unsigned long long>(rhs_impl.size(0)),
+        static_cast<unsigned long long>(rhs_impl.size(1)));
+    return __binary_operation_function<MatrixMul, __reread_operand_t<LhsImplType>,
+                                       __reread_operand_t<RhsImplType>>(
+        __materialize(lhs), __materialize(rhs)
+    );
 }
 
 template<typename LhsImplType, typename RhsImplType>
-Exp<BinaryExpImpl<BatchMatrixMul, LhsImplType, RhsImplType>>
+Exp<BinaryExpImpl<BatchMatrixMul, __reread_operand_t<LhsImplType>, 
+                                  __reread_operand_t<RhsImplType>>>
 batch_matrix_mul(const Exp<LhsImplType>& lhs, const Exp<RhsImplType>& rhs) {
     auto& lhs_impl = lhs.impl();
     auto& rhs_impl = rhs.impl();
     CHECK_TRUE(lhs_impl.ndim() == 3 && rhs_impl.ndim() == 3, 
-        "Baths of Matrices expected, got %dD and %dD Tensor。", 
-        lhs_impl.ndim(), rhs_impl.ndim());
+        "Baths of Matrices expected, got %lluD and %lluD Tensor。", 
+        static_cast<unsigned long long>(lhs_impl.ndim()),
+        static_cast<unsigned long long>(rhs_impl.ndim()));
     CHECK_TRUE(lhs_impl.size(0) == rhs_impl.size(0),
-        "Bath sizes, %d and %d, doesn't match.",
-        lhs_impl.size(0), rhs_impl.size(0));
+        "Bath sizes, %llu and %llu, doesn't match.",
+        static_cast<unsigned long long>(lhs_impl.size(0)),
+        static_cast<unsigned long long>(rhs_impl.size(0)));
     CHECK_EQUAL(lhs_impl.size(2), rhs_impl.size(1),
-        "Size mismatch, m1: [%d, %d], m2: [%d, %d].",
-        lhs_impl.size(1), lhs_impl.size(2), rhs_impl.size(1), rhs_impl.size(2));
-    return __binary_operation_function<BatchMatrixMul, LhsImplType, RhsImplType>(lhs, rhs);
+        "Size mismatch, m1: [%llu, %llu], m2: [%llu, %llu].",
+        static_cast<unsigned long long>(lhs_impl.size(1)),
+        static_cast<unsigned long long>(lhs_impl.size(2)),
+        static_cast<unsigned long long>(rhs_impl.size(1)),
+        static_cast<unsigned long long>(rhs_impl.size(2)));
+    return __binary_operation_function<BatchMatrixMul, __reread_operand_t<LhsImplType>,
+                                       __reread_operand_t<RhsImplType>>(
+        __materialize(lhs), __materialize(rhs)
+    );
 }
 
 // function for log_softmax
@@ -174,8 +203,8 @@ template<typename OIType>
 Exp<UnaryExpImpl<LogSoftmax, OIType>>
 log_softmax(const Exp<OIType>& operand) {
     CHECK_EQUAL(operand.impl().ndim(), 2, 
-        "log_softmax Only supported for 2D Tensor, but got a %dD one", 
-        operand.impl().ndim());
+        "log_softmax Only supported for 2D Tensor, but got a %lluD one", 
+        static_cast<unsigned long long>(operand.impl().ndim()));
     return __unary_operation_function<LogSoftmax, OIType>(operand);
 }
 
@@ -185,8 +214,9 @@ template<typename OIType>
 Exp<UnaryExpImpl<Mean, OIType>>
 mean(const Exp<OIType>& operand, index_t dim) {
     CHECK_IN_RANGE(dim, 0, operand.impl().ndim(), 
-        "Dimension out of range (expected to be in range of [0, %d), but got %d)",
-        operand.impl().ndim(), dim);
+        "Dimension out of range (expected to be in range of [0, %llu), but got %llu)",
+        static_cast<unsigned long long>(operand.impl().ndim()),
+        static_cast<unsigned long long>(dim));
     return Exp<UnaryExpImpl<Mean, OIType>>(
         Alloc::unique_construct<UnaryExpImpl<Mean, OIType>>(
             operand.impl_ptr(), dim
@@ -198,8 +228,9 @@ template<typename OIType>
 Exp<UnaryExpImpl<Max, OIType>>
 max(const Exp<OIType>& operand, index_t dim) {
     CHECK_IN_RANGE(dim, 0, operand.impl().ndim(), 
-        "Dimension out of range (expected to be in range of [0, %d), but got %d)",
-        operand.impl().ndim(), dim);
+        "Dimension out of range (expected to be in range of [0, %llu), but got %llu)",
+        static_cast<unsigned long long>(operand.impl().ndim()),
+        static_cast<unsigned long long>(dim));
     return Exp<UnaryExpImpl<Max, OIType>>(
         Alloc::unique_construct<UnaryExpImpl<Max, OIType>>(
             operand.impl_ptr(), dim
@@ -211,8 +242,9 @@ template<typename OIType>
 Exp<UnaryExpImpl<Argmax, OIType>>
 argmax(const Exp<OIType>& operand, index_t dim) {
     CHECK_IN_RANGE(dim, 0, operand.impl().ndim(), 
-        "Dimension out of range (expected to be in range of [0, %d), but got %d)",
-        operand.impl().ndim(), dim);
+        "Dimension out of range (expected to be in range of [0, %llu), but got %llu)",
+        static_cast<unsigned long long>(operand.impl().ndim()),
+        static_cast<unsigned long long>(dim));
     return Exp<UnaryExpImpl<Argmax, OIType>>(
         Alloc::unique_construct<UnaryExpImpl<Argmax, OIType>>(
             operand.impl_ptr(), dim
@@ -227,18 +259,22 @@ nll_loss(const Exp<OIType>& operand,
          const std::shared_ptr<index_t>& labels_ptr, 
          index_t n_label=-1) {
     CHECK_EQUAL(operand.impl().ndim(), 2, 
-        "NLL Loss is only supported for 2D Tensor, but got %dD one.", 
-        operand.impl().ndim());
+        "NLL Loss is only supported for 2D Tensor, but got %lluD one.", 
+        static_cast<unsigned long long>(operand.impl().ndim()));
 
     index_t n_batch = operand.impl().size(0);
     index_t n_cls = operand.impl().size(1);
     CHECK_TRUE(n_label == -1 || n_label == n_batch,
-        "Batch size mismatch, x: %d, labels: %d", n_batch, n_label);
+        "Batch size mismatch, x: %llu, labels: %llu",
+        static_cast<unsigned long long>(n_batch),
+        static_cast<unsigned long long>(n_label));
 
     auto labels = labels_ptr.get();
     for(index_t i = 0; i < n_batch; ++i)
         CHECK_IN_RANGE(labels[i], 0, n_cls,
-            "%d classes got label of %d", n_cls, labels[i]);
+            "%llu classes got label of %llu",
+            static_cast<unsigned long long>(n_cls),
+            static_cast<unsigned long long>(labels[i]));
 
     return Exp<UnaryExpImpl<NLLLoss, OIType>>(
         Alloc::unique_construct<UnaryExpImpl<NLLLoss, OIType>>(
@@ -253,17 +289,21 @@ nll_loss(const Exp<OIType>& operand,
          const index_t* labels, 
          index_t n_label=-1) {
     CHECK_EQUAL(operand.impl().ndim(), 2, 
-        "NLL Loss is only supported for 2D Tensor, but got %dD one.", 
-        operand.impl().ndim());
+        "NLL Loss is only supported for 2D Tensor, but got %lluD one.", 
+        static_cast<unsigned long long>(operand.impl().ndim()));
 
     index_t n_batch = operand.impl().size(0);
     index_t n_cls = operand.impl().size(1);
     CHECK_TRUE(n_label == -1 || n_label == n_batch,
-        "Batch size mismatch, x: %d, labels: %d", n_batch, n_label);
+        "Batch size mismatch, x: %llu, labels: %llu",
+        static_cast<unsigned long long>(n_batch),
+        static_cast<unsigned long long>(n_label));
 
     for(index_t i = 0; i < n_batch; ++i)
         CHECK_IN_RANGE(labels[i], 0, n_cls,
-            "%d classes got label of %d", n_cls, labels[i]);
+            "%llu classes got label of %llu",
+            static_cast<unsigned long long>(n_cls),
+            static_cast<unsigned long long>(labels[i]));
 
     std::shared_ptr<index_t> labels_ptr = 
         Alloc::shared_allocate<index_t>(n_batch * sizeof(index_t));
@@ -277,13 +317,15 @@ nll_loss(const Exp<OIType>& operand,
 }
 
 // function for conv
+// img2col reads every pixel once for each kernel position covering it, so an
+// expensive operand is materialized, see exp/materialize.h.
 template<typename OIType>
-Exp<UnaryExpImpl<Img2col, OIType>>
+Exp<UnaryExpImpl<Img2col, __reread_operand_t<OIType>>>
 img2col(const Exp<OIType>& operand, const Img2col::Wsize& kernel_size,
         const Img2col::Wsize& stride_size, const Img2col::Wsize& padding_size) {
     CHECK_EQUAL(operand.impl().ndim(), 4, 
-        "Img2col is only supported for 4D Tensor, but got a %dD one", 
-        operand.impl().ndim());
+        "Img2col is only supported for 4D Tensor, but got a %lluD one", 
+        static_cast<unsigned long long>(operand.impl().ndim()));
     CHECK_INDEX_VALID(kernel_size.first, "Invalid kernel_size.");
     CHECK_INDEX_VALID(kernel_size.second, "Invalid kernel_size.");
     CHECK_IN_RANGE(stride_size.first, 1, INDEX_MAX, "Invalid stride_size.");
@@ -291,12 +333,16 @@ img2col(const Exp<OIType>& operand, const Img2col::Wsize& kernel_size,
     CHECK_INDEX_VALID(padding_size.first, "Invalid padding_size.");
     CHECK_INDEX_VALID(padding_size.second, "Invalid padding_size.");
     CHECK_INDEX_VALID(operand.impl().size(2) + 2*padding_size.first - kernel_size.first, 
-        "Kernel size (%d %d) is too large", kernel_size.first, kernel_size.second);
+        "Kernel size (%llu %llu) is too large",
+        static_cast<unsigned long long>(kernel_size.first),
+        static_cast<unsigned long long>(kernel_size.second));
     CHECK_INDEX_VALID(operand.impl().size(3) + 2*padding_size.second - kernel_size.second, 
-        "Kernel size (%d %d) is too large", kernel_size.first, kernel_size.second);
-    return Exp<UnaryExpImpl<Img2col, OIType>>(
-        Alloc::unique_construct<UnaryExpImpl<Img2col, OIType>>(
-            operand.impl_ptr(), kernel_size, stride_size, padding_size 
+        "Kernel size (%llu %llu) is too large",
+        static_cast<unsigned long long>(kernel_size.first),
+        static_cast<unsigned long long>(kernel_size.second));
+    return Exp<UnaryExpImpl<Img2col, __reread_operand_t<OIType>>>(
+        Alloc::unique_construct<UnaryExpImpl<Img2col, __reread_operand_t<OIType>>>(
+            __materialize(operand).impl_ptr(), kernel_size, stride_size, padding_size 
         )
     );
 }
@@ -306,8 +352,8 @@ Exp<UnaryExpImpl<MaxPool2d, OIType>>
 max_pool2d(const Exp<OIType>& operand, const MaxPool2d::Wsize& kernel_size,
            const MaxPool2d::Wsize& stride_size, const MaxPool2d::Wsize& padding_size) {
     CHECK_EQUAL(operand.impl().ndim(), 4, 
-        "MaxPool2d is only supported for 4D Tensor, but got a %dD one", 
-        operand.impl().ndim());
+        "MaxPool2d is only supported for 4D Tensor, but got a %lluD one", 
+        static_cast<unsigned long long>(operand.impl().ndim()));
     CHECK_INDEX_VALID(kernel_size.first, "Invalid kernel_size.");
     CHECK_INDEX_VALID(kernel_size.second, "Invalid kernel_size.");
     CHECK_IN_RANGE(stride_size.first, 1, INDEX_MAX, "Invalid stride_size.");
@@ -315,9 +361,13 @@ max_pool2d(const Exp<OIType>& operand, const MaxPool2d::Wsize& kernel_size,
     CHECK_INDEX_VALID(padding_size.first, "Invalid padding_size.");
     CHECK_INDEX_VALID(padding_size.second, "Invalid padding_size.");
     CHECK_INDEX_VALID(operand.impl().size(2) + 2*padding_size.first - kernel_size.first, 
-        "Kernel size (%d %d) is too large", kernel_size.first, kernel_size.second);
+        "Kernel size (%llu %llu) is too large",
+        static_cast<unsigned long long>(kernel_size.first),
+        static_cast<unsigned long long>(kernel_size.second));
     CHECK_INDEX_VALID(operand.impl().size(3) + 2*padding_size.second - kernel_size.second, 
-        "Kernel size (%d %d) is too large", kernel_size.first, kernel_size.second);
+        "Kernel size (%llu %llu) is too large",
+        static_cast<unsigned long long>(kernel_size.first),
+        static_cast<unsigned long long>(kernel_size.second));
     return Exp<UnaryExpImpl<MaxPool2d, OIType>>(
         Alloc::unique_construct<UnaryExpImpl<MaxPool2d, OIType>>(
             operand.impl_ptr(), kernel_size, stride_size, padding_size 
@@ -334,6 +384,84 @@ constant(data_t value, IndexArray&& size) {
     );
 }
 
+// Constant folding, see exp/rewrite.h. An operation of constants is a
+// constant, which is computed here instead of for every element.
+template<typename Op>
+Exp<UnaryExpImpl<Constant, data_t>>
+__fold_constant(const Exp<UnaryExpImpl<Constant, data_t>>& operand) {
+    auto& impl = operand.impl();
+    IndexArray inds(impl.ndim());
+    Rewrite::count(Rewrite::fold_constant);
+    return constant(Op::map(inds, impl), impl.size());
+}
+
+template<typename Op>
+Exp<UnaryExpImpl<Constant, data_t>>
+__fold_constant(const Exp<UnaryExpImpl<Constant, data_t>>& lhs,
+                const Exp<UnaryExpImpl<Constant, data_t>>& rhs) {
+    auto& lhs_impl = lhs.impl();
+    auto& rhs_impl = rhs.impl();
+    __check_broadcast(lhs_impl, rhs_impl);
+    IndexArray size(Op::ndim(lhs_impl, rhs_impl));
+    for(index_t i = 0; i < size.size(); ++i)
+        size[i] = Op::size(i, lhs_impl, rhs_impl);
+    IndexArray inds(size.size());
+    Rewrite::count(Rewrite::fold_constant);
+    return constant(Op::map(inds, lhs_impl, rhs_impl), std::move(size));
+}
+
+inline Exp<UnaryExpImpl<Constant, data_t>>
+minus(const Exp<UnaryExpImpl<Constant, data_t>>& operand) {
+    return __fold_constant<Minus>(operand);
+}
+inline Exp<UnaryExpImpl<Constant, data_t>>
+operator-(const Exp<UnaryExpImpl<Constant, data_t>>& operand) {
+    return minus(operand);
+}
+
+inline Exp<UnaryExpImpl<Constant, data_t>>
+relu(const Exp<UnaryExpImpl<Constant, data_t>>& operand) {
+    return __fold_constant<ReLU>(operand);
+}
+
+inline Exp<UnaryExpImpl<Constant, data_t>>
+sigmoid(const Exp<UnaryExpImpl<Constant, data_t>>& operand) {
+    return __fold_constant<Sigmoid>(operand);
+}
+
+inline Exp<UnaryExpImpl<Constant, data_t>>
+add(const Exp<UnaryExpImpl<Constant, data_t>>& lhs,
+    const Exp<UnaryExpImpl<Constant, data_t>>& rhs) {
+    return __fold_constant<Add>(lhs, rhs);
+}
+inline Exp<UnaryExpImpl<Constant, data_t>>
+operator+(const Exp<UnaryExpImpl<Constant, data_t>>& lhs,
+          const Exp<UnaryExpImpl<Constant, data_t>>& rhs) {
+    return add(lhs, rhs);
+}
+
+inline Exp<UnaryExpImpl<Constant, data_t>>
+mul(const Exp<UnaryExpImpl<Constant, data_t>>& lhs,
+    const Exp<UnaryExpImpl<Constant, data_t>>& rhs) {
+    return __fold_constant<Mul>(lhs, rhs);
+}
+inline Exp<UnaryExpImpl<Constant, data_t>>
+operator*(const Exp<UnaryExpImpl<Constant, data_t>>& lhs,
+          const Exp<UnaryExpImpl<Constant, data_t>>& rhs) {
+    return mul(lhs, rhs);
+}
+
+inline Exp<UnaryExpImpl<Constant, data_t>>
+sub(const Exp<UnaryExpImpl<Constant, data_t>>& lhs,
+    const Exp<UnaryExpImpl<Constant, data_t>>& rhs) {
+    return __fold_constant<Sub>(lhs, rhs);
+}
+inline Exp<UnaryExpImpl<Constant, data_t>>
+operator-(const Exp<UnaryExpImpl<Constant, data_t>>& lhs,
+          const Exp<UnaryExpImpl<Constant, data_t>>& rhs) {
+    return sub(lhs, rhs);
+}
+
 }  // namespace op
 }  // namespace st
 
@@ -3,10 +3,12 @@
 
 #include <type_traits>
 
+#include "utils/allocator.h"
 #include "utils/base_config.h"
 #include "utils/array.h"
 #include "utils/exception.h"
 
+#include "exp/operator/matrix_op.h"
 #include "exp/operator/log_softmax.h"
 #include "exp/operator/constant.h"
 #include "exp/operator/reduce_op.h"
@@ -43,8 +45,9 @@ typename std::enable_if<Op::allow_broadcast::value,
 __grad_size(const GIType& grad, const LhsType& lhs, const RhsType& rhs) {
     CHECK_EQUAL(lhs.ndim(), rhs.ndim(), 
         "Backward of broadcasting is supported only when the dimensions \
-        of operands are equal, but got %dD and %dD.",
-        lhs.ndim(), rhs.ndim());
+        of operands are equal, but got %lluD and %lluD.",
+        static_cast<unsigned long long>(lhs.ndim()),
+        static_cast<unsigned long long>(rhs.ndim()));
     return grad.grad_size();
 }
 
@@ -108,6 +111,69 @@ private:
     const LhsImplType& lhs_;
     const RhsImplType& rhs_;
 };
+
+// Gradients stored in memory.
+//
+// The gradient of matrix_mul reads every element of the incoming gradient
+// once for each row or column of its operands, just like the forward reads
+// its operands, see exp/materialize.h. The incoming gradient is often an
+// expression, e.g. the gradient of relu(matrix_mul(...)) evaluates
+// matrix_mul again for every element it reads. So such an operation
+// evaluates the incoming gradient into StoredGradImpl first, unless it is
+// read from memory already, i.e. __is_stored_grad is true for it.
+template<typename Op>
+struct __rereads_grad : std::integral_constant<bool,
+        std::is_same<Op, op::MatrixMul>::value
+     || std::is_same<Op, op::BatchMatrixMul>::value> {};
+
+template<typename GIType>
+struct __is_stored_grad : std::false_type {};
+
+class StoredGradImpl : public GradImpl<StoredGradImpl> {
+public:
+    template<typename GIType>
+    explicit StoredGradImpl(const GIType& grad)
+            : shape_(grad.grad_size()),
+              stride_(shape_.size()),
+              dsize_(1),
+              dptr_(nullptr, Alloc::trivial_delete_handler(0)) {
+        index_t ndim = shape_.size();
+        for(index_t i = ndim; i-- > 0;) {
+            stride_[i] = dsize_;
+            dsize_ *= shape_[i];
+        }
+        dptr_ = Alloc::unique_allocate<data_t>(dsize_ * sizeof(data_t));
+
+        IndexArray inds(ndim);
+        inds.memset(0);
+        data_t* ptr = dptr_.get();
+        for(index_t k = 0; k < dsize_; ++k) {
+            ptr[k] = grad.eval(inds);
+            for(index_t i = ndim; i-- > 0;) {
+                if(++inds[i] < shape_[i])
+                    break;
+                inds[i] = 0;
+            }
+        }
+    }
+
+    IndexArray grad_size(void) const { return shape_; }
+
+    data_t eval(IndexArray& inds) const {
+        index_t offset = 0;
+        for(index_t i = 0; i < shape_.size(); ++i)
+            offset += inds[i] * stride_[i];
+        return dptr_.get()[offset];
+    }
+private:
+    IndexArray shape_;
+    IndexArray stride_;
+    index_t dsize_;
+    Alloc::TrivialUniquePtr<data_t> dptr_;
+};
+
+template<>
+struct __is_stored_grad<StoredGradImpl> : std::true_type {};
 }  // namespace st
 
 
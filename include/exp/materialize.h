@@ -0,0 +1,119 @@
+#ifndef EXP_MATERIALIZE_H
+#define EXP_MATERIALIZE_H
+
+#include <type_traits>
+
+#include "utils/allocator.h"
+#include "utils/base_config.h"
+#include "exp/exp.h"
+#include "exp/exp_impl.h"
+#include "exp/rewrite.h"
+#include "tensor/tensor_impl.h"
+
+#include "exp/operator/basic_op.h"
+#include "exp/operator/matrix_op.h"
+#include "exp/operator/reduce_op.h"
+#include "exp/operator/nll_loss.h"
+#include "exp/operator/log_softmax.h"
+#include "exp/operator/conv.h"
+
+namespace st {
+
+// Materialization of operands.
+//
+// An element of an expression is computed every time it is read. That's
+// what we want for a chain of element-wise operations, but matrix_mul reads
+// every element of its operands once for each row or column of the output,
+// and img2col reads every pixel once for each kernel position covering it.
+// If such an operand is an expensive expression, e.g. relu(matrix_mul(...)),
+// it is evaluated again and again. So these operations evaluate an expensive
+// operand into a TensorImpl first, just like
+//     Tensor col(op::img2col(x, ...));
+//     Tensor y = op::matrix_mul(col, ...);
+// The TensorImpl takes the operand as its grad_fn, so backward isn't changed.
+//
+// Whether an operand is expensive is decided by its type. __exp_cost is the
+// estimated cost to evaluate one element of an expression:
+//     - reading a tensor costs 1, and a constant costs 0,
+//     - an element-wise operation or a transpose costs 1 plus the costs of
+//       its operands,
+//     - img2col costs kIndexingCost plus the cost of its operand, because of
+//       the division and modulo of indices,
+//     - a reduction, i.e. matrix_mul, mean, max, log_softmax and so on,
+//       reads about kReducedElements elements of its operands for one element.
+// An operand whose cost exceeds kMaxRereadCost is materialized. Costs
+// saturate at kCostLimit, so that nested reductions don't overflow.
+constexpr index_t kIndexingCost = 4;
+constexpr index_t kReducedElements = 16;
+constexpr index_t kMaxRereadCost = 4;
+constexpr index_t kCostLimit = 1 << 20;
+
+constexpr index_t __saturate_cost(index_t cost) {
+    return cost > kCostLimit ? kCostLimit : cost;
+}
+
+template<typename Op>
+struct __is_reduction : std::integral_constant<bool,
+        std::is_base_of<op::ReduceOperator, Op>::value
+     || std::is_same<Op, op::MatrixMul>::value
+     || std::is_same<Op, op::BatchMatrixMul>::value
+     || std::is_same<Op, op::LogSoftmax>::value
+     || std::is_same<Op, op::NLLLoss>::value
+     || std::is_same<Op, op::MaxPool2d>::value> {};
+
+template<typename Op>
+struct __op_cost : std::integral_constant<index_t,
+        std::is_same<Op, op::Img2col>::value ? kIndexingCost : 1> {};
+
+template<typename Op>
+struct __op_fanin : std::integral_constant<index_t,
+        __is_reduction<Op>::value ? kReducedElements : 1> {};
+
+// TensorImpl and HalfTensorImpl
+template<typename ImplType>
+struct __exp_cost : std::integral_constant<index_t, 1> {};
+
+template<>
+struct __exp_cost<UnaryExpImpl<op::Constant, data_t>>
+        : std::integral_constant<index_t, 0> {};
+
+template<typename Op, typename OIType>
+struct __exp_cost<UnaryExpImpl<Op, OIType>>
+        : std::integral_constant<index_t, __saturate_cost(
+              __op_cost<Op>::value
+              + __op_fanin<Op>::value * __exp_cost<OIType>::value)> {};
+
+template<typename Op, typename LhsImplType, typename RhsImplType>
+struct __exp_cost<BinaryExpImpl<Op, LhsImplType, RhsImplType>>
+        : std::integral_constant<index_t, __saturate_cost(
+              __op_cost<Op>::value
+              + __op_fanin<Op>::value * (__exp_cost<LhsImplType>::value
+                                         + __exp_cost<RhsImplType>::value))> {};
+
+template<typename ImplType>
+struct __should_materialize
+        : std::integral_constant<bool, (__exp_cost<ImplType>::value > kMaxRereadCost)> {};
+
+// The type of an operand of an operation reading it repeatedly.
+template<typename ImplType>
+using __reread_operand_t = typename std::conditional<
+    __should_materialize<ImplType>::value, TensorImpl, ImplType>::type;
+
+template<typename ImplType>
+typename std::enable_if<!__should_materialize<ImplType>::value,
+                        const Exp<ImplType>&>::type
+__materialize(const Exp<ImplType>& operand) {
+    return operand;
+}
+
+template<typename ImplType>
+typename std::enable_if<__should_materialize<ImplType>::value,
+                        Exp<TensorImpl>>::type
+__materialize(const Exp<ImplType>& operand) {
+    Rewrite::count(Rewrite::materialize);
+    return Exp<TensorImpl>(Alloc::unique_construct<TensorImpl>(operand.impl()));
+}
+
+}  // namespace st
+
+#endif
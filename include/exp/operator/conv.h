@@ -98,12 +98,14 @@ struct Img2col {
                     }
                 }
             */
-            inds[2] += padding_size.first;
-            inds[3] += padding_size.second;
-            for(kh_idx = 0; kh_idx < kernel_size.first && kh_idx <= inds[2]; ++kh_idx) {
-                for(kw_idx = 0; kw_idx < kernel_size.second && kw_idx <= inds[3]; ++kw_idx) {
-                    ph_idx = inds[2] - kh_idx;
-                    pw_idx = inds[3] - kw_idx;
+            // The location in the padded image. inds is left as it is,
+            // because the caller still uses it to locate the output.
+            index_t h_idx = inds[2] + padding_size.first;
+            index_t w_idx = inds[3] + padding_size.second;
+            for(kh_idx = 0; kh_idx < kernel_size.first && kh_idx <= h_idx; ++kh_idx) {
+                for(kw_idx = 0; kw_idx < kernel_size.second && kw_idx <= w_idx; ++kw_idx) {
+                    ph_idx = h_idx - kh_idx;
+                    pw_idx = w_idx - kw_idx;
 
                     if(ph_idx + kernel_size.first > img_h 
                     || pw_idx + kernel_size.second > img_w
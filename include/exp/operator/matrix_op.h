@@ -145,7 +145,9 @@ struct BatchMatrixTranspose {
     template<typename OperandType>
     static data_t map(IndexArray& inds, const OperandType& operand) {
         std::swap(inds[1], inds[2]);
-        return operand.eval(inds);
+        data_t value = operand.eval(inds);
+        std::swap(inds[1], inds[2]);
+        return value;
     }
 
     struct Grad {
@@ -157,7 +159,9 @@ struct BatchMatrixTranspose {
         static data_t map(IndexArray& inds, const GradType& grad, 
                           const OperandType& operand) {
             std::swap(inds[1], inds[2]);
-            return grad.eval(inds);
+            data_t value = grad.eval(inds);
+            std::swap(inds[1], inds[2]);
+            return value;
         }
     };
 };
@@ -0,0 +1,74 @@
+#ifndef EXP_RANK_H
+#define EXP_RANK_H
+
+#include <type_traits>
+
+#include "utils/base_config.h"
+#include "exp/operator/basic_op.h"
+#include "exp/operator/matrix_op.h"
+#include "exp/operator/reduce_op.h"
+#include "exp/operator/nll_loss.h"
+#include "exp/operator/log_softmax.h"
+#include "exp/operator/conv.h"
+#include "exp/operator/constant.h"
+
+namespace st {
+
+// forward declaration
+template<typename Op, typename OIType> class UnaryExpImpl;
+template<typename Op, typename LhsImplType, typename RhsImplType> class BinaryExpImpl;
+
+// Static rank of expressions.
+//
+// The rank of a tensor is only known at runtime, but many operations always
+// output a fixed rank, e.g. matrix_mul and img2col are 2D, max_pool2d is 4D.
+// __static_rank is the rank of an expression if it's known from its type, or
+// kDynamicRank otherwise. The kernels in tensor/tensor_impl.h use it to pick a
+// rank at compile time, so that their loops over dimensions are unrolled. For
+// an expression of dynamic rank, they dispatch the runtime rank to one of
+// ranks 1 to kMaxStaticRank.
+constexpr index_t kDynamicRank = static_cast<index_t>(-1);
+constexpr index_t kMaxStaticRank = 4;
+
+template<typename Op>
+struct __op_rank : std::integral_constant<index_t, kDynamicRank> {};
+template<> struct __op_rank<op::MatrixTranspose> : std::integral_constant<index_t, 2> {};
+template<> struct __op_rank<op::MatrixMul> : std::integral_constant<index_t, 2> {};
+template<> struct __op_rank<op::BatchMatrixTranspose> : std::integral_constant<index_t, 3> {};
+template<> struct __op_rank<op::BatchMatrixMul> : std::integral_constant<index_t, 3> {};
+template<> struct __op_rank<op::LogSoftmax> : std::integral_constant<index_t, 2> {};
+template<> struct __op_rank<op::NLLLoss> : std::integral_constant<index_t, 1> {};
+template<> struct __op_rank<op::Img2col> : std::integral_constant<index_t, 2> {};
+template<> struct __op_rank<op::MaxPool2d> : std::integral_constant<index_t, 4> {};
+
+// TensorImpl, HalfTensorImpl and gradients
+template<typename ImplType>
+struct __static_rank : std::integral_constant<index_t, kDynamicRank> {};
+
+template<typename Op, typename OIType>
+struct __static_rank<UnaryExpImpl<Op, OIType>> : std::integral_constant<index_t,
+        __op_rank<Op>::value != kDynamicRank ? __op_rank<Op>::value
+        // element-wise operations keep the rank
+        : std::is_base_of<op::UnaryBasicOperator, Op>::value
+            ? __static_rank<OIType>::value
+        // reductions remove one dimension, but keep at least one
+        : std::is_base_of<op::ReduceOperator, Op>::value
+            && __static_rank<OIType>::value != kDynamicRank
+            ? (__static_rank<OIType>::value > 2 ? __static_rank<OIType>::value - 1 : 1)
+        : kDynamicRank> {};
+
+template<typename Op, typename LhsImplType, typename RhsImplType>
+struct __static_rank<BinaryExpImpl<Op, LhsImplType, RhsImplType>>
+        : std::integral_constant<index_t,
+        __op_rank<Op>::value != kDynamicRank ? __op_rank<Op>::value
+        // broadcasting outputs the larger rank
+        : std::is_base_of<op::BinaryBasicOperator, Op>::value
+            && __static_rank<LhsImplType>::value != kDynamicRank
+            && __static_rank<RhsImplType>::value != kDynamicRank
+            ? (__static_rank<LhsImplType>::value > __static_rank<RhsImplType>::value
+               ? __static_rank<LhsImplType>::value : __static_rank<RhsImplType>::value)
+        : kDynamicRank> {};
+
+}  // namespace st
+
+#endif
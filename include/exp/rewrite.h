@@ -0,0 +1,333 @@
+#ifndef EXP_REWRITE_H
+#define EXP_REWRITE_H
+
+#include <atomic>
+#include <ostream>
+#include <type_traits>
+
+#include "utils/base_config.h"
+#include "utils/array.h"
+#include "exp/operator/basic_op.h"
+#include "exp/operator/matrix_op.h"
+#include "exp/operator/constant.h"
+
+namespace st {
+
+// forward declaration
+template<typename Op, typename OIType> class UnaryExpImpl;
+template<typename Op, typename LhsImplType, typename RhsImplType> class BinaryExpImpl;
+
+// Rewrites of expressions.
+//
+// An expression is evaluated per element as it is written, e.g. a transpose
+// swaps indices for every element it reads, and in (a - b) * (a - b), a - b
+// is computed twice. Rewrites find such patterns once, when an expression is
+// built, and evaluate an equivalent but cheaper form. They don't change the
+// graph, so gradients are computed as before. A step captured by StaticGraph
+// builds its expressions once, so replay() runs the rewritten kernels.
+//     fold_transpose   T(T(x)) is x, and matrix_mul reads a transposed
+//                      operand from its operand directly.
+//     remove_negation  -(-x) is x, a - (-b) is a + b, a + (-b) is a - b.
+//     fold_constant    An operation of constants is a constant, see
+//                      exp/function.h. x + 0, x - 0, x * 1 and 1 * x are x.
+//     share_subexp     Operands of an element-wise operation, which are the
+//                      same expression, are evaluated once.
+//     collapse_view    A view of a view refers to their base directly, so
+//                      backward doesn't go through every view in a chain.
+//     materialize      An expensive operand of matrix_mul or img2col is
+//                      evaluated into a tensor first, see exp/materialize.h.
+// Rewrite counts them, as a report of what has been applied.
+class Rewrite {
+public:
+    enum Kind {
+        fold_transpose,
+        remove_negation,
+        fold_constant,
+        share_subexp,
+        collapse_view,
+        materialize,
+        n_kinds
+    };
+
+    static void count(Kind kind) { ++counter(kind); }
+    static index_t counted(Kind kind) { return counter(kind); }
+    static index_t total(void) {
+        index_t n = 0;
+        for(int kind = 0; kind < n_kinds; ++kind)
+            n += counter(static_cast<Kind>(kind));
+        return n;
+    }
+    static void reset(void) {
+        for(int kind = 0; kind < n_kinds; ++kind)
+            counter(static_cast<Kind>(kind)) = 0;
+    }
+
+    // One line for each kind of rewrite.
+    static void report(std::ostream& out) {
+        static const char* names[n_kinds] = {
+            "fold_transpose", "remove_negation", "fold_constant",
+            "share_subexp", "collapse_view", "materialize"
+        };
+        for(int kind = 0; kind < n_kinds; ++kind)
+            out << names[kind] << ": " << counter(static_cast<Kind>(kind)) << std::endl;
+    }
+private:
+    static std::atomic<index_t>& counter(Kind kind) {
+        static std::atomic<index_t> counters[n_kinds];
+        return counters[kind];
+    }
+};
+
+
+template<typename ImplType>
+struct __is_constant_exp : std::false_type {};
+template<>
+struct __is_constant_exp<UnaryExpImpl<op::Constant, data_t>> : std::true_type {};
+
+template<typename ImplType>
+struct __is_transposed : std::false_type {};
+template<typename OIType>
+struct __is_transposed<UnaryExpImpl<op::MatrixTranspose, OIType>> : std::true_type {};
+
+// Operators without parameters. Two expressions of such an operator are the
+// same if their operands are.
+template<typename Op>
+struct __is_stateless : std::integral_constant<bool,
+        std::is_base_of<op::UnaryBasicOperator, Op>::value
+     || std::is_base_of<op::BinaryBasicOperator, Op>::value
+     || std::is_same<Op, op::MatrixTranspose>::value
+     || std::is_same<Op, op::BatchMatrixTranspose>::value
+     || std::is_same<Op, op::MatrixMul>::value
+     || std::is_same<Op, op::BatchMatrixMul>::value> {};
+
+
+// Whether two expressions always evaluate to the same values.
+template<typename LhsImplType, typename RhsImplType>
+bool __same_exp(const LhsImplType& lhs, const RhsImplType& rhs) {
+    return false;
+}
+
+template<typename ImplType>
+bool __same_exp(const ImplType& lhs, const ImplType& rhs) {
+    return &lhs == &rhs;
+}
+
+template<typename Op, typename OIType>
+typename std::enable_if<__is_stateless<Op>::value, bool>::type
+__same_exp(const UnaryExpImpl<Op, OIType>& lhs, const UnaryExpImpl<Op, OIType>& rhs) {
+    return &lhs == &rhs || __same_exp(lhs.operand(), rhs.operand());
+}
+
+template<typename Op, typename LhsImplType, typename RhsImplType>
+typename std::enable_if<__is_stateless<Op>::value, bool>::type
+__same_exp(const BinaryExpImpl<Op, LhsImplType, RhsImplType>& lhs,
+           const BinaryExpImpl<Op, LhsImplType, RhsImplType>& rhs) {
+    return &lhs == &rhs || (__same_exp(lhs.lhs(), rhs.lhs())
+                            && __same_exp(lhs.rhs(), rhs.rhs()));
+}
+
+inline bool __same_exp(const UnaryExpImpl<op::Constant, data_t>& lhs,
+                       const UnaryExpImpl<op::Constant, data_t>& rhs);
+
+
+// Whether an expression is a constant of the value.
+template<typename ImplType>
+typename std::enable_if<!__is_constant_exp<ImplType>::value, bool>::type
+__is_constant_of(const ImplType& impl, data_t value) {
+    return false;
+}
+
+template<typename ImplType>
+typename std::enable_if<__is_constant_exp<ImplType>::value, bool>::type
+__is_constant_of(const ImplType& impl, data_t value) {
+    return impl.value() == value;
+}
+
+
+// Rewrites decided by the operands of a BinaryExpImpl when it is built.
+enum class __BinaryRewrite { none, lhs_only, rhs_only, shared_operands };
+
+template<typename Op, typename LhsImplType, typename RhsImplType>
+__BinaryRewrite __plan_binary_rewrite(const LhsImplType& lhs, const RhsImplType& rhs) {
+    if(!std::is_base_of<op::BinaryBasicOperator, Op>::value)
+        return __BinaryRewrite::none;
+
+    bool add = std::is_same<Op, op::Add>::value;
+    bool sub = std::is_same<Op, op::Sub>::value;
+    bool mul = std::is_same<Op, op::Mul>::value;
+    // A constant is broadcast to the other operand, so the result is the
+    // other operand only if it has the shape of the result.
+    bool lhs_full = lhs.ndim() >= rhs.ndim();
+    bool rhs_full = rhs.ndim() >= lhs.ndim();
+    for(index_t i = 0; i < lhs.ndim() && i < rhs.ndim(); ++i) {
+        lhs_full = lhs_full && lhs.size(i) >= rhs.size(i);
+        rhs_full = rhs_full && rhs.size(i) >= lhs.size(i);
+    }
+
+    if(lhs_full && (((add || sub) && __is_constant_of(rhs, 0))
+                    || (mul && __is_constant_of(rhs, 1)))) {
+        Rewrite::count(Rewrite::fold_constant);
+        return __BinaryRewrite::lhs_only;
+    }
+    if(rhs_full && ((add && __is_constant_of(lhs, 0))
+                    || (mul && __is_constant_of(lhs, 1)))) {
+        Rewrite::count(Rewrite::fold_constant);
+        return __BinaryRewrite::rhs_only;
+    }
+    if(__same_exp(lhs, rhs)) {
+        Rewrite::count(Rewrite::share_subexp);
+        return __BinaryRewrite::shared_operands;
+    }
+    return __BinaryRewrite::none;
+}
+
+
+// Value of an operand which has been evaluated.
+struct __EvaluatedOperand {
+    data_t value;
+    data_t eval(IndexArray& inds) const { return value; }
+};
+
+// Element-wise operation of an expression with itself. Only element-wise
+// operations are planned to share their operands.
+template<typename Op, typename ImplType>
+typename std::enable_if<std::is_base_of<op::BinaryBasicOperator, Op>::value,
+                        data_t>::type
+__map_shared_operands(IndexArray& inds, const ImplType& operand) {
+    __EvaluatedOperand evaluated{operand.eval(inds)};
+    return Op::map(inds, evaluated, evaluated);
+}
+
+template<typename Op, typename ImplType>
+typename std::enable_if<!std::is_base_of<op::BinaryBasicOperator, Op>::value,
+                        data_t>::type
+__map_shared_operands(IndexArray& inds, const ImplType& operand) {
+    return 0;
+}
+
+
+// Rewrites decided by the types of operands. __count_rewrites is called when
+// an expression is built, and __rewritten_map when it is evaluated. Each
+// pattern is matched by an overload of both.
+template<typename Op, typename OIType>
+void __count_rewrites(Op, const OIType& operand) {}
+
+template<typename Op, typename OIType>
+data_t __rewritten_map(Op, IndexArray& inds, const OIType& operand) {
+    return Op::map(inds, operand);
+}
+
+template<typename Op, typename LhsImplType, typename RhsImplType>
+void __count_rewrites(Op, const LhsImplType& lhs, const RhsImplType& rhs) {}
+
+template<typename Op, typename LhsImplType, typename RhsImplType>
+data_t __rewritten_map(Op, IndexArray& inds,
+                       const LhsImplType& lhs, const RhsImplType& rhs) {
+    return Op::map(inds, lhs, rhs);
+}
+
+// T(T(x)) is x.
+template<typename OIType>
+void __count_rewrites(op::MatrixTranspose,
+                      const UnaryExpImpl<op::MatrixTranspose, OIType>& operand) {
+    Rewrite::count(Rewrite::fold_transpose);
+}
+
+template<typename OIType>
+data_t __rewritten_map(op::MatrixTranspose, IndexArray& inds,
+                       const UnaryExpImpl<op::MatrixTranspose, OIType>& operand) {
+    return operand.operand().eval(inds);
+}
+
+template<typename OIType>
+void __count_rewrites(op::BatchMatrixTranspose,
+                      const UnaryExpImpl<op::BatchMatrixTranspose, OIType>& operand) {
+    Rewrite::count(Rewrite::fold_transpose);
+}
+
+template<typename OIType>
+data_t __rewritten_map(op::BatchMatrixTranspose, IndexArray& inds,
+                       const UnaryExpImpl<op::BatchMatrixTranspose, OIType>& operand) {
+    return operand.operand().eval(inds);
+}
+
+// -(-x) is x.
+template<typename OIType>
+void __count_rewrites(op::Minus, const UnaryExpImpl<op::Minus, OIType>& operand) {
+    Rewrite::count(Rewrite::remove_negation);
+}
+
+template<typename OIType>
+data_t __rewritten_map(op::Minus, IndexArray& inds,
+                       const UnaryExpImpl<op::Minus, OIType>& operand) {
+    return operand.operand().eval(inds);
+}
+
+// a - (-b) is a + b, and a + (-b) is a - b.
+template<typename LhsImplType, typename OIType>
+void __count_rewrites(op::Sub, const LhsImplType& lhs,
+                      const UnaryExpImpl<op::Minus, OIType>& rhs) {
+    Rewrite::count(Rewrite::remove_negation);
+}
+
+template<typename LhsImplType, typename OIType>
+data_t __rewritten_map(op::Sub, IndexArray& inds, const LhsImplType& lhs,
+                       const UnaryExpImpl<op::Minus, OIType>& rhs) {
+    return op::Add::map(inds, lhs, rhs.operand());
+}
+
+template<typename LhsImplType, typename OIType>
+void __count_rewrites(op::Add, const LhsImplType& lhs,
+                      const UnaryExpImpl<op::Minus, OIType>& rhs) {
+    Rewrite::count(Rewrite::remove_negation);
+}
+
+template<typename LhsImplType, typename OIType>
+data_t __rewritten_map(op::Add, IndexArray& inds, const LhsImplType& lhs,
+                       const UnaryExpImpl<op::Minus, OIType>& rhs) {
+    return op::Sub::map(inds, lhs, rhs.operand());
+}
+
+// A transposed operand of matrix_mul is read from its operand, with the
+// indices in the other order.
+template<typename ImplType>
+const ImplType& __untransposed(const ImplType& impl) { return impl; }
+
+template<typename OIType>
+const OIType& __untransposed(const UnaryExpImpl<op::MatrixTranspose, OIType>& impl) {
+    return impl.operand();
+}
+
+template<typename LhsImplType, typename RhsImplType>
+void __count_rewrites(op::MatrixMul, const LhsImplType& lhs, const RhsImplType& rhs) {
+    if(__is_transposed<LhsImplType>::value)
+        Rewrite::count(Rewrite::fold_transpose);
+    if(__is_transposed<RhsImplType>::value)
+        Rewrite::count(Rewrite::fold_transpose);
+}
+
+template<typename LhsImplType, typename RhsImplType>
+data_t __rewritten_map(op::MatrixMul, IndexArray& inds,
+                       const LhsImplType& lhs, const RhsImplType& rhs) {
+    constexpr index_t lhs_k = __is_transposed<LhsImplType>::value ? 0 : 1;
+    constexpr index_t rhs_k = __is_transposed<RhsImplType>::value ? 1 : 0;
+    auto& lhs_matrix = __untransposed(lhs);
+    auto& rhs_matrix = __untransposed(rhs);
+
+    index_t hsize = lhs.size(1);
+    IndexArray lhs_inds(2);
+    IndexArray rhs_inds(2);
+    lhs_inds[1 - lhs_k] = inds[0];
+    rhs_inds[1 - rhs_k] = inds[1];
+
+    data_t value = 0;
+    for(index_t i = 0; i < hsize; ++i) {
+        lhs_inds[lhs_k] = i;
+        rhs_inds[rhs_k] = i;
+        value += lhs_matrix.eval(lhs_inds) * rhs_matrix.eval(rhs_inds);
+    }
+    return value;
+}
+
+}  // namespace st
+#endif
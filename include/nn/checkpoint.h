@@ -0,0 +1,44 @@
+#ifndef NN_CHECKPOINT_H
+#define NN_CHECKPOINT_H
+
+#include "tensor/tensor.h"
+#include "nn/module.h"
+
+namespace st {
+namespace nn {
+
+// Gradient checkpointing.
+//
+// forward() runs the wrapped module without recording the graph, so the
+// activations inside it are freed as soon as it returns. Only the input is
+// kept. When the gradient of the output arrives in backward, the module is run
+// again with the graph recorded, and the gradient is propagated through the
+// recomputed graph to the parameters and the input.
+//
+// It trades one more forward of the module for the memory of its activations.
+// The forward of the module should be deterministic.
+//     Checkpoint stage1_ckpt(stage1);
+//     Tensor y = stage1_ckpt.forward(x);
+class Checkpoint : public Module {
+public:
+    explicit Checkpoint(Module& module) : module_(module) {}
+    Checkpoint(const Checkpoint& other) = delete;
+    ~Checkpoint() = default;
+
+    Tensor forward(const Tensor& input) override;
+    ParamsDict parameters(void) override { return module_.parameters(); }
+    void mixed_precision(bool enable, HalfType type=HalfType::bfloat16) override {
+        module_.mixed_precision(enable, type);
+    }
+private:
+    struct RecomputeGradFn;
+
+    // Whether input or a parameter of the module requires grad.
+    bool needs_grad(const Tensor& input);
+
+    Module& module_;
+};
+
+}  // namespace nn
+}  // namespace st
+#endif
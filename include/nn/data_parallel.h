@@ -0,0 +1,105 @@
+#ifndef NN_DATA_PARALLEL_H
+#define NN_DATA_PARALLEL_H
+
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "nn/module.h"
+#include "dist/process_group.h"
+
+namespace st {
+namespace nn {
+
+// Data-parallel training. Every process of a ProcessGroup runs the same model
+// on its own batches, and the gradients are averaged over the processes
+// before the optimizer steps, so the parameters stay the same in all of them.
+//
+// Parameters are broadcast from the rank 0 at construction, and put into
+// buckets of about bucket_size elements. Once backward has completed the
+// gradients of a bucket, a communication thread all-reduces it while
+// backward goes on with the rest of the graph. Buckets go in the same order
+// in every process. At first the parameters are taken by their names in
+// reverse, and after the first step in the order the gradients of the rank 0
+// were completed, so the buckets completed first go first.
+//
+//     DataParallel parallel(model.parameters(), group);
+//     optimizer.set_data_parallel(&parallel);
+//     for(...) {
+//         loss.backward();
+//         optimizer.step();  // calls parallel.synchronize() first
+//         optimizer.zero_grad();
+//     }
+//
+// One backward is expected between two synchronizations. Parameters which
+// got no gradient in backward are all-reduced by synchronize().
+//
+// A bucket is summed over the processes by a communication hook, which may
+// compress the gradients, e.g. half_compression() sends them in 16 bits.
+class DataParallel {
+public:
+    static constexpr index_t kDefaultBucketSize = 1 << 18;
+
+    // Called on the communication thread with the n gradients of a bucket,
+    // one parameter after another. It must leave their sums over the
+    // processes in grads, the same in every process. By default it's
+    // group.all_reduce.
+    using CommHook = std::function<void(dist::ProcessGroup& group,
+                                        data_t* grads, index_t n)>;
+    static CommHook half_compression(HalfType type=HalfType::bfloat16);
+
+    DataParallel(const ParamsDict& params, dist::ProcessGroup& group,
+                 index_t bucket_size=kDefaultBucketSize);
+    DataParallel(const DataParallel& other) = delete;
+    ~DataParallel();
+
+    index_t n_buckets(void) const { return buckets_.size(); }
+    // Set between steps, in all processes.
+    void register_comm_hook(CommHook hook);
+
+    // Wait until the gradients of all parameters are averaged over the
+    // processes. The first exception thrown by the communication is
+    // rethrown here.
+    void synchronize(void);
+    // Whether the parameters are the same in all processes, bit for bit.
+    // All of them must call it, between steps.
+    bool parameters_in_sync(void);
+private:
+    struct Bucket {
+        std::vector<index_t> params_;
+        std::vector<data_t> flat_;  // gradients of the params, one after another
+        index_t n_pending_;  // params whose gradients aren't complete
+    };
+
+    void build_buckets(const std::vector<index_t>& order);
+    // Called by backward through the hook of the param.
+    void on_grad_ready(index_t param_idx);
+    // Called with mutex_ held.
+    void mark_ready(index_t param_idx);
+    void comm_loop(void);
+    void reduce_bucket(Bucket& bucket);
+
+    dist::ProcessGroup& group_;
+    index_t bucket_size_;
+    CommHook comm_hook_;
+    std::vector<std::reference_wrapper<TensorImpl>> params_;
+    std::vector<Bucket> buckets_;
+    std::vector<index_t> bucket_of_;  // of each param
+    std::vector<bool> ready_;
+    std::vector<index_t> ready_order_;
+    bool reordered_;
+
+    std::mutex mutex_;
+    std::condition_variable ready_cv_, reduced_cv_;
+    index_t n_reduced_;  // buckets reduced in this step
+    bool stop_;
+    std::exception_ptr error_;
+    std::thread comm_thread_;
+};
+
+}  // namespace nn
+}  // namespace st
+#endif
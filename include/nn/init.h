@@ -30,6 +30,10 @@ protected:
         return param_.storage_.dptr_;
     }
 
+    void increment_version(void) const {
+        param_.storage_.increment_version();
+    }
+
     static std::default_random_engine engine_;
     TensorImpl& param_;
 };
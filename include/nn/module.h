@@ -6,8 +6,10 @@
 #include <unordered_map>
 #include <functional>
 #include <initializer_list>
+#include <memory>
 
 #include "tensor/tensor.h"
+#include "tensor/half_tensor.h"
 
 namespace st {
 namespace nn {
@@ -43,6 +45,11 @@ class Module {
 public:
     virtual Tensor forward(const Tensor& input) = 0;
     virtual ParamsDict parameters(void) = 0;
+    // In mixed precision mode, forward() reads weights from a HalfTensor copy
+    // of type `type`. Parameters stay in data_t as master weights, so the
+    // optimizer and the gradients are unchanged. Modules containing other
+    // modules should pass the call on to them.
+    virtual void mixed_precision(bool enable, HalfType type=HalfType::bfloat16) {}
     virtual ~Module() = default;
 };
 
@@ -54,9 +61,13 @@ public:
 
     Tensor forward(const Tensor& input) override;
     ParamsDict parameters(void) override;
+    void mixed_precision(bool enable, HalfType type=HalfType::bfloat16) override;
+
+    friend class QuantizedLinear;
 protected:
     Tensor weight_;
     Tensor bias_;
+    Alloc::NontrivialUniquePtr<HalfTensor> half_weight_;
 };
 
 class LinearWithReLU : public Linear {
@@ -77,6 +88,9 @@ public:
 
     Tensor forward(const Tensor& input) override;
     ParamsDict parameters(void) override;
+    void mixed_precision(bool enable, HalfType type=HalfType::bfloat16) override;
+
+    friend class QuantizedConv2d;
 protected:
     index_t in_channels_;
     index_t out_channels_;
@@ -86,6 +100,7 @@ protected:
     Wsize padding_;
 
     Tensor weight_;
+    Alloc::NontrivialUniquePtr<HalfTensor> half_weight_;
 };
 
 class Conv2dWithReLU : public Conv2d {
@@ -120,6 +135,10 @@ public:
 
     Tensor forward(const Tensor& input,
                    const index_t* labels);
+    // The labels are shared instead of copied, e.g. to be a placeholder of
+    // a StaticGraph.
+    Tensor forward(const Tensor& input,
+                   const std::shared_ptr<index_t>& labels);
 };
 
 }  // namespace nn
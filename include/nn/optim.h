@@ -9,12 +9,22 @@
 namespace st {
 namespace nn{
 
+// forward declaration
+class DataParallel;
+
 class OptimizerBase {
 public:
     OptimizerBase(const ParamsDict& params_dict);
     void zero_grad(void);
     virtual void step(void) = 0;
+    // In data-parallel training, step() first waits for the gradients to be
+    // averaged over the processes, so the parameters stay the same in all of
+    // them. nullptr to train alone.
+    void set_data_parallel(DataParallel* parallel) { parallel_ = parallel; }
 protected:
+    // Called by step() before the parameters are updated.
+    void synchronize_grads(void);
+
     static index_t data_size(const TensorImpl& t) {
         return t.shape_.dsize();
     }
@@ -24,8 +34,14 @@ protected:
     static data_t* get_grad(TensorImpl& t) {
         return t.gradmeta_ptr_->grad_.dptr_;
     }
+    // Parameters are updated in place. Bump the version to tell the HalfTensor
+    // copies used in mixed precision mode to re-sync.
+    static void increment_version(TensorImpl& t) {
+        t.storage_.increment_version();
+    }
 
     std::vector<std::reference_wrapper<TensorImpl>> params_;
+    DataParallel* parallel_;
 };
 
 class SGD : public OptimizerBase {
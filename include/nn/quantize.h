@@ -0,0 +1,125 @@
+#ifndef NN_QUANTIZE_H
+#define NN_QUANTIZE_H
+
+#include <cstdint>
+
+#include "tensor/tensor.h"
+#include "nn/module.h"
+
+namespace st {
+
+namespace data {
+    class DatasetBase;
+}
+
+namespace nn {
+
+// Post-training quantization for inference.
+//
+// Weights are quantized symmetrically to int8 with one scale per output
+// channel. Activations are quantized symmetrically to int8 with one scale per
+// tensor, and the scale is calibrated by running the float model on some data.
+// The int8 x int8 products are accumulated in int32, and the bias, ReLU and
+// the conversion to the output scale are done in the epilogue of the GEMM.
+//
+// Usage:
+//     QuantizedLinear q(linear);   // wraps the float layer, calibrating
+//     calibrate(model_with_q, dataset, {784}, 16);
+//     q.freeze();                  // quantize weights, int8 from now on
+
+// int8 activations with a per-tensor scale. real_value = scale * data[i].
+struct QTensor {
+    QTensor(const Shape& shape, data_t scale);
+    QTensor(QTensor&& other) = default;
+
+    Tensor dequantize(void) const;
+
+    Shape shape_;
+    data_t scale_;
+    Alloc::TrivialUniquePtr<int8_t> data_;
+};
+
+class QuantizedModule : public Module {
+public:
+    // In calibrating mode, forward() runs the float layer and records the
+    // range of its input and output.
+    bool calibrating(void) const { return calibrating_; }
+    virtual void freeze(void) = 0;
+
+    // int8 in, int8 out, the output is requantized to output_scale().
+    virtual QTensor forward(const QTensor& input) = 0;
+    using Module::forward;
+
+    QTensor quantize(const Tensor& input) const;
+    data_t input_scale(void) const { return input_scale_; }
+    data_t output_scale(void) const { return output_scale_; }
+    ParamsDict parameters(void) override { return {}; }
+
+protected:
+    QuantizedModule() = default;
+
+    void observe(const Tensor& input, const Tensor& output);
+    void quantize_weight(TensorImpl& weight, index_t n_channels);
+
+    static const data_t* get_storage(const TensorImpl& t) {
+        return t.storage_.dptr_;
+    }
+    static data_t* get_storage(TensorImpl& t) {
+        return t.storage_.dptr_;
+    }
+
+    bool calibrating_ = true;
+    data_t input_absmax_ = 0;
+    data_t output_absmax_ = 0;
+    data_t input_scale_ = 1;
+    data_t output_scale_ = 1;
+
+    index_t n_channels_ = 0;
+    index_t channel_size_ = 0;
+    Alloc::TrivialUniquePtr<int8_t> qweight_{nullptr, 0};
+    Alloc::TrivialUniquePtr<data_t> weight_scale_{nullptr, 0};
+};
+
+class QuantizedLinear : public QuantizedModule {
+public:
+    // Works with both Linear and LinearWithReLU.
+    explicit QuantizedLinear(Linear& linear);
+
+    Tensor forward(const Tensor& input) override;
+    QTensor forward(const QTensor& input) override;
+    void freeze(void) override;
+private:
+    // data_t in and out, int8 inside
+    Tensor forward_int8(const Tensor& input);
+
+    Linear& linear_;
+    bool relu_;
+    Alloc::TrivialUniquePtr<data_t> bias_{nullptr, 0};
+};
+
+class QuantizedConv2d : public QuantizedModule {
+public:
+    // Works with both Conv2d and Conv2dWithReLU.
+    explicit QuantizedConv2d(Conv2d& conv);
+
+    Tensor forward(const Tensor& input) override;
+    QTensor forward(const QTensor& input) override;
+    void freeze(void) override;
+private:
+    Tensor forward_int8(const Tensor& input);
+    // Img2col on int8 data. Row (b*oh + h)*ow + w of col holds the patch
+    // whose output is out[b, :, h, w].
+    void img2col(const QTensor& input, int8_t* col) const;
+
+    Conv2d& conv_;
+    bool relu_;
+};
+
+// Run `model` on the first n_batchs batches of `dataset`. QuantizedModules in
+// it record the activation ranges. Samples have shape sample_shape.
+void calibrate(Module& model, const data::DatasetBase& dataset,
+               const Shape& sample_shape, index_t n_batchs);
+
+}  // namespace nn
+}  // namespace st
+#endif
@@ -0,0 +1,96 @@
+#ifndef TENSOR_GRAD_ENGINE_H
+#define TENSOR_GRAD_ENGINE_H
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <vector>
+
+#include "utils/base_config.h"
+#include "utils/allocator.h"
+#include "utils/thread_pool.h"
+
+namespace st {
+
+// forward declaration
+class TensorImpl;
+template<typename ImplType> class ExpImplPtr;
+
+// Scheduler of the backward pass.
+//
+// A TensorImpl is a node of the graph, its grad_fn is the edge to the tensors
+// it was computed from. The gradcount_ of a TensorImpl is its dependency count:
+// it is increased when an expression holding the tensor is built, and
+// decreased when that expression passes its gradient down. A node with a zero
+// count has got all of its gradient and is ready.
+//
+// Ready nodes are put into a FIFO queue and their grad_fn is executed by the
+// loop in run(), instead of being called from inside the grad_fn of the node
+// that made them ready. So the depth of the call stack is bounded by the depth
+// of a single expression, no matter how many tensors are chained.
+//
+// With set_num_threads(n) and n > 1, ready nodes are tasks of a work-stealing
+// ThreadPool instead, so independent branches of the graph run concurrently.
+// The thread calling backward works as one of the n threads. Gradients of a
+// tensor, and of the views sharing them, are accumulated under the mutex in
+// its AutoGradMeta.
+//
+// Once the grad_fn of a node has been executed, it is released, together with
+// the operands and buffers it saved, unless the engine retains the graph. A
+// released node can't be backwarded again. With retain_graph, the gradient of
+// a node is cleared once passed on, and the gradcount of each node is restored
+// after run(), so backward can be called once more.
+//
+// Tensor::backward() creates an engine on its stack. The engine is the current
+// one of the thread while it lives.
+class GradEngine {
+public:
+    // Without check_version, tensors modified in place since forward are
+    // not reported, see tensor/static_graph.h.
+    explicit GradEngine(bool retain_graph=false, bool check_version=true);
+    GradEngine(const GradEngine& other) = delete;
+    ~GradEngine();
+
+    // Execute the grad_fn of ready nodes until no node is ready.
+    void run(void);
+    index_t n_executed(void) const { return n_executed_; }
+    bool retain_graph(void) const { return retain_graph_; }
+
+    // Called by TensorImpl when its gradcount reaches zero. Without a current
+    // engine, the grad_fn of `node` is executed right away.
+    static void schedule(TensorImpl* node);
+    static GradEngine* current(void);
+    // Whether backward checks the version of saved tensors.
+    static bool checks_version(void);
+    // Called by ExpImplPtr after decreasing a gradcount, so that the current
+    // engine can restore it if the graph is retained.
+    static void on_gradcount_decreased(std::atomic<index_t>& gradcount);
+
+    // Number of threads used by backward, 1 by default.
+    static void set_num_threads(index_t n_threads);
+    static index_t num_threads(void);
+private:
+    // A scheduled node is referred by the engine until it is executed, since
+    // the node which made it ready may be released in the meantime.
+    using NodePtr = std::shared_ptr<ExpImplPtr<TensorImpl>>;
+
+    void execute(const NodePtr& node);
+    void restore_gradcounts(void);
+
+    std::queue<NodePtr> ready_queue_;
+    std::atomic<index_t> n_executed_;
+    GradEngine* prev_engine_;
+
+    bool retain_graph_;
+    bool check_version_;
+    std::mutex decreased_mutex_;
+    std::vector<std::atomic<index_t>*> decreased_gradcounts_;
+
+    ThreadPool* pool_;
+    ThreadPool* prev_pool_;
+    Alloc::NontrivialUniquePtr<TaskGroup> task_group_;
+};
+
+}  // namespace st
+#endif
@@ -1,6 +1,9 @@
 #ifndef TENSOR_GRAD_META_H
 #define TENSOR_GRAD_META_H
 
+#include <functional>
+#include <mutex>
+
 #include "utils/exception.h"
 #include "exp/grad_impl.h"
 #include "tensor/tensor_impl.h"
@@ -42,6 +45,9 @@ struct GradFn {
     };
 };
 
+template<>
+struct __is_stored_grad<GradFn::TensorGradImpl> : std::true_type {};
+
 template<typename ImplType> 
 class __GradFn: public GradFn {
 public:
@@ -86,16 +92,33 @@ struct AutoGradMeta {
     Storage grad_;
     bool from_view_;
     std::shared_ptr<GradFn> grad_fn_ptr_;
+    // Set when backward dropped grad_fn_ptr_ after running it.
+    bool grad_fn_released_;
+    // Guards grad_ and the gradcount of the tensor when backward runs on
+    // several threads. Views share it with their base, like grad_.
+    std::shared_ptr<std::mutex> mutex_ptr_;
+    // The tensor which grad_fn of a view refers to. It's kept alive by 
+    // grad_fn_ptr_.
+    const TensorImpl* view_base_;
+    // Called by backward once the gradient of a leaf tensor is complete,
+    // e.g. to send it to other processes while backward goes on.
+    std::function<void(void)> grad_ready_hook_;
 
     AutoGradMeta(const Shape& tensor_shape)
             : grad_(tensor_shape.dsize(), 0),
               from_view_(false),
-              grad_fn_ptr_(nullptr) {}
+              grad_fn_ptr_(nullptr),
+              grad_fn_released_(false),
+              mutex_ptr_(Alloc::shared_construct<std::mutex>()),
+              view_base_(nullptr) {}
     
-    AutoGradMeta(const Storage& grad, index_t offset)
-            : grad_(grad, offset),
+    AutoGradMeta(const AutoGradMeta& base, index_t offset)
+            : grad_(base.grad_, offset),
               from_view_(false),
-              grad_fn_ptr_(nullptr) {}
+              grad_fn_ptr_(nullptr),
+              grad_fn_released_(false),
+              mutex_ptr_(base.mutex_ptr_),
+              view_base_(nullptr) {}
 
     void set_from_view(bool from_view) { from_view_ = from_view; }
 
@@ -103,6 +126,14 @@ struct AutoGradMeta {
     void set_grad_fn(const ImplType& impl) {
         auto ptr = Alloc::shared_construct<__GradFn<ImplType>>(impl);
         grad_fn_ptr_ = ptr;
+        grad_fn_released_ = false;
+        view_base_ = nullptr;
+    }
+
+    void set_view_base(const TensorImpl& base) {
+        set_from_view(true);
+        set_grad_fn(base);
+        view_base_ = &base;
     }
 };
 }  // namespace st
@@ -130,7 +161,12 @@ Backward workflow:
     2. BinaryExpImpl
         1. check gradcount == 0. if not, throw Error
     3. TensorImpl
-        1. acculate grad
-        2. check gradcount == 0. if so, call grad_fn
+        1. acculate grad, together with decreasing gradcount under its mutex
+        2. check gradcount == 0. if so, schedule it in GradEngine
         3. check from_view is False. if so, don't pass grad
+
+4. GradEngine::run()
+    1. pop a ready TensorImpl and call its grad_fn, which goes to 2. again
+    2. repeat until the ready queue is empty
+    (with more than one thread, ready TensorImpls are tasks of a thread pool)
 */
\ No newline at end of file
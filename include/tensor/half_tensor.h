@@ -0,0 +1,187 @@
+#ifndef TENSOR_HALF_TENSOR_H
+#define TENSOR_HALF_TENSOR_H
+
+#include <memory>
+#include <mutex>
+#include <ostream>
+
+#include "utils/base_config.h"
+#include "utils/allocator.h"
+#include "utils/exception.h"
+#include "utils/half.h"
+#include "exp/exp.h"
+#include "exp/exp_impl.h"
+#include "tensor/shape.h"
+#include "tensor/tensor_impl.h"
+#include "tensor/tensor.h"
+
+namespace st {
+
+// Storage keeping 16-bit values. It only converts on access, so it can't give
+// out a data_t& like Storage does. Use set() to write.
+class HalfStorage {
+public:
+    HalfStorage(index_t size, HalfType type);
+    HalfStorage(const HalfStorage& other) = default;
+    HalfStorage(HalfStorage&& other) = default;
+    ~HalfStorage() = default;
+    HalfStorage& operator=(const HalfStorage& other) = delete;
+
+    // inline function
+    data_t operator[](index_t idx) const { return half::load(type_, dptr_[idx]); }
+    void set(index_t idx, data_t value) { dptr_[idx] = half::store(type_, value); }
+    HalfType type(void) const { return type_; }
+    half_t* data(void) { return dptr_; }
+    const half_t* data(void) const { return dptr_; }
+private:
+    std::shared_ptr<half_t> bptr_;
+    half_t* dptr_;
+    HalfType type_;
+};
+
+// A contiguous leaf of expressions whose elements are stored in float16 or
+// bfloat16. Operators read it through eval() like a TensorImpl, and the
+// conversion to data_t happens right there, so the computation is still done
+// in data_t while the memory traffic is a quarter of it. No other copy is
+// kept, so nbytes() is all the memory of the values. A kernel reading an
+// element many times, as matrix_mul does, converts it every time, which is a
+// shift for bfloat16.
+//
+// A HalfTensorImpl built from a TensorImpl keeps a reference to it as master.
+// sync() re-quantizes the master when its version changed, and the gradient
+// flowing into the HalfTensorImpl is accumulated into the master directly.
+// That is how mixed precision training works in nn::Linear and nn::Conv2d.
+class HalfTensorImpl : public ExpImpl<HalfTensorImpl> {
+public:
+    // To be consistent with TensorImpl
+    using op = op::Identity;
+    using operand_type = HalfTensorImpl;
+
+    HalfTensorImpl(const Shape& shape, HalfType type);
+    HalfTensorImpl(const TensorImpl& master, HalfType type);
+    template<typename ImplType> HalfTensorImpl(const ImplType& impl, HalfType type);
+
+    HalfTensorImpl(const HalfTensorImpl& other) = delete;
+    HalfTensorImpl(HalfTensorImpl&& other) = default;
+
+    // inline function
+    index_t ndim(void) const { return shape_.ndim(); }
+    index_t size(index_t idx) const { return shape_[idx]; }
+    const Shape& size(void) const { return shape_; }
+    const IndexArray& stride(void) const { return stride_; }
+    HalfType type(void) const { return storage_.type(); }
+    index_t nbytes(void) const { return shape_.dsize() * sizeof(half_t); }
+    bool requires_grad(void) const {
+        return bool(master_ptr_) && (*master_ptr_)->requires_grad();
+    }
+
+    void sync(void);
+
+    // member function for expression template
+    data_t eval(IndexArray& inds) const {
+        index_t offset = 0;
+        for(index_t i = 0; i < ndim(); ++i)
+            offset += inds[i] * stride_[i];
+        return storage_[offset];
+    }
+    data_t eval(index_t idx) const { return storage_[idx]; }
+    template<typename ImplType> HalfTensorImpl& operator=(const ImplType& exp_impl);
+
+    template<typename GIType>
+    void backward(const GIType& grad) {
+        // The master weight is a leaf. Just accumulate the gradient into it.
+        if(requires_grad()) {
+            TensorImpl* master = (*master_ptr_).operator->();
+            {
+                std::lock_guard<std::mutex> guard(master->grad_mutex());
+                master->accumulate_grad(grad);
+            }
+            master->backward();
+        }
+    }
+
+    friend std::ostream& operator<<(std::ostream& out, const HalfTensorImpl& t);
+private:
+    // Chunk size of the fused store conversion. Values are computed into a
+    // buffer on the stack and converted by half::to_half in bulk.
+    static constexpr index_t kChunkSize = 256;
+
+    HalfStorage storage_;
+    Shape shape_;
+    IndexArray stride_;
+
+    Alloc::NontrivialUniquePtr<ExpImplPtr<TensorImpl>> master_ptr_;
+    index_t synced_version_;
+};
+
+// Shell of HalfTensorImpl, see exp/exp.h and tensor/tensor.h.
+class HalfTensor : public Exp<HalfTensorImpl> {
+public:
+    explicit HalfTensor(const Shape& shape, HalfType type=HalfType::bfloat16);
+    HalfTensor(const Tensor& master, HalfType type=HalfType::bfloat16);
+    HalfTensor(Alloc::NontrivialUniquePtr<HalfTensorImpl>&& ptr);
+    template<typename ImplType>
+    HalfTensor(const Exp<ImplType>& exp, HalfType type=HalfType::bfloat16);
+
+    HalfTensor(const HalfTensor& other) = default;
+    HalfTensor(HalfTensor&& other) = default;
+
+    index_t ndim(void) const { return impl_ptr_->ndim(); }
+    index_t size(index_t idx) const { return impl_ptr_->size(idx); }
+    const Shape& size(void) const { return impl_ptr_->size(); }
+    HalfType type(void) const { return impl_ptr_->type(); }
+    index_t nbytes(void) const { return impl_ptr_->nbytes(); }
+    void sync(void) { impl_ptr_->sync(); }
+
+    template<typename ImplType> HalfTensor& operator=(const Exp<ImplType>& exp);
+
+    friend std::ostream& operator<<(std::ostream& out, const HalfTensor& t);
+};
+
+
+// member template function definition
+template<typename ImplType>
+HalfTensorImpl::HalfTensorImpl(const ImplType& impl, HalfType type)
+        : HalfTensorImpl(Shape(impl.size()), type) {
+    this->operator=(impl);
+}
+
+template<typename ImplType>
+HalfTensorImpl& HalfTensorImpl::operator=(const ImplType& exp_impl) {
+    CHECK_EXP_SAME_SHAPE(*this, exp_impl);
+
+    data_t chunk[kChunkSize];
+    IndexArray inds(ndim());
+    index_t dsize = shape_.dsize();
+    for(index_t start = 0; start < dsize; start += kChunkSize) {
+        index_t n = std::min(kChunkSize, dsize - start);
+        for(index_t k = 0; k < n; ++k) {
+            for(index_t ii = start + k, j = 0; j < ndim(); ++j) {
+                if(stride_[j] != 0) {
+                    inds[j] = ii / stride_[j];
+                    ii %= stride_[j];
+                } else {
+                    inds[j] = 0;
+                }
+            }
+            chunk[k] = exp_impl.eval(inds);
+        }
+        half::to_half(type(), chunk, storage_.data() + start, n);
+    }
+    return *this;
+}
+
+template<typename ImplType>
+HalfTensor::HalfTensor(const Exp<ImplType>& exp, HalfType type)
+        : Exp<HalfTensorImpl>(
+            Alloc::unique_construct<HalfTensorImpl>(exp.impl(), type))
+    {}
+
+template<typename ImplType>
+HalfTensor& HalfTensor::operator=(const Exp<ImplType>& exp) {
+    impl_ptr_->operator=(exp.impl());
+    return *this;
+}
+
+}  // namespace st
+#endif
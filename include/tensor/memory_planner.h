@@ -0,0 +1,74 @@
+#ifndef TENSOR_MEMORY_PLANNER_H
+#define TENSOR_MEMORY_PLANNER_H
+
+#include <memory>
+
+#include "utils/base_config.h"
+
+namespace st {
+
+// Static memory planning of the Storages of a training step.
+//
+// A step allocating its tensors one by one needs a buffer for each of them,
+// although many of them are never alive at the same time. Once backward
+// releases the graph, see tensor/grad_engine.h, each Storage of a step lives
+// from its allocation to the release of the last node using it.
+//
+// The planner traces a step: the size, the allocation time and the free time
+// of every Storage allocated between begin_trace() and end_trace() on this
+// thread. Then each of them gets an offset in a single slab. Storages alive
+// at the same time never overlap. The blocks are placed from the largest one,
+// each into the smallest gap left between the blocks it overlaps in time
+// (greedy interval coloring with best-fit offsets). Activations kept by the
+// graph are all alive when backward starts, so the slab is much smaller than
+// the naive size where tensors die inside the step, like in evaluation or in
+// stages of nn::Checkpoint.
+//
+// Between begin_step() and end_step(), the k-th Storage allocated is taken
+// from the slab if its size is the traced one. A block whose place is still
+// used by another one, because the step went differently from the trace, is
+// allocated as usual instead. So are Storages outliving the traced step.
+// n_fallbacks() counts such allocations in the last step.
+//     st::MemoryPlanner planner;
+//     for(...) {
+//         j == 0 ? planner.begin_trace() : planner.begin_step();
+//         {
+//             st::Tensor loss = ...;
+//             loss.backward();
+//         }
+//         j == 0 ? planner.end_trace() : planner.end_step();
+//     }
+class MemoryPlanner {
+public:
+    MemoryPlanner();
+    MemoryPlanner(const MemoryPlanner& other) = delete;
+    ~MemoryPlanner();
+
+    void begin_trace(void);
+    void end_trace(void);
+    void begin_step(void);
+    void end_step(void);
+    bool planned(void) const;
+
+    // Number of planned Storages, the sum of their sizes, the most bytes of
+    // traced Storages alive at once, and the size of the slab.
+    index_t n_blocks(void) const;
+    index_t naive_size(void) const;
+    index_t traced_peak(void) const;
+    index_t planned_size(void) const;
+    index_t n_fallbacks(void) const;
+
+    // Called by Storage. Return nullptr unless a planner is tracing or
+    // stepping on this thread, or when the block can't be from the slab.
+    static std::shared_ptr<void> allocate(index_t nbytes);
+private:
+    struct State;
+    static std::shared_ptr<State>& active_state(void);
+
+    // Deleters of the blocks refer to the state, so it lives until the last
+    // of them is freed.
+    std::shared_ptr<State> state_;
+};
+
+}  // namespace st
+#endif
@@ -0,0 +1,74 @@
+#ifndef TENSOR_STATIC_GRAPH_H
+#define TENSOR_STATIC_GRAPH_H
+
+#include <functional>
+#include <vector>
+
+#include "utils/base_config.h"
+#include "utils/allocator.h"
+
+namespace st {
+
+// forward declaration
+class Tensor;
+class TensorImpl;
+template<typename ImplType> class ExpImplPtr;
+
+// Capture and replay of a training step with fixed shapes.
+//
+// Building the graph of a step allocates ExpImpl nodes, GradFns and
+// IndexArrays, checks shapes and resolves broadcasting, and it's the same for
+// every step. While a StaticGraph is capturing, every assignment of an
+// expression to a tensor is recorded as a kernel, which holds the expression
+// and the destination tensor. So are the other computations done in forward,
+// like the precomputation of log_softmax and the sync of a HalfTensor.
+//
+// replay() runs the kernels in order. Buffers, strides and the graph are the
+// captured ones, so nothing is built again. backward() runs backward through
+// the captured graph, which is retained. Between steps, only the data of the
+// placeholders, the tensors and labels the captured step was called with, is
+// changed by feed().
+//     st::StaticGraph graph;
+//     graph.begin_capture();
+//     st::Tensor loss = criterion.forward(model.forward(input), labels);
+//     graph.end_capture(loss);
+//     for(...) {
+//         graph.feed(input, batch_samples);
+//         std::memcpy(labels.get(), batch_labels, ...);
+//         graph.replay();
+//         graph.backward();
+//         optimizer.step();
+//     }
+//
+// Things not made of expressions are frozen at capture, e.g. a tensor copied
+// from a raw pointer inside forward. In-place add can't be captured, since
+// replaying it would add once more. Labels are only range-checked at capture.
+class StaticGraph {
+public:
+    using Kernel = std::function<void(void)>;
+
+    StaticGraph();
+    StaticGraph(const StaticGraph& other) = delete;
+    ~StaticGraph();
+
+    void begin_capture(void);
+    void end_capture(const Tensor& loss);
+    bool captured(void) const { return bool(loss_ptr_); }
+    index_t n_kernels(void) const { return kernels_.size(); }
+
+    void feed(const Tensor& placeholder, const data_t* data);
+    void replay(void);
+    void backward(void);
+
+    // Called where forward computes something. Do nothing unless a graph is
+    // capturing on this thread.
+    static bool is_capturing(void);
+    static void record(Kernel&& kernel);
+private:
+    std::vector<Kernel> kernels_;
+    Alloc::NontrivialUniquePtr<ExpImplPtr<TensorImpl>> loss_ptr_;
+    bool capturing_;
+};
+
+}  // namespace st
+#endif
@@ -2,6 +2,7 @@
 #define TENSOR_STORAGE_H
 
 #include <memory>
+#include <functional>
 
 #include "utils/base_config.h"
 #include "utils/allocator.h"
@@ -11,6 +12,7 @@ namespace st {
 namespace nn {
     class InitializerBase;
     class OptimizerBase;
+    class QuantizedModule;
 }
 
 class Storage {
@@ -19,30 +21,53 @@ public:
     Storage(const Storage& other, index_t offset);
     Storage(index_t size, data_t value);
     Storage(const data_t* data, index_t size);
+    // Storage of size elements at data, which aren't copied, e.g. a mmap
+    // region or an array of the caller. The caller still owns the memory,
+    // which must live until release is called. That happens once the last
+    // Storage sharing it is destroyed. Pass nullptr if there is nothing to
+    // release.
+    static Storage borrow(data_t* data, index_t size,
+                          std::function<void(void)> release=nullptr);
+    // The same for memory which mustn't be written, e.g. a batch of a dataset
+    // or a PROT_READ mapping. Tensors of the storage throw when written.
+    static Storage borrow_read_only(const data_t* data, index_t size,
+                                    std::function<void(void)> release=nullptr);
     
     explicit Storage(const Storage& other) = default;
-    explicit Storage(Storage&& other) = default;
+    Storage(Storage&& other) = default;
     ~Storage() = default;
     Storage& operator=(const Storage& other) = delete;
 
     // inline function
     data_t operator[](index_t idx) const { return dptr_[idx]; }
     data_t& operator[](index_t idx) { return dptr_[idx]; }
-    index_t offset(void) const { return dptr_ - bptr_->data_; }
+    index_t offset(void) const { return dptr_ - base_; }
     index_t version(void) const { return bptr_->version_; }
+    bool read_only(void) const { return read_only_; }
     void increment_version(void) const { ++bptr_->version_; }
+    // Exchange the memory of two Storages. No data is copied.
+    void swap(Storage& other);
 
     // friend function
     friend class nn::InitializerBase;
     friend class nn::OptimizerBase;
+    friend class nn::QuantizedModule;
 private:
     struct Vdata {
         index_t version_;
         data_t data_[1];
     };
 
+    Storage(data_t* data, index_t size, std::function<void(void)> release,
+            bool read_only);
+
+    // From the MemoryPlanner of the step if there is one.
+    static std::shared_ptr<Vdata> allocate(index_t nbytes);
+
     std::shared_ptr<Vdata> bptr_;  // base pointer
+    data_t* base_;  // first element, which is out of *bptr_ if borrowed
     data_t* dptr_;  // data pointer
+    bool read_only_;  // borrowed by borrow_read_only
 };
 }  // namespace st
 #endif
\ No newline at end of file
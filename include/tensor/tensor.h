@@ -2,6 +2,7 @@
 #define TENSOR_TENSOR_H
 
 #include <memory>
+#include <functional>
 #include <initializer_list>
 
 #include "exp/exp.h"
@@ -28,6 +29,14 @@ public:
                     bool requires_grad=false);
     Tensor(TensorImpl&& impl);
     Tensor(Alloc::NontrivialUniquePtr<TensorImpl>&& ptr);
+    // A contiguous tensor of shape over the elements at data, which are
+    // borrowed by Storage::borrow and aren't copied.
+    static Tensor from_blob(data_t* data, const Shape& shape,
+                            std::function<void(void)> release=nullptr);
+    // The same for read-only memory, e.g. a batch of a dataset, borrowed by
+    // Storage::borrow_read_only. Writing the tensor throws.
+    static Tensor from_read_only_blob(const data_t* data, const Shape& shape,
+                                      std::function<void(void)> release=nullptr);
 
     template<typename ImplType> Tensor(const Exp<ImplType>& exp);
     
@@ -43,6 +52,8 @@ public:
     index_t version(void) const;
     
     bool is_contiguous(void) const;
+    // See TensorImpl::rebind.
+    void rebind(const Storage& storage, index_t n_rows);
     Tensor grad(void) const;
 
     data_t& operator[](std::initializer_list<index_t> ids);
@@ -60,7 +71,8 @@ public:
     template<typename ImplType> Tensor& operator=(const Exp<ImplType>& exp);
     template<typename ImplType> Tensor& operator+=(const Exp<ImplType>& exp);
 
-    void backward(void);
+    // The graph is released during backward, unless retain_graph is true.
+    void backward(bool retain_graph=false);
 
     // friend function
     friend std::ostream& operator<<(std::ostream& out, const Tensor& t);
@@ -1,22 +1,32 @@
 #ifndef TENSOR_TENSOR_IMPL_H
 #define TENSOR_TENSOR_IMPL_H
 
+#include <algorithm>
 #include <initializer_list>
+#include <mutex>
+#include <type_traits>
 #include <utility>
 
 #include "exp/exp_impl.h"
+#include "exp/rank.h"
 #include "tensor/storage.h"
 #include "tensor/shape.h"
 #include "utils/exception.h"
+#include "utils/grad_mode.h"
+#include "tensor/static_graph.h"
 
 
 namespace st {
 
 // foward declaration
 struct AutoGradMeta;
+class HalfTensorImpl;
 namespace nn {
     class InitializerBase;
     class OptimizerBase;
+    class QuantizedModule;
+    class Checkpoint;
+    class DataParallel;
 }
 namespace op {
     struct Identity;
@@ -56,6 +66,9 @@ public:
 
     // other method
     bool is_contiguous(void) const;
+    // Point the tensor at n_rows rows in storage, keeping the other
+    // dimensions, e.g. to take a batch of a DataLoader without copying it.
+    void rebind(const Storage& storage, index_t n_rows);
     Alloc::NontrivialUniquePtr<TensorImpl> grad(void) const;
     
     data_t& operator[](std::initializer_list<index_t> ids);
@@ -81,12 +94,26 @@ public:
     // friend function
     friend std::ostream& operator<<(std::ostream& out, const TensorImpl& t);
     friend ExpImplPtr<TensorImpl>;
+    friend class GradEngine;
+    friend class HalfTensorImpl;
     friend class nn::InitializerBase;
     friend class nn::OptimizerBase;
+    friend class nn::QuantizedModule;
+    friend class nn::Checkpoint;
+    friend class nn::DataParallel;
+    friend class StaticGraph;
 private:
+    template<typename ImplType> void record_assign(const ImplType& exp_impl);
+    const TensorImpl& view_base(void) const;
+    // Throws if the storage is borrowed read-only, see Storage::borrow_read_only.
+    void check_writable(void) const;
 
-    template<typename ImplType> void backward(const ImplType& grad);
+    template<typename ImplType> void accumulate_grad(const ImplType& grad);
+    std::mutex& grad_mutex(void);
     void backward(void);
+    void apply_grad_fn(void);
+    void release_grad_fn(void);
+    void clear_grad(void);
 
     Storage storage_;
     Shape shape_;
@@ -94,6 +121,7 @@ private:
 
     bool requires_grad_;
     Alloc::NontrivialUniquePtr<AutoGradMeta> gradmeta_ptr_;
+    bool is_view_;  // made by slice, transpose, permute or view
 };
 
 // Template specialization for ExpImplPtr
@@ -102,19 +130,22 @@ class ExpImplPtr<TensorImpl> {
 public:
     ExpImplPtr(Alloc::NontrivialUniquePtr<TensorImpl>&& ptr, bool with_grad)
             : ptr_(ptr.release()),
-              with_grad_(with_grad && static_cast<TensorImpl*>(ptr_)->requires_grad()),
+              with_grad_(with_grad && GradMode::is_enabled() 
+                         && static_cast<TensorImpl*>(ptr_)->requires_grad()),
               version_(static_cast<TensorImpl*>(ptr_)->version()) {
         increment_counters();
     }
     ExpImplPtr(const TensorImpl& impl, bool with_grad)
             : ptr_(const_cast<TensorImpl*>(&impl)),
-              with_grad_(with_grad && static_cast<TensorImpl*>(ptr_)->requires_grad()),
+              with_grad_(with_grad && GradMode::is_enabled() 
+                         && static_cast<TensorImpl*>(ptr_)->requires_grad()),
               version_(static_cast<TensorImpl*>(ptr_)->version()) {
         increment_counters();
     }
     ExpImplPtr(const ExpImplPtr& other, bool with_grad)
             : ptr_(other.ptr_),
-              with_grad_(with_grad && static_cast<TensorImpl*>(ptr_)->requires_grad()),
+              with_grad_(with_grad && GradMode::is_enabled() 
+                         && static_cast<TensorImpl*>(ptr_)->requires_grad()),
               version_(static_cast<TensorImpl*>(ptr_)->version()) { 
         increment_counters(); 
     }
@@ -128,22 +159,41 @@ public:
     void invoke_backward(const GradImplType& grad) {
         TensorImpl* ptr = static_cast<TensorImpl*>(ptr_);
         if(ptr->requires_grad()) {
-            CHECK_EQUAL(version_, ptr->version(),
+            CHECK_TRUE(version_ == ptr->version() || !GradEngine::checks_version(),
                 "Leaf variable has been moved into the graph interior");
-            if(with_grad_)
-                --ptr->gradcount_;
-            ptr->backward(grad);
+            // Parallel branches of backward may reach the same tensor, so
+            // accumulating and counting must be done as a whole.
+            bool ready;
+            {
+                std::lock_guard<std::mutex> guard(ptr->grad_mutex());
+                if(with_grad_) {
+                    --ptr->gradcount_;
+                    GradEngine::on_gradcount_decreased(ptr->gradcount_);
+                }
+                ptr->accumulate_grad(grad);
+                ready = ptr->gradcount() == 0;
+            }
+            if(ready)
+                ptr->backward();
         }
     }
 
     void invoke_backward(void) {
         TensorImpl* ptr = static_cast<TensorImpl*>(ptr_);
         if(ptr->requires_grad()) {
-            CHECK_EQUAL(version_, ptr->version(),
+            CHECK_TRUE(version_ == ptr->version() || !GradEngine::checks_version(),
                 "Leaf variable has been moved into the graph interior");
-            if(with_grad_)
-                --ptr->gradcount_;
-            ptr->backward();
+            bool ready;
+            {
+                std::lock_guard<std::mutex> guard(ptr->grad_mutex());
+                if(with_grad_) {
+                    --ptr->gradcount_;
+                    GradEngine::on_gradcount_decreased(ptr->gradcount_);
+                }
+                ready = ptr->gradcount() == 0;
+            }
+            if(ready)
+                ptr->backward();
         }
     }
 private:
@@ -154,8 +204,7 @@ private:
     }
 
     void decrease_refcount() {
-        -- ptr_->refcount_;
-        if(ptr_->refcount_ == 0)
+        if(-- ptr_->refcount_ == 0)
             delete_handler(static_cast<void*>(ptr_));
     }
 
@@ -166,6 +215,7 @@ private:
 };
 }  // namespace st
 #include "tensor/grad_meta.h"
+#include "tensor/grad_engine.h"
 
 namespace st {
 
@@ -187,15 +237,19 @@ void __inplacement_add_uncontiguous(Storage& dist_storage, const Shape& dist_sha
 // member template function definition
 template<typename ImplType>
 TensorImpl::TensorImpl(const ImplType& impl)
-        : TensorImpl(impl.size(), impl.requires_grad()) {
+        : TensorImpl(impl.size(), impl.requires_grad() && GradMode::is_enabled()) {
     this->operator=(impl);
 }
 
 template<typename ImplType> 
 TensorImpl& TensorImpl::operator=(const ImplType& exp_impl) {
     CHECK_EXP_SAME_SHAPE(*this, exp_impl);
+    check_writable();
 
-    if(requires_grad_) {
+    if(StaticGraph::is_capturing())
+        record_assign(exp_impl);
+
+    if(requires_grad_ && GradMode::is_enabled()) {
         gradmeta_ptr_->set_grad_fn(exp_impl);
         gradmeta_ptr_->set_from_view(false);
         storage_.increment_version();
@@ -211,8 +265,11 @@ TensorImpl& TensorImpl::operator=(const ImplType& exp_impl) {
 template<typename ImplType>
 TensorImpl& TensorImpl::operator+=(const ImplType& exp_impl) {
     CHECK_EXP_SAME_SHAPE(*this, exp_impl);
+    check_writable();
+    CHECK_TRUE(!StaticGraph::is_capturing(), 
+        "In-place add can't be captured by a StaticGraph.");
 
-    if(requires_grad_) {
+    if(requires_grad_ && GradMode::is_enabled()) {
         gradmeta_ptr_->set_grad_fn(exp_impl);
         gradmeta_ptr_->set_from_view(false);
         storage_.increment_version();
@@ -227,8 +284,12 @@ TensorImpl& TensorImpl::operator+=(const ImplType& exp_impl) {
 
 inline TensorImpl& TensorImpl::operator=(const TensorImpl& other) {
     CHECK_EXP_SAME_SHAPE(*this, other);
+    check_writable();
+
+    if(StaticGraph::is_capturing())
+        record_assign(other);
 
-    if(requires_grad_) {
+    if(requires_grad_ && GradMode::is_enabled()) {
         gradmeta_ptr_->set_grad_fn(other);
         gradmeta_ptr_->set_from_view(false);
         storage_.increment_version();
@@ -242,7 +303,22 @@ inline TensorImpl& TensorImpl::operator=(const TensorImpl& other) {
 }
 
 template<typename ImplType>
-void TensorImpl::backward(const ImplType& grad) {
+void TensorImpl::record_assign(const ImplType& exp_impl) {
+    // The kernel holds the destination and the expression, so that they
+    // live as long as the graph.
+    auto dist_ptr = Alloc::shared_construct<ExpImplPtr<TensorImpl>>(*this, false);
+    auto src_ptr = Alloc::shared_construct<ExpImplPtr<ImplType>>(exp_impl, false);
+    StaticGraph::record([dist_ptr, src_ptr]() {
+        TensorImpl& dist = const_cast<TensorImpl&>(**dist_ptr);
+        if(dist.is_contiguous())
+            __assign(dist.storage_, dist.shape_, dist.stride_, **src_ptr);
+        else
+            __assign_uncontiguous(dist.storage_, dist.shape_, dist.stride_, **src_ptr);
+    });
+}
+
+template<typename ImplType>
+void TensorImpl::accumulate_grad(const ImplType& grad) {
     // If the gradient is from a non-broadcasting operation,
     // shape will be the same to this->shape_;
     // Otherwise, shape will be broadcasted.
@@ -254,109 +330,154 @@ void TensorImpl::backward(const ImplType& grad) {
             gradmeta_ptr_->grad_, shape, stride_, grad
         );
     }
-    backward();
+}
+
+inline void TensorImpl::check_writable(void) const {
+    // Not a CHECK, which may be cancelled: the memory may be unwritable.
+    if(storage_.read_only())
+        THROW_ERROR("A tensor of read-only borrowed memory can't be written.");
+}
+
+inline std::mutex& TensorImpl::grad_mutex(void) {
+    return *(gradmeta_ptr_->mutex_ptr_);
 }
 
 inline void TensorImpl::backward(void) {
-    if(bool(gradmeta_ptr_->grad_fn_ptr_) && gradcount() == 0) {
-        auto& grad_fn = *(gradmeta_ptr_->grad_fn_ptr_);
-        if(gradmeta_ptr_->from_view_)
-            grad_fn();
-        else
-            grad_fn(gradmeta_ptr_->grad_, shape_, stride_);
+    if(gradcount() != 0)
+        return;
+    CHECK_TRUE(!gradmeta_ptr_->grad_fn_released_,
+        "Trying to backward through the graph a second time, but it has been "
+        "released. Specify retain_graph=true when calling backward the first time.");
+    // All of the gradient has arrived. Let the engine call grad_fn.
+    if(bool(gradmeta_ptr_->grad_fn_ptr_))
+        GradEngine::schedule(this);
+    else if(gradmeta_ptr_->grad_ready_hook_)
+        gradmeta_ptr_->grad_ready_hook_();
+}
+
+inline void TensorImpl::release_grad_fn(void) {
+    gradmeta_ptr_->grad_fn_ptr_.reset();
+    gradmeta_ptr_->grad_fn_released_ = true;
+}
+
+inline void TensorImpl::apply_grad_fn(void) {
+    auto& grad_fn = *(gradmeta_ptr_->grad_fn_ptr_);
+    if(gradmeta_ptr_->from_view_)
+        grad_fn();
+    else
+        grad_fn(gradmeta_ptr_->grad_, shape_, stride_);
+}
+
+inline void TensorImpl::clear_grad(void) {
+    // The gradient of a view is cleared with its base.
+    if(gradmeta_ptr_->from_view_)
+        return;
+    if(is_contiguous())
+        std::fill_n(&gradmeta_ptr_->grad_[0], shape_.dsize(), 0);
+    else
+        __assign_uncontiguous(gradmeta_ptr_->grad_, shape_, stride_,
+            UnaryGradImpl<st::op::Constant, void, data_t>(0, static_cast<IndexArray>(shape_)));
+}
+
+// Kernels evaluating an expression into a tensor.
+//
+// Elements are visited in order, and their indices are counted up dimension
+// by dimension, so no index is divided by strides. Rank is a template
+// parameter, so loops over dimensions are unrolled. It's the static rank of
+// the expression, see exp/rank.h, or the runtime rank dispatched to one of
+// 1 to kMaxStaticRank. Other ranks use the kernel of kDynamicRank.
+struct __AssignTo {
+    static void apply(data_t& dist, data_t value) { dist = value; }
+};
+struct __AddTo {
+    static void apply(data_t& dist, data_t value) { dist += value; }
+};
+
+template<index_t Rank, bool Contiguous, typename AssignOp, typename ImplType>
+void __eval_kernel(Storage& dist_storage, const Shape& dist_shape,
+                   const IndexArray& dist_stride, const ImplType& src_exp) {
+    const index_t ndim = Rank == kDynamicRank ? dist_shape.ndim() : Rank;
+    const index_t dsize = dist_shape.dsize();
+    IndexArray inds(ndim);
+    IndexArray cur(ndim);
+    cur.memset(0);
+
+    for(index_t i = 0; i < dsize; ++i) {
+        // Operators may leave inds changed, so it's copied for every element.
+        index_t offset = Contiguous ? i : 0;
+        for(index_t j = 0; j < ndim; ++j) {
+            inds[j] = cur[j];
+            if(!Contiguous)
+                offset += cur[j] * dist_stride[j];
+        }
+        AssignOp::apply(dist_storage[offset], src_exp.eval(inds));
+
+        for(index_t j = ndim; j-- > 0; ) {
+            if(++cur[j] < dist_shape[j])
+                break;
+            cur[j] = 0;
+        }
+    }
+}
+
+template<bool Contiguous, typename AssignOp, typename ImplType>
+typename std::enable_if<__static_rank<ImplType>::value != kDynamicRank>::type
+__launch_eval_kernel(Storage& dist_storage, const Shape& dist_shape,
+                     const IndexArray& dist_stride, const ImplType& src_exp) {
+    __eval_kernel<__static_rank<ImplType>::value, Contiguous, AssignOp>(
+        dist_storage, dist_shape, dist_stride, src_exp);
+}
+
+template<bool Contiguous, typename AssignOp, typename ImplType>
+typename std::enable_if<__static_rank<ImplType>::value == kDynamicRank>::type
+__launch_eval_kernel(Storage& dist_storage, const Shape& dist_shape,
+                     const IndexArray& dist_stride, const ImplType& src_exp) {
+    static_assert(kMaxStaticRank == 4, "Dispatch every static rank.");
+    switch(dist_shape.ndim()) {
+        case 1:
+            return __eval_kernel<1, Contiguous, AssignOp>(
+                dist_storage, dist_shape, dist_stride, src_exp);
+        case 2:
+            return __eval_kernel<2, Contiguous, AssignOp>(
+                dist_storage, dist_shape, dist_stride, src_exp);
+        case 3:
+            return __eval_kernel<3, Contiguous, AssignOp>(
+                dist_storage, dist_shape, dist_stride, src_exp);
+        case 4:
+            return __eval_kernel<4, Contiguous, AssignOp>(
+                dist_storage, dist_shape, dist_stride, src_exp);
+        default:
+            return __eval_kernel<kDynamicRank, Contiguous, AssignOp>(
+                dist_storage, dist_shape, dist_stride, src_exp);
     }
 }
 
 template<typename ImplType>
 void __assign(Storage& dist_storage, const Shape& dist_shape, 
               const IndexArray& dist_stride, const ImplType& src_exp) {
-    IndexArray inds(dist_shape.ndim());
-    for(index_t i = 0; i < dist_shape.dsize(); ++i) {
-        for(index_t ii = i, j = 0; j < dist_shape.ndim(); ++j) {
-            if(dist_stride[j] != 0) {
-                inds[j] = ii / dist_stride[j];
-                ii %= dist_stride[j];
-            } else {
-                inds[j] = 0;
-            }
-        }
-        dist_storage[i] = src_exp.eval(inds);
-    }
+    __launch_eval_kernel<true, __AssignTo>(
+        dist_storage, dist_shape, dist_stride, src_exp);
 }
 
 template<typename ImplType>
 void __inplacement_add(Storage& dist_storage, const Shape& dist_shape, 
                        const IndexArray& dist_stride, const ImplType& src_exp) {
-    IndexArray inds(dist_shape.ndim());
-    for(index_t i = 0; i < dist_shape.dsize(); ++i) {
-        for(index_t ii = i, j = 0; j < dist_shape.ndim(); ++j) {
-            if(dist_stride[j] != 0) {
-                inds[j] = ii / dist_stride[j];
-                ii %= dist_stride[j];
-            } else {
-                inds[j] = 0;
-            }
-        }
-        dist_storage[i] += src_exp.eval(inds);
-    }
+    __launch_eval_kernel<true, __AddTo>(
+        dist_storage, dist_shape, dist_stride, src_exp);
 }
 
 template<typename ImplType>
 void __assign_uncontiguous(Storage& dist_storage, const Shape& dist_shape, 
                            const IndexArray& dist_stride, const ImplType& src_exp) {
-    IndexArray inds(dist_shape.ndim());
-    IndexArray cur(dist_shape.ndim());
-    index_t idx = 0;
-    cur.memset(0);
-
-    while(true) {
-        if(idx == dist_shape.ndim()) {
-            --idx;
-            index_t offset = 0;
-            for(index_t i = 0; i < inds.size(); ++i)
-                offset += dist_stride[i] * inds[i];
-            dist_storage[offset] = src_exp.eval(inds);
-        } else {
-            while(idx < dist_shape.ndim() && cur[idx] == dist_shape[idx]) {
-                cur[idx] = 0;
-                --idx;
-            }
-            if(idx > dist_shape.ndim()) break;
-
-            inds[idx] = cur[idx];
-            ++cur[idx];
-            ++idx;
-        }
-    }
+    __launch_eval_kernel<false, __AssignTo>(
+        dist_storage, dist_shape, dist_stride, src_exp);
 }
 
 template<typename ImplType>
 void __inplacement_add_uncontiguous(Storage& dist_storage, const Shape& dist_shape, 
                                     const IndexArray& dist_stride, const ImplType& src_exp) {
-    IndexArray inds(dist_shape.ndim());
-    IndexArray cur(dist_shape.ndim());
-    index_t idx = 0;
-    cur.memset(0);
-
-    while(true) {
-        if(idx == dist_shape.ndim()) {
-            --idx;
-            index_t offset = 0;
-            for(index_t i = 0; i < inds.size(); ++i)
-                offset += dist_stride[i] * inds[i];
-            dist_storage[offset] += src_exp.eval(inds);
-        } else {
-            while(idx < dist_shape.ndim() && cur[idx] == dist_shape[idx]) {
-                cur[idx] = 0;
-                --idx;
-            }
-            if(idx > dist_shape.ndim()) break;
-
-            inds[idx] = cur[idx];
-            ++cur[idx];
-            ++idx;
-        }
-    }
+    __launch_eval_kernel<false, __AddTo>(
+        dist_storage, dist_shape, dist_stride, src_exp);
 }
 }  // namespace st
 #endif
\ No newline at end of file
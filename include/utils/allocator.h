@@ -4,6 +4,7 @@
 #include <cstdlib>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <utility>
 
 #include "utils/base_config.h"
@@ -81,6 +82,11 @@ public:
     }
 
     static bool all_clear(void);
+    // Bytes allocated and not yet deallocated, and the maximum of it since
+    // the last reset_peak_memory(). Cached blocks are not counted.
+    static index_t memory_in_use(void);
+    static index_t peak_memory_in_use(void);
+    static void reset_peak_memory(void);
 
 private:
     Alloc() = default;
@@ -91,11 +97,14 @@ private:
 
     static index_t allocate_memory_size;
     static index_t deallocate_memory_size;
+    static index_t peak_memory_size;
 
     struct free_deletor {
         void operator()(void* ptr) { std::free(ptr); }
     };
     std::multimap<index_t, std::unique_ptr<void, free_deletor>> cache_;
+    // Backward may run on several threads, see tensor/grad_engine.h.
+    std::mutex mutex_;
 };
 
 } // namespace st
@@ -11,15 +11,24 @@
 
 namespace st {
 
+// DynamicArray keeps up to kInlineSize elements in itself, and allocates
+// memory only for larger ones. Most arrays are indices and shapes of tensors,
+// which are constructed for every element evaluated, and never have more
+// than a few dimensions.
 template<typename Dtype>
 class DynamicArray {
 public:
+    static constexpr index_t kInlineSize = 8;
+
     explicit DynamicArray(index_t size) 
             : size_(size),
-              dptr_(Alloc::unique_allocate<Dtype>(size_ * sizeof(Dtype))) {}
+              dptr_(size_ > kInlineSize 
+                    ? Alloc::unique_allocate<Dtype>(size_ * sizeof(Dtype))
+                    : Alloc::TrivialUniquePtr<Dtype>(
+                          nullptr, Alloc::trivial_delete_handler(0))) {}
     DynamicArray(std::initializer_list<Dtype> data) 
             : DynamicArray(data.size()) {
-        auto ptr = dptr_.get();
+        auto ptr = this->data();
         for(auto d: data) {
             *ptr = d;
             ++ptr;
@@ -27,24 +36,34 @@ public:
     }
     DynamicArray(const DynamicArray<Dtype>& other) 
             : DynamicArray(other.size()) {
-        std::memcpy(dptr_.get(), other.dptr_.get(), size_ * sizeof(Dtype));
+        std::memcpy(data(), other.data(), size_ * sizeof(Dtype));
     }
     DynamicArray(const Dtype* data, index_t size) 
             : DynamicArray(size) {
-        std::memcpy(dptr_.get(), data, size_ * sizeof(Dtype));
+        std::memcpy(this->data(), data, size_ * sizeof(Dtype));
     }
+    // The default one moves dptr_, or copies inline_ if dptr_ is empty.
     explicit DynamicArray(DynamicArray<Dtype>&& other) = default;
     ~DynamicArray() = default;
 
-    Dtype& operator[](index_t idx) { return dptr_.get()[idx]; }
-    Dtype operator[](index_t idx) const { return dptr_.get()[idx]; }
+    Dtype& operator[](index_t idx) { return data()[idx]; }
+    Dtype operator[](index_t idx) const { return data()[idx]; }
     index_t size() const { return size_; }
-    void memset(int value) const { std::memset(dptr_.get(), value, size_ * sizeof(Dtype)); }
+    void memset(int value) const { 
+        std::memset(const_cast<Dtype*>(data()), value, size_ * sizeof(Dtype)); 
+    }
 private:
+    Dtype* data(void) { return dptr_ ? dptr_.get() : inline_; }
+    const Dtype* data(void) const { return dptr_ ? dptr_.get() : inline_; }
+
     index_t size_;
     Alloc::TrivialUniquePtr<Dtype> dptr_;
+    Dtype inline_[kInlineSize];
 };
 
+template<typename Dtype>
+constexpr index_t DynamicArray<Dtype>::kInlineSize;
+
 
 } // namespace st
 
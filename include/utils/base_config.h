@@ -5,13 +5,21 @@
 
 namespace st {
 
+// index_t is 32-bit unless INDEX_64BIT is defined, e.g. by 
+// `make INDEX_64BIT=1`. A tensor of 32-bit index_t has at most INDEX_MAX,
+// about 2 billion, elements. Sizes are checked against it, see 
+// checked_mul in utils/exception.h.
+#ifdef INDEX_64BIT
+using index_t = unsigned long long;
+#else
 using index_t = unsigned int;
+#endif
 using data_t = double;
 
 template<typename Dtype> class DynamicArray;
 using IndexArray = DynamicArray<index_t>;
 
-// INDEX_MAX =  UINT_MAX/2, to check negative value.
+// INDEX_MAX = max of index_t / 2, to check negative value.
 // See CHECK_INDEX_INVALID in utils/exception.h for the reason. 
 constexpr index_t INDEX_MAX = std::numeric_limits<index_t>::max() >> 1;
 constexpr index_t INDEX_MIN = 0;
@@ -5,6 +5,8 @@
 #include <exception>
 #include <algorithm>
 
+#include "utils/base_config.h"
+
 namespace st {
 namespace err {
 
@@ -51,12 +53,15 @@ struct Error: public std::exception {
     auto& e1 = (e1_);  \
     auto& e2 = (e2_);  \
     CHECK_EQUAL(e1.ndim(), e2.ndim(),  \
-        "Expect the same dimensions, but got %dD and %dD",  \
-        e1.ndim(), e2.ndim());  \
+        "Expect the same dimensions, but got %lluD and %lluD",  \
+        static_cast<unsigned long long>(e1.ndim()),  \
+        static_cast<unsigned long long>(e2.ndim()));  \
     for(index_t i = 0; i < e1.ndim(); ++i) \
         CHECK_EQUAL(e1.size(i), e2.size(i),  \
-            "Expect the same size on the %d dimension, but got %d and %d.",  \
-            i, e1.size(i), e2.size(i));  \
+            "Expect the same size on the %llu dimension, but got %llu and %llu.",  \
+            static_cast<unsigned long long>(i),  \
+            static_cast<unsigned long long>(e1.size(i)),  \
+            static_cast<unsigned long long>(e2.size(i)));  \
 } while(0)
 
 #define CHECK_EXP_BROADCAST(e1_, e2_) do { \
@@ -65,8 +70,10 @@ struct Error: public std::exception {
     index_t min_dim = std::min(e1.ndim(), e2.ndim()); \
     for(index_t i = 0; i < min_dim; ++i)  \
         CHECK_TRUE(e1.size(i) == e2.size(i) || e1.size(i) == 1 || e2.size(i) == 1, \
-            "The size on %dth dimension, %d and %d, can't be broadcasted.", \
-            i, e1.size(i), e2.size(i));  \
+            "The size on %lluth dimension, %llu and %llu, can't be broadcasted.", \
+            static_cast<unsigned long long>(i),  \
+            static_cast<unsigned long long>(e1.size(i)),  \
+            static_cast<unsigned long long>(e2.size(i)));  \
 } while(0)
 
 #else  // ifndef CANCEL_CHECK
@@ -82,5 +89,21 @@ struct Error: public std::exception {
 
 #endif
 
+// Sizes of tensors and buffers are products and sums of sizes. They are 
+// checked against INDEX_MAX, instead of wrapping around silently.
+inline index_t checked_mul(index_t x, index_t y) {
+    CHECK_TRUE(y == 0 || x <= INDEX_MAX / y,
+        "Size %llu * %llu overflows index_t. Define INDEX_64BIT for larger tensors.",
+        static_cast<unsigned long long>(x), static_cast<unsigned long long>(y));
+    return x * y;
+}
+
+inline index_t checked_add(index_t x, index_t y) {
+    CHECK_TRUE(x <= INDEX_MAX && y <= INDEX_MAX - x,
+        "Size %llu + %llu overflows index_t. Define INDEX_64BIT for larger tensors.",
+        static_cast<unsigned long long>(x), static_cast<unsigned long long>(y));
+    return x + y;
+}
+
 }  // namespace st
 #endif
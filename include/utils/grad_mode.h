@@ -0,0 +1,40 @@
+#ifndef UTILS_GRAD_MODE_H
+#define UTILS_GRAD_MODE_H
+
+namespace st {
+
+// Whether autograd records the graph on the current thread.
+//
+// When disabled, expressions don't count their operands as gradient users,
+// tensors computed from expressions don't require grad, and assignments to
+// tensors which require grad neither set grad_fn nor bump the version. It is
+// meant for evaluation and inference, where backward is never called.
+class GradMode {
+public:
+    static bool is_enabled(void) { return enabled(); }
+    static void set_enabled(bool enable) { enabled() = enable; }
+private:
+    static bool& enabled(void) {
+        static thread_local bool value = true;
+        return value;
+    }
+};
+
+// Disable autograd in a scope.
+//     {
+//         st::NoGradGuard no_grad;
+//         st::Tensor output = model.forward(input);
+//     }
+class NoGradGuard {
+public:
+    NoGradGuard() : prev_enabled_(GradMode::is_enabled()) {
+        GradMode::set_enabled(false);
+    }
+    NoGradGuard(const NoGradGuard& other) = delete;
+    ~NoGradGuard() { GradMode::set_enabled(prev_enabled_); }
+private:
+    bool prev_enabled_;
+};
+
+}  // namespace st
+#endif
@@ -0,0 +1,115 @@
+#ifndef UTILS_HALF_H
+#define UTILS_HALF_H
+
+#include <cstdint>
+#include <cstring>
+
+#ifdef __F16C__
+#include <immintrin.h>
+#endif
+
+#include "utils/base_config.h"
+
+namespace st {
+
+// Storage format of half precision data. Computation is always done in data_t,
+// the 16-bit values are only converted when they are loaded or stored.
+//   float16:  1 sign, 5 exponent, 10 mantissa bits (IEEE 754 binary16).
+//   bfloat16: 1 sign, 8 exponent,  7 mantissa bits (upper half of a float32).
+enum class HalfType { float16 = 0, bfloat16 };
+
+using half_t = std::uint16_t;
+
+namespace half {
+
+inline float __bits_to_float(std::uint32_t bits) {
+    float value;
+    std::memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+inline std::uint32_t __float_to_bits(float value) {
+    std::uint32_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
+
+inline float bfloat16_to_float(half_t h) {
+    return __bits_to_float(static_cast<std::uint32_t>(h) << 16);
+}
+
+inline half_t float_to_bfloat16(float f) {
+    std::uint32_t bits = __float_to_bits(f);
+    if((bits & 0x7fffffff) > 0x7f800000)  // NaN, keep it quiet
+        return static_cast<half_t>((bits >> 16) | 0x0040);
+    // round to nearest even
+    bits += 0x7fff + ((bits >> 16) & 1);
+    return static_cast<half_t>(bits >> 16);
+}
+
+inline float float16_to_float(half_t h) {
+#ifdef __F16C__
+    return _cvtsh_ss(h);
+#else
+    std::uint32_t sign = static_cast<std::uint32_t>(h & 0x8000) << 16;
+    std::uint32_t exp = (h >> 10) & 0x1f;
+    std::uint32_t mant = h & 0x3ff;
+
+    if(exp == 0x1f)  // inf or NaN
+        return __bits_to_float(sign | 0x7f800000 | (mant << 13));
+    if(exp == 0) {
+        if(mant == 0)
+            return __bits_to_float(sign);
+        // subnormal, mant * 2^-24
+        float value = static_cast<float>(mant) * (1.f / 16777216.f);
+        return sign ? -value : value;
+    }
+    return __bits_to_float(sign | ((exp + 112) << 23) | (mant << 13));
+#endif
+}
+
+inline half_t float_to_float16(float f) {
+#ifdef __F16C__
+    return _cvtss_sh(f, _MM_FROUND_TO_NEAREST_INT);
+#else
+    std::uint32_t bits = __float_to_bits(f);
+    half_t sign = static_cast<half_t>((bits >> 16) & 0x8000);
+    std::uint32_t abs_bits = bits & 0x7fffffff;
+
+    if(abs_bits > 0x7f800000)  // NaN
+        return sign | 0x7e00;
+    if(abs_bits >= 0x477ff000)  // overflow after rounding, or inf
+        return sign | 0x7c00;
+    if(abs_bits < 0x38800000) {
+        // subnormal or zero in float16, round(|f| * 2^24)
+        float value = __bits_to_float(abs_bits) * 16777216.f;
+        std::uint32_t mant = static_cast<std::uint32_t>(value);
+        float rest = value - mant;
+        if(rest > 0.5f || (rest == 0.5f && (mant & 1)))
+            ++mant;
+        return sign | static_cast<half_t>(mant);
+    }
+    // normal number, re-bias exponent from 127 to 15 and round to nearest even
+    abs_bits -= 112u << 23;
+    abs_bits += 0xfff + ((abs_bits >> 13) & 1);
+    return sign | static_cast<half_t>(abs_bits >> 13);
+#endif
+}
+
+inline data_t load(HalfType type, half_t h) {
+    return type == HalfType::float16 ? float16_to_float(h) : bfloat16_to_float(h);
+}
+
+inline half_t store(HalfType type, data_t value) {
+    float f = static_cast<float>(value);
+    return type == HalfType::float16 ? float_to_float16(f) : float_to_bfloat16(f);
+}
+
+// Bulk conversion used by contiguous kernels. See src/utils/half.cpp,
+// F16C and AVX512-BF16 are used if the compiler targets them.
+void to_half(HalfType type, const data_t* src, half_t* dist, index_t n);
+void from_half(HalfType type, const half_t* src, data_t* dist, index_t n);
+
+}  // namespace half
+}  // namespace st
+#endif
@@ -0,0 +1,107 @@
+#ifndef UTILS_THREAD_POOL_H
+#define UTILS_THREAD_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "utils/base_config.h"
+
+namespace st {
+
+// A work-stealing thread pool.
+//
+// Every worker owns a deque. Tasks submitted by a worker go to the back of its
+// own deque and it pops from the back, so a branch is likely continued on the
+// thread that has its data in cache. An idle worker steals from the front of
+// the others' deques. Threads outside the pool share one extra deque.
+class ThreadPool {
+public:
+    using Task = std::function<void(void)>;
+
+    explicit ThreadPool(index_t n_threads);
+    ThreadPool(const ThreadPool& other) = delete;
+    ~ThreadPool();
+
+    index_t n_threads(void) const { return threads_.size(); }
+
+    void submit(Task task);
+    // Take one task and run it on the calling thread. Return false if there
+    // is no task to take.
+    bool run_one(void);
+
+    // The pool the calling thread works for, or nullptr. Threads outside any
+    // pool can bind themselves to one by set_current(), the previous value
+    // is returned.
+    static ThreadPool* current(void);
+    static ThreadPool* set_current(ThreadPool* pool);
+private:
+    struct TaskQueue {
+        std::deque<Task> tasks_;
+        std::mutex mutex_;
+    };
+
+    void worker_loop(index_t id);
+    bool take(index_t id, Task& task);
+    index_t queue_id(void) const;
+
+    std::vector<std::thread> threads_;
+    std::unique_ptr<TaskQueue[]> queues_;  // n_threads() + 1 queues
+
+    std::atomic<index_t> n_queued_;
+    std::mutex sleep_mutex_;
+    std::condition_variable sleep_cv_;
+    bool stop_;
+};
+
+// Tasks which can be waited for together. wait() runs tasks of the pool on
+// the calling thread until all tasks of the group finished, so it is fine to
+// wait inside a task. The first exception thrown by a task is rethrown by
+// wait().
+class TaskGroup {
+public:
+    explicit TaskGroup(ThreadPool& pool) : pool_(pool), n_pending_(0) {}
+    TaskGroup(const TaskGroup& other) = delete;
+    ~TaskGroup() = default;
+
+    void run(ThreadPool::Task task);
+    void wait(void);
+private:
+    ThreadPool& pool_;
+    std::atomic<index_t> n_pending_;
+    std::mutex error_mutex_;
+    std::exception_ptr error_;
+};
+
+// Run f1 and f2, in parallel if the calling thread works for a pool.
+template<typename F1, typename F2>
+void parallel_invoke(F1&& f1, F2&& f2) {
+    ThreadPool* pool = ThreadPool::current();
+    if(!pool) {
+        f1();
+        f2();
+        return;
+    }
+
+    TaskGroup group(*pool);
+    group.run(std::forward<F2>(f2));
+    // f2 may refer to the stack of the caller, wait for it before unwinding.
+    std::exception_ptr error;
+    try {
+        f1();
+    } catch(...) {
+        error = std::current_exception();
+    }
+    group.wait();
+    if(error)
+        std::rethrow_exception(error);
+}
+
+}  // namespace st
+#endif
@@ -0,0 +1,127 @@
+#include <algorithm>
+#include <cstring>
+
+#include "data/augment.h"
+#include "data/convert.h"
+#include "utils/exception.h"
+
+namespace st {
+namespace data {
+
+ImageAugment::ImageAugment(index_t n_channels, index_t n_rows, index_t n_cols)
+        : n_channels_(n_channels), n_rows_(n_rows), n_cols_(n_cols),
+          padding_(0), flip_p_(0), cutout_size_(0),
+          mean_(n_channels, 0), std_(n_channels, 1),
+          channels_last_(false) {}
+
+ImageAugment& ImageAugment::random_crop(index_t padding) {
+    CHECK_TRUE(padding <= n_rows_ && padding <= n_cols_,
+               "Padding %llu is larger than the image of %llux%llu.",
+               (unsigned long long)padding, (unsigned long long)n_rows_,
+               (unsigned long long)n_cols_);
+    padding_ = padding;
+    return *this;
+}
+
+ImageAugment& ImageAugment::horizontal_flip(data_t p) {
+    flip_p_ = p;
+    return *this;
+}
+
+ImageAugment& ImageAugment::cutout(index_t size) {
+    cutout_size_ = size;
+    return *this;
+}
+
+ImageAugment& ImageAugment::normalize(const std::vector<data_t>& mean,
+                                      const std::vector<data_t>& std) {
+    CHECK_TRUE(mean.size() == n_channels_ && std.size() == n_channels_,
+               "Expect mean and std of %llu channels, but got %llu and %llu.",
+               (unsigned long long)n_channels_, (unsigned long long)mean.size(),
+               (unsigned long long)std.size());
+    mean_ = mean;
+    std_ = std;
+    return *this;
+}
+
+ImageAugment& ImageAugment::channels_last(bool enable) {
+    channels_last_ = enable;
+    return *this;
+}
+
+bool ImageAugment::deterministic(void) const {
+    return padding_ == 0 && flip_p_ == 0 && cutout_size_ == 0;
+}
+
+void ImageAugment::apply(const unsigned char* src, data_t byte_scale,
+                         data_t* dist, std::default_random_engine& engine,
+                         Scratch& scratch) const {
+    // Offsets of the crop in the padded image, so padding_ means no shift.
+    index_t offset_row = padding_, offset_col = padding_;
+    if(padding_ > 0) {
+        std::uniform_int_distribution<index_t> offset(0, 2 * padding_);
+        offset_row = offset(engine);
+        offset_col = offset(engine);
+    }
+    bool flip = flip_p_ > 0
+                && std::uniform_real_distribution<data_t>(0, 1)(engine) < flip_p_;
+    // The cutout is centered at (cut_row, cut_col) of the output, and it
+    // covers rows [cut_row - size / 2, cut_row - size / 2 + size).
+    index_t cut_row = 0, cut_col = 0;
+    if(cutout_size_ > 0) {
+        cut_row = std::uniform_int_distribution<index_t>(0, n_rows_ - 1)(engine);
+        cut_col = std::uniform_int_distribution<index_t>(0, n_cols_ - 1)(engine);
+    }
+
+    std::vector<unsigned char>& row = scratch.row_;
+    std::vector<data_t>& converted = scratch.converted_;
+    row.resize(n_cols_);
+    if(channels_last_)
+        converted.resize(n_cols_);
+    index_t plane = n_rows_ * n_cols_;
+    for(index_t c = 0; c < n_channels_; ++c) {
+        data_t scale = byte_scale / std_[c];
+        data_t bias = -mean_[c] / std_[c];
+        for(index_t i = 0; i < n_rows_; ++i) {
+            // Bytes of the output row, black where it's out of the image.
+            // The source columns are [col_begin, col_end), which land at
+            // [dist_begin, dist_begin + n) of the cropped row.
+            std::memset(row.data(), 0, n_cols_);
+            index_t src_row = i + offset_row;
+            if(src_row >= padding_ && src_row < n_rows_ + padding_) {
+                index_t col_begin = std::max(offset_col, padding_) - padding_;
+                index_t col_end = std::min(offset_col + n_cols_, n_cols_ + padding_)
+                                  - padding_;
+                index_t dist_begin = col_begin + padding_ - offset_col;
+                const unsigned char* src_ptr = src + c * plane
+                                               + (src_row - padding_) * n_cols_;
+                std::memcpy(row.data() + dist_begin, src_ptr + col_begin,
+                            col_end - col_begin);
+            }
+            if(flip)
+                std::reverse(row.begin(), row.end());
+
+            data_t* out = channels_last_ ? converted.data()
+                                         : dist + c * plane + i * n_cols_;
+            bytes_to_data(row.data(), n_cols_, scale, bias, out);
+
+            if(cutout_size_ > 0) {
+                index_t half = cutout_size_ / 2;
+                if(i + half >= cut_row && i + half < cut_row + cutout_size_) {
+                    index_t begin = cut_col > half ? cut_col - half : 0;
+                    index_t end = std::min(cut_col + cutout_size_ - half, n_cols_);
+                    std::fill(out + begin, out + end, 0);
+                }
+            }
+
+            if(channels_last_) {
+                data_t* hwc = dist + i * n_cols_ * n_channels_ + c;
+                for(index_t j = 0; j < n_cols_; ++j)
+                    hwc[j * n_channels_] = converted[j];
+            }
+        }
+    }
+}
+
+}  // namespace data
+}  // namespace st
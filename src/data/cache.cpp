@@ -0,0 +1,272 @@
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <numeric>
+#include <algorithm>
+#include <random>
+
+#include "data/cache.h"
+#include "data/convert.h"
+#include "utils/exception.h"
+
+namespace st {
+namespace data {
+
+namespace {
+
+const char kMagic[8] = "STCACHE";
+
+void write_padding(std::ofstream& file, std::uint64_t offset) {
+    static const char zeros[CacheHeader::kAlignment] = {};
+    std::uint64_t pos = file.tellp();
+    file.write(zeros, offset - pos);
+}
+
+}  // namespace
+
+
+std::uint64_t CacheHeader::dtype_size(void) const {
+    switch(dtype_) {
+        case CacheType::uint8: return 1;
+        case CacheType::float32: return 4;
+        case CacheType::float64: return 8;
+    }
+    return 0;
+}
+
+index_t CacheHeader::sample_size(void) const {
+    index_t size = 1;
+    for(std::uint32_t i = 0; i < ndim_; ++i)
+        size *= shape_[i];
+    return size;
+}
+
+std::uint64_t CacheHeader::labels_offset(void) const {
+    std::uint64_t end = samples_offset() + n_samples_ * sample_size() * dtype_size();
+    return (end + kAlignment - 1) / kAlignment * kAlignment;
+}
+
+const char* CacheHeader::check(std::uint64_t file_size) const {
+    if(std::memcmp(magic_, kMagic, sizeof(kMagic)) != 0)
+        return "not a cache";
+    if(byte_order_ != kByteOrder)
+        return "written in another byte order";
+    if(version_ != kVersion)
+        return "of another version";
+    if(dtype_size() == 0)
+        return "of unknown dtype";
+    if(ndim_ == 0 || ndim_ > kMaxDims)
+        return "of invalid dimensions";
+
+    std::uint64_t size = 1;
+    for(std::uint32_t i = 0; i < ndim_; ++i) {
+        if(shape_[i] == 0)
+            return "of empty samples";
+        if(shape_[i] > INDEX_MAX / size)
+            return "too large";
+        size *= shape_[i];
+    }
+    if(n_samples_ > INDEX_MAX)
+        return "too large";
+
+    // Every factor is bounded by the file before it's multiplied, so the
+    // offsets can't wrap around whatever the header says.
+    if(file_size < samples_offset())
+        return "truncated";
+    std::uint64_t body_size = file_size - samples_offset();
+    if(size > body_size / dtype_size())
+        return "truncated";
+    std::uint64_t sample_bytes = size * dtype_size();
+    if(n_samples_ > body_size / sample_bytes)
+        return "truncated";
+    std::uint64_t labels_size = n_samples_ * sizeof(std::int32_t);
+    if(labels_offset() > file_size || labels_size > file_size - labels_offset())
+        return "truncated";
+    return nullptr;
+}
+
+void decode_samples(CacheType dtype, data_t scale,
+                    const unsigned char* src, index_t n, data_t* dist) {
+    switch(dtype) {
+        case CacheType::uint8:
+            bytes_to_data(src, n, scale, 0, dist);
+            break;
+        case CacheType::float32: {
+            const float* fsrc = reinterpret_cast<const float*>(src);
+            for(index_t i = 0; i < n; ++i)
+                dist[i] = fsrc[i];
+            break;
+        }
+        case CacheType::float64:
+            std::memcpy(dist, src, n * sizeof(double));
+            break;
+    }
+}
+
+void write_cache(const DatasetBase& dataset,
+                 const std::vector<index_t>& sample_shape,
+                 const std::string& path, CacheType dtype,
+                 data_t scale) {
+    CacheHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic_, kMagic, sizeof(kMagic));
+    header.version_ = CacheHeader::kVersion;
+    header.byte_order_ = CacheHeader::kByteOrder;
+    header.dtype_ = dtype;
+    header.n_samples_ = dataset.n_samples();
+    header.scale_ = dtype == CacheType::uint8 ? scale : 1;
+
+    CHECK_IN_RANGE(sample_shape.size(), 1, CacheHeader::kMaxDims + 1,
+                   "Expect 1 to %u dimensions of a sample, but got %llu",
+                   CacheHeader::kMaxDims,
+                   (unsigned long long)sample_shape.size());
+    header.ndim_ = sample_shape.size();
+    index_t sample_size = 1;
+    for(index_t i = 0; i < header.ndim_; ++i) {
+        header.shape_[i] = sample_shape[i];
+        sample_size = checked_mul(sample_size, sample_shape[i]);
+    }
+    CHECK_EQUAL(sample_size, dataset.sample_size(),
+                "Shape of %llu elements doesn't match samples of %llu elements.",
+                (unsigned long long)sample_size,
+                (unsigned long long)dataset.sample_size());
+
+    std::ofstream file(path, std::ios::binary);
+    if(!file.is_open())
+        THROW_ERROR("Can't open file: %s", path.c_str());
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+    std::vector<data_t> sample(sample_size);
+    std::vector<unsigned char> converted(sample_size * header.dtype_size());
+    std::vector<std::int32_t> labels(header.n_samples_);
+    for(index_t i = 0; i < header.n_samples_; ++i) {
+        labels[i] = dataset.copy_sample(i, sample.data());
+
+        const char* bytes = reinterpret_cast<const char*>(sample.data());
+        if(dtype == CacheType::uint8) {
+            for(index_t j = 0; j < sample_size; ++j) {
+                data_t value = sample[j] / scale;
+                data_t rounded = std::round(value);
+                CHECK_TRUE(rounded >= 0 && rounded <= 255
+                           && std::abs(value - rounded) < 1e-3,
+                           "Sample %llu can't be stored as uint8 with scale %f.",
+                           (unsigned long long)i, scale);
+                converted[j] = static_cast<unsigned char>(rounded);
+            }
+            bytes = reinterpret_cast<const char*>(converted.data());
+        } else if(dtype == CacheType::float32) {
+            float* dist = reinterpret_cast<float*>(converted.data());
+            for(index_t j = 0; j < sample_size; ++j)
+                dist[j] = sample[j];
+            bytes = reinterpret_cast<const char*>(converted.data());
+        }
+        file.write(bytes, converted.size());
+    }
+
+    write_padding(file, header.labels_offset());
+    file.write(reinterpret_cast<const char*>(labels.data()),
+               labels.size() * sizeof(std::int32_t));
+    if(!file)
+        THROW_ERROR("Can't write file: %s", path.c_str());
+}
+
+bool is_cache(const std::string& path) {
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    if(!file.is_open())
+        return false;
+    std::uint64_t file_size = file.tellg();
+    if(file_size < sizeof(CacheHeader))
+        return false;
+
+    CacheHeader header;
+    file.seekg(0);
+    file.read(reinterpret_cast<char*>(&header), sizeof(header));
+    return file && !header.check(file_size);
+}
+
+
+CachedDataset::CachedDataset(const std::string& path, index_t batch_size,
+                             bool shuffle)
+        : batch_size_(batch_size), file_(path), shuffled_(false) {
+    // The file is read in place, so it's checked even with CANCEL_CHECK.
+    if(file_.size() < sizeof(CacheHeader))
+        THROW_ERROR("Invalid cache %s: truncated", path.c_str());
+    CacheHeader header;
+    std::memcpy(&header, file_.data(), sizeof(header));
+    const char* problem = header.check(file_.size());
+    if(problem)
+        THROW_ERROR("Invalid cache %s: %s", path.c_str(), problem);
+
+    n_samples_ = header.n_samples_;
+    n_batchs_ = (n_samples_ + batch_size - 1) / batch_size;
+    dtype_ = header.dtype_;
+    scale_ = header.scale_;
+    sample_size_ = header.sample_size();
+    sample_shape_.assign(header.shape_, header.shape_ + header.ndim_);
+    dtype_size_ = header.dtype_size();
+    samples_ = file_.data() + header.samples_offset();
+    labels_ = reinterpret_cast<const std::int32_t*>(
+        file_.data() + header.labels_offset());
+    for(index_t i = 0; i < n_samples_; ++i)
+        if(labels_[i] < 0)
+            THROW_ERROR("Invalid cache %s: negative label of sample %llu",
+                        path.c_str(), (unsigned long long)i);
+
+    order_.resize(n_samples_);
+    std::iota(order_.begin(), order_.end(), 0);
+    if(shuffle)
+        this->shuffle();
+}
+
+std::pair<const data_t*, index_t>
+CachedDataset::get_sample(index_t idx) const {
+    buffer_.resize(sample_size_);
+    index_t label = copy_sample(idx, buffer_.data());
+    return {buffer_.data(), label};
+}
+
+std::tuple<index_t, const data_t*, const index_t*>
+CachedDataset::get_batch(index_t idx) const {
+    index_t n_samples = (idx == n_batchs_ - 1)
+                            ? n_samples_ - idx * batch_size_
+                            : batch_size_;
+    label_buffer_.resize(n_samples);
+
+    // Samples of data_t in order are used in place.
+    if(dtype_ == CacheType::float64 && !shuffled_) {
+        for(index_t i = 0; i < n_samples; ++i)
+            label_buffer_[i] = labels_[idx * batch_size_ + i];
+        const data_t* samples = reinterpret_cast<const data_t*>(samples_);
+        return {
+            n_samples,
+            samples + static_cast<std::uint64_t>(idx) * batch_size_ * sample_size_,
+            label_buffer_.data()
+        };
+    }
+
+    buffer_.resize(n_samples * sample_size_);
+    gather_range(idx * batch_size_, n_samples, buffer_.data(), label_buffer_.data());
+    return {n_samples, buffer_.data(), label_buffer_.data()};
+}
+
+void CachedDataset::shuffle(unsigned seed) {
+    std::shuffle(order_.begin(), order_.end(), std::default_random_engine(seed));
+    shuffled_ = true;
+}
+
+index_t CachedDataset::copy_sample(index_t idx, data_t* dist) const {
+    std::uint64_t sample_idx = order_[idx];
+    decode_samples(dtype_, scale_, samples_ + sample_idx * sample_size_ * dtype_size_,
+                   sample_size_, dist);
+    return labels_[sample_idx];
+}
+
+index_t CachedDataset::copy_bytes(index_t idx, unsigned char* dist) const {
+    CHECK_TRUE(has_bytes(), "The cache doesn't keep samples as bytes.");
+    std::uint64_t sample_idx = order_[idx];
+    std::memcpy(dist, samples_ + sample_idx * sample_size_, sample_size_);
+    return labels_[sample_idx];
+}
+
+}  // namespace data
+}  // namespace st
@@ -0,0 +1,30 @@
+#include "data/convert.h"
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+namespace st {
+namespace data {
+
+void bytes_to_data(const unsigned char* src, index_t n,
+                   data_t scale, data_t bias, data_t* dist) {
+    index_t i = 0;
+#ifdef __AVX2__
+    __m256d vscale = _mm256_set1_pd(scale);
+    __m256d vbias = _mm256_set1_pd(bias);
+    for(; i + 8 <= n; i += 8) {
+        __m256i w = _mm256_cvtepu8_epi32(
+            _mm_loadl_epi64(reinterpret_cast<const __m128i*>(src + i)));
+        __m256d lo = _mm256_cvtepi32_pd(_mm256_castsi256_si128(w));
+        __m256d hi = _mm256_cvtepi32_pd(_mm256_extracti128_si256(w, 1));
+        _mm256_storeu_pd(dist + i, _mm256_add_pd(_mm256_mul_pd(lo, vscale), vbias));
+        _mm256_storeu_pd(dist + i + 4, _mm256_add_pd(_mm256_mul_pd(hi, vscale), vbias));
+    }
+#endif
+    for(; i < n; ++i)
+        dist[i] = src[i] * scale + bias;
+}
+
+}  // namespace data
+}  // namespace st
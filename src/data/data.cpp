@@ -1,34 +1,98 @@
-#include <fstream>
+#include <exception>
+#include <functional>
 #include <memory>
 #include <vector>
 #include <cstring>
 #include <random>
 #include <chrono>
 #include <algorithm>
+#include <numeric>
 #include <tuple>
+#include <cstdint>
 
 #include "utils/base_config.h"
 #include "utils/exception.h"
+#include "utils/thread_pool.h"
 #include "data/data.h"
+#include "data/convert.h"
 
 namespace st {
 namespace data {
 
-unsigned int __reverse_int(int i) {
-	unsigned char ch1, ch2, ch3, ch4;
-	ch1 = i & 255;
-	ch2 = (i >> 8) & 255;
-	ch3 = (i >> 16) & 255;
-	ch4 = (i >> 24) & 255;
-	return((int)ch1 << 24) + ((int)ch2 << 16) + ((int)ch3 << 8) + ch4;
+index_t __read_big_endian(const unsigned char* bytes) {
+    return (index_t(bytes[0]) << 24) | (index_t(bytes[1]) << 16) 
+           | (index_t(bytes[2]) << 8) | index_t(bytes[3]);
+}
+
+void __normalize(const unsigned char* src, index_t n, data_t* dist) {
+    // Multiplying by the reciprocal, unlike dividing, is vectorized cheaply.
+    bytes_to_data(src, n, 1.0 / 255, 0, dist);
+}
+
+// Call f(begin, end) for chunks of [0, n), in parallel if the calling thread
+// works for a ThreadPool. The first exception thrown is rethrown.
+void __parallel_range(index_t n, const std::function<void(index_t, index_t)>& f) {
+    ThreadPool* pool = ThreadPool::current();
+    if(!pool || n < 2) {
+        f(0, n);
+        return;
+    }
+
+    // One chunk for each worker of the pool and the calling thread.
+    index_t n_chunks = std::min<index_t>(n, pool->n_threads() + 1);
+    TaskGroup group(*pool);
+    for(index_t k = 1; k < n_chunks; ++k)
+        group.run([=, &f]() { f(n * k / n_chunks, n * (k + 1) / n_chunks); });
+    // The tasks write to the memory of the caller, wait for them before
+    // unwinding.
+    std::exception_ptr error;
+    try {
+        f(0, n / n_chunks);
+    } catch(...) {
+        error = std::current_exception();
+    }
+    group.wait();
+    if(error)
+        std::rethrow_exception(error);
+}
+
+void DatasetBase::shuffle(void) {
+    shuffle(std::chrono::system_clock::now().time_since_epoch().count());
+}
+
+index_t DatasetBase::copy_bytes(index_t idx, unsigned char* dist) const {
+    THROW_ERROR("The dataset doesn't keep samples as bytes.");
+}
+
+void DatasetBase::gather(const index_t* indices, index_t n, 
+                         data_t* dist, index_t* labels) const {
+    index_t size = sample_size();
+    __parallel_range(n, [=](index_t begin, index_t end) {
+        for(index_t i = begin; i < end; ++i)
+            labels[i] = copy_sample(indices[i], dist + i * size);
+    });
+}
+
+void DatasetBase::gather_range(index_t first, index_t n,
+                               data_t* dist, index_t* labels) const {
+    index_t size = sample_size();
+    __parallel_range(n, [=](index_t begin, index_t end) {
+        for(index_t i = begin; i < end; ++i)
+            labels[i] = copy_sample(first + i, dist + i * size);
+    });
 }
 
 MNIST::MNIST(const std::string& img_path, const std::string& label_path, 
-             index_t batch_size, bool shuffle)
-        : batch_size_(batch_size) {
-    read_mnist_images(img_path);
-    read_mnist_labels(label_path);
-    n_batchs_ = (imgs_.size() + batch_size - 1) / batch_size;
+             index_t batch_size, bool shuffle, bool memory_map)
+        : batch_size_(batch_size), shuffled_(false), memory_map_(memory_map),
+          pixels_(nullptr), labels_data_(nullptr) {
+    map_mnist(img_path, label_path);
+    if(!memory_map_)
+        decode_mnist();
+    n_batchs_ = (n_samples_ + batch_size - 1) / batch_size;
+
+    order_.resize(n_samples_);
+    std::iota(order_.begin(), order_.end(), 0);
 
     if(shuffle)
         this->shuffle();
@@ -36,79 +100,85 @@ MNIST::MNIST(const std::string& img_path, const std::string& label_path,
 
 std::pair<const data_t*, index_t> 
 MNIST::get_sample(index_t idx) const {
+    if(memory_map_) {
+        buffer_.resize(Img::n_pixels_);
+        index_t label = copy_sample(idx, buffer_.data());
+        return {buffer_.data(), label};
+    }
     return {
-        reinterpret_cast<const data_t*>(&imgs_[idx]),
-        labels_[idx]
+        reinterpret_cast<const data_t*>(&imgs_[order_[idx]]),
+        labels_[order_[idx]]
     };
 }
 
 std::tuple<index_t, const data_t*, const index_t*> 
 MNIST::get_batch(index_t idx) const {
     index_t n_samples = (idx == n_batchs_ - 1) 
-                            ? imgs_.size() - idx * batch_size_
+                            ? n_samples_ - idx * batch_size_
                             : batch_size_;
-    return {
-        n_samples,
-        reinterpret_cast<const data_t*>(&imgs_[idx * batch_size_]),
-        &labels_[idx * batch_size_]
-    };
-}
-
-void MNIST::shuffle(void) {
-    unsigned seed = std::chrono::system_clock::now().time_since_epoch().count();
-    
-    std::default_random_engine engine1(seed);
-    std::shuffle(imgs_.begin(), imgs_.end(), engine1);
+    if(!memory_map_ && !shuffled_) {
+        return {
+            n_samples,
+            reinterpret_cast<const data_t*>(&imgs_[idx * batch_size_]),
+            &labels_[idx * batch_size_]
+        };
+    }
 
-    std::default_random_engine engine2(seed);
-    std::shuffle(labels_.begin(), labels_.end(), engine2);
+    buffer_.resize(n_samples * Img::n_pixels_);
+    label_buffer_.resize(n_samples);
+    gather_range(idx * batch_size_, n_samples, buffer_.data(), label_buffer_.data());
+    return {n_samples, buffer_.data(), label_buffer_.data()};
 }
 
-void MNIST::read_mnist_images(const std::string& path) {
-    std::ifstream file(path, std::ios::binary);
-    if(!file.is_open())
-        THROW_ERROR("Can't open file: %s", path.c_str());
-
-    unsigned int headers[4];
-    file.read(reinterpret_cast<char*>(headers), 16);
-    index_t magic_number = __reverse_int(headers[0]);
-    index_t n_imgs = __reverse_int(headers[1]);
-    index_t n_bytes = n_imgs * Img::n_pixels_;
-
-    auto char_data_ptr = std::unique_ptr<char[]>(new char[n_bytes]);
-    file.read(char_data_ptr.get(), n_bytes);
-    auto uchar_data = reinterpret_cast<unsigned char*>(char_data_ptr.get());
-
-    imgs_.reserve(n_imgs);
-    for(index_t i = 0; i < n_imgs; ++i) {
-        imgs_.push_back({});
-        auto dist = reinterpret_cast<data_t*>(imgs_.data()) + i * Img::n_pixels_;
-        auto src = uchar_data + i * Img::n_pixels_;
-        for(index_t j = 0; j < Img::n_pixels_; ++j)
-            dist[j] = src[j] / 255.0;
+index_t MNIST::copy_sample(index_t idx, data_t* dist) const {
+    index_t sample_idx = order_[idx];
+    if(memory_map_) {
+        __normalize(pixels_ + sample_idx * Img::n_pixels_, Img::n_pixels_, dist);
+        return labels_data_[sample_idx];
     }
+    std::memcpy(dist, imgs_[sample_idx].pixels_, sizeof(Img));
+    return labels_[sample_idx];
 }
 
-void MNIST::read_mnist_labels(const std::string& path) {
-    std::ifstream file(path, std::ios::binary);
-    if(!file.is_open())
-        THROW_ERROR("Can't open file: %s", path.c_str());
+index_t MNIST::copy_bytes(index_t idx, unsigned char* dist) const {
+    CHECK_TRUE(memory_map_, "MNIST keeps bytes only with memory_map.");
+    index_t sample_idx = order_[idx];
+    std::memcpy(dist, pixels_ + sample_idx * Img::n_pixels_, Img::n_pixels_);
+    return labels_data_[sample_idx];
+}
 
-    unsigned int headers[2];
-    file.read(reinterpret_cast<char*>(headers), 8);
-    index_t magic_number = __reverse_int(headers[0]);
-    index_t n_imgs = __reverse_int(headers[1]);
-    index_t n_bytes = n_imgs;
+void MNIST::shuffle(unsigned seed) {
+    std::shuffle(order_.begin(), order_.end(), std::default_random_engine(seed));
+    shuffled_ = true;
+}
 
-    auto char_data_ptr = std::unique_ptr<char[]>(new char[n_bytes]);
-    file.read(char_data_ptr.get(), n_bytes);
-    auto uchar_data = reinterpret_cast<unsigned char*>(char_data_ptr.get());
+void MNIST::map_mnist(const std::string& img_path, const std::string& label_path) {
+    img_file_ = MappedFile(img_path);
+    label_file_ = MappedFile(label_path);
+    CHECK_TRUE(img_file_.size() >= 16 && label_file_.size() >= 8,
+               "Invalid MNIST files: %s, %s", img_path.c_str(), label_path.c_str());
+
+    n_samples_ = __read_big_endian(img_file_.data() + 4);
+    index_t n_bytes = checked_add(checked_mul(n_samples_, Img::n_pixels_), 16);
+    CHECK_TRUE(img_file_.size() >= n_bytes 
+               && __read_big_endian(label_file_.data() + 4) == n_samples_
+               && label_file_.size() >= std::uint64_t(n_samples_) + 8,
+               "Invalid MNIST files: %s, %s", img_path.c_str(), label_path.c_str());
+    pixels_ = img_file_.data() + 16;
+    labels_data_ = label_file_.data() + 8;
+}
 
-    labels_.reserve(n_imgs);
-    for(index_t i = 0; i < n_imgs; ++i) {
-        index_t label = uchar_data[i];
-        labels_.push_back(label);
-    }
+void MNIST::decode_mnist(void) {
+    imgs_.reset(new Img[n_samples_]);
+    labels_.assign(labels_data_, labels_data_ + n_samples_);
+    __parallel_range(n_samples_, [this](index_t begin, index_t end) {
+        __normalize(pixels_ + begin * Img::n_pixels_, (end - begin) * Img::n_pixels_,
+                    imgs_[begin].pixels_);
+    });
+
+    img_file_ = MappedFile();
+    label_file_ = MappedFile();
+    pixels_ = labels_data_ = nullptr;
 }
 }  // namespace data
 }  // namespace st
@@ -120,83 +190,113 @@ namespace data {
 
 Cifar10::Cifar10(const std::string& dataset_dir, bool train,
                  index_t batch_size, bool shuffle, 
-                 char path_sep)
-        : batch_size_(batch_size) {
+                 char path_sep, bool memory_map)
+        : batch_size_(batch_size), shuffled_(false), memory_map_(memory_map) {
     read_cifar10(dataset_dir, train, path_sep);
-    n_batchs_ = (imgs_.size() + batch_size_ - 1) / batch_size_;
+    n_batchs_ = (n_samples_ + batch_size_ - 1) / batch_size_;
+
+    order_.resize(n_samples_);
+    std::iota(order_.begin(), order_.end(), 0);
+
+    if(shuffle)
+        this->shuffle();
 }
 
 std::pair<const data_t*, index_t> 
 Cifar10::get_sample(index_t idx) const {
+    if(memory_map_) {
+        buffer_.resize(Img::n_pixels_);
+        index_t label = copy_sample(idx, buffer_.data());
+        return {buffer_.data(), label};
+    }
     return {
-        reinterpret_cast<const data_t*>(&imgs_[idx]),
-        labels_[idx]
+        reinterpret_cast<const data_t*>(&imgs_[order_[idx]]),
+        labels_[order_[idx]]
     };
 }
 
 std::tuple<index_t, const data_t*, const index_t*> 
 Cifar10::get_batch(index_t idx) const {
     index_t n_samples = (idx == n_batchs_ - 1) 
-                            ? imgs_.size() - idx * batch_size_
+                            ? n_samples_ - idx * batch_size_
                             : batch_size_;
-    return {
-        n_samples,
-        reinterpret_cast<const data_t*>(&imgs_[idx * batch_size_]),
-        &labels_[idx * batch_size_]
-    };
+    if(!memory_map_ && !shuffled_) {
+        return {
+            n_samples,
+            reinterpret_cast<const data_t*>(&imgs_[idx * batch_size_]),
+            &labels_[idx * batch_size_]
+        };
+    }
+
+    buffer_.resize(n_samples * Img::n_pixels_);
+    label_buffer_.resize(n_samples);
+    gather_range(idx * batch_size_, n_samples, buffer_.data(), label_buffer_.data());
+    return {n_samples, buffer_.data(), label_buffer_.data()};
+}
+
+index_t Cifar10::copy_sample(index_t idx, data_t* dist) const {
+    index_t sample_idx = order_[idx];
+    if(memory_map_) {
+        const unsigned char* record = records_[sample_idx];
+        __normalize(record + 1, Img::n_pixels_, dist);
+        return record[0];
+    }
+    std::memcpy(dist, imgs_[sample_idx].data_, sizeof(Img));
+    return labels_[sample_idx];
 }
 
-void Cifar10::shuffle(void) {
-    unsigned seed = std::chrono::system_clock::now().time_since_epoch().count();
-    
-    std::default_random_engine engine1(seed);
-    std::shuffle(imgs_.begin(), imgs_.end(), engine1);
+index_t Cifar10::copy_bytes(index_t idx, unsigned char* dist) const {
+    CHECK_TRUE(memory_map_, "Cifar10 keeps bytes only with memory_map.");
+    const unsigned char* record = records_[order_[idx]];
+    std::memcpy(dist, record + 1, Img::n_pixels_);
+    return record[0];
+}
 
-    std::default_random_engine engine2(seed);
-    std::shuffle(labels_.begin(), labels_.end(), engine2);
+void Cifar10::shuffle(unsigned seed) {
+    std::shuffle(order_.begin(), order_.end(), std::default_random_engine(seed));
+    shuffled_ = true;
 }
 
 void Cifar10::read_cifar10(const std::string& dataset_dir, bool train, 
                            char path_sep) {
+    std::vector<std::string> bin_names{"test_batch.bin"};
     if(train) {
-        imgs_.reserve(Img::n_train_samples_);
-        labels_.reserve(Img::n_train_samples_);
-        std::vector<std::string> bin_names{
+        bin_names = {
             "data_batch_1.bin", "data_batch_2.bin", "data_batch_3.bin",
             "data_batch_4.bin", "data_batch_5.bin"
         };
-        for(auto& bin_name : bin_names)
-            read_bin(dataset_dir + path_sep + bin_name);
-    } else {
-        imgs_.reserve(Img::n_test_samples_);
-        labels_.reserve(Img::n_test_samples_);
-        const std::string bin_name = "test_batch.bin";
-        read_bin(dataset_dir + path_sep + bin_name);
     }
+    records_.reserve(train ? Img::n_train_samples_ : Img::n_test_samples_);
+    for(auto& bin_name : bin_names)
+        map_bin(dataset_dir + path_sep + bin_name);
+    n_samples_ = records_.size();
+    if(!memory_map_)
+        decode_records();
 }
 
-void Cifar10::read_bin(const std::string& bin_path) {
-    std::ifstream file(bin_path, std::ios::binary);
-    if(!file.is_open()) 
-        THROW_ERROR("Can't open file: %s", bin_path.c_str());
+void Cifar10::map_bin(const std::string& bin_path) {
+    bin_files_.emplace_back(bin_path);
+    const MappedFile& file = bin_files_.back();
 
     index_t sample_size = 1 + Img::n_pixels_;
-    std::unique_ptr<char> char_data_ptr(new char[sample_size]);
-    auto char_data = char_data_ptr.get();
-    auto uchar_data = reinterpret_cast<unsigned char*>(char_data);
-
-    while(file.peek() != EOF) {
-        file.read(char_data, sample_size);
-
-        imgs_.push_back({});
-        labels_.push_back(uchar_data[0]);
-
-        auto src = uchar_data + 1;
-        auto dist = reinterpret_cast<data_t*>(&imgs_.back());
+    CHECK_TRUE(file.size() % sample_size == 0, 
+               "Invalid file of cifar10: %s", bin_path.c_str());
+    for(std::uint64_t offset = 0; offset < file.size(); offset += sample_size)
+        records_.push_back(file.data() + offset);
+}
 
-        for(index_t i = 0; i < Img::n_pixels_; ++i)
-            dist[i] = src[i] / 255.0;
-    }
+void Cifar10::decode_records(void) {
+    imgs_.reset(new Img[n_samples_]);
+    labels_.resize(n_samples_);
+    __parallel_range(n_samples_, [this](index_t begin, index_t end) {
+        for(index_t i = begin; i < end; ++i) {
+            labels_[i] = records_[i][0];
+            __normalize(records_[i] + 1, Img::n_pixels_, imgs_[i].data_);
+        }
+    });
+
+    bin_files_.clear();
+    records_.clear();
 }
 }  // namesapce data
 }  // namespace st
\ No newline at end of file
@@ -0,0 +1,168 @@
+#include <algorithm>
+
+#include "data/data_loader.h"
+#include "tensor/tensor.h"
+#include "utils/exception.h"
+
+namespace st {
+namespace data {
+
+DataLoader::DataLoader(const DatasetBase& dataset, index_t batch_size,
+                       bool shuffle, bool drop_last,
+                       index_t n_workers, index_t n_prefetch, unsigned seed,
+                       const ImageAugment* augment)
+        : dataset_(dataset),
+          batch_size_(batch_size),
+          sample_size_(dataset.sample_size()),
+          shuffle_(shuffle),
+          seed_(seed),
+          augment_(augment),
+          engine_(seed),
+          n_claimed_(0),
+          n_taken_(0),
+          stop_(false) {
+    CHECK_TRUE(batch_size > 0 && n_workers > 0 && n_prefetch > 0,
+               "Expect positive batch_size, n_workers and n_prefetch, "
+               "but got %llu, %llu and %llu", (unsigned long long)batch_size,
+               (unsigned long long)n_workers, (unsigned long long)n_prefetch);
+    index_t n_samples = dataset.n_samples();
+    n_batchs_ = drop_last ? n_samples / batch_size
+                          : (n_samples + batch_size - 1) / batch_size;
+    CHECK_TRUE(n_batchs_ > 0, "Dataset of %llu samples has no batch of %llu.",
+               (unsigned long long)n_samples, (unsigned long long)batch_size);
+    if(augment) {
+        CHECK_TRUE(dataset.has_bytes(),
+                   "Only datasets which keep samples as bytes can be augmented.");
+        CHECK_EQUAL(augment->sample_size(), sample_size_,
+                    "Augment images of %llu elements, but samples have %llu.",
+                    (unsigned long long)augment->sample_size(),
+                    (unsigned long long)sample_size_);
+    }
+
+    order_.resize(n_samples);
+    for(index_t i = 0; i < n_samples; ++i)
+        order_[i] = i;
+
+    index_t slot_size = checked_mul(batch_size, sample_size_);
+    for(index_t i = 0; i < n_prefetch; ++i)
+        slots_.emplace_back(new Slot(slot_size));
+
+    workers_.reserve(n_workers);
+    for(index_t i = 0; i < n_workers; ++i)
+        workers_.emplace_back(&DataLoader::worker_loop, this);
+}
+
+DataLoader::~DataLoader() {
+    {
+        std::lock_guard<std::mutex> guard(mutex_);
+        stop_ = true;
+    }
+    freed_cv_.notify_all();
+    for(auto& worker: workers_)
+        worker.join();
+}
+
+std::tuple<index_t, const data_t*, const index_t*> DataLoader::next(void) {
+    Slot& slot = take_slot();
+    return {
+        static_cast<index_t>(slot.indices_.size()),
+        &slot.samples_[0],
+        slot.labels_.data()
+    };
+}
+
+const index_t* DataLoader::next_into(Tensor& input) {
+    CHECK_TRUE(input.ndim() > 0 && input.is_contiguous()
+               && input.size().subsize(1) == sample_size_,
+               "Expect a contiguous input with samples of %llu elements.",
+               (unsigned long long)sample_size_);
+    Slot& slot = take_slot();
+    // Share the storage of the slot, and leave the old one to be released.
+    input.rebind(slot.samples_, slot.indices_.size());
+    return slot.labels_.data();
+}
+
+DataLoader::Slot& DataLoader::take_slot(void) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    // Release the batch taken last time.
+    if(n_taken_ > 0) {
+        slots_[(n_taken_ - 1) % slots_.size()]->state_ = SlotState::free;
+        freed_cv_.notify_all();
+    }
+
+    Slot& slot = *slots_[n_taken_ % slots_.size()];
+    filled_cv_.wait(lock, [&slot]() { return slot.state_ == SlotState::ready; });
+    ++n_taken_;
+    if(slot.error_) {
+        std::exception_ptr error = slot.error_;
+        slot.error_ = nullptr;
+        std::rethrow_exception(error);
+    }
+    return slot;
+}
+
+void DataLoader::worker_loop(void) {
+    ImageAugment::Scratch scratch;
+    while(true) {
+        Slot* slot;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            freed_cv_.wait(lock, [this]() {
+                return stop_
+                       || slots_[n_claimed_ % slots_.size()]->state_ == SlotState::free;
+            });
+            if(stop_)
+                return;
+            slot = slots_[n_claimed_ % slots_.size()].get();
+            claim_batch(*slot);
+        }
+
+        try {
+            index_t n_samples = slot->indices_.size();
+            slot->labels_.resize(n_samples);
+            if(augment_)
+                augment_batch(*slot, scratch);
+            else
+                dataset_.gather(slot->indices_.data(), n_samples,
+                                &slot->samples_[0], slot->labels_.data());
+        } catch(...) {
+            slot->error_ = std::current_exception();
+        }
+
+        {
+            std::lock_guard<std::mutex> guard(mutex_);
+            slot->state_ = SlotState::ready;
+        }
+        filled_cv_.notify_all();
+    }
+}
+
+void DataLoader::claim_batch(Slot& slot) {
+    index_t batch_idx = n_claimed_ % n_batchs_;
+    if(batch_idx == 0 && shuffle_)
+        std::shuffle(order_.begin(), order_.end(), engine_);
+
+    index_t begin = batch_idx * batch_size_;
+    index_t end = std::min(begin + batch_size_,
+                           static_cast<index_t>(order_.size()));
+    slot.indices_.assign(order_.begin() + begin, order_.begin() + end);
+    slot.batch_number_ = n_claimed_;
+    slot.state_ = SlotState::filling;
+    ++n_claimed_;
+}
+
+void DataLoader::augment_batch(Slot& slot, ImageAugment::Scratch& scratch) {
+    std::seed_seq seq{seed_, static_cast<unsigned>(slot.batch_number_)};
+    std::default_random_engine engine(seq);
+    data_t byte_scale = dataset_.byte_scale();
+    slot.bytes_.resize(sample_size_);
+    data_t* dist = &slot.samples_[0];
+    for(index_t i = 0; i < slot.indices_.size(); ++i) {
+        slot.labels_[i] = dataset_.copy_bytes(slot.indices_[i], slot.bytes_.data());
+        augment_->apply(slot.bytes_.data(), byte_scale,
+                        dist + i * sample_size_, engine, scratch);
+    }
+}
+
+}  // namespace data
+}  // namespace st
@@ -0,0 +1,132 @@
+#include <limits>
+#include <utility>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "data/mapped_file.h"
+#include "utils/exception.h"
+
+namespace st {
+namespace data {
+
+MappedFile::MappedFile()
+        : data_(nullptr), size_(0) {
+#ifdef _WIN32
+    file_handle_ = INVALID_HANDLE_VALUE;
+    mapping_handle_ = nullptr;
+#endif
+}
+
+#ifdef _WIN32
+MappedFile::MappedFile(const std::string& path)
+        : MappedFile() {
+    file_handle_ = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+                               OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if(file_handle_ == INVALID_HANDLE_VALUE)
+        THROW_ERROR("Can't open file: %s", path.c_str());
+
+    LARGE_INTEGER file_size;
+    if(!GetFileSizeEx(file_handle_, &file_size)) {
+        unmap();
+        THROW_ERROR("Can't get the size of file: %s", path.c_str());
+    }
+    size_ = file_size.QuadPart;
+    // A file of size 0 can't be mapped.
+    if(size_ == 0)
+        return;
+
+    mapping_handle_ = CreateFileMappingA(file_handle_, nullptr, PAGE_READONLY,
+                                         0, 0, nullptr);
+    void* ptr = mapping_handle_ 
+                ? MapViewOfFile(mapping_handle_, FILE_MAP_READ, 0, 0, 0)
+                : nullptr;
+    if(!ptr) {
+        unmap();
+        THROW_ERROR("Can't map file: %s", path.c_str());
+    }
+    data_ = static_cast<const unsigned char*>(ptr);
+}
+
+void MappedFile::unmap(void) {
+    if(data_)
+        UnmapViewOfFile(data_);
+    if(mapping_handle_)
+        CloseHandle(mapping_handle_);
+    if(file_handle_ != INVALID_HANDLE_VALUE)
+        CloseHandle(file_handle_);
+    data_ = nullptr;
+    size_ = 0;
+    file_handle_ = INVALID_HANDLE_VALUE;
+    mapping_handle_ = nullptr;
+}
+#else
+MappedFile::MappedFile(const std::string& path)
+        : MappedFile() {
+    int fd = open(path.c_str(), O_RDONLY);
+    if(fd < 0)
+        THROW_ERROR("Can't open file: %s", path.c_str());
+
+    struct stat file_stat;
+    if(fstat(fd, &file_stat) != 0) {
+        close(fd);
+        THROW_ERROR("Can't get the size of file: %s", path.c_str());
+    }
+    size_ = file_stat.st_size;
+    // A file of size 0 can't be mapped.
+    if(size_ == 0) {
+        close(fd);
+        return;
+    }
+    if(size_ > std::numeric_limits<size_t>::max()) {
+        close(fd);
+        size_ = 0;
+        THROW_ERROR("File is too large to map: %s", path.c_str());
+    }
+
+    // The mapping is kept after closing the file.
+    void* ptr = mmap(nullptr, static_cast<size_t>(size_), PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(ptr == MAP_FAILED) {
+        size_ = 0;
+        THROW_ERROR("Can't map file: %s", path.c_str());
+    }
+    data_ = static_cast<const unsigned char*>(ptr);
+}
+
+void MappedFile::unmap(void) {
+    if(data_)
+        munmap(const_cast<unsigned char*>(data_), static_cast<size_t>(size_));
+    data_ = nullptr;
+    size_ = 0;
+}
+#endif
+
+MappedFile::MappedFile(MappedFile&& other)
+        : MappedFile() {
+    *this = std::move(other);
+}
+
+MappedFile::~MappedFile() { unmap(); }
+
+MappedFile& MappedFile::operator=(MappedFile&& other) {
+    if(this != &other) {
+        unmap();
+        std::swap(data_, other.data_);
+        std::swap(size_, other.size_);
+#ifdef _WIN32
+        std::swap(file_handle_, other.file_handle_);
+        std::swap(mapping_handle_, other.mapping_handle_);
+#endif
+    }
+    return *this;
+}
+
+}  // namespace data
+}  // namespace st
@@ -0,0 +1,61 @@
+#include <algorithm>
+#include <random>
+
+#include "data/shard.h"
+#include "utils/exception.h"
+
+namespace st {
+namespace data {
+
+DatasetShard::DatasetShard(const DatasetBase& dataset, index_t rank,
+                           index_t n_shards, index_t batch_size, bool shuffle)
+        : dataset_(dataset), batch_size_(batch_size) {
+    CHECK_TRUE(n_shards > 0 && rank < n_shards,
+               "Invalid shard %llu of %llu shards.",
+               (unsigned long long)rank, (unsigned long long)n_shards);
+    n_samples_ = dataset.n_samples() / n_shards;
+    CHECK_TRUE(n_samples_ > 0 && batch_size > 0,
+               "Can't split %llu samples into %llu shards of batches of %llu.",
+               (unsigned long long)dataset.n_samples(),
+               (unsigned long long)n_shards, (unsigned long long)batch_size);
+    n_batchs_ = (n_samples_ + batch_size - 1) / batch_size;
+
+    order_.resize(n_samples_);
+    for(index_t i = 0; i < n_samples_; ++i)
+        order_[i] = rank + i * n_shards;
+    if(shuffle)
+        this->shuffle();
+}
+
+std::pair<const data_t*, index_t>
+DatasetShard::get_sample(index_t idx) const {
+    buffer_.resize(sample_size());
+    index_t label = copy_sample(idx, buffer_.data());
+    return {buffer_.data(), label};
+}
+
+std::tuple<index_t, const data_t*, const index_t*>
+DatasetShard::get_batch(index_t idx) const {
+    index_t n_samples = (idx == n_batchs_ - 1)
+                            ? n_samples_ - idx * batch_size_
+                            : batch_size_;
+    buffer_.resize(n_samples * sample_size());
+    label_buffer_.resize(n_samples);
+    gather_range(idx * batch_size_, n_samples, buffer_.data(), label_buffer_.data());
+    return {n_samples, buffer_.data(), label_buffer_.data()};
+}
+
+void DatasetShard::shuffle(unsigned seed) {
+    std::shuffle(order_.begin(), order_.end(), std::default_random_engine(seed));
+}
+
+index_t DatasetShard::copy_sample(index_t idx, data_t* dist) const {
+    return dataset_.copy_sample(order_[idx], dist);
+}
+
+index_t DatasetShard::copy_bytes(index_t idx, unsigned char* dist) const {
+    return dataset_.copy_bytes(order_[idx], dist);
+}
+
+}  // namespace data
+}  // namespace st
@@ -0,0 +1,239 @@
+#include <algorithm>
+#include <cstring>
+#include <numeric>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/types.h>
+#endif
+
+#include "data/stream.h"
+#include "utils/exception.h"
+
+namespace st {
+namespace data {
+
+namespace {
+
+bool seek(std::FILE* file, std::uint64_t offset) {
+#ifdef _WIN32
+    return _fseeki64(file, offset, SEEK_SET) == 0;
+#else
+    return fseeko(file, offset, SEEK_SET) == 0;
+#endif
+}
+
+// Hint how bytes [offset, offset + len) of file will be used. Where
+// posix_fadvise isn't available, it does nothing.
+enum class Advice { sequential, will_need, dont_need };
+
+void advise(std::FILE* file, std::uint64_t offset, std::uint64_t len,
+            Advice advice) {
+#ifdef POSIX_FADV_SEQUENTIAL
+    int flag = advice == Advice::sequential ? POSIX_FADV_SEQUENTIAL
+               : advice == Advice::will_need ? POSIX_FADV_WILLNEED
+               : POSIX_FADV_DONTNEED;
+    posix_fadvise(fileno(file), offset, len, flag);
+#endif
+}
+
+}  // namespace
+
+StreamingDataset::Iterator& StreamingDataset::Iterator::operator++(void) {
+    batch_ = stream_->next_batch();
+    if(std::get<0>(batch_) == 0)
+        stream_ = nullptr;
+    return *this;
+}
+
+StreamingDataset::StreamingDataset(const std::vector<std::string>& shard_paths,
+                                   index_t batch_size,
+                                   index_t shuffle_buffer_size,
+                                   unsigned seed, bool drop_last)
+        : batch_size_(batch_size),
+          n_samples_(0),
+          shuffle_buffer_size_(shuffle_buffer_size),
+          drop_last_(drop_last),
+          engine_(seed),
+          next_shard_(0),
+          file_(nullptr),
+          shard_(nullptr),
+          shard_pos_(0),
+          chunk_begin_(0),
+          chunk_end_(0),
+          pool_count_(0) {
+    CHECK_TRUE(!shard_paths.empty() && batch_size > 0,
+               "Expect some shards and a positive batch size.");
+
+    for(auto& path: shard_paths) {
+        std::FILE* file = std::fopen(path.c_str(), "rb");
+        if(!file)
+            THROW_ERROR("Can't open file: %s", path.c_str());
+        Shard shard;
+        shard.path_ = path;
+        bool read = std::fread(&shard.header_, sizeof(CacheHeader), 1, file) == 1;
+        std::uint64_t file_size = 0;
+        if(read && std::fseek(file, 0, SEEK_END) == 0) {
+#ifdef _WIN32
+            file_size = _ftelli64(file);
+#else
+            file_size = ftello(file);
+#endif
+        }
+        std::fclose(file);
+        const char* problem = read ? shard.header_.check(file_size) : "truncated";
+        CHECK_TRUE(!problem, "Invalid shard %s: %s", path.c_str(), problem);
+
+        if(shards_.empty())
+            sample_size_ = shard.header_.sample_size();
+        CHECK_EQUAL(shard.header_.sample_size(), sample_size_,
+                    "Shard %s has samples of %llu elements, but expect %llu.",
+                    path.c_str(), (unsigned long long)shard.header_.sample_size(),
+                    (unsigned long long)sample_size_);
+        n_samples_ = checked_add(n_samples_,
+                                 static_cast<index_t>(shard.header_.n_samples_));
+        shards_.push_back(shard);
+    }
+    n_batchs_ = drop_last ? n_samples_ / batch_size
+                          : (n_samples_ + batch_size - 1) / batch_size;
+
+    shard_order_.resize(shards_.size());
+    std::iota(shard_order_.begin(), shard_order_.end(), 0);
+    if(shuffle_buffer_size_ > 1) {
+        pool_.resize(checked_mul(shuffle_buffer_size_, sample_size_));
+        pool_labels_.resize(shuffle_buffer_size_);
+    }
+    batch_.resize(checked_mul(batch_size, sample_size_));
+    batch_labels_.resize(batch_size);
+}
+
+StreamingDataset::~StreamingDataset() {
+    close_shard();
+}
+
+void StreamingDataset::reset(void) {
+    close_shard();
+    if(shuffle_buffer_size_ > 1)
+        std::shuffle(shard_order_.begin(), shard_order_.end(), engine_);
+    next_shard_ = 0;
+    pool_count_ = 0;
+}
+
+StreamingDataset::Batch StreamingDataset::next_batch(void) {
+    index_t n_samples = 0;
+    while(n_samples < batch_size_
+          && take_sample(batch_.data() + n_samples * sample_size_,
+                         batch_labels_[n_samples]))
+        ++n_samples;
+
+    if(n_samples == 0 || (drop_last_ && n_samples < batch_size_))
+        return Batch{0, nullptr, nullptr};
+    return Batch{n_samples, batch_.data(), batch_labels_.data()};
+}
+
+StreamingDataset::Iterator StreamingDataset::begin(void) {
+    reset();
+    Iterator iter(this);
+    return ++iter;
+}
+
+bool StreamingDataset::take_sample(data_t* dist, index_t& label) {
+    if(shuffle_buffer_size_ <= 1)
+        return read_sample(dist, label);
+
+    while(pool_count_ < shuffle_buffer_size_
+          && read_sample(pool_.data() + pool_count_ * sample_size_,
+                         pool_labels_[pool_count_]))
+        ++pool_count_;
+    if(pool_count_ == 0)
+        return false;
+
+    // Take a sample at random, and move the last one to its place.
+    index_t idx = std::uniform_int_distribution<index_t>(0, pool_count_ - 1)(engine_);
+    data_t* sample = pool_.data() + idx * sample_size_;
+    std::memcpy(dist, sample, sample_size_ * sizeof(data_t));
+    label = pool_labels_[idx];
+
+    --pool_count_;
+    if(idx != pool_count_) {
+        std::memcpy(sample, pool_.data() + pool_count_ * sample_size_,
+                    sample_size_ * sizeof(data_t));
+        pool_labels_[idx] = pool_labels_[pool_count_];
+    }
+    return true;
+}
+
+bool StreamingDataset::read_sample(data_t* dist, index_t& label) {
+    while(!shard_ || shard_pos_ == shard_->header_.n_samples_)
+        if(!open_next_shard())
+            return false;
+
+    if(shard_pos_ == chunk_end_)
+        read_chunk();
+    const CacheHeader& header = shard_->header_;
+    std::uint64_t sample_bytes = sample_size_ * header.dtype_size();
+    decode_samples(header.dtype_, header.scale_,
+                   chunk_.data() + (shard_pos_ - chunk_begin_) * sample_bytes,
+                   sample_size_, dist);
+    label = shard_labels_[shard_pos_];
+    ++shard_pos_;
+    return true;
+}
+
+bool StreamingDataset::open_next_shard(void) {
+    close_shard();
+    if(next_shard_ == shards_.size())
+        return false;
+
+    shard_ = &shards_[shard_order_[next_shard_++]];
+    const CacheHeader& header = shard_->header_;
+    file_ = std::fopen(shard_->path_.c_str(), "rb");
+    if(!file_)
+        THROW_ERROR("Can't open file: %s", shard_->path_.c_str());
+
+    // Labels are small, read them at once.
+    shard_labels_.resize(header.n_samples_);
+    if(!seek(file_, header.labels_offset())
+       || std::fread(shard_labels_.data(), sizeof(std::int32_t),
+                     header.n_samples_, file_) != header.n_samples_)
+        THROW_ERROR("Can't read file: %s", shard_->path_.c_str());
+
+    if(!seek(file_, header.samples_offset()))
+        THROW_ERROR("Can't read file: %s", shard_->path_.c_str());
+    advise(file_, 0, 0, Advice::sequential);
+    shard_pos_ = chunk_begin_ = chunk_end_ = 0;
+    return true;
+}
+
+void StreamingDataset::read_chunk(void) {
+    const CacheHeader& header = shard_->header_;
+    std::uint64_t sample_bytes = sample_size_ * header.dtype_size();
+    index_t n_chunk_samples = std::max<std::uint64_t>(1, kChunkBytes / sample_bytes);
+    index_t n_samples = std::min<std::uint64_t>(
+        n_chunk_samples, header.n_samples_ - shard_pos_);
+
+    chunk_.resize(n_samples * sample_bytes);
+    if(std::fread(chunk_.data(), sample_bytes, n_samples, file_) != n_samples)
+        THROW_ERROR("Can't read file: %s", shard_->path_.c_str());
+
+    // Drop the pages of the last chunk, and read the next one ahead.
+    std::uint64_t offset = header.samples_offset() + shard_pos_ * sample_bytes;
+    if(chunk_end_ > chunk_begin_)
+        advise(file_, header.samples_offset() + chunk_begin_ * sample_bytes,
+               (chunk_end_ - chunk_begin_) * sample_bytes, Advice::dont_need);
+    advise(file_, offset + chunk_.size(), n_chunk_samples * sample_bytes,
+           Advice::will_need);
+
+    chunk_begin_ = shard_pos_;
+    chunk_end_ = shard_pos_ + n_samples;
+}
+
+void StreamingDataset::close_shard(void) {
+    if(file_)
+        std::fclose(file_);
+    file_ = nullptr;
+    shard_ = nullptr;
+}
+
+}  // namespace data
+}  // namespace st
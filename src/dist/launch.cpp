@@ -0,0 +1,70 @@
+#include <cstdio>
+#include <iostream>
+#include <string>
+
+#ifndef _WIN32
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#endif
+
+#include "dist/launch.h"
+#include "utils/exception.h"
+
+namespace st {
+namespace dist {
+
+ForkedProcesses::ForkedProcesses(index_t n_processes)
+        : rank_(0), n_processes_(n_processes), parent_id_(0) {
+    CHECK_TRUE(n_processes > 0, "Expect some processes, but got %llu.",
+               (unsigned long long)n_processes);
+#ifdef _WIN32
+    CHECK_TRUE(n_processes == 1, "Forking processes needs a POSIX system.");
+#else
+    parent_id_ = getpid();
+    // Flush before forking, or the buffered output would be written by every
+    // process.
+    std::cout.flush();
+    std::cerr.flush();
+    std::fflush(nullptr);
+    for(index_t rank = 1; rank < n_processes; ++rank) {
+        pid_t pid = fork();
+        if(pid < 0) {
+            wait();
+            THROW_ERROR("Can't fork the process of rank %llu.",
+                        (unsigned long long)rank);
+        }
+        if(pid == 0) {
+            rank_ = rank;
+            children_.clear();
+            return;
+        }
+        children_.push_back(pid);
+    }
+#endif
+}
+
+ForkedProcesses::~ForkedProcesses() {
+    wait();
+}
+
+std::string ForkedProcesses::shm_name(void) const {
+    return "/simple-tensor-" + std::to_string(parent_id_);
+}
+
+index_t ForkedProcesses::wait(void) {
+    index_t n_failed = 0;
+#ifndef _WIN32
+    for(long pid: children_) {
+        int status;
+        if(waitpid(static_cast<pid_t>(pid), &status, 0) != static_cast<pid_t>(pid)
+           || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            ++n_failed;
+    }
+#endif
+    children_.clear();
+    return n_failed;
+}
+
+}  // namespace dist
+}  // namespace st
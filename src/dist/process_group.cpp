@@ -0,0 +1,18 @@
+#include <vector>
+
+#include "dist/process_group.h"
+
+namespace st {
+namespace dist {
+
+void ProcessGroup::all_reduce_half(data_t* data, index_t n, HalfType type) {
+    std::vector<half_t> halves(n);
+    half::to_half(type, data, halves.data(), n);
+    half::from_half(type, halves.data(), data, n);
+    all_reduce(data, n);
+    half::to_half(type, data, halves.data(), n);
+    half::from_half(type, halves.data(), data, n);
+}
+
+}  // namespace dist
+}  // namespace st
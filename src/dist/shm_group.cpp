@@ -0,0 +1,250 @@
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <new>
+#include <thread>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "dist/shm_group.h"
+#include "utils/exception.h"
+
+namespace st {
+namespace dist {
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2,
+              "Counters in shared memory must be lock-free.");
+
+struct alignas(64) ShmProcessGroup::Header {
+    static constexpr std::uint64_t kReady = 0x5354534d52454459;  // "STSMREDY"
+
+    std::atomic<std::uint64_t> ready_;
+    std::uint64_t world_size_;
+    std::uint64_t capacity_;
+    std::atomic<std::uint64_t> n_attached_;
+};
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+bool timed_out(Clock::time_point start, double timeout_seconds) {
+    return std::chrono::duration<double>(Clock::now() - start).count()
+           > timeout_seconds;
+}
+
+}  // namespace
+
+ShmProcessGroup::ShmProcessGroup(const std::string& name, index_t rank,
+                                 index_t world_size, index_t capacity,
+                                 double timeout_seconds)
+        : name_(name), rank_(rank), world_size_(world_size), capacity_(capacity),
+          timeout_seconds_(timeout_seconds),
+          segment_(nullptr), segment_size_(0), header_(nullptr),
+          counters_(nullptr), buffers_(nullptr), steps_(0) {
+    CHECK_TRUE(world_size > 0 && rank < world_size && capacity > 0,
+               "Invalid rank %llu of %llu processes with capacity %llu.",
+               (unsigned long long)rank, (unsigned long long)world_size,
+               (unsigned long long)capacity);
+    // A single process has nothing to share.
+    if(world_size == 1)
+        return;
+#ifdef _WIN32
+    THROW_ERROR("ShmProcessGroup needs POSIX shared memory.");
+#else
+    segment_size_ = sizeof(Header)
+                    + static_cast<std::uint64_t>(world_size) * sizeof(Counter)
+                    + static_cast<std::uint64_t>(world_size) * capacity * sizeof(data_t);
+    Clock::time_point start = Clock::now();
+    int fd;
+    if(rank == 0) {
+        // A segment left by a crashed run is replaced.
+        shm_unlink(name.c_str());
+        fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+        if(fd < 0)
+            THROW_ERROR("Can't create shared memory: %s", name.c_str());
+        if(ftruncate(fd, segment_size_) != 0) {
+            close(fd);
+            shm_unlink(name.c_str());
+            THROW_ERROR("Can't allocate shared memory: %s", name.c_str());
+        }
+    } else {
+        // Wait for the rank 0 to create and size the segment.
+        struct stat segment_stat;
+        while(true) {
+            fd = shm_open(name.c_str(), O_RDWR, 0600);
+            if(fd >= 0 && fstat(fd, &segment_stat) == 0
+               && static_cast<std::uint64_t>(segment_stat.st_size) >= segment_size_)
+                break;
+            if(fd >= 0)
+                close(fd);
+            if(timed_out(start, timeout_seconds))
+                THROW_ERROR("Shared memory %s wasn't created in time.", name.c_str());
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+
+    segment_ = mmap(nullptr, segment_size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(segment_ == MAP_FAILED) {
+        segment_ = nullptr;
+        if(rank == 0)
+            shm_unlink(name.c_str());
+        THROW_ERROR("Can't map shared memory: %s", name.c_str());
+    }
+    unsigned char* bytes = static_cast<unsigned char*>(segment_);
+    header_ = reinterpret_cast<Header*>(bytes);
+    counters_ = reinterpret_cast<Counter*>(bytes + sizeof(Header));
+    buffers_ = reinterpret_cast<data_t*>(bytes + sizeof(Header)
+                                         + world_size * sizeof(Counter));
+
+    if(rank == 0) {
+        // The segment is zeroed by ftruncate.
+        new(header_) Header();
+        header_->world_size_ = world_size;
+        header_->capacity_ = capacity;
+        for(index_t i = 0; i < world_size; ++i)
+            new(&counters_[i]) Counter();
+        header_->ready_.store(Header::kReady, std::memory_order_release);
+    } else {
+        while(header_->ready_.load(std::memory_order_acquire) != Header::kReady) {
+            if(timed_out(start, timeout_seconds)) {
+                munmap(segment_, segment_size_);
+                THROW_ERROR("Shared memory %s wasn't initialized in time.",
+                            name.c_str());
+            }
+            std::this_thread::yield();
+        }
+        if(header_->world_size_ != world_size || header_->capacity_ != capacity) {
+            munmap(segment_, segment_size_);
+            THROW_ERROR("Shared memory %s is of another group.", name.c_str());
+        }
+    }
+
+    header_->n_attached_.fetch_add(1);
+    if(rank == 0) {
+        while(header_->n_attached_.load() < world_size) {
+            if(timed_out(start, timeout_seconds)) {
+                munmap(segment_, segment_size_);
+                shm_unlink(name.c_str());
+                THROW_ERROR("Processes didn't open shared memory %s in time.",
+                            name.c_str());
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        shm_unlink(name.c_str());
+    }
+#endif
+}
+
+ShmProcessGroup::~ShmProcessGroup() {
+#ifndef _WIN32
+    if(segment_)
+        munmap(segment_, segment_size_);
+#endif
+}
+
+void ShmProcessGroup::all_reduce(data_t* data, index_t n) {
+    if(world_size_ == 1)
+        return;
+    for(index_t offset = 0; offset < n; offset += capacity_)
+        all_reduce_piece(data + offset, std::min(capacity_, n - offset));
+}
+
+void ShmProcessGroup::all_reduce_piece(data_t* data, index_t n) {
+    index_t size = world_size_;
+    std::uint64_t base = steps_;
+    auto chunk_begin = [=](index_t c) {
+        return static_cast<index_t>(static_cast<std::uint64_t>(n) * c / size);
+    };
+
+    // The others may still read the buffer in the last collective.
+    wait(size, base);
+    data_t* mine = buffer(rank_);
+    index_t left = (rank_ + size - 1) % size;
+    const data_t* theirs = buffer(left);
+    std::memcpy(mine, data, n * sizeof(data_t));
+    finish_step();
+
+    // reduce-scatter: the left neighbour has added s chunks into the chunk
+    // r - s, add the one of this rank. Then the chunk r + 1 is reduced.
+    for(index_t s = 1; s < size; ++s) {
+        wait(left, base + s);
+        index_t c = (rank_ + size - s) % size;
+        for(index_t i = chunk_begin(c), end = chunk_begin(c + 1); i < end; ++i)
+            mine[i] += theirs[i];
+        finish_step();
+    }
+    // all-gather: the left neighbour has the chunk r + 1 - g reduced.
+    for(index_t g = 1; g < size; ++g) {
+        wait(left, base + size - 1 + g);
+        index_t c = (rank_ + 1 + size - g) % size;
+        index_t begin = chunk_begin(c);
+        std::memcpy(mine + begin, theirs + begin,
+                    (chunk_begin(c + 1) - begin) * sizeof(data_t));
+        finish_step();
+    }
+    std::memcpy(data, mine, n * sizeof(data_t));
+}
+
+void ShmProcessGroup::broadcast(data_t* data, index_t n, index_t root) {
+    CHECK_IN_RANGE(root, 0, world_size_, "Invalid root %llu of %llu processes.",
+                   (unsigned long long)root, (unsigned long long)world_size_);
+    if(world_size_ == 1)
+        return;
+    for(index_t offset = 0; offset < n; offset += capacity_) {
+        index_t m = std::min(capacity_, n - offset);
+        std::uint64_t base = steps_;
+        wait(world_size_, base);
+        if(rank_ == root) {
+            std::memcpy(buffer(root), data + offset, m * sizeof(data_t));
+        } else {
+            wait(root, base + 1);
+            std::memcpy(data + offset, buffer(root), m * sizeof(data_t));
+        }
+        finish_step();
+    }
+}
+
+void ShmProcessGroup::barrier(void) {
+    if(world_size_ == 1)
+        return;
+    finish_step();
+    wait(world_size_, steps_);
+}
+
+void ShmProcessGroup::wait(index_t rank, std::uint64_t steps) const {
+    auto ready = [=]() {
+        if(rank < world_size_)
+            return counters_[rank].steps_.load(std::memory_order_acquire) >= steps;
+        for(index_t i = 0; i < world_size_; ++i)
+            if(counters_[i].steps_.load(std::memory_order_acquire) < steps)
+                return false;
+        return true;
+    };
+
+    // Spin shortly, then give the core to others, e.g. to the process waited
+    // for when there are fewer cores than processes.
+    Clock::time_point start = Clock::now();
+    for(index_t n_spins = 0; !ready(); ++n_spins) {
+        if(n_spins < 128)
+            continue;
+        std::this_thread::yield();
+        if(n_spins % 1024 == 0 && timed_out(start, timeout_seconds_))
+            THROW_ERROR("Rank %llu waited for other processes too long in %s.",
+                        (unsigned long long)rank_, name_.c_str());
+    }
+}
+
+void ShmProcessGroup::finish_step(void) {
+    ++steps_;
+    counters_[rank_].steps_.store(steps_, std::memory_order_release);
+}
+
+}  // namespace dist
+}  // namespace st
@@ -0,0 +1,460 @@
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <limits>
+#include <thread>
+
+#ifndef _WIN32
+#include <cerrno>
+#include <netdb.h>
+#include <poll.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#endif
+
+#include "dist/tcp_group.h"
+#include "utils/exception.h"
+
+namespace st {
+namespace dist {
+
+#ifndef _WIN32
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+#ifdef MSG_NOSIGNAL
+constexpr int kSendFlags = MSG_NOSIGNAL | MSG_DONTWAIT;
+#else
+constexpr int kSendFlags = MSG_DONTWAIT;
+#endif
+
+// The first message on every connection.
+struct Hello {
+    static constexpr std::uint64_t kMagic = 0x5354544350484c4f;  // "STTCPHLO"
+
+    std::uint64_t magic_;
+    std::uint32_t rank_;
+    std::uint32_t world_size_;
+    std::uint32_t port_;  // which the rank listens on
+    std::uint32_t reserved_;
+};
+
+// Where a rank listens, sent by the rank 0 to the others.
+struct PeerAddress {
+    std::uint32_t ip_;  // in network byte order
+    std::uint32_t port_;
+};
+
+bool timed_out(Clock::time_point start, double timeout_seconds) {
+    return std::chrono::duration<double>(Clock::now() - start).count()
+           > timeout_seconds;
+}
+
+void configure(int fd) {
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+#ifdef SO_NOSIGPIPE
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+}
+
+// Send send_bytes to send_fd and receive recv_bytes from recv_fd, each as
+// soon as the socket is ready, until both are done. So two processes sending
+// to each other don't wait for each other to receive.
+void transfer(int send_fd, const void* send_data, std::uint64_t send_bytes,
+              int recv_fd, void* recv_data, std::uint64_t recv_bytes,
+              double timeout_seconds) {
+    const unsigned char* send_ptr = static_cast<const unsigned char*>(send_data);
+    unsigned char* recv_ptr = static_cast<unsigned char*>(recv_data);
+    std::uint64_t sent = 0, received = 0;
+    while(sent < send_bytes || received < recv_bytes) {
+        pollfd fds[2];
+        int n_fds = 0, send_idx = -1, recv_idx = -1;
+        if(sent < send_bytes) {
+            fds[n_fds] = {send_fd, POLLOUT, 0};
+            send_idx = n_fds++;
+        }
+        if(received < recv_bytes) {
+            fds[n_fds] = {recv_fd, POLLIN, 0};
+            recv_idx = n_fds++;
+        }
+        int n_ready = poll(fds, n_fds, static_cast<int>(timeout_seconds * 1000));
+        if(n_ready < 0 && errno == EINTR)
+            continue;
+        if(n_ready == 0)
+            THROW_ERROR("Waited for a peer more than %g seconds.", timeout_seconds);
+        if(n_ready < 0)
+            THROW_ERROR("Can't poll sockets: %s", std::strerror(errno));
+
+        if(send_idx >= 0 && fds[send_idx].revents) {
+            ssize_t n = send(send_fd, send_ptr + sent, send_bytes - sent, kSendFlags);
+            if(n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                THROW_ERROR("Can't send to a peer: %s", std::strerror(errno));
+            sent += std::max<ssize_t>(n, 0);
+        }
+        if(recv_idx >= 0 && fds[recv_idx].revents) {
+            ssize_t n = recv(recv_fd, recv_ptr + received, recv_bytes - received,
+                             MSG_DONTWAIT);
+            if(n == 0)
+                THROW_ERROR("A peer closed the connection.");
+            if(n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                THROW_ERROR("Can't receive from a peer: %s", std::strerror(errno));
+            received += std::max<ssize_t>(n, 0);
+        }
+    }
+}
+
+void send_hello(int fd, index_t rank, index_t world_size, int port,
+                double timeout_seconds) {
+    // The constructor checks that rank and world_size fit.
+    Hello hello = {Hello::kMagic, static_cast<std::uint32_t>(rank),
+                   static_cast<std::uint32_t>(world_size),
+                   static_cast<std::uint32_t>(port), 0};
+    transfer(fd, &hello, sizeof(hello), -1, nullptr, 0, timeout_seconds);
+}
+
+Hello recv_hello(int fd, index_t world_size, double timeout_seconds) {
+    Hello hello;
+    transfer(-1, nullptr, 0, fd, &hello, sizeof(hello), timeout_seconds);
+    CHECK_TRUE(hello.magic_ == Hello::kMagic, "A peer isn't of a TcpProcessGroup.");
+    CHECK_TRUE(hello.world_size_ == world_size && hello.rank_ < world_size,
+               "A peer of rank %d of %d processes is of another group.",
+               hello.rank_, hello.world_size_);
+    return hello;
+}
+
+sockaddr_in resolve(const std::string& host, int port) {
+    addrinfo hints;
+    std::memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* result;
+    int code = getaddrinfo(host.c_str(), nullptr, &hints, &result);
+    if(code != 0)
+        THROW_ERROR("Can't resolve %s: %s", host.c_str(), gai_strerror(code));
+    sockaddr_in addr;
+    std::memcpy(&addr, result->ai_addr, sizeof(addr));
+    freeaddrinfo(result);
+    addr.sin_port = htons(port);
+    return addr;
+}
+
+// Listen on port of all interfaces. With port 0, the port is chosen by the
+// system, and returned in port.
+int listen_on(int& port, int backlog) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if(fd < 0)
+        THROW_ERROR("Can't create a socket: %s", std::strerror(errno));
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    sockaddr_in addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    socklen_t length = sizeof(addr);
+    if(bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0
+       || listen(fd, backlog) != 0
+       || getsockname(fd, reinterpret_cast<sockaddr*>(&addr), &length) != 0) {
+        int error = errno;
+        close(fd);
+        THROW_ERROR("Can't listen on port %d: %s", port, std::strerror(error));
+    }
+    port = ntohs(addr.sin_port);
+    return fd;
+}
+
+int accept_peer(int listen_fd, sockaddr_in& peer, double timeout_seconds) {
+    pollfd listen_poll = {listen_fd, POLLIN, 0};
+    while(true) {
+        int n_ready = poll(&listen_poll, 1, static_cast<int>(timeout_seconds * 1000));
+        if(n_ready < 0 && errno == EINTR)
+            continue;
+        if(n_ready == 0)
+            THROW_ERROR("No peer connected in %g seconds.", timeout_seconds);
+        if(n_ready < 0)
+            THROW_ERROR("Can't poll sockets: %s", std::strerror(errno));
+        socklen_t length = sizeof(peer);
+        int fd = accept(listen_fd, reinterpret_cast<sockaddr*>(&peer), &length);
+        if(fd >= 0) {
+            configure(fd);
+            return fd;
+        }
+        if(errno != EINTR && errno != ECONNABORTED && errno != EAGAIN)
+            THROW_ERROR("Can't accept a peer: %s", std::strerror(errno));
+    }
+}
+
+// Retry until the peer listens.
+int connect_peer(const sockaddr_in& addr, Clock::time_point start,
+                 double timeout_seconds) {
+    while(true) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if(fd < 0)
+            THROW_ERROR("Can't create a socket: %s", std::strerror(errno));
+        if(connect(fd, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) == 0) {
+            configure(fd);
+            return fd;
+        }
+        close(fd);
+        if(timed_out(start, timeout_seconds))
+            THROW_ERROR("Can't connect to %s:%d in time.",
+                        inet_ntoa(addr.sin_addr), ntohs(addr.sin_port));
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+}
+
+}  // namespace
+#endif
+
+TcpProcessGroup::TcpProcessGroup(const std::string& master_addr, int master_port,
+                                 index_t rank, index_t world_size,
+                                 double timeout_seconds)
+        : rank_(rank), world_size_(world_size), timeout_seconds_(timeout_seconds),
+          listen_fd_(-1), right_fd_(-1), left_fd_(-1) {
+    CHECK_TRUE(world_size > 0 && rank < world_size,
+               "Invalid rank %llu of %llu processes.",
+               (unsigned long long)rank, (unsigned long long)world_size);
+    // Hello carries them in 32 bits, whatever index_t is.
+    CHECK_TRUE(world_size <= std::numeric_limits<std::uint32_t>::max(),
+               "%llu processes are too many for a TcpProcessGroup.",
+               (unsigned long long)world_size);
+    // A single process has nothing to connect.
+    if(world_size == 1)
+        return;
+#ifdef _WIN32
+    THROW_ERROR("TcpProcessGroup needs POSIX sockets.");
+#else
+    try {
+        connect_ring(master_addr, master_port);
+    } catch(...) {
+        close_all();
+        throw;
+    }
+#endif
+}
+
+TcpProcessGroup::~TcpProcessGroup() {
+    close_all();
+}
+
+int TcpProcessGroup::free_port(void) {
+#ifdef _WIN32
+    THROW_ERROR("TcpProcessGroup needs POSIX sockets.");
+#else
+    int port = 0;
+    close(listen_on(port, 1));
+    return port;
+#endif
+}
+
+void TcpProcessGroup::connect_ring(const std::string& master_addr,
+                                   int master_port) {
+#ifndef _WIN32
+    Clock::time_point start = Clock::now();
+    sockaddr_in master = resolve(master_addr, master_port);
+    std::vector<sockaddr_in> addresses(world_size_, master);
+    std::vector<PeerAddress> table(world_size_);
+    int port = rank_ == 0 ? master_port : 0;
+    listen_fd_ = listen_on(port, world_size_);
+
+    if(rank_ == 0) {
+        // connections of the rendezvous, by ranks
+        std::vector<int> fds(world_size_, -1);
+        auto close_fds = [&fds]() {
+            for(int fd: fds)
+                if(fd >= 0)
+                    close(fd);
+        };
+        try {
+            for(index_t i = 1; i < world_size_; ++i) {
+                sockaddr_in peer;
+                int fd = accept_peer(listen_fd_, peer, timeout_seconds_);
+                Hello hello;
+                try {
+                    hello = recv_hello(fd, world_size_, timeout_seconds_);
+                } catch(...) {
+                    close(fd);
+                    throw;
+                }
+                if(hello.rank_ == 0 || fds[hello.rank_] >= 0) {
+                    close(fd);
+                    THROW_ERROR("Rank %d connected twice.", hello.rank_);
+                }
+                fds[hello.rank_] = fd;
+                table[hello.rank_] = {peer.sin_addr.s_addr, hello.port_};
+            }
+            for(index_t i = 1; i < world_size_; ++i)
+                transfer(fds[i], table.data(), table.size() * sizeof(PeerAddress),
+                         -1, nullptr, 0, timeout_seconds_);
+        } catch(...) {
+            close_fds();
+            throw;
+        }
+        close_fds();
+    } else {
+        int fd = connect_peer(master, start, timeout_seconds_);
+        try {
+            send_hello(fd, rank_, world_size_, port, timeout_seconds_);
+            transfer(-1, nullptr, 0, fd, table.data(),
+                     table.size() * sizeof(PeerAddress), timeout_seconds_);
+        } catch(...) {
+            close(fd);
+            throw;
+        }
+        close(fd);
+    }
+    // The rank 0 is reached at master_addr.
+    for(index_t i = 1; i < world_size_; ++i) {
+        addresses[i].sin_addr.s_addr = table[i].ip_;
+        addresses[i].sin_port = htons(table[i].port_);
+    }
+
+    // Connecting to the right returns once it's queued by the listener, so
+    // all ranks can connect before they accept.
+    index_t right = (rank_ + 1) % world_size_;
+    index_t left = (rank_ + world_size_ - 1) % world_size_;
+    right_fd_ = connect_peer(addresses[right], start, timeout_seconds_);
+    send_hello(right_fd_, rank_, world_size_, 0, timeout_seconds_);
+    sockaddr_in peer;
+    left_fd_ = accept_peer(listen_fd_, peer, timeout_seconds_);
+    Hello hello = recv_hello(left_fd_, world_size_, timeout_seconds_);
+    CHECK_TRUE(hello.rank_ == left, "Expect the rank %llu on the left, but got %llu.",
+               (unsigned long long)left, (unsigned long long)hello.rank_);
+    close(listen_fd_);
+    listen_fd_ = -1;
+#endif
+}
+
+void TcpProcessGroup::close_all(void) {
+#ifndef _WIN32
+    for(int* fd: {&listen_fd_, &right_fd_, &left_fd_}) {
+        if(*fd >= 0)
+            close(*fd);
+        *fd = -1;
+    }
+#endif
+}
+
+void TcpProcessGroup::all_reduce(data_t* data, index_t n) {
+    if(world_size_ == 1)
+        return;
+    ring_all_reduce(data, n, nullptr);
+}
+
+void TcpProcessGroup::all_reduce_half(data_t* data, index_t n, HalfType type) {
+    if(world_size_ == 1)
+        return ProcessGroup::all_reduce_half(data, n, type);
+    ring_all_reduce(data, n, &type);
+}
+
+void TcpProcessGroup::ring_all_reduce(data_t* data, index_t n,
+                                      const HalfType* half_type) {
+    index_t size = world_size_;
+    auto chunk_begin = [=](index_t c) {
+        return static_cast<index_t>(static_cast<std::uint64_t>(n) * c / size);
+    };
+    auto chunk_size = [=](index_t c) { return chunk_begin(c + 1) - chunk_begin(c); };
+    std::uint64_t value_size = half_type ? sizeof(half_t) : sizeof(data_t);
+    std::uint64_t max_bytes = (n / size + 1) * value_size;
+    send_buffer_.resize(max_bytes);
+    recv_buffer_.resize(max_bytes);
+    half_t* send_halves = reinterpret_cast<half_t*>(send_buffer_.data());
+    const half_t* recv_halves = reinterpret_cast<const half_t*>(recv_buffer_.data());
+    // Values of the chunk c to send, in half precision if compressed.
+    auto pack = [&](index_t c) -> const void* {
+        if(!half_type)
+            return data + chunk_begin(c);
+        half::to_half(*half_type, data + chunk_begin(c), send_halves, chunk_size(c));
+        return send_halves;
+    };
+
+    // reduce-scatter: then the chunk r + 1 is reduced.
+    for(index_t s = 0; s + 1 < size; ++s) {
+        index_t send_c = (rank_ + size - s) % size;
+        index_t recv_c = (rank_ + size - s - 1) % size;
+        exchange(pack(send_c), chunk_size(send_c) * value_size,
+                 recv_buffer_.data(), chunk_size(recv_c) * value_size);
+        data_t* dist = data + chunk_begin(recv_c);
+        index_t m = chunk_size(recv_c);
+        if(half_type) {
+            for(index_t i = 0; i < m; ++i)
+                dist[i] += half::load(*half_type, recv_halves[i]);
+        } else {
+            const data_t* src = reinterpret_cast<const data_t*>(recv_buffer_.data());
+            for(index_t i = 0; i < m; ++i)
+                dist[i] += src[i];
+        }
+    }
+
+    // all-gather: the left neighbour has the chunk r - s reduced. Compressed,
+    // the own chunk is rounded like the ones received.
+    if(half_type) {
+        index_t c = (rank_ + 1) % size;
+        pack(c);
+        half::from_half(*half_type, send_halves, data + chunk_begin(c), chunk_size(c));
+    }
+    for(index_t s = 0; s + 1 < size; ++s) {
+        index_t send_c = (rank_ + 1 + size - s) % size;
+        index_t recv_c = (rank_ + size - s) % size;
+        if(half_type) {
+            exchange(pack(send_c), chunk_size(send_c) * value_size,
+                     recv_buffer_.data(), chunk_size(recv_c) * value_size);
+            half::from_half(*half_type, recv_halves, data + chunk_begin(recv_c),
+                            chunk_size(recv_c));
+        } else {
+            exchange(data + chunk_begin(send_c), chunk_size(send_c) * value_size,
+                     data + chunk_begin(recv_c), chunk_size(recv_c) * value_size);
+        }
+    }
+}
+
+void TcpProcessGroup::broadcast(data_t* data, index_t n, index_t root) {
+    CHECK_IN_RANGE(root, 0, world_size_, "Invalid root %llu of %llu processes.",
+                   (unsigned long long)root, (unsigned long long)world_size_);
+    if(world_size_ == 1)
+        return;
+    // Pieces are passed on along the ring, so ranks forward one while the
+    // next is arriving.
+    index_t right = (rank_ + 1) % world_size_;
+    for(index_t offset = 0; offset < n; offset += kPieceSize) {
+        std::uint64_t n_bytes = std::min(kPieceSize, n - offset) * sizeof(data_t);
+        if(rank_ != root)
+            exchange(nullptr, 0, data + offset, n_bytes);
+        if(right != root)
+            exchange(data + offset, n_bytes, nullptr, 0);
+    }
+}
+
+void TcpProcessGroup::barrier(void) {
+    if(world_size_ == 1)
+        return;
+    // A token goes around the ring twice, the rank 0 knows all have arrived
+    // once it's back, and the others after it goes around once more.
+    unsigned char token = 0;
+    for(index_t round = 0; round < 2; ++round) {
+        if(rank_ == 0) {
+            exchange(&token, 1, nullptr, 0);
+            exchange(nullptr, 0, &token, 1);
+        } else {
+            exchange(nullptr, 0, &token, 1);
+            exchange(&token, 1, nullptr, 0);
+        }
+    }
+}
+
+void TcpProcessGroup::exchange(const void* send_data, std::uint64_t send_bytes,
+                               void* recv_data, std::uint64_t recv_bytes) {
+#ifndef _WIN32
+    transfer(right_fd_, send_data, send_bytes, left_fd_, recv_data, recv_bytes,
+             timeout_seconds_);
+#endif
+}
+
+}  // namespace dist
+}  // namespace st
@@ -0,0 +1,84 @@
+#include "nn/checkpoint.h"
+#include "tensor/grad_meta.h"
+#include "tensor/grad_engine.h"
+#include "utils/grad_mode.h"
+
+namespace st {
+namespace nn {
+
+// grad_fn of the output of Checkpoint::forward().
+struct Checkpoint::RecomputeGradFn : public GradFn {
+    RecomputeGradFn(Module& module, const TensorImpl& input)
+            : module_(module),
+              input_ptr_(input, true),
+              version_(input.version()) {}
+
+    void operator()(void) override {
+        THROW_ERROR("Need grad when invoke backward method of a checkpoint.");
+    }
+
+    void operator()(const Storage& grad, const Shape& shape,
+                    const IndexArray& stride) override {
+        const TensorImpl& input = *input_ptr_;
+        CHECK_EQUAL(input.version(), version_,
+            "Input of a checkpoint has been modified before backward.");
+
+        // Recompute on a leaf sharing the storage of the input.
+        Tensor x(input.storage_, input.shape_, input.stride_, input.requires_grad());
+        Tensor y = module_.forward(x);
+        TensorImpl& y_impl = const_cast<TensorImpl&>(y.impl());
+        if(!y_impl.requires_grad())
+            return;
+
+        // Backward of the recomputed graph must be finished before the
+        // gradient of x is passed on, so it runs in an engine of its own.
+        {
+            GradEngine engine;
+            y_impl.accumulate_grad(TensorGradImpl(grad, shape, stride));
+            y_impl.backward();
+            engine.run();
+        }
+
+        if(input.requires_grad()) {
+            const TensorImpl& x_impl = x.impl();
+            input_ptr_.invoke_backward(TensorGradImpl(
+                x_impl.gradmeta_ptr_->grad_, x_impl.shape_, x_impl.stride_));
+        }
+    }
+
+    Module& module_;
+    ExpImplPtr<TensorImpl> input_ptr_;
+    index_t version_;
+};
+
+bool Checkpoint::needs_grad(const Tensor& input) {
+    if(input.impl().requires_grad())
+        return true;
+    for(auto& named_param: module_.parameters())
+        if(named_param.second.get().impl().requires_grad())
+            return true;
+    return false;
+}
+
+Tensor Checkpoint::forward(const Tensor& input) {
+    // Without anything to train, the output is a plain tensor, and the input
+    // isn't kept.
+    bool record_graph = GradMode::is_enabled() && needs_grad(input);
+    Tensor y = [&]() {
+        NoGradGuard no_grad;
+        return module_.forward(input);
+    }();
+
+    // The output shares the storage of y, and its grad_fn recomputes.
+    const TensorImpl& y_impl = y.impl();
+    Tensor output(y_impl.storage_, y_impl.shape_, y_impl.stride_, record_graph);
+    if(record_graph) {
+        TensorImpl& output_impl = const_cast<TensorImpl&>(output.impl());
+        output_impl.gradmeta_ptr_->grad_fn_ptr_ =
+            Alloc::shared_construct<RecomputeGradFn>(module_, input.impl());
+    }
+    return output;
+}
+
+}  // namespace nn
+}  // namespace st
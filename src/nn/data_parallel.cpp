@@ -0,0 +1,227 @@
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <utility>
+
+#include "tensor/tensor.h"
+#include "tensor/tensor_impl.h"
+#include "nn/data_parallel.h"
+
+namespace st {
+namespace nn {
+
+DataParallel::DataParallel(const ParamsDict& params, dist::ProcessGroup& group,
+                           index_t bucket_size)
+        : group_(group),
+          bucket_size_(bucket_size),
+          comm_hook_([](dist::ProcessGroup& group, data_t* grads, index_t n) {
+              group.all_reduce(grads, n);
+          }),
+          reordered_(false),
+          n_reduced_(0),
+          stop_(false) {
+    CHECK_TRUE(bucket_size > 0, "Expect a positive bucket size.");
+    // Sorted by names, so the params are the same in every process.
+    std::vector<std::pair<std::string, TensorImpl*>> named_params;
+    for(auto& named_param: params) {
+        const Tensor& tensor = named_param.second.get();
+        named_params.emplace_back(named_param.first,
+                                  const_cast<TensorImpl*>(&tensor.impl()));
+    }
+    std::sort(named_params.begin(), named_params.end());
+
+    for(auto& named_param: named_params) {
+        TensorImpl& impl = *named_param.second;
+        CHECK_TRUE(impl.is_contiguous() && impl.requires_grad(),
+                   "Only contiguous Tensor requiring grad can be trained in "
+                   "parallel, but %s isn't.", named_param.first.c_str());
+        // Start from the same parameters in all processes.
+        group_.broadcast(&impl.storage_[0], impl.shape_.dsize(), 0);
+        impl.storage_.increment_version();
+        params_.emplace_back(impl);
+    }
+
+    std::vector<index_t> order(params_.size());
+    for(index_t i = 0; i < order.size(); ++i)
+        order[i] = order.size() - 1 - i;
+    build_buckets(order);
+    ready_.assign(params_.size(), false);
+
+    for(index_t i = 0; i < params_.size(); ++i) {
+        TensorImpl& impl = params_[i];
+        impl.gradmeta_ptr_->grad_ready_hook_ = [this, i]() { on_grad_ready(i); };
+    }
+    comm_thread_ = std::thread(&DataParallel::comm_loop, this);
+}
+
+DataParallel::~DataParallel() {
+    for(TensorImpl& impl: params_)
+        impl.gradmeta_ptr_->grad_ready_hook_ = nullptr;
+    {
+        std::lock_guard<std::mutex> guard(mutex_);
+        stop_ = true;
+    }
+    ready_cv_.notify_all();
+    comm_thread_.join();
+}
+
+DataParallel::CommHook DataParallel::half_compression(HalfType type) {
+    return [type](dist::ProcessGroup& group, data_t* grads, index_t n) {
+        group.all_reduce_half(grads, n, type);
+    };
+}
+
+void DataParallel::register_comm_hook(CommHook hook) {
+    CHECK_TRUE(bool(hook), "Expect a communication hook.");
+    std::lock_guard<std::mutex> guard(mutex_);
+    comm_hook_ = std::move(hook);
+}
+
+bool DataParallel::parameters_in_sync(void) {
+    std::lock_guard<std::mutex> guard(mutex_);
+    std::vector<data_t> mine, root;
+    for(TensorImpl& impl: params_) {
+        const data_t* data = &impl.storage_[0];
+        mine.insert(mine.end(), data, data + impl.shape_.dsize());
+    }
+    root = mine;
+    group_.broadcast(root.data(), root.size(), 0);
+    data_t n_different = std::memcmp(mine.data(), root.data(),
+                                     mine.size() * sizeof(data_t)) != 0;
+    group_.all_reduce(&n_different, 1);
+    return n_different == 0;
+}
+
+void DataParallel::synchronize(void) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    for(index_t i = 0; i < params_.size(); ++i)
+        if(!ready_[i])
+            mark_ready(i);
+    ready_cv_.notify_all();
+    reduced_cv_.wait(lock, [this]() { return n_reduced_ == buckets_.size(); });
+
+    std::exception_ptr error = error_;
+    error_ = nullptr;
+    // Buckets of later steps follow the order of the rank 0 in this one. The
+    // communication thread is waiting, so the group is free.
+    if(!reordered_ && !error) {
+        reordered_ = true;
+        std::vector<data_t> order(ready_order_.begin(), ready_order_.end());
+        group_.broadcast(order.data(), order.size(), 0);
+        build_buckets(std::vector<index_t>(order.begin(), order.end()));
+    }
+
+    // Start the next step.
+    std::fill(ready_.begin(), ready_.end(), false);
+    ready_order_.clear();
+    for(auto& bucket: buckets_)
+        bucket.n_pending_ = bucket.params_.size();
+    n_reduced_ = 0;
+    if(error)
+        std::rethrow_exception(error);
+}
+
+void DataParallel::build_buckets(const std::vector<index_t>& order) {
+    buckets_.clear();
+    bucket_of_.assign(params_.size(), 0);
+    index_t size = 0;
+    for(index_t param_idx: order) {
+        index_t param_size = params_[param_idx].get().shape_.dsize();
+        if(buckets_.empty() || (size > 0 && size + param_size > bucket_size_)) {
+            buckets_.emplace_back();
+            size = 0;
+        }
+        buckets_.back().params_.push_back(param_idx);
+        bucket_of_[param_idx] = buckets_.size() - 1;
+        size += param_size;
+    }
+    for(auto& bucket: buckets_) {
+        index_t flat_size = 0;
+        for(index_t param_idx: bucket.params_)
+            flat_size += params_[param_idx].get().shape_.dsize();
+        bucket.flat_.resize(flat_size);
+        bucket.n_pending_ = bucket.params_.size();
+    }
+}
+
+void DataParallel::on_grad_ready(index_t param_idx) {
+    bool bucket_ready = false;
+    {
+        std::lock_guard<std::mutex> guard(mutex_);
+        if(!ready_[param_idx]) {
+            mark_ready(param_idx);
+            bucket_ready = buckets_[bucket_of_[param_idx]].n_pending_ == 0;
+        }
+    }
+    if(bucket_ready)
+        ready_cv_.notify_all();
+}
+
+void DataParallel::mark_ready(index_t param_idx) {
+    ready_[param_idx] = true;
+    ready_order_.push_back(param_idx);
+    --buckets_[bucket_of_[param_idx]].n_pending_;
+}
+
+void DataParallel::comm_loop(void) {
+    while(true) {
+        Bucket* bucket;
+        bool failed;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            ready_cv_.wait(lock, [this]() {
+                return stop_ || (n_reduced_ < buckets_.size()
+                                 && buckets_[n_reduced_].n_pending_ == 0);
+            });
+            if(stop_)
+                return;
+            bucket = &buckets_[n_reduced_];
+            failed = bool(error_);
+        }
+
+        // Once a collective failed, the processes are out of step, and the
+        // rest of the buckets is skipped.
+        std::exception_ptr error;
+        if(!failed) {
+            try {
+                reduce_bucket(*bucket);
+            } catch(...) {
+                error = std::current_exception();
+            }
+        }
+
+        {
+            std::lock_guard<std::mutex> guard(mutex_);
+            if(error)
+                error_ = error;
+            ++n_reduced_;
+        }
+        reduced_cv_.notify_all();
+    }
+}
+
+void DataParallel::reduce_bucket(Bucket& bucket) {
+    data_t* flat = bucket.flat_.data();
+    for(index_t param_idx: bucket.params_) {
+        TensorImpl& impl = params_[param_idx];
+        index_t size = impl.shape_.dsize();
+        std::memcpy(flat, &impl.gradmeta_ptr_->grad_[0], size * sizeof(data_t));
+        flat += size;
+    }
+
+    comm_hook_(group_, bucket.flat_.data(), bucket.flat_.size());
+
+    data_t scale = 1.0 / group_.world_size();
+    flat = bucket.flat_.data();
+    for(index_t param_idx: bucket.params_) {
+        TensorImpl& impl = params_[param_idx];
+        data_t* grad = &impl.gradmeta_ptr_->grad_[0];
+        index_t size = impl.shape_.dsize();
+        for(index_t i = 0; i < size; ++i)
+            grad[i] = flat[i] * scale;
+        flat += size;
+    }
+}
+
+}  // namespace nn
+}  // namespace st
@@ -20,6 +20,7 @@ void CpyInitializer::init(void) const {
     index_t dsize = data_size();
     for(index_t i = 0; i < dsize; ++i)
         storage_dptr[i] = data_[i];
+    increment_version();
 }
 
 KaimingInitializer::KaimingInitializer(Tensor& param, Mode mode, 
@@ -41,6 +42,7 @@ void KaimingInitializer::init(void) const {
     for(index_t i = 0; i < dsize; ++i) {
         storage_dptr[i] = u(engine_);
     }
+    increment_version();
 }
 
 UniformInitializer::UniformInitializer(Tensor& param, data_t a, data_t b)
@@ -54,6 +56,7 @@ void UniformInitializer::init(void) const {
     index_t dsize = data_size();
     for(index_t i = 0; i < dsize; ++i)
         storage_dptr[i] = u(engine_);
+    increment_version();
 }
 
 }  // namespace nn
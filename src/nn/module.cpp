@@ -19,9 +19,10 @@ Linear::Linear(index_t in_features, index_t out_features)
 }
 
 Tensor Linear::forward(const Tensor& x) {
-    Tensor y1 = op::matrix_mul(
-        x, op::matrix_transpose(weight_)
-    );
+    if(half_weight_) half_weight_->sync();
+    Tensor y1 = half_weight_
+        ? Tensor(op::matrix_mul(x, op::matrix_transpose(*half_weight_)))
+        : Tensor(op::matrix_mul(x, op::matrix_transpose(weight_)));
     Tensor y2 = y1 + bias_;
     return y2;
 }
@@ -33,14 +34,22 @@ ParamsDict Linear::parameters(void) {
     };
 }
 
+void Linear::mixed_precision(bool enable, HalfType type) {
+    if(enable)
+        half_weight_ = Alloc::unique_construct<HalfTensor>(weight_, type);
+    else
+        half_weight_.reset();
+}
+
 LinearWithReLU::LinearWithReLU(index_t in_features, index_t out_features)
         : Linear(in_features, out_features)
     {}
 
 Tensor LinearWithReLU::forward(const Tensor& x) {
-    Tensor y1 = op::matrix_mul(
-        x, op::matrix_transpose(weight_)
-    );
+    if(half_weight_) half_weight_->sync();
+    Tensor y1 = half_weight_
+        ? Tensor(op::matrix_mul(x, op::matrix_transpose(*half_weight_)))
+        : Tensor(op::matrix_mul(x, op::matrix_transpose(weight_)));
     Tensor y2 = op::relu(y1 + bias_);
     return y2;
 }
@@ -63,13 +72,15 @@ Conv2d::Conv2d(index_t in_channels, index_t out_channels,
 }
 
 Tensor Conv2d::forward(const Tensor& x) {
+    // matrix_mul materializes col_exp, see exp/materialize.h.
     auto col_exp = op::img2col(
         x, kernel_size_, stride_, padding_
     );
 
-    Tensor y1 = op::matrix_mul(
-        Tensor(col_exp), op::matrix_transpose(weight_)
-    );
+    if(half_weight_) half_weight_->sync();
+    Tensor y1 = half_weight_
+        ? Tensor(op::matrix_mul(col_exp, op::matrix_transpose(*half_weight_)))
+        : Tensor(op::matrix_mul(col_exp, op::matrix_transpose(weight_)));
 
     auto&& conv_feat_size = col_exp.impl().conv_feat_size();
     Tensor y2 = y1.view({
@@ -83,6 +94,13 @@ ParamsDict Conv2d::parameters(void) {
     return {{"weight", weight_}};
 }
 
+void Conv2d::mixed_precision(bool enable, HalfType type) {
+    if(enable)
+        half_weight_ = Alloc::unique_construct<HalfTensor>(weight_, type);
+    else
+        half_weight_.reset();
+}
+
 Conv2dWithReLU::Conv2dWithReLU(index_t in_channels, index_t out_channels,
                                const Wsize& kernel_size, const Wsize& stride,
                                const Wsize& padding)
@@ -95,9 +113,10 @@ Tensor Conv2dWithReLU::forward(const Tensor& x) {
         x, kernel_size_, stride_, padding_
     );
 
-    Tensor y1 = op::relu(op::matrix_mul(
-        Tensor(col_exp), op::matrix_transpose(weight_)
-    ));
+    if(half_weight_) half_weight_->sync();
+    Tensor y1 = half_weight_
+        ? Tensor(op::relu(op::matrix_mul(col_exp, op::matrix_transpose(*half_weight_))))
+        : Tensor(op::relu(op::matrix_mul(col_exp, op::matrix_transpose(weight_))));
 
     auto& conv_feat_size = col_exp.impl().conv_feat_size();
     Tensor y2 = y1.view({
@@ -148,5 +167,13 @@ Tensor CrossEntropy::forward(const Tensor& input,
     Tensor loss = op::mean(nll, 0);
     return loss;
 }
+
+Tensor CrossEntropy::forward(const Tensor& input,
+                             const std::shared_ptr<index_t>& labels) {
+    auto logits = op::log_softmax(input);
+    auto nll = op::nll_loss(logits, labels);
+    Tensor loss = op::mean(nll, 0);
+    return loss;
+}
 }  // namespace nn
 }  // namespace st
\ No newline at end of file
@@ -4,11 +4,13 @@
 #include "tensor/tensor.h"
 #include "tensor/tensor_impl.h"
 #include "nn/optim.h"
+#include "nn/data_parallel.h"
 
 namespace st {
 namespace nn {
 
-OptimizerBase::OptimizerBase(const ParamsDict& params_dict) {
+OptimizerBase::OptimizerBase(const ParamsDict& params_dict)
+        : parallel_(nullptr) {
     params_.reserve(params_dict.size());
     for(auto named_param_ref: params_dict) {
         Tensor& tensor = named_param_ref.second.get();
@@ -26,11 +28,17 @@ void OptimizerBase::zero_grad(void) {
     }
 }
 
+void OptimizerBase::synchronize_grads(void) {
+    if(parallel_)
+        parallel_->synchronize();
+}
+
 SGD::SGD(const ParamsDict& params_dict, data_t lr)
         : OptimizerBase(params_dict), lr_(lr)
     {}
 
 void SGD::step(void) {
+    synchronize_grads();
     for(TensorImpl& t : params_) {
         data_t* storage_dptr = get_storage(t);
         data_t* grad_dptr = get_grad(t);
@@ -38,6 +46,7 @@ void SGD::step(void) {
 
         for(index_t i = 0; i < dsize; ++i)
             storage_dptr[i] -= lr_ * grad_dptr[i];
+        increment_version(t);
     }
 }
 
@@ -56,6 +65,7 @@ SGDwithMomentum::SGDwithMomentum(const ParamsDict& params_dict,
 }
 
 void SGDwithMomentum::step(void) {
+    synchronize_grads();
     if(first_step_) {
         first_step_ = false;
         for(index_t i = 0; i < params_.size(); ++i) {
@@ -68,6 +78,7 @@ void SGDwithMomentum::step(void) {
             std::memcpy(vx, grad_dptr, dsize * sizeof(data_t));
             for(index_t j = 0; j < dsize; ++j)
                 storage_dptr[j] -= lr_ * vx[j];
+            increment_version(t);
         }
     } else {
         for(index_t i = 0; i < params_.size(); ++i) {
@@ -81,6 +92,7 @@ void SGDwithMomentum::step(void) {
                 vx[j] = momentum_ * vx[j] + grad_dptr[j];
                 storage_dptr[j] -= lr_ * vx[j];
             }
+            increment_version(t);
         }
     }
 }
@@ -0,0 +1,361 @@
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+#include <tuple>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+#include "nn/quantize.h"
+#include "data/data.h"
+#include "utils/grad_mode.h"
+
+namespace st {
+namespace nn {
+
+static constexpr data_t kQMax = 127;
+
+inline int8_t __saturate_round(data_t value) {
+    value = std::min(std::max(value, -kQMax), kQMax);
+    return static_cast<int8_t>(value >= 0 ? value + 0.5 : value - 0.5);
+}
+
+inline data_t __scale_of(data_t absmax) {
+    return absmax > 0 ? absmax / kQMax : 1;
+}
+
+inline int32_t __dot_s8(const int8_t* a, const int8_t* b, index_t k) {
+    index_t p = 0;
+    int32_t acc = 0;
+#ifdef __AVX2__
+    __m256i vacc = _mm256_setzero_si256();
+    for(; p + 16 <= k; p += 16) {
+        __m256i va = _mm256_cvtepi8_epi16(
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + p)));
+        __m256i vb = _mm256_cvtepi8_epi16(
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + p)));
+        vacc = _mm256_add_epi32(vacc, _mm256_madd_epi16(va, vb));
+    }
+    __m128i v = _mm_add_epi32(_mm256_castsi256_si128(vacc),
+                              _mm256_extracti128_si256(vacc, 1));
+    v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+    v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)));
+    acc = _mm_cvtsi128_si32(v);
+#endif
+    for(; p < k; ++p)
+        acc += static_cast<int32_t>(a[p]) * static_cast<int32_t>(b[p]);
+    return acc;
+}
+
+// c[i, j] = a[i, :] . b[j, :], and epilogue(i, j, c[i, j]) is called right after
+// c[i, j] is computed. The int32 result never goes to memory.
+template<typename Epilogue>
+void __gemm_s8s8s32(index_t m, index_t n, index_t k, const int8_t* a,
+                    const int8_t* b, Epilogue& epilogue) {
+    // Block on the rows of b so that they stay in cache while a row of a
+    // streams over them.
+    constexpr index_t block_n = 64;
+    for(index_t j0 = 0; j0 < n; j0 += block_n) {
+        index_t j1 = std::min(n, j0 + block_n);
+        for(index_t i = 0; i < m; ++i) {
+            const int8_t* a_row = a + i * k;
+            for(index_t j = j0; j < j1; ++j)
+                epilogue(i, j, __dot_s8(a_row, b + j * k, k));
+        }
+    }
+}
+
+// acc * input_scale * weight_scale[j] + bias[j], then relu.
+struct __DequantEpilogue {
+    data_t input_scale;
+    const data_t* weight_scale;
+    const data_t* bias;
+    bool relu;
+
+    data_t operator()(index_t j, int32_t acc) const {
+        data_t value = acc * input_scale * weight_scale[j];
+        if(bias) value += bias[j];
+        if(relu) value = std::max(value, 0.);
+        return value;
+    }
+};
+
+QTensor::QTensor(const Shape& shape, data_t scale)
+        : shape_(shape), scale_(scale),
+          data_(Alloc::unique_allocate<int8_t>(shape.dsize() * sizeof(int8_t)))
+    {}
+
+Tensor QTensor::dequantize(void) const {
+    index_t dsize = shape_.dsize();
+    auto buffer = Alloc::unique_allocate<data_t>(dsize * sizeof(data_t));
+    for(index_t i = 0; i < dsize; ++i)
+        buffer.get()[i] = data_.get()[i] * scale_;
+    return Tensor(buffer.get(), shape_);
+}
+
+static data_t __absmax(const Tensor& t) {
+    if(!t.is_contiguous()) {
+        Tensor copy(t.size());
+        copy = t;
+        return __absmax(copy);
+    }
+    const TensorImpl& impl = t.impl();
+    data_t absmax = 0;
+    for(index_t i = 0; i < impl.size().dsize(); ++i)
+        absmax = std::max(absmax, std::abs(impl.eval(i)));
+    return absmax;
+}
+
+QTensor QuantizedModule::quantize(const Tensor& input) const {
+    CHECK_TRUE(!calibrating_, "Call freeze() before running in int8.");
+    if(!input.is_contiguous()) {
+        Tensor copy(input.size());
+        copy = input;
+        return quantize(copy);
+    }
+
+    QTensor q(input.size(), input_scale_);
+    const data_t* src = get_storage(input.impl());
+    int8_t* dist = q.data_.get();
+    data_t inv_scale = 1 / input_scale_;
+    index_t dsize = input.size().dsize();
+    for(index_t i = 0; i < dsize; ++i)
+        dist[i] = __saturate_round(src[i] * inv_scale);
+    return q;
+}
+
+void QuantizedModule::observe(const Tensor& input, const Tensor& output) {
+    input_absmax_ = std::max(input_absmax_, __absmax(input));
+    output_absmax_ = std::max(output_absmax_, __absmax(output));
+}
+
+void QuantizedModule::quantize_weight(TensorImpl& weight, index_t n_channels) {
+    n_channels_ = n_channels;
+    channel_size_ = weight.size().dsize() / n_channels;
+    qweight_ = Alloc::unique_allocate<int8_t>(
+        n_channels_ * channel_size_ * sizeof(int8_t));
+    weight_scale_ = Alloc::unique_allocate<data_t>(n_channels_ * sizeof(data_t));
+
+    const data_t* w = get_storage(weight);
+    for(index_t c = 0; c < n_channels_; ++c) {
+        const data_t* w_row = w + c * channel_size_;
+        data_t absmax = 0;
+        for(index_t i = 0; i < channel_size_; ++i)
+            absmax = std::max(absmax, std::abs(w_row[i]));
+
+        data_t scale = __scale_of(absmax);
+        weight_scale_.get()[c] = scale;
+        int8_t* q_row = qweight_.get() + c * channel_size_;
+        for(index_t i = 0; i < channel_size_; ++i)
+            q_row[i] = __saturate_round(w_row[i] / scale);
+    }
+
+    input_scale_ = __scale_of(input_absmax_);
+    output_scale_ = __scale_of(output_absmax_);
+    calibrating_ = false;
+}
+
+QuantizedLinear::QuantizedLinear(Linear& linear)
+        : linear_(linear),
+          relu_(dynamic_cast<LinearWithReLU*>(&linear) != nullptr)
+    {}
+
+void QuantizedLinear::freeze(void) {
+    TensorImpl& weight = const_cast<TensorImpl&>(linear_.weight_.impl());
+    TensorImpl& bias = const_cast<TensorImpl&>(linear_.bias_.impl());
+    quantize_weight(weight, weight.size(0));
+
+    bias_ = Alloc::unique_allocate<data_t>(n_channels_ * sizeof(data_t));
+    std::memcpy(bias_.get(), get_storage(bias), n_channels_ * sizeof(data_t));
+}
+
+Tensor QuantizedLinear::forward(const Tensor& input) {
+    Tensor output = calibrating_ ? linear_.forward(input) : forward_int8(input);
+    if(calibrating_)
+        observe(input, output);
+    return output;
+}
+
+Tensor QuantizedLinear::forward_int8(const Tensor& input) {
+
+    QTensor x = quantize(input);
+    index_t n_batch = x.shape_[0];
+    Tensor output(Shape{n_batch, n_channels_});
+    data_t* y = get_storage(const_cast<TensorImpl&>(output.impl()));
+
+    struct {
+        __DequantEpilogue dequant;
+        data_t* y;
+        index_t n;
+        void operator()(index_t i, index_t j, int32_t acc) {
+            y[i * n + j] = dequant(j, acc);
+        }
+    } epilogue{{x.scale_, weight_scale_.get(), bias_.get(), relu_}, y, n_channels_};
+
+    __gemm_s8s8s32(n_batch, n_channels_, channel_size_,
+                   x.data_.get(), qweight_.get(), epilogue);
+    return output;
+}
+
+QTensor QuantizedLinear::forward(const QTensor& input) {
+    CHECK_TRUE(!calibrating_, "Call freeze() before running in int8.");
+    CHECK_TRUE(input.shape_.ndim() == 2 && input.shape_[1] == channel_size_,
+        "Size mismatch, expect %llu features.", (unsigned long long)channel_size_);
+
+    index_t n_batch = input.shape_[0];
+    QTensor output(Shape{n_batch, n_channels_}, output_scale_);
+
+    struct {
+        __DequantEpilogue dequant;
+        data_t inv_output_scale;
+        int8_t* y;
+        index_t n;
+        void operator()(index_t i, index_t j, int32_t acc) {
+            y[i * n + j] = __saturate_round(dequant(j, acc) * inv_output_scale);
+        }
+    } epilogue{{input.scale_, weight_scale_.get(), bias_.get(), relu_},
+               1 / output_scale_, output.data_.get(), n_channels_};
+
+    __gemm_s8s8s32(n_batch, n_channels_, channel_size_,
+                   input.data_.get(), qweight_.get(), epilogue);
+    return output;
+}
+
+QuantizedConv2d::QuantizedConv2d(Conv2d& conv)
+        : conv_(conv),
+          relu_(dynamic_cast<Conv2dWithReLU*>(&conv) != nullptr)
+    {}
+
+void QuantizedConv2d::freeze(void) {
+    TensorImpl& weight = const_cast<TensorImpl&>(conv_.weight_.impl());
+    quantize_weight(weight, conv_.out_channels_);
+}
+
+void QuantizedConv2d::img2col(const QTensor& input, int8_t* col) const {
+    index_t n_batch = input.shape_[0];
+    index_t c = input.shape_[1];
+    index_t h = input.shape_[2];
+    index_t w = input.shape_[3];
+    index_t kh = conv_.kernel_size_.first, kw = conv_.kernel_size_.second;
+    index_t sh = conv_.stride_.first, sw = conv_.stride_.second;
+    index_t ph = conv_.padding_.first, pw = conv_.padding_.second;
+    index_t oh = (h + 2*ph - kh) / sh + 1;
+    index_t ow = (w + 2*pw - kw) / sw + 1;
+    const int8_t* x = input.data_.get();
+
+    for(index_t b = 0; b < n_batch; ++b)
+    for(index_t i = 0; i < oh; ++i)
+    for(index_t j = 0; j < ow; ++j) {
+        for(index_t ci = 0; ci < c; ++ci) {
+            const int8_t* x_plane = x + (b * c + ci) * h * w;
+            for(index_t ki = 0; ki < kh; ++ki) {
+                // index_t is unsigned, so compare before substracting padding
+                index_t hi = i * sh + ki;
+                bool h_valid = hi >= ph && hi < h + ph;
+                for(index_t kj = 0; kj < kw; ++kj) {
+                    index_t wj = j * sw + kj;
+                    bool valid = h_valid && wj >= pw && wj < w + pw;
+                    *col++ = valid ? x_plane[(hi - ph) * w + wj - pw] : 0;
+                }
+            }
+        }
+    }
+}
+
+Tensor QuantizedConv2d::forward(const Tensor& input) {
+    Tensor output = calibrating_ ? conv_.forward(input) : forward_int8(input);
+    if(calibrating_)
+        observe(input, output);
+    return output;
+}
+
+Tensor QuantizedConv2d::forward_int8(const Tensor& input) {
+    QTensor x = quantize(input);
+    index_t n_batch = x.shape_[0];
+    index_t oh = (x.shape_[2] + 2*conv_.padding_.first - conv_.kernel_size_.first)
+                 / conv_.stride_.first + 1;
+    index_t ow = (x.shape_[3] + 2*conv_.padding_.second - conv_.kernel_size_.second)
+                 / conv_.stride_.second + 1;
+    index_t n_rows = checked_mul(checked_mul(n_batch, oh), ow);
+
+    auto col_ptr = Alloc::unique_allocate<int8_t>(checked_mul(n_rows, channel_size_));
+    img2col(x, col_ptr.get());
+
+    Tensor output(Shape{n_batch, n_channels_, oh, ow});
+    data_t* y = get_storage(const_cast<TensorImpl&>(output.impl()));
+
+    // Row r of the GEMM is output pixel (b, :, h, w) with r = b*oh*ow + h*ow + w,
+    // so the epilogue writes NCHW directly.
+    struct {
+        __DequantEpilogue dequant;
+        data_t* y;
+        index_t plane, n_channels;
+        void operator()(index_t r, index_t o, int32_t acc) {
+            index_t b = r / plane, p = r % plane;
+            y[(b * n_channels + o) * plane + p] = dequant(o, acc);
+        }
+    } epilogue{{x.scale_, weight_scale_.get(), nullptr, relu_}, y, oh * ow, n_channels_};
+
+    __gemm_s8s8s32(n_rows, n_channels_, channel_size_,
+                   col_ptr.get(), qweight_.get(), epilogue);
+    return output;
+}
+
+QTensor QuantizedConv2d::forward(const QTensor& input) {
+    CHECK_TRUE(!calibrating_, "Call freeze() before running in int8.");
+    CHECK_TRUE(input.shape_.ndim() == 4 && input.shape_[1] == conv_.in_channels_,
+        "Size mismatch, expect %llu channels.",
+        (unsigned long long)conv_.in_channels_);
+
+    index_t n_batch = input.shape_[0];
+    index_t oh = (input.shape_[2] + 2*conv_.padding_.first - conv_.kernel_size_.first)
+                 / conv_.stride_.first + 1;
+    index_t ow = (input.shape_[3] + 2*conv_.padding_.second - conv_.kernel_size_.second)
+                 / conv_.stride_.second + 1;
+    index_t n_rows = checked_mul(checked_mul(n_batch, oh), ow);
+
+    auto col_ptr = Alloc::unique_allocate<int8_t>(checked_mul(n_rows, channel_size_));
+    img2col(input, col_ptr.get());
+
+    QTensor output(Shape{n_batch, n_channels_, oh, ow}, output_scale_);
+    struct {
+        __DequantEpilogue dequant;
+        data_t inv_output_scale;
+        int8_t* y;
+        index_t plane, n_channels;
+        void operator()(index_t r, index_t o, int32_t acc) {
+            index_t b = r / plane, p = r % plane;
+            y[(b * n_channels + o) * plane + p] =
+                __saturate_round(dequant(o, acc) * inv_output_scale);
+        }
+    } epilogue{{input.scale_, weight_scale_.get(), nullptr, relu_},
+               1 / output_scale_, output.data_.get(), oh * ow, n_channels_};
+
+    __gemm_s8s8s32(n_rows, n_channels_, channel_size_,
+                   col_ptr.get(), qweight_.get(), epilogue);
+    return output;
+}
+
+void calibrate(Module& model, const data::DatasetBase& dataset,
+               const Shape& sample_shape, index_t n_batchs) {
+    n_batchs = std::min(n_batchs, dataset.n_batchs());
+    NoGradGuard no_grad;
+
+    index_t n_samples;
+    const data_t* batch_samples;
+    const index_t* batch_labels;
+    for(index_t i = 0; i < n_batchs; ++i) {
+        std::tie(n_samples, batch_samples, batch_labels) = dataset.get_batch(i);
+
+        IndexArray dims(sample_shape.ndim() + 1);
+        dims[0] = n_samples;
+        for(index_t j = 0; j < sample_shape.ndim(); ++j)
+            dims[j + 1] = sample_shape[j];
+        Tensor input(batch_samples, Shape(std::move(dims)));
+        model.forward(input);
+    }
+}
+
+}  // namespace nn
+}  // namespace st
@@ -0,0 +1,133 @@
+#include <memory>
+
+#include "tensor/grad_engine.h"
+#include "tensor/tensor_impl.h"
+
+namespace st {
+
+static thread_local GradEngine* current_engine = nullptr;
+
+// Workers of the pool used by backward. The thread calling backward is one of
+// the threads, so there are n_threads - 1 workers. The pool lives until the
+// program exits, so it doesn't come from Alloc.
+static index_t n_backward_threads = 1;
+static std::unique_ptr<ThreadPool> backward_pool;
+
+GradEngine::GradEngine(bool retain_graph, bool check_version)
+        : n_executed_(0), 
+          prev_engine_(current_engine),
+          retain_graph_(retain_graph),
+          check_version_(check_version),
+          pool_(backward_pool.get()),
+          prev_pool_(nullptr),
+          task_group_(nullptr) {
+    current_engine = this;
+    if(pool_) {
+        task_group_ = Alloc::unique_construct<TaskGroup>(*pool_);
+        prev_pool_ = ThreadPool::set_current(pool_);
+    }
+}
+
+GradEngine::~GradEngine() {
+    if(pool_) {
+        // Tasks refer to this engine. If backward failed before run(),
+        // wait for them anyway.
+        try {
+            task_group_->wait();
+        } catch(...) {}
+        ThreadPool::set_current(prev_pool_);
+    }
+    current_engine = prev_engine_;
+}
+
+void GradEngine::run(void) {
+    if(pool_) {
+        task_group_->wait();
+    } else {
+        while(!ready_queue_.empty()) {
+            NodePtr node = std::move(ready_queue_.front());
+            ready_queue_.pop();
+            execute(node);
+        }
+    }
+    if(retain_graph_)
+        restore_gradcounts();
+}
+
+void GradEngine::execute(const NodePtr& node) {
+    TensorImpl* impl = (*node).operator->();
+    impl->apply_grad_fn();
+    // The gradient of a retained node has been passed on. Clear it, or it
+    // would be passed on again by the next backward.
+    if(retain_graph_)
+        impl->clear_grad();
+    else
+        impl->release_grad_fn();
+    ++n_executed_;
+}
+
+void GradEngine::restore_gradcounts(void) {
+    // The graph is kept, so all of the counters are still alive.
+    for(std::atomic<index_t>* gradcount : decreased_gradcounts_)
+        ++ *gradcount;
+    decreased_gradcounts_.clear();
+}
+
+void GradEngine::schedule(TensorImpl* node) {
+    GradEngine* engine = current_engine;
+    if(!engine) {
+        node->apply_grad_fn();
+        return;
+    }
+    NodePtr node_ptr = Alloc::shared_construct<ExpImplPtr<TensorImpl>>(*node, false);
+    if(engine->pool_) {
+        engine->task_group_->run([engine, node_ptr]() {
+            // Nodes made ready by this one are scheduled to the same engine.
+            GradEngine* prev_engine = current_engine;
+            current_engine = engine;
+            try {
+                engine->execute(node_ptr);
+            } catch(...) {
+                current_engine = prev_engine;
+                throw;
+            }
+            current_engine = prev_engine;
+        });
+    } else {
+        engine->ready_queue_.push(std::move(node_ptr));
+    }
+}
+
+GradEngine* GradEngine::current(void) {
+    return current_engine;
+}
+
+bool GradEngine::checks_version(void) {
+    return !current_engine || current_engine->check_version_;
+}
+
+void GradEngine::on_gradcount_decreased(std::atomic<index_t>& gradcount) {
+    GradEngine* engine = current_engine;
+    if(!engine || !engine->retain_graph_)
+        return;
+    std::lock_guard<std::mutex> guard(engine->decreased_mutex_);
+    engine->decreased_gradcounts_.push_back(&gradcount);
+}
+
+void GradEngine::set_num_threads(index_t n_threads) {
+    CHECK_TRUE(current_engine == nullptr, 
+        "Can't change the number of threads during backward.");
+    CHECK_TRUE(n_threads > 0, "Number of threads should be positive.");
+    if(n_threads == n_backward_threads)
+        return;
+    backward_pool.reset();
+    if(n_threads > 1)
+        backward_pool.reset(new ThreadPool(n_threads - 1));
+    n_backward_threads = n_threads;
+}
+
+index_t GradEngine::num_threads(void) {
+    return n_backward_threads;
+}
+
+}  // namespace st
@@ -0,0 +1,83 @@
+#include <algorithm>
+
+#include "tensor/half_tensor.h"
+#include "tensor/grad_meta.h"
+#include "tensor/static_graph.h"
+
+namespace st {
+
+constexpr index_t HalfTensorImpl::kChunkSize;
+
+HalfStorage::HalfStorage(index_t size, HalfType type)
+        : bptr_(Alloc::shared_allocate<half_t>(checked_mul(size, sizeof(half_t)))),
+          dptr_(bptr_.get()),
+          type_(type) {}
+
+HalfTensorImpl::HalfTensorImpl(const Shape& shape, HalfType type)
+        : storage_(shape.dsize(), type),
+          shape_(shape),
+          stride_(shape_.ndim()),
+          master_ptr_(nullptr),
+          synced_version_(0) {
+    // if shape_[i] == 1, set stride_[i] = 0. For broadcasting operatoion.
+    for(index_t i = 0; i < stride_.size(); ++i)
+        stride_[i] = shape_[i] == 1 ? 0 : shape_.subsize(i + 1);
+}
+
+HalfTensorImpl::HalfTensorImpl(const TensorImpl& master, HalfType type)
+        : HalfTensorImpl(master.size(), type) {
+    CHECK_TRUE(master.is_contiguous(),
+        "Only contiguous Tensor can be the master of HalfTensor.");
+    master_ptr_ = Alloc::unique_construct<ExpImplPtr<TensorImpl>>(master, false);
+    // make sure the first sync() does convert the data
+    synced_version_ = master.version() + 1;
+    sync();
+}
+
+void HalfTensorImpl::sync(void) {
+    if(!master_ptr_) return;
+    if(StaticGraph::is_capturing()) {
+        auto self_ptr = Alloc::shared_construct<ExpImplPtr<HalfTensorImpl>>(*this, false);
+        StaticGraph::record([self_ptr]() {
+            const_cast<HalfTensorImpl&>(**self_ptr).sync();
+        });
+    }
+    const TensorImpl& master = **master_ptr_;
+    if(master.version() == synced_version_) return;
+
+    data_t chunk[kChunkSize];
+    index_t dsize = shape_.dsize();
+    for(index_t start = 0; start < dsize; start += kChunkSize) {
+        index_t n = std::min(kChunkSize, dsize - start);
+        for(index_t k = 0; k < n; ++k)
+            chunk[k] = master.eval(start + k);
+        half::to_half(type(), chunk, storage_.data() + start, n);
+    }
+    synced_version_ = master.version();
+}
+
+std::ostream& operator<<(std::ostream& out, const HalfTensorImpl& t) {
+    TensorImpl copy(t.size());
+    copy = t;
+    return out << copy;
+}
+
+HalfTensor::HalfTensor(const Shape& shape, HalfType type)
+        : Exp<HalfTensorImpl>(
+            Alloc::unique_construct<HalfTensorImpl>(shape, type))
+    {}
+
+HalfTensor::HalfTensor(const Tensor& master, HalfType type)
+        : Exp<HalfTensorImpl>(
+            Alloc::unique_construct<HalfTensorImpl>(master.impl(), type))
+    {}
+
+HalfTensor::HalfTensor(Alloc::NontrivialUniquePtr<HalfTensorImpl>&& ptr)
+        : Exp<HalfTensorImpl>(std::move(ptr))
+    {}
+
+std::ostream& operator<<(std::ostream& out, const HalfTensor& t) {
+    return out << t.impl();
+}
+
+}  // namespace st
@@ -0,0 +1,241 @@
+#include <algorithm>
+#include <cstddef>
+#include <mutex>
+#include <vector>
+
+#include "tensor/memory_planner.h"
+#include "utils/allocator.h"
+#include "utils/exception.h"
+
+namespace st {
+
+namespace {
+
+constexpr index_t kAlignment = alignof(std::max_align_t);
+constexpr index_t kNever = static_cast<index_t>(-1);
+
+index_t align_up(index_t nbytes) {
+    return (nbytes + kAlignment - 1) / kAlignment * kAlignment;
+}
+
+}  // namespace
+
+struct MemoryPlanner::State {
+    enum class Mode { idle, tracing, stepping };
+
+    struct Block {
+        index_t nbytes;
+        index_t alloc_time;
+        index_t free_time;
+        index_t offset;
+        bool in_use;
+        // Blocks sharing bytes of the slab with this one.
+        std::vector<index_t> conflicts;
+    };
+
+    std::mutex mutex;
+    Mode mode = Mode::idle;
+    bool planned = false;
+
+    // trace
+    std::vector<Block> blocks;
+    index_t clock = 0;
+    index_t live_size = 0;
+    index_t traced_peak = 0;
+
+    // plan
+    std::vector<index_t> planned_ids;
+    index_t naive_size = 0;
+    index_t planned_size = 0;
+    Alloc::TrivialUniquePtr<char> slab{nullptr, Alloc::trivial_delete_handler(0)};
+
+    // step
+    index_t next_block = 0;
+    index_t n_fallbacks = 0;
+
+    void plan(void);
+    std::shared_ptr<void> trace_allocate(const std::shared_ptr<State>& self,
+                                         index_t nbytes);
+    std::shared_ptr<void> step_allocate(const std::shared_ptr<State>& self,
+                                        index_t nbytes);
+};
+
+std::shared_ptr<MemoryPlanner::State>& MemoryPlanner::active_state(void) {
+    static thread_local std::shared_ptr<State> state;
+    return state;
+}
+
+void MemoryPlanner::State::plan(void) {
+    for(index_t i = 0; i < blocks.size(); ++i) {
+        if(blocks[i].free_time == kNever)
+            continue;
+        planned_ids.push_back(i);
+        naive_size += blocks[i].nbytes;
+    }
+
+    // Place the largest blocks first.
+    std::vector<index_t> order(planned_ids);
+    std::stable_sort(order.begin(), order.end(), [this](index_t a, index_t b) {
+        return blocks[a].nbytes > blocks[b].nbytes;
+    });
+
+    std::vector<index_t> placed;
+    for(index_t id : order) {
+        Block& block = blocks[id];
+        index_t size = align_up(block.nbytes);
+
+        std::vector<index_t> alive;
+        for(index_t other : placed) {
+            const Block& b = blocks[other];
+            if(b.alloc_time < block.free_time && block.alloc_time < b.free_time)
+                alive.push_back(other);
+        }
+        std::sort(alive.begin(), alive.end(), [this](index_t a, index_t b) {
+            return blocks[a].offset < blocks[b].offset;
+        });
+
+        // The smallest gap fitting the block, or the end.
+        index_t best_offset = kNever, best_gap = kNever, end = 0;
+        for(index_t other : alive) {
+            const Block& b = blocks[other];
+            if(b.offset > end) {
+                index_t gap = b.offset - end;
+                if(gap >= size && gap < best_gap) {
+                    best_gap = gap;
+                    best_offset = end;
+                }
+            }
+            end = std::max(end, b.offset + align_up(b.nbytes));
+        }
+        block.offset = best_offset == kNever ? end : best_offset;
+        planned_size = std::max(planned_size, block.offset + size);
+        placed.push_back(id);
+    }
+
+    for(index_t i = 0; i < planned_ids.size(); ++i)
+        for(index_t j = i + 1; j < planned_ids.size(); ++j) {
+            Block& a = blocks[planned_ids[i]];
+            Block& b = blocks[planned_ids[j]];
+            if(a.offset < b.offset + b.nbytes && b.offset < a.offset + a.nbytes) {
+                a.conflicts.push_back(planned_ids[j]);
+                b.conflicts.push_back(planned_ids[i]);
+            }
+        }
+
+    if(planned_size > 0)
+        slab = Alloc::unique_allocate<char>(planned_size);
+    planned = true;
+}
+
+std::shared_ptr<void>
+MemoryPlanner::State::trace_allocate(const std::shared_ptr<State>& self,
+                                     index_t nbytes) {
+    index_t id = blocks.size();
+    blocks.push_back({nbytes, clock++, kNever, 0, false, {}});
+    live_size += nbytes;
+    traced_peak = std::max(traced_peak, live_size);
+
+    char* ptr = Alloc::unique_allocate<char>(nbytes).release();
+    Alloc::trivial_delete_handler deallocate(nbytes);
+    return std::shared_ptr<void>(ptr, [self, id, nbytes, deallocate](void* ptr) mutable {
+        {
+            std::lock_guard<std::mutex> guard(self->mutex);
+            // Blocks freed after the trace outlive the step.
+            if(self->mode == Mode::tracing) {
+                self->blocks[id].free_time = self->clock++;
+                self->live_size -= nbytes;
+            }
+        }
+        deallocate(ptr);
+    });
+}
+
+std::shared_ptr<void>
+MemoryPlanner::State::step_allocate(const std::shared_ptr<State>& self,
+                                    index_t nbytes) {
+    if(next_block == blocks.size()) {
+        ++n_fallbacks;
+        return nullptr;
+    }
+    index_t id = next_block++;
+    Block& block = blocks[id];
+    if(block.free_time == kNever)
+        return nullptr;
+
+    bool usable = block.nbytes == nbytes && !block.in_use;
+    for(index_t other : block.conflicts)
+        usable = usable && !blocks[other].in_use;
+    if(!usable) {
+        ++n_fallbacks;
+        return nullptr;
+    }
+
+    block.in_use = true;
+    return std::shared_ptr<void>(slab.get() + block.offset, [self, id](void* ptr) {
+        std::lock_guard<std::mutex> guard(self->mutex);
+        self->blocks[id].in_use = false;
+    });
+}
+
+MemoryPlanner::MemoryPlanner()
+        : state_(std::make_shared<State>()) {}
+
+MemoryPlanner::~MemoryPlanner() {
+    if(active_state() == state_)
+        active_state().reset();
+}
+
+void MemoryPlanner::begin_trace(void) {
+    CHECK_TRUE(!active_state(), "Another MemoryPlanner is active on this thread.");
+    CHECK_TRUE(!state_->planned && state_->blocks.empty(),
+        "The MemoryPlanner has traced a step.");
+    std::lock_guard<std::mutex> guard(state_->mutex);
+    state_->mode = State::Mode::tracing;
+    active_state() = state_;
+}
+
+void MemoryPlanner::end_trace(void) {
+    CHECK_TRUE(state_->mode == State::Mode::tracing,
+        "The MemoryPlanner isn't tracing.");
+    std::lock_guard<std::mutex> guard(state_->mutex);
+    state_->mode = State::Mode::idle;
+    active_state().reset();
+    state_->plan();
+}
+
+void MemoryPlanner::begin_step(void) {
+    CHECK_TRUE(!active_state(), "Another MemoryPlanner is active on this thread.");
+    CHECK_TRUE(state_->planned, "The MemoryPlanner hasn't traced a step.");
+    std::lock_guard<std::mutex> guard(state_->mutex);
+    state_->mode = State::Mode::stepping;
+    state_->next_block = 0;
+    state_->n_fallbacks = 0;
+    active_state() = state_;
+}
+
+void MemoryPlanner::end_step(void) {
+    CHECK_TRUE(state_->mode == State::Mode::stepping,
+        "The MemoryPlanner isn't in a step.");
+    std::lock_guard<std::mutex> guard(state_->mutex);
+    state_->mode = State::Mode::idle;
+    active_state().reset();
+}
+
+bool MemoryPlanner::planned(void) const { return state_->planned; }
+index_t MemoryPlanner::n_blocks(void) const { return state_->planned_ids.size(); }
+index_t MemoryPlanner::naive_size(void) const { return state_->naive_size; }
+index_t MemoryPlanner::traced_peak(void) const { return state_->traced_peak; }
+index_t MemoryPlanner::planned_size(void) const { return state_->planned_size; }
+index_t MemoryPlanner::n_fallbacks(void) const { return state_->n_fallbacks; }
+
+std::shared_ptr<void> MemoryPlanner::allocate(index_t nbytes) {
+    std::shared_ptr<State> state = active_state();
+    if(!state)
+        return nullptr;
+    std::lock_guard<std::mutex> guard(state->mutex);
+    if(state->mode == State::Mode::tracing)
+        return state->trace_allocate(state, nbytes);
+    return state->step_allocate(state, nbytes);
+}
+
+}  // namespace st
@@ -1,4 +1,5 @@
 #include "tensor/shape.h"
+#include "utils/exception.h"
 
 namespace st {
 
@@ -17,16 +18,16 @@ Shape::Shape(index_t* dims, index_t dim_) : dims_(dims, dim_) {}
 Shape::Shape(IndexArray&& shape) : dims_(std::move(shape)) {}
 
 index_t Shape::dsize() const {
-    int res = 1;
-    for(int i = 0; i < dims_.size(); ++i)
-        res *= dims_[i];
+    index_t res = 1;
+    for(index_t i = 0; i < dims_.size(); ++i)
+        res = checked_mul(res, dims_[i]);
     return res;
 }
 
 index_t Shape::subsize(index_t start_dim, index_t end_dim) const {
-    int res = 1;
+    index_t res = 1;
     for(; start_dim < end_dim; ++start_dim)
-        res *= dims_[start_dim];
+        res = checked_mul(res, dims_[start_dim]);
     return res;
 }
 
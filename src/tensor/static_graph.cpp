@@ -0,0 +1,69 @@
+#include <cstring>
+
+#include "tensor/static_graph.h"
+#include "tensor/tensor.h"
+#include "tensor/grad_engine.h"
+
+namespace st {
+
+static thread_local StaticGraph* capturing_graph = nullptr;
+
+StaticGraph::StaticGraph() : loss_ptr_(nullptr), capturing_(false) {}
+
+StaticGraph::~StaticGraph() {
+    if(capturing_)
+        capturing_graph = nullptr;
+}
+
+void StaticGraph::begin_capture(void) {
+    CHECK_TRUE(capturing_graph == nullptr,
+        "Another StaticGraph is capturing on this thread.");
+    CHECK_TRUE(!captured(), "The StaticGraph has been captured.");
+    capturing_graph = this;
+    capturing_ = true;
+}
+
+void StaticGraph::end_capture(const Tensor& loss) {
+    CHECK_TRUE(capturing_, "The StaticGraph isn't capturing.");
+    CHECK_TRUE(loss.impl().requires_grad(),
+        "Loss of the captured step doesn't require grad.");
+    capturing_graph = nullptr;
+    capturing_ = false;
+    loss_ptr_ = Alloc::unique_construct<ExpImplPtr<TensorImpl>>(loss.impl(), false);
+}
+
+void StaticGraph::feed(const Tensor& placeholder, const data_t* data) {
+    TensorImpl& impl = const_cast<TensorImpl&>(placeholder.impl());
+    CHECK_TRUE(impl.is_contiguous(), "Placeholder should be contiguous.");
+    std::memcpy(&impl.storage_[0], data, impl.shape_.dsize() * sizeof(data_t));
+}
+
+void StaticGraph::replay(void) {
+    CHECK_TRUE(captured(), "The StaticGraph hasn't been captured.");
+    for(Kernel& kernel : kernels_)
+        kernel();
+}
+
+void StaticGraph::backward(void) {
+    CHECK_TRUE(captured(), "The StaticGraph hasn't been captured.");
+    // Parameters have been updated in place since the capture, but the
+    // kernels have run again with them.
+    GradEngine engine(/*retain_graph=*/true, /*check_version=*/false);
+    loss_ptr_->invoke_backward(
+        UnaryGradImpl<op::Constant, void, data_t>(
+            1, static_cast<IndexArray>((**loss_ptr_).size())
+        )
+    );
+    engine.run();
+}
+
+bool StaticGraph::is_capturing(void) {
+    return capturing_graph != nullptr;
+}
+
+void StaticGraph::record(Kernel&& kernel) {
+    if(capturing_graph)
+        capturing_graph->kernels_.push_back(std::move(kernel));
+}
+
+}  // namespace st
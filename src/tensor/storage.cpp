@@ -1,18 +1,33 @@
 #include <cstring>
+#include <cstddef>
 
 #include "tensor/storage.h"
+#include "tensor/memory_planner.h"
+#include "utils/exception.h"
 
 namespace st {
 
 Storage::Storage(index_t size)
-        : bptr_(Alloc::shared_allocate<Vdata>(size * sizeof(data_t) + sizeof(index_t))),
-          dptr_(bptr_->data_) {
+        : bptr_(allocate(checked_add(checked_mul(size, sizeof(data_t)),
+                                     offsetof(Vdata, data_)))),
+          base_(bptr_->data_),
+          dptr_(base_),
+          read_only_(false) {
     bptr_->version_ = 0;
 }
 
+std::shared_ptr<Storage::Vdata> Storage::allocate(index_t nbytes) {
+    std::shared_ptr<void> planned = MemoryPlanner::allocate(nbytes);
+    if(planned)
+        return std::static_pointer_cast<Vdata>(planned);
+    return Alloc::shared_allocate<Vdata>(nbytes);
+}
+
 Storage::Storage(const Storage& other, index_t offset)
         : bptr_(other.bptr_),
-          dptr_(other.dptr_ + offset) {}
+          base_(other.base_),
+          dptr_(other.dptr_ + offset),
+          read_only_(other.read_only_) {}
 
 Storage::Storage(index_t size, data_t value)
         : Storage(size) {
@@ -24,4 +39,39 @@ Storage::Storage(const data_t* data, index_t size)
     std::memcpy(dptr_, data, size * sizeof(data_t));
 }
 
+Storage Storage::borrow(data_t* data, index_t size,
+                        std::function<void(void)> release) {
+    return Storage(data, size, std::move(release), false);
+}
+
+Storage Storage::borrow_read_only(const data_t* data, index_t size,
+                                  std::function<void(void)> release) {
+    // The elements are never written through the storage, see read_only_.
+    return Storage(const_cast<data_t*>(data), size, std::move(release), true);
+}
+
+Storage::Storage(data_t* data, index_t size,
+                 std::function<void(void)> release, bool read_only)
+        : base_(data), dptr_(base_), read_only_(read_only) {
+    CHECK_TRUE(data || size == 0, "Can't borrow %llu elements at nullptr.",
+               (unsigned long long)size);
+    // The borrowed elements must be addressable as the allocated ones are.
+    checked_mul(size, sizeof(data_t));
+    // Only the version is allocated. The deleter keeps the header alive and
+    // frees it after calling release.
+    std::shared_ptr<Vdata> header = Alloc::shared_allocate<Vdata>(sizeof(Vdata));
+    header->version_ = 0;
+    Vdata* raw_ptr = header.get();
+    bptr_ = std::shared_ptr<Vdata>(raw_ptr, [header, release](Vdata*) {
+        if(release) release();
+    });
+}
+
+void Storage::swap(Storage& other) {
+    bptr_.swap(other.bptr_);
+    std::swap(base_, other.base_);
+    std::swap(dptr_, other.dptr_);
+    std::swap(read_only_, other.read_only_);
+}
+
 }  // namespace st
\ No newline at end of file
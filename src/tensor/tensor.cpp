@@ -1,5 +1,6 @@
 #include "tensor/tensor.h"
 #include "tensor/shape.h"
+#include "tensor/grad_engine.h"
 #include "exp/operator/constant.h"
 #include "exp/grad_impl.h"
 
@@ -28,6 +29,17 @@ Tensor::Tensor(const Shape& shape, bool requires_grad)
             Alloc::unique_construct<TensorImpl>(shape, requires_grad))
     {}
 
+Tensor Tensor::from_blob(data_t* data, const Shape& shape,
+                         std::function<void(void)> release) {
+    return Tensor(Storage::borrow(data, shape.dsize(), std::move(release)), shape);
+}
+
+Tensor Tensor::from_read_only_blob(const data_t* data, const Shape& shape,
+                                   std::function<void(void)> release) {
+    return Tensor(Storage::borrow_read_only(data, shape.dsize(), std::move(release)),
+                  shape);
+}
+
 Tensor::Tensor(TensorImpl&& impl)
         : Exp<TensorImpl>(
             Alloc::unique_construct<TensorImpl>(std::move(impl)))
@@ -50,12 +62,15 @@ const IndexArray& Tensor::stride(void) const { return impl_ptr_->stride(); }
 index_t Tensor::version(void) const { return impl_ptr_->version(); }
 
 bool Tensor::is_contiguous(void) const { return impl_ptr_->is_contiguous(); }
+void Tensor::rebind(const Storage& storage, index_t n_rows) {
+    impl_ptr_->rebind(storage, n_rows);
+}
 
 data_t& Tensor::operator[](std::initializer_list<index_t> ids) {
     return impl_ptr_->operator[](ids);
 };
 data_t Tensor::operator[](std::initializer_list<index_t> ids) const {
-    return impl_ptr_->operator[](ids);
+    return impl().operator[](ids);
 }
 data_t Tensor::item(void) const { return impl_ptr_->item(); }
 
@@ -85,16 +100,18 @@ Tensor Tensor::grad(void) const {
     return Tensor(impl_ptr_->grad());
 }
 
-void Tensor::backward(void) {
+void Tensor::backward(bool retain_graph) {
     CHECK_TRUE(impl_ptr_->requires_grad(),
         "Tensor doesn't require grad and doesn't have a grad_fn.");
     // CHECK_TRUE(ndim() == 1 && size(0) == 1,
     //     "Grad can be implicitly created only for scalar outputs");
+    GradEngine engine(retain_graph);
     impl_ptr_.invoke_backward(
         UnaryGradImpl<op::Constant, void, data_t>(
             1, static_cast<IndexArray>(this->size())
         )
     );
+    engine.run();
 }
 
 // friend function
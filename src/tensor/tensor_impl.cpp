@@ -17,7 +17,8 @@ TensorImpl::TensorImpl(const Storage& storage,
           shape_(shape),
           stride_(stride),
           requires_grad_(requires_grad),
-          gradmeta_ptr_(nullptr) {
+          gradmeta_ptr_(nullptr),
+          is_view_(false) {
     if(requires_grad_)
         gradmeta_ptr_ = Alloc::unique_construct<AutoGradMeta>(shape_);
 }
@@ -27,7 +28,8 @@ TensorImpl::TensorImpl(const Storage& storage, const Shape& shape, bool requires
           shape_(shape), 
           stride_(shape_.ndim()), 
           requires_grad_(requires_grad),
-          gradmeta_ptr_(nullptr) {
+          gradmeta_ptr_(nullptr),
+          is_view_(false) {
     // if shape_[i] == 1, set stride_[i] = 0. For broadcasting operatoion.
     for(int i = 0; i < stride_.size(); ++i)
         stride_[i] = shape_[i] == 1 ? 0 : shape_.subsize(i + 1);
@@ -49,11 +51,24 @@ TensorImpl::TensorImpl(Storage&& storage,
           shape_(std::move(shape)),
           stride_(std::move(stride)),
           requires_grad_(requires_grad),
-          gradmeta_ptr_(nullptr) {
+          gradmeta_ptr_(nullptr),
+          is_view_(false) {
     if(requires_grad_)
         gradmeta_ptr_ = Alloc::unique_construct<AutoGradMeta>(shape_);
 }
 
+void TensorImpl::rebind(const Storage& storage, index_t n_rows) {
+    // A gradient or a base would be left with the old shape and memory.
+    CHECK_TRUE(!requires_grad_ && !is_view_ && ndim() > 0 && is_contiguous(),
+        "Only a contiguous tensor which doesn't require grad and isn't a view "
+        "can be rebound.");
+    Storage other(storage);
+    storage_.swap(other);
+    storage_.increment_version();
+    shape_[0] = n_rows;
+    stride_[0] = n_rows == 1 ? 0 : shape_.subsize(1);
+}
+
 bool TensorImpl::is_contiguous(void) const {
     for(index_t i = 0; i < stride_.size(); i++)
         if(stride_[i] != 0 && stride_[i] != shape_.subsize(i+1))
@@ -62,13 +77,18 @@ bool TensorImpl::is_contiguous(void) const {
 }
 
 data_t& TensorImpl::operator[](std::initializer_list<index_t> inds) {
+    check_writable();
     CHECK_EQUAL(ndim(), inds.size(),
-        "Invalid %dD indices for %dD tensor", inds.size(), ndim());
+        "Invalid %lluD indices for %lluD tensor",
+        static_cast<unsigned long long>(inds.size()),
+        static_cast<unsigned long long>(ndim()));
 
     index_t offset = 0, i = 0;
     for(auto idx: inds) {
         CHECK_IN_RANGE(idx, 0, size(i),
-            "Index %d is out of bound for dimension %d with size %d", idx, i, size(i));
+            "Index %llu is out of bound for dimension %llu with size %llu",
+            static_cast<unsigned long long>(idx), static_cast<unsigned long long>(i),
+            static_cast<unsigned long long>(size(i)));
         offset += idx * stride_[i++];
     }
     storage_.increment_version();
@@ -77,12 +97,16 @@ data_t& TensorImpl::operator[](std::initializer_list<index_t> inds) {
 
 data_t TensorImpl::operator[](std::initializer_list<index_t> inds) const {
     CHECK_EQUAL(ndim(), inds.size(),
-        "Invalid %dD indices for %dD tensor", inds.size(), ndim());
+        "Invalid %lluD indices for %lluD tensor",
+        static_cast<unsigned long long>(inds.size()),
+        static_cast<unsigned long long>(ndim()));
 
     index_t offset = 0, i = 0;
     for(auto idx: inds) {
         CHECK_IN_RANGE(idx, 0, size(i),
-            "Index %d is out of bound for dimension %d with size %d", idx, i, size(i));
+            "Index %llu is out of bound for dimension %llu with size %llu",
+            static_cast<unsigned long long>(idx), static_cast<unsigned long long>(i),
+            static_cast<unsigned long long>(size(i)));
         offset += idx * stride_[i++];
     }
     return storage_[offset]; 
@@ -97,11 +121,12 @@ data_t TensorImpl::item(void) const {
 Alloc::NontrivialUniquePtr<TensorImpl>
 TensorImpl::slice(index_t idx, index_t dim) const {
     CHECK_IN_RANGE(dim, 0, ndim(),
-        "Dimension out of range (expected to be in range of [0, %d), but got %d)", 
-        ndim(), dim);
+        "Dimension out of range (expected to be in range of [0, %llu), but got %llu)", 
+        static_cast<unsigned long long>(ndim()), static_cast<unsigned long long>(dim));
     CHECK_IN_RANGE(idx, 0, size(dim),
-        "Index %d is out of bound for dimension %d with size %d", 
-        idx, dim, size(dim));
+        "Index %llu is out of bound for dimension %llu with size %llu", 
+        static_cast<unsigned long long>(idx), static_cast<unsigned long long>(dim),
+        static_cast<unsigned long long>(size(dim)));
     
     // new_dptr = dptr + idx * stride_[dim]
     index_t offset = stride_[dim] * idx;
@@ -120,13 +145,13 @@ TensorImpl::slice(index_t idx, index_t dim) const {
     auto ret_ptr = Alloc::unique_construct<TensorImpl>(
         std::move(storage), std::move(shape), std::move(stride), false
     );
-    if(requires_grad_) {
+    ret_ptr->is_view_ = true;
+    if(requires_grad_ && GradMode::is_enabled()) {
         ret_ptr->requires_grad_ = true;
         ret_ptr->gradmeta_ptr_ = Alloc::unique_construct<AutoGradMeta>(
-            gradmeta_ptr_->grad_, offset
+            *gradmeta_ptr_, offset
         );
-        ret_ptr->gradmeta_ptr_->set_from_view(true);
-        ret_ptr->gradmeta_ptr_->set_grad_fn(*this);
+        ret_ptr->gradmeta_ptr_->set_view_base(view_base());
     }
     return ret_ptr;
 }
@@ -134,14 +159,16 @@ TensorImpl::slice(index_t idx, index_t dim) const {
 Alloc::NontrivialUniquePtr<TensorImpl>
 TensorImpl::slice(index_t start_idx, index_t end_idx, index_t dim) const {
     CHECK_IN_RANGE(dim, 0, ndim(),
-        "Dimension out of range (expected to be in range of [0, %d), but got %d)",
-        ndim(), dim);
+        "Dimension out of range (expected to be in range of [0, %llu), but got %llu)",
+        static_cast<unsigned long long>(ndim()), static_cast<unsigned long long>(dim));
     CHECK_IN_RANGE(start_idx, 0, size(dim),
-        "Index %d is out of bound for dimension %d with size %d", 
-        start_idx, dim, size(dim));
+        "Index %llu is out of bound for dimension %llu with size %llu", 
+        static_cast<unsigned long long>(start_idx), static_cast<unsigned long long>(dim),
+        static_cast<unsigned long long>(size(dim)));
     CHECK_IN_RANGE(end_idx, 0, size(dim)+1,
-        "Range end %d is out of bound for dimension %d with size %d", 
-        end_idx, dim, size(dim));
+        "Range end %llu is out of bound for dimension %llu with size %llu", 
+        static_cast<unsigned long long>(end_idx), static_cast<unsigned long long>(dim),
+        static_cast<unsigned long long>(size(dim)));
 
     // new_dptr = dptr + start_idx * stride_[dim]
     index_t offset = stride_[dim] * start_idx;
@@ -155,13 +182,13 @@ TensorImpl::slice(index_t start_idx, index_t end_idx, index_t dim) const {
     auto ret_ptr =  Alloc::unique_construct<TensorImpl>(
         std::move(storage), std::move(shape), std::move(stride), false
     );
-    if(requires_grad_) {
+    ret_ptr->is_view_ = true;
+    if(requires_grad_ && GradMode::is_enabled()) {
         ret_ptr->requires_grad_ = true;
         ret_ptr->gradmeta_ptr_ = Alloc::unique_construct<AutoGradMeta>(
-            gradmeta_ptr_->grad_, offset
+            *gradmeta_ptr_, offset
         );
-        ret_ptr->gradmeta_ptr_->set_from_view(true);
-        ret_ptr->gradmeta_ptr_->set_grad_fn(*this);
+        ret_ptr->gradmeta_ptr_->set_view_base(view_base());
     }
     return ret_ptr;
 }
@@ -169,11 +196,11 @@ TensorImpl::slice(index_t start_idx, index_t end_idx, index_t dim) const {
 Alloc::NontrivialUniquePtr<TensorImpl>
 TensorImpl::transpose(index_t dim1, index_t dim2) const {
     CHECK_IN_RANGE(dim1, 0, ndim(),
-        "Dimension out of range (expected to be in range of [0, %d), but got %d)", 
-        ndim(), dim1);
+        "Dimension out of range (expected to be in range of [0, %llu), but got %llu)", 
+        static_cast<unsigned long long>(ndim()), static_cast<unsigned long long>(dim1));
     CHECK_IN_RANGE(dim2, 0, ndim(),
-        "Dimension out of range (expected to be in range of [0, %d), but got %d)", 
-        ndim(), dim2);
+        "Dimension out of range (expected to be in range of [0, %llu), but got %llu)", 
+        static_cast<unsigned long long>(ndim()), static_cast<unsigned long long>(dim2));
     
     // new_dptr = dptr
     // Exchange the value in shape_ and stride_ on #dim1 and #dim2
@@ -188,13 +215,13 @@ TensorImpl::transpose(index_t dim1, index_t dim2) const {
     auto ret_ptr = Alloc::unique_construct<TensorImpl>(
         Storage(storage_), std::move(shape), std::move(stride), false
     );
-    if(requires_grad_) {
+    ret_ptr->is_view_ = true;
+    if(requires_grad_ && GradMode::is_enabled()) {
         ret_ptr->requires_grad_ = true;
         ret_ptr->gradmeta_ptr_ = Alloc::unique_construct<AutoGradMeta>(
-            gradmeta_ptr_->grad_, 0
+            *gradmeta_ptr_, 0
         );
-        ret_ptr->gradmeta_ptr_->set_from_view(true);
-        ret_ptr->gradmeta_ptr_->set_grad_fn(*this);
+        ret_ptr->gradmeta_ptr_->set_view_base(view_base());
     }
     return ret_ptr;
 }
@@ -202,8 +229,9 @@ TensorImpl::transpose(index_t dim1, index_t dim2) const {
 Alloc::NontrivialUniquePtr<TensorImpl>
 TensorImpl::permute(std::initializer_list<index_t> dims) const {
     CHECK_EQUAL(dims.size(), ndim(),
-        "Dimension not match (expected dims of %d, but got %d)",
-        ndim(), dims.size());
+        "Dimension not match (expected dims of %llu, but got %llu)",
+        static_cast<unsigned long long>(ndim()),
+        static_cast<unsigned long long>(dims.size()));
 
     IndexArray shape(ndim());
     IndexArray stride(ndim());
@@ -216,13 +244,13 @@ TensorImpl::permute(std::initializer_list<index_t> dims) const {
     auto ret_ptr = Alloc::unique_construct<TensorImpl>(
         Storage(storage_), std::move(shape), std::move(stride), false
     );
-    if(requires_grad_) {
+    ret_ptr->is_view_ = true;
+    if(requires_grad_ && GradMode::is_enabled()) {
         ret_ptr->requires_grad_ = true;
         ret_ptr->gradmeta_ptr_ = Alloc::unique_construct<AutoGradMeta>(
-            gradmeta_ptr_->grad_, 0
+            *gradmeta_ptr_, 0
         );
-        ret_ptr->gradmeta_ptr_->set_from_view(true);
-        ret_ptr->gradmeta_ptr_->set_grad_fn(*this);
+        ret_ptr->gradmeta_ptr_->set_view_base(view_base());
     }
     return ret_ptr;
 }
@@ -232,20 +260,21 @@ TensorImpl::view(const Shape& shape) const {
     CHECK_TRUE(is_contiguous(),
         "view() is only supported to contiguous tensor");
     CHECK_EQUAL(shape.dsize(), shape_.dsize(),
-        "Shape of size %d is invalid for input tensor with size %d", 
-        shape.dsize(), shape_.dsize());
+        "Shape of size %llu is invalid for input tensor with size %llu", 
+        static_cast<unsigned long long>(shape.dsize()),
+        static_cast<unsigned long long>(shape_.dsize()));
     // new_dptr = dptr
     // Just use new shape and adjust stride.
     auto ret_ptr = Alloc::unique_construct<TensorImpl>(
         storage_, shape, false
     );
-    if(requires_grad_) {
+    ret_ptr->is_view_ = true;
+    if(requires_grad_ && GradMode::is_enabled()) {
         ret_ptr->requires_grad_ = true;
         ret_ptr->gradmeta_ptr_ = Alloc::unique_construct<AutoGradMeta>(
-            gradmeta_ptr_->grad_, 0
+            *gradmeta_ptr_, 0
         );
-        ret_ptr->gradmeta_ptr_->set_from_view(true);
-        ret_ptr->gradmeta_ptr_->set_grad_fn(*this);
+        ret_ptr->gradmeta_ptr_->set_view_base(view_base());
     }
     return ret_ptr;
 }
@@ -267,8 +296,8 @@ Alloc::NontrivialUniquePtr<TensorImpl>
 TensorImpl::unsqueeze(index_t dim) const {
     index_t new_ndim = ndim() + 1;
     CHECK_IN_RANGE(dim, 0, new_ndim,
-        "Dimension out of range (expected to be in range of [0, %d), but got %d)", 
-        new_ndim, dim);
+        "Dimension out of range (expected to be in range of [0, %llu), but got %llu)", 
+        static_cast<unsigned long long>(new_ndim), static_cast<unsigned long long>(dim));
 
     auto unsqueeze_dims_ptr = 
         Alloc::unique_allocate<index_t>(new_ndim * sizeof(index_t));
@@ -283,6 +312,17 @@ TensorImpl::unsqueeze(index_t dim) const {
     return view(Shape(unsqueeze_dims, new_ndim));
 }
 
+// A view of a view refers to their base, see exp/rewrite.h. The base is
+// alive as long as grad_fn of the view isn't released.
+const TensorImpl& TensorImpl::view_base(void) const {
+    if(gradmeta_ptr_->from_view_ && gradmeta_ptr_->grad_fn_ptr_ 
+            && gradmeta_ptr_->view_base_) {
+        Rewrite::count(Rewrite::collapse_view);
+        return *gradmeta_ptr_->view_base_;
+    }
+    return *this;
+}
+
 Alloc::NontrivialUniquePtr<TensorImpl>
 TensorImpl::grad(void) const {
     CHECK_TRUE(requires_grad_, "The tensor don't require grad.");
@@ -8,6 +8,7 @@ inline unsigned int round_up(int x) { return x == 1 ? 1 : 1 << (64 - __builtin_c
 
 index_t Alloc::allocate_memory_size;
 index_t Alloc::deallocate_memory_size;
+index_t Alloc::peak_memory_size;
 
 Alloc& Alloc::self() {
     static Alloc alloc;
@@ -15,6 +16,7 @@ Alloc& Alloc::self() {
 }
 
 void* Alloc::allocate(index_t size) {
+    std::lock_guard<std::mutex> guard(self().mutex_);
     auto iter = self().cache_.find(size);
     void* res;
     if(iter != self().cache_.end()) {
@@ -22,13 +24,17 @@ void* Alloc::allocate(index_t size) {
         self().cache_.erase(iter);
     } else {
         res = std::malloc(size);
-        CHECK_NOT_NULL(res, "failed to allocate %d memory.", size);
+        CHECK_NOT_NULL(res, "failed to allocate %llu memory.",
+                       static_cast<unsigned long long>(size));
     }
     allocate_memory_size += size;
+    if(allocate_memory_size - deallocate_memory_size > peak_memory_size)
+        peak_memory_size = allocate_memory_size - deallocate_memory_size;
     return res;
 }
 
 void Alloc::deallocate(void* ptr, index_t size) {
+    std::lock_guard<std::mutex> guard(self().mutex_);
     deallocate_memory_size += size;
     self().cache_.emplace(size, ptr);
 }
@@ -37,4 +43,19 @@ bool Alloc::all_clear() {
     return allocate_memory_size == deallocate_memory_size;
 }
 
+index_t Alloc::memory_in_use() {
+    std::lock_guard<std::mutex> guard(self().mutex_);
+    return allocate_memory_size - deallocate_memory_size;
+}
+
+index_t Alloc::peak_memory_in_use() {
+    std::lock_guard<std::mutex> guard(self().mutex_);
+    return peak_memory_size;
+}
+
+void Alloc::reset_peak_memory() {
+    std::lock_guard<std::mutex> guard(self().mutex_);
+    peak_memory_size = allocate_memory_size - deallocate_memory_size;
+}
+
 } // namespace st
\ No newline at end of file
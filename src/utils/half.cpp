@@ -0,0 +1,59 @@
+#include <cstring>
+
+#include "utils/half.h"
+
+#if defined(__F16C__) || defined(__AVX512BF16__)
+#include <immintrin.h>
+#endif
+
+namespace st {
+namespace half {
+
+void to_half(HalfType type, const data_t* src, half_t* dist, index_t n) {
+    index_t i = 0;
+    if(type == HalfType::float16) {
+#if defined(__F16C__) && defined(__AVX__)
+        for(; i + 8 <= n; i += 8) {
+            __m128 lo = _mm256_cvtpd_ps(_mm256_loadu_pd(src + i));
+            __m128 hi = _mm256_cvtpd_ps(_mm256_loadu_pd(src + i + 4));
+            __m256 f = _mm256_insertf128_ps(_mm256_castps128_ps256(lo), hi, 1);
+            __m128i h = _mm256_cvtps_ph(f, _MM_FROUND_TO_NEAREST_INT);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dist + i), h);
+        }
+#endif
+        for(; i < n; ++i)
+            dist[i] = float_to_float16(static_cast<float>(src[i]));
+    } else {
+#if defined(__AVX512BF16__) && defined(__AVX512VL__)
+        for(; i + 8 <= n; i += 8) {
+            __m128bh h = _mm256_cvtneps_pbh(_mm512_cvtpd_ps(_mm512_loadu_pd(src + i)));
+            std::memcpy(dist + i, &h, sizeof(h));
+        }
+#endif
+        for(; i < n; ++i)
+            dist[i] = float_to_bfloat16(static_cast<float>(src[i]));
+    }
+}
+
+void from_half(HalfType type, const half_t* src, data_t* dist, index_t n) {
+    index_t i = 0;
+    if(type == HalfType::float16) {
+#if defined(__F16C__) && defined(__AVX__)
+        for(; i + 8 <= n; i += 8) {
+            __m128i h = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+            __m256 f = _mm256_cvtph_ps(h);
+            _mm256_storeu_pd(dist + i, _mm256_cvtps_pd(_mm256_castps256_ps128(f)));
+            _mm256_storeu_pd(dist + i + 4, _mm256_cvtps_pd(_mm256_extractf128_ps(f, 1)));
+        }
+#endif
+        for(; i < n; ++i)
+            dist[i] = float16_to_float(src[i]);
+    } else {
+        // A shift is all bfloat16 needs, the compiler vectorizes this loop.
+        for(; i < n; ++i)
+            dist[i] = bfloat16_to_float(src[i]);
+    }
+}
+
+}  // namespace half
+}  // namespace st
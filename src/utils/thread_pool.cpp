@@ -0,0 +1,130 @@
+#include "utils/thread_pool.h"
+
+namespace st {
+
+static thread_local ThreadPool* current_pool = nullptr;
+static thread_local index_t current_worker_id = 0;
+
+ThreadPool::ThreadPool(index_t n_threads)
+        : queues_(new TaskQueue[n_threads + 1]),
+          n_queued_(0),
+          stop_(false) {
+    threads_.reserve(n_threads);
+    for(index_t i = 0; i < n_threads; ++i)
+        threads_.emplace_back(&ThreadPool::worker_loop, this, i);
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> guard(sleep_mutex_);
+        stop_ = true;
+    }
+    sleep_cv_.notify_all();
+    for(auto& thread: threads_)
+        thread.join();
+}
+
+void ThreadPool::submit(Task task) {
+    TaskQueue& queue = queues_[queue_id()];
+    {
+        std::lock_guard<std::mutex> guard(queue.mutex_);
+        queue.tasks_.push_back(std::move(task));
+    }
+    {
+        // Take the lock so that a worker can't miss the notification
+        // between checking n_queued_ and going to sleep.
+        std::lock_guard<std::mutex> guard(sleep_mutex_);
+        ++n_queued_;
+    }
+    sleep_cv_.notify_one();
+}
+
+bool ThreadPool::run_one(void) {
+    Task task;
+    if(!take(queue_id(), task))
+        return false;
+    task();
+    return true;
+}
+
+ThreadPool* ThreadPool::current(void) {
+    return current_pool;
+}
+
+ThreadPool* ThreadPool::set_current(ThreadPool* pool) {
+    ThreadPool* prev = current_pool;
+    current_pool = pool;
+    current_worker_id = pool ? pool->n_threads() : 0;
+    return prev;
+}
+
+void ThreadPool::worker_loop(index_t id) {
+    current_pool = this;
+    current_worker_id = id;
+    while(true) {
+        if(run_one())
+            continue;
+
+        std::unique_lock<std::mutex> lock(sleep_mutex_);
+        sleep_cv_.wait(lock, [this]() { return stop_ || n_queued_ > 0; });
+        if(stop_ && n_queued_ == 0)
+            return;
+    }
+}
+
+bool ThreadPool::take(index_t id, Task& task) {
+    if(n_queued_ == 0)
+        return false;
+
+    index_t n_queues = n_threads() + 1;
+    for(index_t i = 0; i < n_queues; ++i) {
+        TaskQueue& queue = queues_[(id + i) % n_queues];
+        std::lock_guard<std::mutex> guard(queue.mutex_);
+        if(queue.tasks_.empty())
+            continue;
+
+        // Pop the newest task of its own queue, steal the oldest of others.
+        if(i == 0) {
+            task = std::move(queue.tasks_.back());
+            queue.tasks_.pop_back();
+        } else {
+            task = std::move(queue.tasks_.front());
+            queue.tasks_.pop_front();
+        }
+        --n_queued_;
+        return true;
+    }
+    return false;
+}
+
+index_t ThreadPool::queue_id(void) const {
+    return current_pool == this ? current_worker_id : n_threads();
+}
+
+void TaskGroup::run(ThreadPool::Task task) {
+    ++n_pending_;
+    pool_.submit([this, task]() {
+        try {
+            task();
+        } catch(...) {
+            std::lock_guard<std::mutex> guard(error_mutex_);
+            if(!error_)
+                error_ = std::current_exception();
+        }
+        --n_pending_;
+    });
+}
+
+void TaskGroup::wait(void) {
+    while(n_pending_ > 0)
+        if(!pool_.run_one())
+            std::this_thread::yield();
+
+    if(error_) {
+        std::exception_ptr error = error_;
+        error_ = nullptr;
+        std::rethrow_exception(error);
+    }
+}
+
+}  // namespace st
@@ -7,18 +7,46 @@
 
 #include <iostream>
 #include <chrono>
+#include <cstring>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <cstdio>
+#include <string>
+#include <cstdlib>
+#include <unistd.h>
 
 #include "utils/base_config.h"
 #include "utils/array.h"
 #include "utils/exception.h" // CHECK_XXX is defined in utils/exception.h
+#include "utils/grad_mode.h"
+#include "utils/thread_pool.h"
 #include "exp/function.h"
+#include "exp/rewrite.h"
+#include "exp/materialize.h"
 #include "tensor/shape.h"
 #include "tensor/storage.h"
 #include "tensor/tensor_impl.h"
 #include "tensor/tensor.h"
+#include "tensor/grad_engine.h"
+#include "tensor/half_tensor.h"
+#include "tensor/static_graph.h"
+#include "tensor/memory_planner.h"
 #include "nn/init.h"
 #include "nn/module.h"
 #include "nn/optim.h"
+#include "nn/quantize.h"
+#include "nn/checkpoint.h"
+#include "nn/data_parallel.h"
+#include "data/data.h"
+#include "data/data_loader.h"
+#include "data/cache.h"
+#include "data/stream.h"
+#include "data/augment.h"
+#include "data/shard.h"
+#include "dist/launch.h"
+#include "dist/shm_group.h"
+#include "dist/tcp_group.h"
 
 
 using std::cout;
@@ -36,11 +64,33 @@ void test_matrix_operator_backward();
 void test_numeric_operator_backward();
 void test_img2col_operator_backward();
 void test_broadcasting_operator_backward();
+void test_grad_engine();
+void test_retain_graph();
+void test_no_grad();
 void test_conv2d_module();
 void test_linear_module();
 void test_maxpool2d_module();
 void test_ce_module();
 void test_optimizer();
+void test_half_tensor();
+void test_quantize();
+void test_checkpoint();
+void test_static_graph();
+void test_memory_planner();
+void test_rewrite();
+void test_materialize();
+void test_static_rank();
+void test_borrowed_storage();
+void test_mapped_file();
+void test_image_datasets();
+void test_data_loader();
+void test_cache();
+void test_streaming_dataset();
+void test_augment();
+void test_shm_all_reduce();
+void test_data_parallel();
+void test_tcp_group();
+void test_tcp_data_parallel();
 
 int main() {
     using namespace std::chrono;
@@ -72,6 +122,12 @@ int main() {
     test_img2col_operator_backward();
     cout << "\033[33mtest broadcasting operator backward...\033[0m" << endl;
     test_broadcasting_operator_backward();
+    cout << "\033[33mtest grad engine...\033[0m" << endl;
+    test_grad_engine();
+    cout << "\033[33mtest retain graph...\033[0m" << endl;
+    test_retain_graph();
+    cout << "\033[33mtest no grad...\033[0m" << endl;
+    test_no_grad();
 
     cout << "\033[33mtest Conv2d module...\033[0m" << endl;
     test_conv2d_module();
@@ -83,6 +139,44 @@ int main() {
     test_ce_module();
     cout << "\033[33mtest optimizer...\033[0m" << endl;
     test_optimizer();
+    cout << "\033[33mtest half tensor...\033[0m" << endl;
+    test_half_tensor();
+    cout << "\033[33mtest quantize...\033[0m" << endl;
+    test_quantize();
+    cout << "\033[33mtest checkpoint...\033[0m" << endl;
+    test_checkpoint();
+    cout << "\033[33mtest static graph...\033[0m" << endl;
+    test_static_graph();
+    cout << "\033[33mtest memory planner...\033[0m" << endl;
+    test_memory_planner();
+    cout << "\033[33mtest rewrite...\033[0m" << endl;
+    test_rewrite();
+    cout << "\033[33mtest materialize...\033[0m" << endl;
+    test_materialize();
+    cout << "\033[33mtest static rank...\033[0m" << endl;
+    test_static_rank();
+    cout << "\033[33mtest borrowed storage...\033[0m" << endl;
+    test_borrowed_storage();
+    cout << "\033[33mtest mapped file...\033[0m" << endl;
+    test_mapped_file();
+    cout << "\033[33mtest image datasets...\033[0m" << endl;
+    test_image_datasets();
+    cout << "\033[33mtest data loader...\033[0m" << endl;
+    test_data_loader();
+    cout << "\033[33mtest cache...\033[0m" << endl;
+    test_cache();
+    cout << "\033[33mtest streaming dataset...\033[0m" << endl;
+    test_streaming_dataset();
+    cout << "\033[33mtest augment...\033[0m" << endl;
+    test_augment();
+    cout << "\033[33mtest shm all reduce...\033[0m" << endl;
+    test_shm_all_reduce();
+    cout << "\033[33mtest data parallel...\033[0m" << endl;
+    test_data_parallel();
+    cout << "\033[33mtest tcp group...\033[0m" << endl;
+    test_tcp_group();
+    cout << "\033[33mtest tcp data parallel...\033[0m" << endl;
+    test_tcp_data_parallel();
 
     cout << "\033[33mcheck all memory is deallocated...\033[0m" << endl;
     CHECK_TRUE(st::Alloc::all_clear(), "check memory all clear");
@@ -140,6 +234,26 @@ void test_Alloc() {
         CHECK_EQUAL(ptr, static_cast<void*>(sptr.get()), "check 4");
     }
     CHECK_EQUAL(Foo::dectr_call_counter, 2, "check 4");
+
+    {
+        // Small arrays are stored inline, and larger ones are allocated.
+        index_t in_use = Alloc::memory_in_use();
+        IndexArray small{1, 2, 3, 4};
+        IndexArray small_copy(small);
+        IndexArray small_moved(std::move(small_copy));
+        CHECK_EQUAL(Alloc::memory_in_use(), in_use, "check 5");
+        CHECK_EQUAL(small_moved[3], 4, "check 5");
+
+        IndexArray large(IndexArray::kInlineSize + 4);
+        for(index_t i = 0; i < large.size(); ++i)
+            large[i] = i;
+        IndexArray large_copy(large);
+        IndexArray large_moved(std::move(large_copy));
+        CHECK_EQUAL(Alloc::memory_in_use(), 
+                    in_use + 2 * large.size() * sizeof(index_t), "check 5");
+        for(index_t i = 0; i < large.size(); ++i)
+            CHECK_EQUAL(large_moved[i], i, "check 5");
+    }
 }
 
 void test_Tensor() {
@@ -229,6 +343,17 @@ void test_Tensor() {
                 data_t value2 = t5[{0, k, 0, i, j}];
                 CHECK_FLOAT_EQUAL(value1, value2, "check7");
             }
+
+    // Sizes beyond INDEX_MAX are errors, instead of wrapping around.
+    Shape shape_t8({1 << 16, 1 << 16});
+    bool thrown = false;
+    try {
+        index_t dsize = shape_t8.dsize();
+        CHECK_EQUAL(dsize >> 16, index_t(1) << 16, "check8");
+    } catch(const std::exception& e) {
+        thrown = true;
+    }
+    CHECK_EQUAL(thrown, sizeof(index_t) < 8, "check8");
 }
 
 void test_basic_operator() {
@@ -663,6 +788,21 @@ void test_numeric_operator_backward() {
                 data_t value2 = t3_grad_expect[i][j][k];
                 CHECK_FLOAT_EQUAL(value1, value2, "check2");
             }
+
+    // identity copies a view contiguously, and passes the gradient back
+    Tensor t6(data2, Shape{2, 6}, /*requires_grad=*/true);
+    Tensor t7 = op::identity(t6.transpose(0, 1));
+    CHECK_TRUE(t7.is_contiguous(), "check3");
+    Tensor t8 = t7.view({2, 6});
+    Tensor t9 = t8 * t8;
+    t9.backward();
+    auto&& t6_grad = t6.grad();
+    for(index_t i = 0; i < 2; ++i)
+        for(index_t j = 0; j < 6; ++j) {
+            data_t value1 = t6_grad[{i, j}];
+            data_t value2 = 2 * data2[i * 6 + j];
+            CHECK_FLOAT_EQUAL(value1, value2, "check3");
+        }
 }
 
 void test_img2col_operator_backward() {
@@ -689,6 +829,23 @@ void test_img2col_operator_backward() {
             CHECK_FLOAT_EQUAL(value1, value2, "check1");
         }
     }
+
+    // an expression as the input, whose gradient reads the same indices
+    // after the gradient of img2col
+    Tensor t3(reinterpret_cast<data_t*>(data), Shape{1, 1, 6, 4}, true);
+    Tensor t4(reinterpret_cast<data_t*>(data), Shape{1, 1, 6, 4});
+    Tensor t5 = op::img2col(t3 * t4, /*kernel_size=*/{3, 3},
+                            /*stride=*/{1, 1}, /*padding=*/{1, 1});
+    t5.backward();
+    auto&& t3_grad = t3.grad();
+    for(index_t i = 0; i < 6; ++i) {
+        for(index_t j = 0; j < 4; ++j) {
+            data_t value1 = t3_grad[{0, 0, i, j}];
+            data_t value2 = (i == 0 || i == 5 ? 2 : 3) * (j == 0 || j == 3 ? 2 : 3)
+                            * data[i][j];
+            CHECK_FLOAT_EQUAL(value1, value2, "check2");
+        }
+    }
 }
 
  void test_broadcasting_operator_backward(void) {
@@ -744,6 +901,165 @@ void test_img2col_operator_backward() {
             }
 }
 
+void test_grad_engine(void) {
+    using namespace st;
+
+    // A long chain of tensors. Each step is scheduled by the engine instead
+    // of being a nested call.
+    constexpr index_t n_steps = 5000;
+    data_t data[] = {1, 2};
+    Tensor x(data, Shape{2}, true);
+    std::vector<Alloc::NontrivialUniquePtr<Tensor>> chain;
+    chain.push_back(Alloc::unique_construct<Tensor>(x + x));
+    for(index_t i = 0; i < n_steps; ++i)
+        chain.push_back(Alloc::unique_construct<Tensor>(*chain.back() + x));
+    chain.back()->backward();
+    auto&& x_grad = x.grad();
+    for(index_t i = 0; i < 2; ++i) {
+        data_t value = x_grad[{i}];
+        CHECK_FLOAT_EQUAL(value, n_steps + 2, "check1");
+    }
+
+    // A diamond. t3 is ready only after both t1 and t2 passed their gradient.
+    Tensor t0(data, Shape{2}, true);
+    Tensor t1 = t0 * t0;
+    Tensor t2 = t1 + t0;
+    Tensor t3 = t1 * t2;
+    t3.backward();
+    // t3 = t0^4 + t0^3, d(t3)/d(t0) = 4*t0^3 + 3*t0^2
+    auto&& t0_grad = t0.grad();
+    for(index_t i = 0; i < 2; ++i) {
+        data_t value1 = t0_grad[{i}];
+        data_t value2 = 4*data[i]*data[i]*data[i] + 3*data[i]*data[i];
+        CHECK_FLOAT_EQUAL(value1, value2, "check2");
+    }
+
+    // Parallel backward gives the same gradients as the sequential one. 
+    // Leaves and views are reached by several branches at the same time.
+    auto compute_grads = [](index_t n_threads) {
+        GradEngine::set_num_threads(n_threads);
+        constexpr index_t n = 64;
+        std::vector<data_t> init(8 * n * n);
+        for(index_t i = 0; i < init.size(); ++i)
+            init[i] = std::sin(i);
+
+        std::vector<Alloc::NontrivialUniquePtr<Tensor>> ws;
+        for(index_t i = 0; i < 8; ++i)
+            ws.push_back(Alloc::unique_construct<Tensor>(
+                init.data() + i * n * n, Shape{n, n}, true));
+        Tensor w0_t = ws[0]->transpose(0, 1);
+        std::vector<Alloc::NontrivialUniquePtr<Tensor>> as;
+        for(index_t i = 0; i < 4; ++i)
+            as.push_back(Alloc::unique_construct<Tensor>(
+                *ws[2*i] * *ws[2*i + 1] + w0_t));
+        Tensor b = *as[0] + *as[1];
+        Tensor c = op::sigmoid(*as[2] - *as[3]);
+        Tensor d = b * c + b;
+        d.backward();
+
+        std::vector<data_t> grads;
+        for(index_t i = 0; i < 8; ++i) {
+            Tensor grad = ws[i]->grad();
+            for(index_t j = 0; j < n; ++j)
+                for(index_t k = 0; k < n; ++k)
+                    grads.push_back(grad[{j, k}]);
+        }
+        GradEngine::set_num_threads(1);
+        return grads;
+    };
+    std::vector<data_t> grads1 = compute_grads(1);
+    std::vector<data_t> grads2 = compute_grads(4);
+    CHECK_EQUAL(grads1.size(), grads2.size(), "check3");
+    for(index_t i = 0; i < grads1.size(); ++i)
+        CHECK_FLOAT_EQUAL(grads1[i], grads2[i], "check3");
+}
+
+void test_retain_graph(void) {
+    using namespace st;
+
+    data_t data[] = {1, 2};
+    Tensor t0(data, Shape{2}, true);
+    index_t before_graph = Alloc::memory_in_use();
+    Alloc::NontrivialUniquePtr<Tensor> t3;
+    {
+        Tensor t1 = t0 * t0;
+        Tensor t2 = t1 + t0;
+        t3 = Alloc::unique_construct<Tensor>(t1 * t2);
+    }
+
+    // With retain_graph, backward can be called again and gradients are
+    // accumulated. d(t3)/d(t0) = 4*t0^3 + 3*t0^2
+    t3->backward(true);
+    index_t after_retained = Alloc::memory_in_use();
+    t3->backward(false);
+    CHECK_TRUE(Alloc::memory_in_use() < after_retained, "check1");
+    {
+        auto&& t0_grad = t0.grad();
+        for(index_t i = 0; i < 2; ++i) {
+            data_t value1 = t0_grad[{i}];
+            data_t value2 = 2 * (4*data[i]*data[i]*data[i] + 3*data[i]*data[i]);
+            CHECK_FLOAT_EQUAL(value1, value2, "check1");
+        }
+    }
+
+    // Without it, t1, t2 and their buffers are released. Only t3 and its
+    // gradient are left.
+    index_t after_backward = Alloc::memory_in_use();
+    t3.reset();
+    index_t released = after_backward - Alloc::memory_in_use();
+    CHECK_TRUE(after_backward - before_graph == released, "check2");
+
+    bool thrown = false;
+    Tensor t4 = t0 * t0;
+    t4.backward();
+    try {
+        t4.backward();
+    } catch(const std::exception& e) {
+        thrown = true;
+    }
+    CHECK_TRUE(thrown, "check3");
+}
+
+void test_no_grad(void) {
+    using namespace st;
+
+    data_t data[] = {1, 2, 3, 4, 5, 6};
+    Tensor t0(data, Shape{2, 3}, true);
+    Tensor t1(data, Shape{2, 3}, true);
+    {
+        NoGradGuard no_grad;
+        CHECK_TRUE(!GradMode::is_enabled(), "check1");
+
+        Tensor t2 = t0 * t0 + op::sigmoid(t0);
+        CHECK_TRUE(!t2.impl().requires_grad(), "check1");
+        CHECK_EQUAL(t0.impl().gradcount(), 0, "check1");
+
+        // Assigning to a tensor requiring grad doesn't touch autograd.
+        index_t version = t1.version();
+        t1 = t0 * t0;
+        CHECK_EQUAL(t1.version(), version, "check2");
+        Tensor t3 = t1.view({3, 2});
+        CHECK_TRUE(!t3.impl().requires_grad(), "check2");
+        {
+            NoGradGuard nested;
+        }
+        CHECK_TRUE(!GradMode::is_enabled(), "check3");
+    }
+    CHECK_TRUE(GradMode::is_enabled(), "check3");
+
+    // Autograd works as usual after the guard.
+    Tensor t4 = t0 * t0;
+    CHECK_EQUAL(t0.impl().gradcount(), 2, "check4");
+    t4.backward();
+    auto&& t0_grad = t0.grad();
+    for(index_t i = 0; i < 2; ++i)
+        for(index_t j = 0; j < 3; ++j) {
+            data_t value1 = t0_grad[{i, j}];
+            data_t value2 = 2 * data[i*3 + j];
+            CHECK_FLOAT_EQUAL(value1, value2, "check4");
+        }
+}
+
 void test_conv2d_module(void) {
     using namespace st;
     data_t weight_data[] = 
@@ -1009,4 +1325,1647 @@ void test_optimizer() {
         data_t value2 = bias[{0, i}];
         CHECK_FLOAT_EQUAL(value1, value2, "check1");
     }
-}
\ No newline at end of file
+}
+
+void test_half_tensor() {
+    using namespace st;
+
+    // conversion is exact for small integers and rounds to nearest even
+    CHECK_FLOAT_EQUAL(half::float16_to_float(half::float_to_float16(-3.f)), -3., "check1");
+    CHECK_FLOAT_EQUAL(half::bfloat16_to_float(half::float_to_bfloat16(257.f)), 256., "check1");
+    CHECK_FLOAT_EQUAL(half::float16_to_float(half::float_to_float16(65504.f)), 65504., "check1");
+
+    data_t data[] = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12};
+    Tensor t0(data, Shape{3, 4});
+    HalfTensor h0(t0 * t0, HalfType::float16);
+    CHECK_EQUAL(h0.nbytes(), 12 * sizeof(half_t), "check2");
+    Tensor t1 = h0 - t0;
+    for(index_t i = 0; i < 3; ++i)
+        for(index_t j = 0; j < 4; ++j) {
+            data_t value1 = t1[{i, j}];
+            data_t value2 = data[i*4 + j] * data[i*4 + j] - data[i*4 + j];
+            CHECK_FLOAT_EQUAL(value1, value2, "check2");
+        }
+
+    // mixed precision: half weights in forward, gradient goes to the master
+    data_t weight_data[4][3] = {{ 0.5437, -0.4394, -0.0307}, {-0.3073,  0.4709,  0.1285},
+                                {-0.0405,  0.5013, -0.3253}, { 0.4171, -0.2727, -0.3348}};
+    data_t input_data[2][3] = {{0.4746, 0.5383, 0.2668}, {0.0405, 0.8955, 0.7365}};
+    nn::Linear linear(3, 4);
+    nn::ParamsDict params = linear.parameters();
+    Tensor& weight = params["weight"];
+    nn::CpyInitializer weight_initializer(weight, reinterpret_cast<data_t*>(weight_data));
+    weight_initializer.init();
+    nn::SGD optimizer(linear.parameters(), 0.1);
+    Tensor input(reinterpret_cast<data_t*>(input_data), Shape{2, 3});
+
+    Tensor& bias = params["bias"];
+    linear.mixed_precision(true, HalfType::bfloat16);
+    for(index_t step = 0; step < 2; ++step) {
+        Tensor out_nobias = op::matrix_mul(input, op::matrix_transpose(weight));
+        Tensor out_expect = out_nobias + bias;
+        Tensor out = linear.forward(input);
+        out.backward();
+        for(index_t i = 0; i < 2; ++i)
+            for(index_t j = 0; j < 4; ++j) {
+                data_t value1 = out[{i, j}];
+                data_t value2 = out_expect[{i, j}];
+                CHECK_TRUE(std::abs(value1 - value2) < 1e-2, "check3");
+            }
+
+        Tensor weight_grad = weight.grad();
+        for(index_t i = 0; i < 4; ++i)
+            for(index_t j = 0; j < 3; ++j) {
+                data_t value1 = weight_grad[{i, j}];
+                data_t value2 = input_data[0][j] + input_data[1][j];
+                CHECK_FLOAT_EQUAL(value1, value2, "check4");
+            }
+        optimizer.step();
+        optimizer.zero_grad();
+    }
+}
+
+void test_quantize() {
+    using namespace st;
+
+    // Linear: calibrate on the input, then compare int8 with data_t.
+    data_t weight_data[4][3] = {{ 0.5437, -0.4394, -0.0307}, {-0.3073,  0.4709,  0.1285},
+                                {-0.0405,  0.5013, -0.3253}, { 0.4171, -0.2727, -0.3348}};
+    data_t input_data[2][3] = {{0.4746, 0.5383, 0.2668}, {0.0405, 0.8955, 0.7365}};
+    nn::LinearWithReLU linear(3, 4);
+    nn::ParamsDict params = linear.parameters();
+    nn::CpyInitializer weight_initializer(params["weight"], 
+                                          reinterpret_cast<data_t*>(weight_data));
+    weight_initializer.init();
+    Tensor input(reinterpret_cast<data_t*>(input_data), Shape{2, 3});
+    Tensor out_expect = linear.forward(input);
+
+    nn::QuantizedLinear qlinear(linear);
+    CHECK_TRUE(qlinear.calibrating(), "check1");
+    qlinear.forward(input);
+    qlinear.freeze();
+    CHECK_TRUE(!qlinear.calibrating(), "check1");
+
+    Tensor out = qlinear.forward(input);
+    nn::QTensor qout = qlinear.forward(qlinear.quantize(input));
+    for(index_t i = 0; i < 2; ++i)
+        for(index_t j = 0; j < 4; ++j) {
+            data_t value1 = out[{i, j}];
+            data_t value2 = out_expect[{i, j}];
+            data_t value3 = qout.data_.get()[i*4 + j] * qout.scale_;
+            CHECK_TRUE(value1 >= 0, "check2");
+            CHECK_TRUE(std::abs(value1 - value2) < 2e-2, "check2");
+            CHECK_TRUE(std::abs(value3 - value2) < 2e-2, "check3");
+        }
+
+    // Conv2d with padding and stride
+    nn::Conv2d conv(2, 3, {3, 3}, {2, 1}, {1, 1});
+    Tensor conv_input(Shape{2, 2, 5, 4});
+    for(index_t i = 0; i < 2; ++i)
+        for(index_t j = 0; j < 2; ++j)
+            for(index_t k = 0; k < 5; ++k)
+                for(index_t l = 0; l < 4; ++l)
+                    conv_input[{i, j, k, l}] = std::sin(i*40 + j*20 + k*4 + l);
+    Tensor conv_expect = conv.forward(conv_input);
+
+    nn::QuantizedConv2d qconv(conv);
+    qconv.forward(conv_input);
+    qconv.freeze();
+    Tensor conv_out = qconv.forward(conv_input);
+    nn::QTensor qconv_out = qconv.forward(qconv.quantize(conv_input));
+    CHECK_TRUE(conv_out.size() == conv_expect.size(), "check4");
+    CHECK_TRUE(qconv_out.shape_ == conv_expect.size(), "check4");
+    data_t out_scale = qconv.output_scale();
+    for(index_t i = 0; i < 2; ++i)
+        for(index_t j = 0; j < 3; ++j)
+            for(index_t k = 0; k < 3; ++k)
+                for(index_t l = 0; l < 4; ++l) {
+                    data_t value1 = conv_out[{i, j, k, l}];
+                    data_t value2 = conv_expect[{i, j, k, l}];
+                    data_t value3 = qconv_out.data_.get()[((i*3 + j)*3 + k)*4 + l] 
+                                    * out_scale;
+                    CHECK_TRUE(std::abs(value1 - value2) < 5e-2, "check5");
+                    CHECK_TRUE(std::abs(value3 - value2) < 5e-2, "check5");
+                }
+}
+
+void test_checkpoint() {
+    using namespace st;
+
+    class TwoLayers : public nn::Module {
+    public:
+        TwoLayers() : linear1_(3, 5), linear2_(5, 4) {}
+        Tensor forward(const Tensor& input) override {
+            Tensor x = linear1_.forward(input);
+            Tensor y = linear2_.forward(x);
+            return y;
+        }
+        nn::ParamsDict parameters(void) override {
+            return {{"linear1", linear1_.parameters()}, 
+                    {"linear2", linear2_.parameters()}};
+        }
+    private:
+        nn::LinearWithReLU linear1_;
+        nn::Linear linear2_;
+    };
+
+    data_t input_data[2][3] = {{0.4746, 0.5383, 0.2668}, {0.0405, 0.8955, 0.7365}};
+    TwoLayers model;
+    nn::Checkpoint checkpoint(model);
+    nn::ParamsDict params = model.parameters();
+
+    // Gradients without checkpoint, as reference
+    Tensor x0(reinterpret_cast<data_t*>(input_data), Shape{2, 3}, true);
+    Tensor y0 = model.forward(x0);
+    Tensor z0 = y0 * y0;
+    z0.backward();
+    Tensor x0_grad = x0.grad();
+    Tensor w0_grad = params["linear1weight"].grad();
+    Tensor b0_grad = params["linear2bias"].grad();
+    nn::SGD optimizer(model.parameters(), 0.1);
+    optimizer.zero_grad();
+
+    Tensor x1(reinterpret_cast<data_t*>(input_data), Shape{2, 3}, true);
+    Tensor y1 = checkpoint.forward(x1);
+    CHECK_TRUE(y1.impl().requires_grad(), "check1");
+    Tensor z1 = y1 * y1;
+    z1.backward();
+    Tensor x1_grad = x1.grad();
+    Tensor w1_grad = params["linear1weight"].grad();
+    Tensor b1_grad = params["linear2bias"].grad();
+    for(index_t i = 0; i < 2; ++i)
+        for(index_t j = 0; j < 4; ++j) {
+            data_t value1 = y0[{i, j}];
+            data_t value2 = y1[{i, j}];
+            CHECK_FLOAT_EQUAL(value1, value2, "check1");
+        }
+    for(index_t i = 0; i < 2; ++i)
+        for(index_t j = 0; j < 3; ++j) {
+            data_t value1 = x0_grad[{i, j}];
+            data_t value2 = x1_grad[{i, j}];
+            CHECK_FLOAT_EQUAL(value1, value2, "check2");
+        }
+    for(index_t i = 0; i < 5; ++i)
+        for(index_t j = 0; j < 3; ++j) {
+            data_t value1 = w0_grad[{i, j}];
+            data_t value2 = w1_grad[{i, j}];
+            CHECK_FLOAT_EQUAL(value1, value2, "check3");
+        }
+    for(index_t j = 0; j < 4; ++j) {
+        data_t value1 = b0_grad[{0, j}];
+        data_t value2 = b1_grad[{0, j}];
+        CHECK_FLOAT_EQUAL(value1, value2, "check3");
+    }
+
+    // A graph is recorded only if the input or a parameter requires grad.
+    Tensor x2(reinterpret_cast<data_t*>(input_data), Shape{2, 3});
+    Tensor y2 = checkpoint.forward(x2);
+    CHECK_TRUE(y2.impl().requires_grad(), "check4");
+    nn::MaxPool2d pool({2, 2}, {2, 2}, {0, 0});
+    nn::Checkpoint pool_checkpoint(pool);
+    Tensor img(Shape{1, 1, 4, 4});
+    Tensor pooled = pool_checkpoint.forward(img);
+    CHECK_TRUE(!pooled.impl().requires_grad(), "check4");
+
+    // A convolution whose output, a permuted view, is copied to be flattened,
+    // as the stages of train_cnn. The weight gets the same gradient from the
+    // recomputed graph.
+    nn::Conv2dWithReLU conv(1, 2, {3, 3}, {1, 1}, {1, 1});
+    nn::Checkpoint conv_checkpoint(conv);
+    nn::ParamsDict conv_params = conv.parameters();
+    Tensor& conv_weight = conv_params["weight"];
+    Tensor conv_input(Shape{1, 1, 4, 4});
+    for(index_t i = 0; i < 16; ++i)
+        conv_input[{0, 0, i / 4, i % 4}] = std::sin(i * 0.7);
+    auto conv_loss = [](const Tensor& y) {
+        Tensor flat = op::identity(y);
+        Tensor z = flat.view({flat.size(0), 2 * 4 * 4});
+        return Tensor(op::mean(op::mean(z * z, 1), 0));
+    };
+    Tensor loss0 = conv_loss(conv.forward(conv_input));
+    loss0.backward();
+    Tensor conv_grad0 = conv_weight.grad();
+    std::vector<data_t> conv_grads;
+    for(index_t i = 0; i < 2; ++i)
+        for(index_t j = 0; j < 9; ++j)
+            conv_grads.push_back(conv_grad0[{i, j}]);
+    Tensor loss1 = conv_loss(conv_checkpoint.forward(conv_input));
+    loss1.backward();
+    Tensor conv_grad1 = conv_weight.grad();
+    // Gradients are accumulated, so they are doubled.
+    for(index_t i = 0; i < 2; ++i)
+        for(index_t j = 0; j < 9; ++j) {
+            data_t value = conv_grad1[{i, j}];
+            CHECK_FLOAT_EQUAL(value, 2 * conv_grads[i * 9 + j], "check5");
+        }
+}
+
+void test_static_graph() {
+    using namespace st;
+
+    data_t batchs[2][2][3] = {{{0.4746, 0.5383, 0.2668}, {0.0405, 0.8955, 0.7365}},
+                              {{0.1353, 0.7411, 0.3802}, {0.6512, 0.0247, 0.9154}}};
+    index_t batch_labels[2][2] = {{1, 3}, {0, 2}};
+    nn::LinearWithReLU linear1(3, 5);
+    nn::Linear linear2(5, 4);
+    nn::CrossEntropy criterion;
+    nn::ParamsDict params = {{"linear1", linear1.parameters()},
+                             {"linear2", linear2.parameters()}};
+    nn::SGD optimizer(params, 0.1);
+    auto collect_grads = [&params]() {
+        std::vector<data_t> grads;
+        for(auto& item : params) {
+            Tensor grad = item.second.get().grad();
+            for(index_t i = 0; i < grad.size(0); ++i)
+                for(index_t j = 0; j < grad.size(1); ++j)
+                    grads.push_back(grad[{i, j}]);
+        }
+        return grads;
+    };
+
+    // Capture a step with placeholders.
+    Tensor input(Shape{2, 3});
+    std::shared_ptr<index_t> labels = Alloc::shared_allocate<index_t>(2 * sizeof(index_t));
+    std::memset(labels.get(), 0, 2 * sizeof(index_t));
+    StaticGraph graph;
+    graph.begin_capture();
+    Tensor x = linear1.forward(input);
+    Tensor y = linear2.forward(x);
+    Tensor loss = criterion.forward(y, labels);
+    graph.end_capture(loss);
+    CHECK_TRUE(graph.captured() && graph.n_kernels() > 0, "check1");
+
+    // Each replayed step is the same as an eager one, also after the 
+    // parameters are updated.
+    index_t memory_in_use = 0;
+    for(index_t k = 0; k < 2; ++k) {
+        Tensor x0(reinterpret_cast<data_t*>(batchs[k]), Shape{2, 3});
+        Tensor loss0 = criterion.forward(linear2.forward(linear1.forward(x0)),
+                                         batch_labels[k]);
+        loss0.backward();
+        std::vector<data_t> grads0 = collect_grads();
+        optimizer.zero_grad();
+
+        graph.feed(input, reinterpret_cast<data_t*>(batchs[k]));
+        std::memcpy(labels.get(), batch_labels[k], 2 * sizeof(index_t));
+        graph.replay();
+        graph.backward();
+        std::vector<data_t> grads1 = collect_grads();
+        data_t value0 = loss0.item();
+        data_t value1 = loss.item();
+        CHECK_FLOAT_EQUAL(value0, value1, "check2");
+        CHECK_EQUAL(grads0.size(), grads1.size(), "check3");
+        for(index_t i = 0; i < grads0.size(); ++i)
+            CHECK_FLOAT_EQUAL(grads0[i], grads1[i], "check3");
+
+        optimizer.step();
+        optimizer.zero_grad();
+
+        // Nothing is built by replaying.
+        if(k == 0)
+            memory_in_use = Alloc::memory_in_use();
+        else
+            CHECK_EQUAL(Alloc::memory_in_use(), memory_in_use, "check4");
+    }
+}
+
+void test_memory_planner() {
+    using namespace st;
+
+    data_t batch[3][3] = {{0.4746, 0.5383, 0.2668}, {0.0405, 0.8955, 0.7365},
+                          {0.1353, 0.7411, 0.3802}};
+    index_t labels[3] = {1, 3, 0};
+    nn::LinearWithReLU linear1(3, 5);
+    nn::LinearWithReLU linear2(5, 5);
+    nn::Linear linear3(5, 4);
+    nn::CrossEntropy criterion;
+    nn::ParamsDict params = {{"linear1", linear1.parameters()},
+                             {"linear2", linear2.parameters()},
+                             {"linear3", linear3.parameters()}};
+    nn::SGD optimizer(params, 0.1);
+    auto step = [&](index_t n_samples) {
+        Tensor x(reinterpret_cast<data_t*>(batch), Shape{n_samples, 3});
+        Tensor y = linear3.forward(linear2.forward(linear1.forward(x)));
+        Tensor loss = criterion.forward(y, labels);
+        loss.backward();
+        std::vector<data_t> grads;
+        for(auto& item : params) {
+            Tensor grad = item.second.get().grad();
+            for(index_t i = 0; i < grad.size(0); ++i)
+                for(index_t j = 0; j < grad.size(1); ++j)
+                    grads.push_back(grad[{i, j}]);
+        }
+        optimizer.zero_grad();
+        return grads;
+    };
+
+    MemoryPlanner planner;
+    planner.begin_trace();
+    std::vector<data_t> grads0 = step(2);
+    planner.end_trace();
+    CHECK_TRUE(planner.planned() && planner.n_blocks() > 0, "check1");
+    CHECK_TRUE(planner.planned_size() >= planner.traced_peak(), "check1");
+
+    // Without the graph, tensors of forward die one after another, and the
+    // slab is smaller than all of them.
+    MemoryPlanner eval_planner;
+    eval_planner.begin_trace();
+    {
+        NoGradGuard no_grad;
+        Tensor x(reinterpret_cast<data_t*>(batch), Shape{2, 3});
+        Tensor y = linear3.forward(linear2.forward(linear1.forward(x)));
+    }
+    eval_planner.end_trace();
+    CHECK_TRUE(eval_planner.planned_size() < eval_planner.naive_size(), "check1");
+
+    // Storages of a planned step are from the slab, and the step computes
+    // the same.
+    index_t memory_in_use = Alloc::memory_in_use();
+    planner.begin_step();
+    std::vector<data_t> grads1 = step(2);
+    planner.end_step();
+    CHECK_EQUAL(planner.n_fallbacks(), 0, "check2");
+    CHECK_EQUAL(Alloc::memory_in_use(), memory_in_use, "check2");
+    CHECK_EQUAL(grads0.size(), grads1.size(), "check2");
+    for(index_t i = 0; i < grads0.size(); ++i)
+        CHECK_FLOAT_EQUAL(grads0[i], grads1[i], "check2");
+
+    // A step of another shape falls back to the allocator.
+    planner.begin_step();
+    std::vector<data_t> grads2 = step(3);
+    planner.end_step();
+    CHECK_TRUE(planner.n_fallbacks() > 0, "check3");
+    CHECK_EQUAL(grads0.size(), grads2.size(), "check3");
+}
+
+void test_rewrite() {
+    using namespace st;
+
+    data_t x_data[2][3] = {{0.4746, -0.5383, 0.2668}, {0.0405, 0.8955, -0.7365}};
+    data_t y_data[2][3] = {{-0.1353, 0.7411, 0.3802}, {0.6512, -0.0247, 0.9154}};
+    data_t w_data[4][3] = {{0.2, -0.1, 0.4}, {-0.3, 0.5, 0.1},
+                           {0.7, 0.2, -0.6}, {0.1, -0.4, 0.3}};
+    Tensor x(reinterpret_cast<data_t*>(x_data), Shape{2, 3}, true);
+    Tensor y(reinterpret_cast<data_t*>(y_data), Shape{2, 3}, true);
+    Tensor w(reinterpret_cast<data_t*>(w_data), Shape{4, 3}, true);
+    Rewrite::reset();
+
+    // T(T(x)) and a transposed operand of matrix_mul
+    {
+        Tensor t1 = op::matrix_transpose(op::matrix_transpose(x));
+        Tensor t2 = op::matrix_mul(x, op::matrix_transpose(w));
+        CHECK_EQUAL(Rewrite::counted(Rewrite::fold_transpose), 2, "check1");
+        for(index_t i = 0; i < 2; ++i)
+            for(index_t j = 0; j < 3; ++j)
+                CHECK_FLOAT_EQUAL((t1[{i, j}]), x_data[i][j], "check1");
+        for(index_t i = 0; i < 2; ++i)
+            for(index_t j = 0; j < 4; ++j) {
+                data_t value = 0;
+                for(index_t k = 0; k < 3; ++k)
+                    value += x_data[i][k] * w_data[j][k];
+                CHECK_FLOAT_EQUAL((t2[{i, j}]), value, "check1");
+            }
+
+        Tensor t3 = op::mean(t2, 0);
+        t3.backward();
+        Tensor w_grad = w.grad();
+        for(index_t j = 0; j < 4; ++j)
+            for(index_t k = 0; k < 3; ++k)
+                CHECK_FLOAT_EQUAL((w_grad[{j, k}]), 
+                    (x_data[0][k] + x_data[1][k]) / 2, "check1");
+        w_grad = op::constant(0, {4, 3});
+        x.grad() = op::constant(0, {2, 3});
+    }
+
+    // double negation
+    {
+        Tensor t1 = -(-x);
+        Tensor t2 = x - (-y);
+        Tensor t3 = x + (-y);
+        CHECK_EQUAL(Rewrite::counted(Rewrite::remove_negation), 3, "check2");
+        for(index_t i = 0; i < 2; ++i)
+            for(index_t j = 0; j < 3; ++j) {
+                CHECK_FLOAT_EQUAL((t1[{i, j}]), x_data[i][j], "check2");
+                CHECK_FLOAT_EQUAL((t2[{i, j}]), x_data[i][j] + y_data[i][j], "check2");
+                CHECK_FLOAT_EQUAL((t3[{i, j}]), x_data[i][j] - y_data[i][j], "check2");
+            }
+
+        Tensor t4 = op::mean(t2, 0);
+        t4.backward();
+        Tensor y_grad = y.grad();
+        for(index_t i = 0; i < 2; ++i)
+            for(index_t j = 0; j < 3; ++j)
+                CHECK_FLOAT_EQUAL((y_grad[{i, j}]), 1. / 2, "check2");
+        y_grad = op::constant(0, {2, 3});
+        x.grad() = op::constant(0, {2, 3});
+    }
+
+    // constants
+    {
+        auto c = op::constant(2, {2, 3}) * op::constant(3, {2, 3}) - op::constant(1, {2, 3});
+        static_assert(std::is_same<decltype(c), 
+                                   Exp<UnaryExpImpl<op::Constant, data_t>>>::value,
+                      "check3");
+        CHECK_EQUAL(Rewrite::counted(Rewrite::fold_constant), 2, "check3");
+        Tensor t1 = x * op::constant(1, {2, 3}) + op::constant(0, {2, 3});
+        Tensor t2 = x + c;
+        CHECK_EQUAL(Rewrite::counted(Rewrite::fold_constant), 4, "check3");
+        for(index_t i = 0; i < 2; ++i)
+            for(index_t j = 0; j < 3; ++j) {
+                CHECK_FLOAT_EQUAL((t1[{i, j}]), x_data[i][j], "check3");
+                CHECK_FLOAT_EQUAL((t2[{i, j}]), x_data[i][j] + 5, "check3");
+            }
+    }
+
+    // common subexpression
+    {
+        Tensor t1 = (x - y) * (x - y);
+        CHECK_EQUAL(Rewrite::counted(Rewrite::share_subexp), 1, "check4");
+        for(index_t i = 0; i < 2; ++i)
+            for(index_t j = 0; j < 3; ++j) {
+                data_t diff = x_data[i][j] - y_data[i][j];
+                CHECK_FLOAT_EQUAL((t1[{i, j}]), diff * diff, "check4");
+            }
+
+        Tensor t2 = op::mean(t1, 0);
+        t2.backward();
+        Tensor x_grad = x.grad();
+        for(index_t i = 0; i < 2; ++i)
+            for(index_t j = 0; j < 3; ++j)
+                CHECK_FLOAT_EQUAL((x_grad[{i, j}]), 
+                    x_data[i][j] - y_data[i][j], "check4");
+        x_grad = op::constant(0, {2, 3});
+        y.grad() = op::constant(0, {2, 3});
+    }
+
+    // a chain of views
+    {
+        Tensor t1 = x * x;
+        Tensor t2 = t1.view({3, 2}).transpose(0, 1).slice(1, 2, 0);
+        CHECK_EQUAL(Rewrite::counted(Rewrite::collapse_view), 2, "check5");
+        Tensor t3 = op::mean(t2, 1);
+        t3.backward();
+        Tensor x_grad = x.grad();
+        data_t expected[2][3] = {{0, 2 * x_data[0][1] / 3, 0}, 
+                                 {2 * x_data[1][0] / 3, 0, 2 * x_data[1][2] / 3}};
+        for(index_t i = 0; i < 2; ++i)
+            for(index_t j = 0; j < 3; ++j)
+                CHECK_FLOAT_EQUAL((x_grad[{i, j}]), expected[i][j], "check5");
+    }
+    Rewrite::reset();
+}
+
+void test_materialize() {
+    using namespace st;
+
+    Tensor x(Shape{4, 3}, true);
+    Tensor w1(Shape{5, 3}, true);
+    Tensor w2(Shape{2, 5}, true);
+    Tensor img(Shape{2, 2, 4, 4}, true);
+    for(index_t i = 0; i < 4; ++i)
+        for(index_t j = 0; j < 3; ++j)
+            x[{i, j}] = std::sin(i * 3 + j);
+    for(index_t i = 0; i < 5; ++i)
+        for(index_t j = 0; j < 3; ++j)
+            w1[{i, j}] = std::cos(i * 3 + j);
+    for(index_t i = 0; i < 2; ++i)
+        for(index_t j = 0; j < 5; ++j)
+            w2[{i, j}] = std::sin(i * 5 + j + 0.5);
+    for(index_t i = 0; i < 2 * 2 * 4 * 4; ++i)
+        img[{i / 32, i / 16 % 2, i / 4 % 4, i % 4}] = std::cos(i * 0.7);
+    Rewrite::reset();
+
+    // relu(matrix_mul(...)) feeding matrix_mul
+    {
+        auto h = op::relu(op::matrix_mul(x, op::matrix_transpose(w1)));
+        auto y_exp = op::matrix_mul(h, op::matrix_transpose(w2));
+        static_assert(std::is_same<decltype(y_exp), 
+            Exp<BinaryExpImpl<op::MatrixMul, TensorImpl, 
+                UnaryExpImpl<op::MatrixTranspose, TensorImpl>>>>::value, "check1");
+        CHECK_EQUAL(Rewrite::counted(Rewrite::materialize), 1, "check1");
+        Tensor y(y_exp);
+        Tensor loss = op::mean(y, 0);
+        loss.backward();
+        std::vector<data_t> grads;
+        for(Tensor* t : {&x, &w1, &w2})
+            for(index_t i = 0; i < t->size(0); ++i)
+                for(index_t j = 0; j < t->size(1); ++j)
+                    grads.push_back(t->grad()[{i, j}]);
+
+        // The same computation with the operand copied by hand. Gradients 
+        // are accumulated, so they are doubled.
+        Tensor h_ = op::relu(op::matrix_mul(x, op::matrix_transpose(w1)));
+        Tensor y_ = op::matrix_mul(h_, op::matrix_transpose(w2));
+        Tensor loss_ = op::mean(y_, 0);
+        loss_.backward();
+        for(index_t i = 0; i < 4; ++i)
+            for(index_t j = 0; j < 2; ++j)
+                CHECK_FLOAT_EQUAL((y[{i, j}]), (y_[{i, j}]), "check1");
+        index_t idx = 0;
+        for(Tensor* t : {&x, &w1, &w2})
+            for(index_t i = 0; i < t->size(0); ++i)
+                for(index_t j = 0; j < t->size(1); ++j)
+                    CHECK_FLOAT_EQUAL((t->grad()[{i, j}]), 2 * grads[idx++], "check1");
+        CHECK_EQUAL(Rewrite::counted(Rewrite::materialize), 1, "check1");
+    }
+
+    // cheap operands stay lazy
+    {
+        auto y_exp = op::matrix_mul(op::relu(x + x), op::matrix_transpose(w1));
+        static_assert(std::is_same<decltype(y_exp), 
+            Exp<BinaryExpImpl<op::MatrixMul,
+                UnaryExpImpl<op::ReLU, BinaryExpImpl<op::Add, TensorImpl, TensorImpl>>,
+                UnaryExpImpl<op::MatrixTranspose, TensorImpl>>>>::value, "check2");
+        CHECK_EQUAL(Rewrite::counted(Rewrite::materialize), 1, "check2");
+    }
+
+    // an expression feeding img2col, and img2col feeding matrix_mul
+    {
+        auto act = op::sigmoid(img * img + img);
+        auto col_exp = op::img2col(act, {3, 3}, {1, 1}, {1, 1});
+        static_assert(std::is_same<decltype(col_exp),
+            Exp<UnaryExpImpl<op::Img2col, TensorImpl>>>::value, "check3");
+        Tensor w(Shape{3, 2 * 3 * 3});
+        for(index_t i = 0; i < 3; ++i)
+            for(index_t j = 0; j < 2 * 3 * 3; ++j)
+                w[{i, j}] = std::sin(i + j * 0.3);
+        Tensor y(op::matrix_mul(col_exp, op::matrix_transpose(w)));
+        CHECK_EQUAL(Rewrite::counted(Rewrite::materialize), 3, "check3");
+
+        Tensor act_ = op::sigmoid(img * img + img);
+        Tensor col_ = op::img2col(act_, {3, 3}, {1, 1}, {1, 1});
+        Tensor y_ = op::matrix_mul(col_, op::matrix_transpose(w));
+        CHECK_EQUAL(Rewrite::counted(Rewrite::materialize), 3, "check3");
+        for(index_t i = 0; i < y.size(0); ++i)
+            for(index_t j = 0; j < 3; ++j)
+                CHECK_FLOAT_EQUAL((y[{i, j}]), (y_[{i, j}]), "check3");
+    }
+
+    // the gradient of relu(matrix_mul(...)) is evaluated once before the
+    // backward of matrix_mul reads it
+    {
+        Tensor a(Shape{4, 3}, true);
+        Tensor b(Shape{5, 3}, true);
+        for(index_t i = 0; i < 4; ++i)
+            for(index_t j = 0; j < 3; ++j)
+                a[{i, j}] = std::sin(i * 3 + j);
+        for(index_t i = 0; i < 5; ++i)
+            for(index_t j = 0; j < 3; ++j)
+                b[{i, j}] = std::cos(i * 3 + j);
+        Tensor y(op::relu(op::matrix_mul(a, op::matrix_transpose(b))));
+        Tensor loss = op::mean(op::mean(y, 1), 0);
+        loss.backward();
+        std::vector<data_t> grads;
+        for(Tensor* t : {&a, &b})
+            for(index_t i = 0; i < t->size(0); ++i)
+                for(index_t j = 0; j < t->size(1); ++j)
+                    grads.push_back(t->grad()[{i, j}]);
+
+        Tensor z_ = op::matrix_mul(a, op::matrix_transpose(b));
+        Tensor y_ = op::relu(z_);
+        Tensor loss_ = op::mean(op::mean(y_, 1), 0);
+        loss_.backward();
+        index_t idx = 0;
+        for(Tensor* t : {&a, &b})
+            for(index_t i = 0; i < t->size(0); ++i)
+                for(index_t j = 0; j < t->size(1); ++j)
+                    CHECK_FLOAT_EQUAL((t->grad()[{i, j}]), 2 * grads[idx++], "check4");
+    }
+    Rewrite::reset();
+}
+
+void test_static_rank() {
+    using namespace st;
+
+    Tensor x(Shape{2, 3, 4});
+    Tensor w(Shape{4, 4});
+    for(index_t i = 0; i < 24; ++i)
+        x[{i / 12, i / 4 % 3, i % 4}] = i;
+    for(index_t i = 0; i < 16; ++i)
+        w[{i / 4, i % 4}] = i % 5;
+
+    // ranks known from types
+    auto mm = op::matrix_mul(w, op::matrix_transpose(w));
+    auto reduced = op::mean(op::relu(mm), 1);
+    auto sum = mm + op::relu(mm);
+    static_assert(__static_rank<std::decay<decltype(mm.impl())>::type>::value == 2, "check1");
+    static_assert(__static_rank<std::decay<decltype(reduced.impl())>::type>::value == 1, "check1");
+    static_assert(__static_rank<std::decay<decltype(sum.impl())>::type>::value == 2, "check1");
+    static_assert(__static_rank<TensorImpl>::value == kDynamicRank, "check1");
+    static_assert(__static_rank<BinaryExpImpl<op::Add, TensorImpl, TensorImpl>>::value 
+                  == kDynamicRank, "check1");
+
+    Tensor t1(sum);
+    for(index_t i = 0; i < 4; ++i)
+        for(index_t j = 0; j < 4; ++j) {
+            data_t value = 0;
+            for(index_t k = 0; k < 4; ++k)
+                value += w[{i, k}] * w[{j, k}];
+            CHECK_FLOAT_EQUAL((t1[{i, j}]), 2 * value, "check1");
+        }
+
+    // ranks dispatched at runtime, into contiguous and uncontiguous tensors
+    Tensor t2 = x.permute({2, 0, 1});
+    Tensor t3(Shape{4, 2, 3});
+    Tensor t4 = t3.permute({1, 2, 0});
+    t4 = x * x;
+    for(index_t i = 0; i < 2; ++i)
+        for(index_t j = 0; j < 3; ++j)
+            for(index_t k = 0; k < 4; ++k) {
+                data_t value = x[{i, j, k}];
+                CHECK_FLOAT_EQUAL((t2[{k, i, j}]), value, "check2");
+                CHECK_FLOAT_EQUAL((t3[{k, i, j}]), value * value, "check2");
+            }
+
+    // ranks beyond kMaxStaticRank
+    Tensor t5 = x.view({1, 2, 1, 3, 4});
+    Tensor t6(Shape{1, 2, 1, 3, 4});
+    t6 = t5 + t5;
+    t6 += t5;
+    for(index_t i = 0; i < 2; ++i)
+        for(index_t j = 0; j < 3; ++j)
+            for(index_t k = 0; k < 4; ++k)
+                CHECK_FLOAT_EQUAL((t6[{0, i, 0, j, k}]), 3 * (x[{i, j, k}]), "check3");
+}
+
+void test_borrowed_storage() {
+    using namespace st;
+
+    data_t data[6] = {0, 1, 2, 3, 4, 5};
+    int n_released = 0;
+    index_t memory_in_use = Alloc::memory_in_use();
+    {
+        std::unique_ptr<Tensor> t(new Tensor(
+            Storage::borrow(data, 6, [&n_released]() { ++n_released; }), Shape{2, 3}
+        ));
+        // Only the version is allocated for the storage.
+        CHECK_TRUE(Alloc::memory_in_use() - memory_in_use 
+                   < sizeof(TensorImpl) + 6 * sizeof(data_t), "check1");
+        CHECK_FLOAT_EQUAL((t->operator[]({1, 2})), 5, "check1");
+        data[0] = 10;
+        CHECK_FLOAT_EQUAL((t->operator[]({0, 0})), 10, "check1");
+        t->operator[]({0, 1}) = 7;
+        CHECK_FLOAT_EQUAL(data[1], 7, "check1");
+
+        // views share the borrowed memory, and release it after all of them
+        Tensor row = t->slice(1);
+        CHECK_EQUAL(row.offset(), 3, "check2");
+        t.reset();
+        CHECK_EQUAL(n_released, 0, "check2");
+        row = row * row;
+        CHECK_FLOAT_EQUAL(data[4], 16, "check2");
+    }
+    CHECK_EQUAL(n_released, 1, "check2");
+    CHECK_EQUAL(Alloc::memory_in_use(), memory_in_use, "check2");
+
+    // without release, and with gradients
+    data_t x_data[6] = {0, 1, 2, 3, 4, 5};
+    {
+        Tensor x(Storage::borrow(x_data, 6), Shape{2, 3}, true);
+        Tensor y = op::mean(x * x, 1);
+        y.backward();
+        Tensor grad = x.grad();
+        for(index_t i = 0; i < 2; ++i)
+            for(index_t j = 0; j < 3; ++j)
+                CHECK_FLOAT_EQUAL((grad[{i, j}]), 2 * x_data[i * 3 + j] / 3, "check3");
+    }
+    CHECK_FLOAT_EQUAL(x_data[5], 5, "check3");
+
+    // read-only memory, as batches of datasets are
+    const data_t batch[4] = {1, 2, 3, 4};
+    {
+        index_t memory_in_use = Alloc::memory_in_use();
+        const Tensor input = Tensor::from_read_only_blob(batch, Shape{2, 2});
+        CHECK_TRUE(Alloc::memory_in_use() - memory_in_use
+                   < sizeof(TensorImpl) + 4 * sizeof(data_t), "check4");
+        CHECK_FLOAT_EQUAL((input[{1, 0}]), 3, "check4");
+        Tensor sum = op::mean(input, 1);
+        CHECK_FLOAT_EQUAL((sum[{1}]), 3.5, "check4");
+    }
+    bool thrown = false;
+    try {
+        Tensor::from_read_only_blob(nullptr, Shape{2, 2});
+    } catch(err::Error&) {
+        thrown = true;
+    }
+    CHECK_TRUE(thrown, "check4");
+
+    // writes to read-only memory are rejected, also through views
+    {
+        Tensor input = Tensor::from_read_only_blob(batch, Shape{2, 2});
+        Tensor row = input.slice(1);
+        int n_thrown = 0;
+        try { input[{0, 0}] = 5; } catch(err::Error&) { ++n_thrown; }
+        try { input = input * input; } catch(err::Error&) { ++n_thrown; }
+        try { row = op::sigmoid(row); } catch(err::Error&) { ++n_thrown; }
+        CHECK_EQUAL(n_thrown, 3, "check5");
+        CHECK_FLOAT_EQUAL(batch[0], 1, "check5");
+        CHECK_FLOAT_EQUAL(batch[3], 4, "check5");
+    }
+}
+
+// The pixel j of the sample i of the files written for image datasets.
+unsigned char image_pixel(st::index_t i, st::index_t j) {
+    return (i * 37 + j * 11) % 256;
+}
+
+// Check every sample and batch of a dataset whose sample i has the pixels
+// image_pixel(i, j) and the label i, and return the samples in their order.
+std::vector<st::index_t> check_image_dataset(const st::data::DatasetBase& dataset,
+                                             st::index_t batch_size) {
+    using namespace st;
+    index_t sample_size = dataset.sample_size();
+    std::vector<index_t> order;
+    for(index_t idx = 0; idx < dataset.n_samples(); ++idx) {
+        std::pair<const data_t*, index_t> sample = dataset.get_sample(idx);
+        index_t label = sample.second;
+        CHECK_TRUE(label < dataset.n_samples(), "label");
+        for(index_t j = 0; j < sample_size; ++j)
+            CHECK_FLOAT_EQUAL(sample.first[j], image_pixel(label, j) / 255.0, "pixel");
+        order.push_back(label);
+    }
+
+    index_t n_samples;
+    const data_t* samples;
+    const index_t* labels;
+    for(index_t b = 0; b < dataset.n_batchs(); ++b) {
+        std::tie(n_samples, samples, labels) = dataset.get_batch(b);
+        index_t first = b * batch_size;
+        CHECK_EQUAL(n_samples, std::min(batch_size, dataset.n_samples() - first),
+                    "batch size");
+        for(index_t i = 0; i < n_samples; ++i) {
+            CHECK_EQUAL(labels[i], order[first + i], "batch label");
+            for(index_t j = 0; j < sample_size; ++j)
+                CHECK_FLOAT_EQUAL(samples[i * sample_size + j],
+                                  image_pixel(labels[i], j) / 255.0, "batch pixel");
+        }
+    }
+
+    // Bytes of the same samples, which only a mapped dataset has.
+    if(dataset.has_bytes()) {
+        std::vector<unsigned char> bytes(sample_size);
+        for(index_t idx = 0; idx < dataset.n_samples(); ++idx) {
+            CHECK_EQUAL(dataset.copy_bytes(idx, bytes.data()), order[idx], "bytes");
+            for(index_t j = 0; j < sample_size; ++j)
+                CHECK_EQUAL(bytes[j], image_pixel(order[idx], j), "bytes");
+        }
+    }
+    return order;
+}
+
+void write_test_file(const std::string& path, const std::vector<unsigned char>& bytes) {
+    std::FILE* file = std::fopen(path.c_str(), "wb");
+    CHECK_TRUE(file, "Can't open file: %s", path.c_str());
+    std::fwrite(bytes.data(), 1, bytes.size(), file);
+    std::fclose(file);
+}
+
+void test_mapped_file() {
+    using namespace st;
+    char dir_template[] = "/tmp/st_test_XXXXXX";
+    const char* dir_path = mkdtemp(dir_template);
+    CHECK_TRUE(dir_path, "Can't make a temporary directory.");
+    const std::string dir(dir_path);
+    const std::string path = dir + "/bytes.bin";
+    const std::string empty_path = dir + "/empty.bin";
+
+    std::vector<unsigned char> bytes;
+    for(int i = 0; i < 300; ++i)
+        bytes.push_back(i * 7);
+    write_test_file(path, bytes);
+    write_test_file(empty_path, {});
+    {
+        data::MappedFile file(path);
+        CHECK_EQUAL(file.size(), bytes.size(), "check1");
+        CHECK_TRUE(std::memcmp(file.data(), bytes.data(), bytes.size()) == 0, "check1");
+
+        // moving hands over the mapping
+        data::MappedFile moved(std::move(file));
+        CHECK_TRUE(file.data() == nullptr && file.size() == 0, "check2");
+        CHECK_EQUAL(moved.size(), bytes.size(), "check2");
+        CHECK_EQUAL(moved.data()[299], bytes[299], "check2");
+        file = std::move(moved);
+        CHECK_TRUE(moved.data() == nullptr, "check2");
+        CHECK_EQUAL(file.data()[1], 7, "check2");
+    }
+    {
+        data::MappedFile file(empty_path);
+        CHECK_EQUAL(file.size(), 0, "check3");
+        CHECK_TRUE(file.data() == nullptr, "check3");
+    }
+    bool thrown = false;
+    try {
+        data::MappedFile file(dir + "/missing.bin");
+    } catch(err::Error&) {
+        thrown = true;
+    }
+    CHECK_TRUE(thrown, "check4");
+
+    std::remove(path.c_str());
+    std::remove(empty_path.c_str());
+    rmdir(dir.c_str());
+}
+
+void test_image_datasets() {
+    using namespace st;
+    // 5 samples in batches of 2, so the last batch has 1 sample
+    const index_t n = 5, batch_size = 2;
+    char dir_template[] = "/tmp/st_test_XXXXXX";
+    const char* dir_path = mkdtemp(dir_template);
+    CHECK_TRUE(dir_path, "Can't make a temporary directory.");
+    const std::string dir(dir_path);
+
+    // MNIST files in IDX, with big-endian sizes
+    index_t n_pixels = data::MNIST::Img::n_pixels_;
+    std::vector<unsigned char> imgs{0, 0, 8, 3, 0, 0, 0, n, 0, 0, 0, 28, 0, 0, 0, 28};
+    std::vector<unsigned char> mnist_labels{0, 0, 8, 1, 0, 0, 0, n};
+    // Cifar10 records of a label and the pixels
+    index_t cifar_pixels = data::Cifar10::Img::n_pixels_;
+    std::vector<unsigned char> records;
+    for(index_t i = 0; i < n; ++i) {
+        for(index_t j = 0; j < n_pixels; ++j)
+            imgs.push_back(image_pixel(i, j));
+        mnist_labels.push_back(i);
+        records.push_back(i);
+        for(index_t j = 0; j < cifar_pixels; ++j)
+            records.push_back(image_pixel(i, j));
+    }
+    const std::string img_path = dir + "/images.idx3-ubyte";
+    const std::string label_path = dir + "/labels.idx1-ubyte";
+    const std::string bin_path = dir + "/test_batch.bin";
+    write_test_file(img_path, imgs);
+    write_test_file(label_path, mnist_labels);
+    write_test_file(bin_path, records);
+
+    std::vector<index_t> in_order(n);
+    for(index_t i = 0; i < n; ++i)
+        in_order[i] = i;
+    const unsigned seed = 7;
+
+    // in memory and mapped, in order and shuffled by the same seed
+    std::vector<index_t> shuffled[2];
+    for(int memory_map = 0; memory_map < 2; ++memory_map) {
+        data::MNIST mnist(img_path, label_path, batch_size, false, memory_map);
+        CHECK_EQUAL(mnist.n_samples(), n, "check1");
+        CHECK_EQUAL(mnist.n_batchs(), 3, "check1");
+        CHECK_TRUE(mnist.has_bytes() == bool(memory_map), "check1");
+        CHECK_TRUE(check_image_dataset(mnist, batch_size) == in_order, "check1");
+        mnist.shuffle(seed);
+        shuffled[memory_map] = check_image_dataset(mnist, batch_size);
+        std::vector<index_t> sorted = shuffled[memory_map];
+        std::sort(sorted.begin(), sorted.end());
+        CHECK_TRUE(sorted == in_order, "check1");
+    }
+    CHECK_TRUE(shuffled[0] == shuffled[1], "check1");
+    CHECK_TRUE(shuffled[0] != in_order, "check1");
+
+    for(int memory_map = 0; memory_map < 2; ++memory_map) {
+        data::Cifar10 cifar10(dir, false, batch_size, false, '/', memory_map);
+        CHECK_EQUAL(cifar10.n_samples(), n, "check2");
+        CHECK_EQUAL(cifar10.n_batchs(), 3, "check2");
+        CHECK_TRUE(cifar10.has_bytes() == bool(memory_map), "check2");
+        CHECK_TRUE(check_image_dataset(cifar10, batch_size) == in_order, "check2");
+        cifar10.shuffle(seed);
+        std::vector<index_t> order = check_image_dataset(cifar10, batch_size);
+        // Both datasets shuffle a permutation of the same samples.
+        CHECK_TRUE(order == shuffled[0], "check2");
+    }
+
+    std::remove(img_path.c_str());
+    std::remove(label_path.c_str());
+    std::remove(bin_path.c_str());
+    rmdir(dir.c_str());
+}
+
+// n samples of size 2 from first, the sample i is {i, i / 2} with label i.
+class ToyDataset : public st::data::DatasetBase {
+public:
+    explicit ToyDataset(st::index_t n, st::index_t first=0) : n_(n), first_(first) {}
+
+    st::index_t n_samples(void) const override { return n_; }
+    st::index_t n_batchs(void) const override { return 1; }
+    std::pair<const st::data_t*, st::index_t> get_sample(st::index_t idx) const override {
+        THROW_ERROR("Not implemented");
+    }
+    std::tuple<st::index_t, const st::data_t*, const st::index_t*>
+    get_batch(st::index_t idx) const override {
+        THROW_ERROR("Not implemented");
+    }
+    void shuffle(unsigned seed) override {}
+
+    st::index_t sample_size(void) const override { return 2; }
+    st::index_t copy_sample(st::index_t idx, st::data_t* dist) const override {
+        CHECK_TRUE(idx != bad_idx_, "bad sample");
+        dist[0] = first_ + idx;
+        dist[1] = (first_ + idx) / 2.0;
+        return first_ + idx;
+    }
+
+    st::index_t n_, first_;
+    st::index_t bad_idx_ = st::INDEX_MAX;
+};
+
+void test_data_loader() {
+    using namespace st;
+    index_t n_samples;
+    const data_t* samples;
+    const index_t* labels;
+
+    // in order, with the last smaller batch
+    ToyDataset dataset(10);
+    {
+        data::DataLoader loader(dataset, 4, false, false, 3, 2);
+        CHECK_EQUAL(loader.n_batchs(), 3, "check1");
+        for(index_t epoch = 0; epoch < 2; ++epoch) {
+            for(index_t j = 0; j < 3; ++j) {
+                std::tie(n_samples, samples, labels) = loader.next();
+                CHECK_EQUAL(n_samples, j < 2 ? 4 : 2, "check1");
+                for(index_t i = 0; i < n_samples; ++i) {
+                    CHECK_EQUAL(labels[i], j * 4 + i, "check1");
+                    CHECK_FLOAT_EQUAL(samples[2 * i], j * 4 + i, "check1");
+                    CHECK_FLOAT_EQUAL(samples[2 * i + 1], (j * 4 + i) / 2.0, "check1");
+                }
+            }
+        }
+    }
+
+    // shuffled and drop_last, every epoch is a new permutation
+    {
+        data::DataLoader loader(dataset, 3, true, true, 2, 3, 7);
+        data::DataLoader same_seed(dataset, 3, true, true, 1, 1, 7);
+        CHECK_EQUAL(loader.n_batchs(), 3, "check2");
+        std::vector<index_t> epoch1, epoch2;
+        for(index_t epoch = 0; epoch < 2; ++epoch) {
+            std::vector<index_t> seen(10, 0);
+            for(index_t j = 0; j < 3; ++j) {
+                std::tie(n_samples, samples, labels) = loader.next();
+                CHECK_EQUAL(n_samples, 3, "check2");
+                const index_t* other_labels = std::get<2>(same_seed.next());
+                for(index_t i = 0; i < n_samples; ++i) {
+                    CHECK_EQUAL(labels[i], other_labels[i], "check2");
+                    CHECK_FLOAT_EQUAL(samples[2 * i], labels[i], "check2");
+                    ++seen[labels[i]];
+                    (epoch == 0 ? epoch1 : epoch2).push_back(labels[i]);
+                }
+            }
+            CHECK_TRUE(std::count(seen.begin(), seen.end(), 1) == 9, "check2");
+        }
+        CHECK_TRUE(epoch1 != epoch2, "check2");
+    }
+
+    // gather in parallel on a pool
+    {
+        ThreadPool pool(3);
+        ThreadPool* prev_pool = ThreadPool::set_current(&pool);
+        std::vector<index_t> indices{9, 2, 4, 4, 0, 7, 1};
+        std::vector<data_t> gathered(2 * indices.size());
+        std::vector<index_t> gathered_labels(indices.size());
+        dataset.gather(indices.data(), indices.size(), 
+                       gathered.data(), gathered_labels.data());
+        ThreadPool::set_current(prev_pool);
+        for(index_t i = 0; i < indices.size(); ++i) {
+            CHECK_EQUAL(gathered_labels[i], indices[i], "check3");
+            CHECK_FLOAT_EQUAL(gathered[2 * i], indices[i], "check3");
+            CHECK_FLOAT_EQUAL(gathered[2 * i + 1], indices[i] / 2.0, "check3");
+        }
+    }
+
+    // errors of workers are rethrown by next()
+    dataset.bad_idx_ = 5;
+    {
+        data::DataLoader loader(dataset, 4, false, false);
+        loader.next();
+        bool thrown = false;
+        try {
+            loader.next();
+        } catch(err::Error&) {
+            thrown = true;
+        }
+        CHECK_TRUE(thrown, "check4");
+        std::tie(n_samples, samples, labels) = loader.next();
+        CHECK_EQUAL(labels[0], 8, "check4");
+    }
+    dataset.bad_idx_ = INDEX_MAX;
+
+    // next_into shares the storage of the slots, and sets the batch size
+    {
+        data::DataLoader loader(dataset, 4, false, false, 1, 2);
+        Tensor input(Shape{0, 2});
+        Tensor kept(Shape{1});
+        const data_t* first = nullptr;
+        for(index_t j = 0; j < 6; ++j) {
+            labels = loader.next_into(input);
+            index_t n = j % 3 < 2 ? 4 : 2;
+            CHECK_EQUAL(input.size(0), n, "check5");
+            CHECK_TRUE(input.is_contiguous(), "check5");
+            for(index_t i = 0; i < n; ++i) {
+                index_t idx = (j % 3) * 4 + i;
+                CHECK_EQUAL(labels[i], idx, "check5");
+                CHECK_FLOAT_EQUAL((input[{i, 0}]), idx, "check5");
+                CHECK_FLOAT_EQUAL((input[{i, 1}]), idx / 2.0, "check5");
+            }
+            // Two slots are used in turn, and nothing is allocated.
+            if(j == 0)
+                first = &input[{0, 0}];
+            CHECK_TRUE((&input[{0, 0}] == first) == (j % 2 == 0), "check5");
+            if(j == 2) {
+                Tensor mean = op::mean(input, 0);
+                CHECK_FLOAT_EQUAL((mean[{0}]), (8 + 9) / 2.0, "check5");
+            }
+        }
+
+        bool thrown = false;
+        try {
+            loader.next_into(kept);
+        } catch(err::Error&) {
+            thrown = true;
+        }
+        CHECK_TRUE(thrown, "check5");
+
+        // A gradient or a base would keep the old batch.
+        Tensor trained(Shape{4, 2}, true);
+        Tensor base(Shape{8, 2});
+        Tensor rows = base.slice(0, 4, 0);
+        Tensor* rejected[] = {&trained, &rows};
+        for(Tensor* tensor: rejected) {
+            thrown = false;
+            try {
+                loader.next_into(*tensor);
+            } catch(err::Error&) {
+                thrown = true;
+            }
+            CHECK_TRUE(thrown, "check5");
+            CHECK_EQUAL(tensor->size(0), 4, "check5");
+        }
+    }
+}
+
+void test_cache() {
+    using namespace st;
+    const std::string path = "test_cache.stc";
+    ToyDataset dataset(7);
+    index_t n_samples;
+    const data_t* samples;
+    const index_t* labels;
+
+    data::CacheType dtypes[] = {
+        data::CacheType::uint8, data::CacheType::float32, data::CacheType::float64
+    };
+    for(auto dtype: dtypes) {
+        data::write_cache(dataset, {1, 2}, path, dtype, 0.5);
+        CHECK_TRUE(data::is_cache(path), "check1");
+        data::CachedDataset cached(path, 3, false);
+        CHECK_EQUAL(cached.n_samples(), 7, "check1");
+        CHECK_EQUAL(cached.n_batchs(), 3, "check1");
+        CHECK_EQUAL(cached.sample_size(), 2, "check1");
+        CHECK_EQUAL(cached.sample_shape().size(), 2, "check1");
+        CHECK_EQUAL(cached.sample_shape()[1], 2, "check1");
+        for(index_t j = 0; j < 3; ++j) {
+            std::tie(n_samples, samples, labels) = cached.get_batch(j);
+            CHECK_EQUAL(n_samples, j < 2 ? 3 : 1, "check1");
+            for(index_t i = 0; i < n_samples; ++i) {
+                CHECK_EQUAL(labels[i], j * 3 + i, "check1");
+                CHECK_FLOAT_EQUAL(samples[2 * i], j * 3 + i, "check1");
+                CHECK_FLOAT_EQUAL(samples[2 * i + 1], (j * 3 + i) / 2.0, "check1");
+            }
+        }
+
+        // shuffled with a seed
+        cached.shuffle(3);
+        data::CachedDataset other(path, 3, false);
+        other.shuffle(3);
+        std::vector<index_t> seen(7, 0);
+        for(index_t j = 0; j < 3; ++j) {
+            std::tie(n_samples, samples, labels) = cached.get_batch(j);
+            const index_t* other_labels = std::get<2>(other.get_batch(j));
+            for(index_t i = 0; i < n_samples; ++i) {
+                CHECK_EQUAL(labels[i], other_labels[i], "check2");
+                CHECK_FLOAT_EQUAL(samples[2 * i + 1], labels[i] / 2.0, "check2");
+                ++seen[labels[i]];
+            }
+        }
+        CHECK_TRUE(std::count(seen.begin(), seen.end(), 1) == 7, "check2");
+    }
+
+    // values which aren't bytes, and files which aren't caches
+    bool thrown = false;
+    try {
+        data::write_cache(dataset, {2}, path, data::CacheType::uint8, 0.25 * 3);
+    } catch(err::Error&) {
+        thrown = true;
+    }
+    CHECK_TRUE(thrown, "check3");
+    CHECK_TRUE(!data::is_cache(path), "check3");
+    CHECK_TRUE(!data::is_cache("not_exist.stc"), "check3");
+
+    // headers whose sizes wrap around, and negative labels
+    data::write_cache(dataset, {2}, path, data::CacheType::float64);
+    std::FILE* file = std::fopen(path.c_str(), "r+b");
+    data::CacheHeader header;
+    CHECK_EQUAL(std::fread(&header, sizeof(header), 1, file), 1, "check4");
+    std::uint64_t file_size = header.labels_offset() + 7 * sizeof(std::int32_t);
+    CHECK_TRUE(!header.check(file_size), "check4");
+    data::CacheHeader wrapped = header;
+    wrapped.n_samples_ = std::uint64_t(1) << 60;
+    CHECK_TRUE(wrapped.check(file_size), "check4");
+    wrapped = header;
+    wrapped.ndim_ = 4;
+    for(index_t i = 0; i < 4; ++i)
+        wrapped.shape_[i] = 1 << 16;
+    CHECK_TRUE(wrapped.check(file_size), "check4");
+
+    std::int32_t label = -1;
+    std::fseek(file, header.labels_offset() + 3 * sizeof(label), SEEK_SET);
+    std::fwrite(&label, sizeof(label), 1, file);
+    std::fclose(file);
+    thrown = false;
+    try {
+        data::CachedDataset cached(path, 3, false);
+    } catch(err::Error&) {
+        thrown = true;
+    }
+    CHECK_TRUE(thrown, "check4");
+    std::remove(path.c_str());
+}
+
+void test_streaming_dataset() {
+    using namespace st;
+    // shards of samples [0, 4), [4, 9) and [9, 12), in different dtypes
+    std::vector<std::string> paths{
+        "test_shard0.stc", "test_shard1.stc", "test_shard2.stc"
+    };
+    data::write_cache(ToyDataset(4, 0), {2}, paths[0], data::CacheType::uint8, 0.5);
+    data::write_cache(ToyDataset(5, 4), {2}, paths[1], data::CacheType::float32);
+    data::write_cache(ToyDataset(3, 9), {2}, paths[2], data::CacheType::float64);
+
+    // in order
+    {
+        data::StreamingDataset stream(paths, 5);
+        CHECK_EQUAL(stream.n_samples(), 12, "check1");
+        CHECK_EQUAL(stream.n_batchs(), 3, "check1");
+        for(index_t epoch = 0; epoch < 2; ++epoch) {
+            index_t n_batchs = 0, next_label = 0;
+            for(auto& batch: stream) {
+                index_t n_samples = std::get<0>(batch);
+                CHECK_EQUAL(n_samples, n_batchs < 2 ? 5 : 2, "check1");
+                for(index_t i = 0; i < n_samples; ++i) {
+                    CHECK_EQUAL(std::get<2>(batch)[i], next_label, "check1");
+                    CHECK_FLOAT_EQUAL(std::get<1>(batch)[2 * i], next_label, "check1");
+                    CHECK_FLOAT_EQUAL(std::get<1>(batch)[2 * i + 1], next_label / 2.0, "check1");
+                    ++next_label;
+                }
+                ++n_batchs;
+            }
+            CHECK_EQUAL(n_batchs, 3, "check1");
+        }
+    }
+
+    // shuffled with drop_last, reproducible by the seed
+    {
+        data::StreamingDataset stream(paths, 5, 4, 11, true);
+        data::StreamingDataset same_seed(paths, 5, 4, 11, true);
+        CHECK_EQUAL(stream.n_batchs(), 2, "check2");
+        std::vector<index_t> epochs[2];
+        for(index_t epoch = 0; epoch < 2; ++epoch) {
+            same_seed.reset();
+            std::vector<index_t> seen(12, 0);
+            index_t n_batchs = 0;
+            for(auto& batch: stream) {
+                data::StreamingDataset::Batch other = same_seed.next_batch();
+                CHECK_EQUAL(std::get<0>(batch), 5, "check2");
+                CHECK_EQUAL(std::get<0>(other), 5, "check2");
+                for(index_t i = 0; i < 5; ++i) {
+                    index_t label = std::get<2>(batch)[i];
+                    CHECK_EQUAL(std::get<2>(other)[i], label, "check2");
+                    CHECK_FLOAT_EQUAL(std::get<1>(batch)[2 * i + 1], label / 2.0, "check2");
+                    ++seen[label];
+                    epochs[epoch].push_back(label);
+                }
+                ++n_batchs;
+            }
+            CHECK_EQUAL(n_batchs, 2, "check2");
+            // The iterator read the end of the epoch, which is dropped.
+            CHECK_EQUAL(std::get<0>(same_seed.next_batch()), 0, "check2");
+            CHECK_TRUE(std::count(seen.begin(), seen.end(), 1) == 10, "check2");
+        }
+        CHECK_TRUE(epochs[0] != epochs[1], "check2");
+    }
+
+    for(auto& path: paths)
+        std::remove(path.c_str());
+}
+
+// Images of 2 channels of 3x4 bytes, whose byte at (c, i, j) of the sample s
+// is 1 + s * 30 + c * 12 + i * 4 + j.
+class ByteDataset : public ToyDataset {
+public:
+    static constexpr st::index_t C = 2, H = 3, W = 4;
+
+    explicit ByteDataset(st::index_t n) : ToyDataset(n) {}
+
+    static unsigned char byte(st::index_t s, st::index_t c,
+                              st::index_t i, st::index_t j) {
+        return 1 + s * 30 + c * 12 + i * 4 + j;
+    }
+
+    st::index_t sample_size(void) const override { return C * H * W; }
+    bool has_bytes(void) const override { return true; }
+    st::data_t byte_scale(void) const override { return 1; }
+    st::index_t copy_bytes(st::index_t idx, unsigned char* dist) const override {
+        for(st::index_t c = 0; c < C; ++c)
+            for(st::index_t i = 0; i < H; ++i)
+                for(st::index_t j = 0; j < W; ++j)
+                    dist[(c * H + i) * W + j] = byte(idx, c, i, j);
+        return idx;
+    }
+};
+
+void test_augment() {
+    using namespace st;
+    constexpr index_t C = ByteDataset::C, H = ByteDataset::H, W = ByteDataset::W;
+    ByteDataset dataset(6);
+    unsigned char bytes[C * H * W];
+    data_t out[C * H * W];
+    std::default_random_engine engine(3);
+    data::ImageAugment::Scratch scratch;
+    dataset.copy_bytes(1, bytes);
+
+    // normalize, and flip with probability 1
+    {
+        data::ImageAugment augment(C, H, W);
+        augment.normalize({2, 4}, {0.5, 2});
+        CHECK_TRUE(augment.deterministic(), "check1");
+        augment.apply(bytes, 0.5, out, engine, scratch);
+        for(index_t c = 0; c < C; ++c)
+            for(index_t i = 0; i < H; ++i)
+                for(index_t j = 0; j < W; ++j)
+                    CHECK_FLOAT_EQUAL(out[(c * H + i) * W + j],
+                                      (ByteDataset::byte(1, c, i, j) * 0.5 - (c ? 4 : 2))
+                                      / (c ? 2 : 0.5), "check1");
+
+        augment.horizontal_flip(1);
+        CHECK_TRUE(!augment.deterministic(), "check1");
+        augment.apply(bytes, 0.5, out, engine, scratch);
+        for(index_t c = 0; c < C; ++c)
+            for(index_t i = 0; i < H; ++i)
+                for(index_t j = 0; j < W; ++j)
+                    CHECK_FLOAT_EQUAL(out[(c * H + i) * W + j],
+                                      (ByteDataset::byte(1, c, i, W - 1 - j) * 0.5
+                                       - (c ? 4 : 2)) / (c ? 2 : 0.5), "check1");
+    }
+
+    // a random crop is a shift of the image with black padding
+    {
+        data::ImageAugment augment(C, H, W);
+        augment.random_crop(1);
+        std::vector<index_t> shifts(9, 0);
+        for(index_t k = 0; k < 100; ++k) {
+            augment.apply(bytes, 1, out, engine, scratch);
+            bool found = false;
+            for(int dr = -1; dr <= 1 && !found; ++dr) {
+                for(int dc = -1; dc <= 1 && !found; ++dc) {
+                    bool match = true;
+                    for(index_t c = 0; c < C; ++c)
+                        for(index_t i = 0; i < H; ++i)
+                            for(index_t j = 0; j < W; ++j) {
+                                // -1 wraps to the largest index_t, out of the image
+                                index_t r = i + dr, q = j + dc;
+                                data_t expected = r < H && q < W
+                                                  ? ByteDataset::byte(1, c, r, q) : 0;
+                                match = match && out[(c * H + i) * W + j] == expected;
+                            }
+                    if(match) {
+                        found = true;
+                        ++shifts[(dr + 1) * 3 + dc + 1];
+                    }
+                }
+            }
+            CHECK_TRUE(found, "check2");
+        }
+        CHECK_TRUE(std::count(shifts.begin(), shifts.end(), 0) == 0, "check2");
+    }
+
+    // cutout sets the same square of every channel to 0
+    {
+        data::ImageAugment augment(C, H, W);
+        augment.cutout(2);
+        for(index_t k = 0; k < 20; ++k) {
+            augment.apply(bytes, 1, out, engine, scratch);
+            index_t n_zeros = 0;
+            for(index_t p = 0; p < H * W; ++p) {
+                bool zero = out[p] == 0;
+                CHECK_TRUE(zero == (out[H * W + p] == 0), "check3");
+                if(!zero)
+                    CHECK_FLOAT_EQUAL(out[p], bytes[p], "check3");
+                n_zeros += zero;
+            }
+            CHECK_TRUE(n_zeros >= 1 && n_zeros <= 4, "check3");
+        }
+    }
+
+    // channels last
+    {
+        data::ImageAugment augment(C, H, W);
+        augment.channels_last();
+        augment.apply(bytes, 1, out, engine, scratch);
+        for(index_t c = 0; c < C; ++c)
+            for(index_t i = 0; i < H; ++i)
+                for(index_t j = 0; j < W; ++j)
+                    CHECK_FLOAT_EQUAL(out[(i * W + j) * C + c],
+                                      ByteDataset::byte(1, c, i, j), "check4");
+    }
+
+    // in a loader, batches are the same whatever the number of workers
+    {
+        data::ImageAugment augment(C, H, W);
+        augment.random_crop(1).horizontal_flip();
+        data::DataLoader loader(dataset, 4, true, false, 3, 2, 5, &augment);
+        data::DataLoader same_seed(dataset, 4, true, false, 1, 1, 5, &augment);
+        for(index_t j = 0; j < 4; ++j) {
+            index_t n_samples, other_n_samples;
+            const data_t *samples, *other_samples;
+            const index_t *labels, *other_labels;
+            std::tie(n_samples, samples, labels) = loader.next();
+            std::tie(other_n_samples, other_samples, other_labels) = same_seed.next();
+            CHECK_EQUAL(n_samples, j % 2 ? 2 : 4, "check5");
+            CHECK_EQUAL(other_n_samples, n_samples, "check5");
+            for(index_t i = 0; i < n_samples; ++i)
+                CHECK_EQUAL(other_labels[i], labels[i], "check5");
+            for(index_t i = 0; i < n_samples * C * H * W; ++i)
+                CHECK_FLOAT_EQUAL(other_samples[i], samples[i], "check5");
+        }
+
+        bool thrown = false;
+        try {
+            data::DataLoader no_bytes(ToyDataset(6), 4, false, false, 1, 1, 0, &augment);
+        } catch(err::Error&) {
+            thrown = true;
+        }
+        CHECK_TRUE(thrown, "check5");
+    }
+}
+
+// Run func(rank) in n_processes processes. The forked ones exit when it
+// returns, and the rank 0 returns whether it succeeded in all of them.
+template<typename Func>
+bool run_processes(st::index_t n_processes, Func func) {
+    st::dist::ForkedProcesses processes(n_processes);
+    bool success = true;
+    try {
+        func(processes);
+    } catch(std::exception& e) {
+        std::cerr << "rank " << processes.rank() << ": " << e.what() << endl;
+        success = false;
+    }
+    if(processes.rank() != 0)
+        std::_Exit(success ? 0 : 1);
+    return processes.wait() == 0 && success;
+}
+
+void test_shm_all_reduce() {
+    using namespace st;
+    constexpr index_t N = 3;
+    bool success = run_processes(N, [](dist::ForkedProcesses& processes) {
+        index_t rank = processes.rank();
+        // Pieces of 5 elements, the last ones are shorter than the ring.
+        dist::ShmProcessGroup group(processes.shm_name(), rank, N, 5, 10);
+        CHECK_EQUAL(group.rank(), rank, "check1");
+        CHECK_EQUAL(group.world_size(), N, "check1");
+
+        for(index_t n: {13, 2, 1}) {
+            std::vector<data_t> data(n);
+            for(index_t i = 0; i < n; ++i)
+                data[i] = (rank + 1) * i;
+            group.all_reduce(data.data(), n);
+            for(index_t i = 0; i < n; ++i)
+                CHECK_FLOAT_EQUAL(data[i], 6 * i, "check2");
+        }
+
+        // all-reduce again right after, buffers are reused
+        std::vector<data_t> data(7, rank);
+        data_t expected = 1;
+        for(index_t k = 0; k < 10; ++k) {
+            group.all_reduce(data.data(), data.size());
+            expected *= 3;
+            for(data_t value: data)
+                CHECK_FLOAT_EQUAL(value, expected, "check3");
+        }
+
+        std::vector<data_t> broadcast(12, rank);
+        if(rank == 1)
+            for(index_t i = 0; i < 12; ++i)
+                broadcast[i] = i;
+        group.broadcast(broadcast.data(), broadcast.size(), 1);
+        for(index_t i = 0; i < 12; ++i)
+            CHECK_FLOAT_EQUAL(broadcast[i], i, "check4");
+        group.barrier();
+    });
+    CHECK_TRUE(success, "check all processes");
+}
+
+void test_data_parallel() {
+    using namespace st;
+    bool success = run_processes(2, [](dist::ForkedProcesses& processes) {
+        index_t rank = processes.rank();
+        dist::ShmProcessGroup group(processes.shm_name(), rank, 2, 4, 10);
+
+        // The rank 0 shards samples 0, 2, 4, and the rank 1 samples 1, 3, 5.
+        ToyDataset dataset(7);
+        data::DatasetShard shard(dataset, rank, 2, 2, false);
+        CHECK_EQUAL(shard.n_samples(), 3, "check1");
+        CHECK_EQUAL(shard.n_batchs(), 2, "check1");
+        for(index_t i = 0; i < 3; ++i)
+            CHECK_FLOAT_EQUAL(shard.get_sample(i).first[0], rank + 2 * i, "check1");
+
+        data_t weight_data[3][2] = {{0.1, -0.2}, {0.3, 0.4}, {-0.5, 0.6}};
+        data_t bias_data[3] = {0.7, -0.8, 0.9};
+        nn::Linear linear(2, 3);
+        nn::ParamsDict params = linear.parameters();
+        Tensor& weight = params["weight"];
+        Tensor& bias = params["bias"];
+        if(rank == 0) {
+            nn::CpyInitializer(weight, reinterpret_cast<data_t*>(weight_data)).init();
+            nn::CpyInitializer(bias, bias_data).init();
+        }
+
+        // Parameters are taken from the rank 0, and each one has a bucket.
+        nn::DataParallel parallel(params, group, 4);
+        CHECK_EQUAL(parallel.n_buckets(), 2, "check2");
+        for(index_t i = 0; i < 3; ++i) {
+            for(index_t j = 0; j < 2; ++j) {
+                data_t value = weight[{i, j}];
+                CHECK_FLOAT_EQUAL(value, weight_data[i][j], "check2");
+            }
+            data_t value = bias[{0, i}];
+            CHECK_FLOAT_EQUAL(value, bias_data[i], "check2");
+        }
+
+        // Gradients are averaged over the batches of both processes: samples
+        // 0 to 3, then 4 and 5.
+        nn::SGD optimizer(params, 0.5);
+        data_t sums[2][2] = {{6 / 2.0, 3 / 2.0}, {9 / 2.0, 4.5 / 2.0}};
+        data_t counts[2] = {2, 1};
+        for(index_t k = 0; k < 2; ++k) {
+            index_t n_samples;
+            const data_t* samples;
+            const index_t* labels;
+            std::tie(n_samples, samples, labels) = shard.get_batch(k);
+            Tensor input(samples, Shape{n_samples, 2});
+            Tensor out = linear.forward(input);
+            out.backward();
+            parallel.synchronize();
+
+            Tensor weight_grad = weight.grad();
+            Tensor bias_grad = bias.grad();
+            for(index_t i = 0; i < 3; ++i) {
+                for(index_t j = 0; j < 2; ++j) {
+                    data_t value = weight_grad[{i, j}];
+                    CHECK_FLOAT_EQUAL(value, sums[k][j], "check3");
+                }
+                data_t value = bias_grad[{0, i}];
+                CHECK_FLOAT_EQUAL(value, counts[k], "check3");
+            }
+            optimizer.step();
+            optimizer.zero_grad();
+        }
+        for(index_t i = 0; i < 3; ++i) {
+            for(index_t j = 0; j < 2; ++j) {
+                data_t value = weight[{i, j}];
+                CHECK_FLOAT_EQUAL(value, weight_data[i][j] - 0.5 * (sums[0][j] + sums[1][j]),
+                                  "check4");
+            }
+            data_t value = bias[{0, i}];
+            CHECK_FLOAT_EQUAL(value, bias_data[i] - 0.5 * (counts[0] + counts[1]), "check4");
+        }
+    });
+    CHECK_TRUE(success, "check all processes");
+}
+
+void test_tcp_group() {
+    using namespace st;
+    constexpr index_t N = 3;
+    int port = dist::TcpProcessGroup::free_port();
+    bool success = run_processes(N, [port](dist::ForkedProcesses& processes) {
+        index_t rank = processes.rank();
+        dist::TcpProcessGroup group("localhost", port, rank, N, 10);
+        CHECK_EQUAL(group.rank(), rank, "check1");
+        CHECK_EQUAL(group.world_size(), N, "check1");
+
+        // chunks are shorter than the ring for the small ones
+        for(index_t n: {0, 1, 2, 13, 100003}) {
+            std::vector<data_t> data(n);
+            for(index_t i = 0; i < n; ++i)
+                data[i] = (rank + 1) * (i % 11);
+            group.all_reduce(data.data(), n);
+            for(index_t i = 0; i < n; ++i)
+                CHECK_FLOAT_EQUAL(data[i], 6 * (i % 11), "check2");
+        }
+
+        // Compressed, sums are rounded, and are the same in all processes.
+        std::vector<data_t> data(1001), root_data;
+        for(index_t i = 0; i < data.size(); ++i)
+            data[i] = (rank + 1) * 0.001 * i;
+        group.all_reduce_half(data.data(), data.size(), HalfType::bfloat16);
+        root_data = data;
+        group.broadcast(root_data.data(), root_data.size(), 0);
+        for(index_t i = 0; i < data.size(); ++i) {
+            CHECK_EQUAL(data[i], root_data[i], "check3");
+            CHECK_TRUE(std::abs(data[i] - 0.006 * i) <= 0.01 * 0.006 * i, "check3");
+            CHECK_EQUAL(half::load(HalfType::bfloat16, 
+                                   half::store(HalfType::bfloat16, data[i])), 
+                        data[i], "check3");
+        }
+
+        // broadcast of several pieces from another root
+        index_t n = dist::TcpProcessGroup::kPieceSize * 2 + 3;
+        std::vector<data_t> broadcast(n, rank);
+        if(rank == 2)
+            for(index_t i = 0; i < n; ++i)
+                broadcast[i] = i;
+        group.broadcast(broadcast.data(), n, 2);
+        for(index_t i = 0; i < n; ++i)
+            CHECK_FLOAT_EQUAL(broadcast[i], i, "check4");
+        group.barrier();
+    });
+    CHECK_TRUE(success, "check all processes");
+
+    // Without the others, the rank 0 gives up waiting.
+    bool thrown = false;
+    try {
+        dist::TcpProcessGroup group("localhost", dist::TcpProcessGroup::free_port(),
+                                    0, 2, 0.2);
+    } catch(err::Error&) {
+        thrown = true;
+    }
+    CHECK_TRUE(thrown, "check5");
+}
+
+void test_tcp_data_parallel() {
+    using namespace st;
+    constexpr index_t N = 3;
+    int port = dist::TcpProcessGroup::free_port();
+    bool success = run_processes(N, [port](dist::ForkedProcesses& processes) {
+        index_t rank = processes.rank();
+        dist::TcpProcessGroup group("127.0.0.1", port, rank, N, 10);
+
+        // The rank r shards samples r, r + 3 and r + 6.
+        ToyDataset dataset(9);
+        data::DatasetShard shard(dataset, rank, N, 3, false);
+        nn::Linear linear(2, 3);
+        nn::ParamsDict params = linear.parameters();
+        Tensor& weight = params["weight"];
+        Tensor& bias = params["bias"];
+        nn::DataParallel parallel(params, group, 4);
+        // Sums of the gradients are exact in bfloat16.
+        parallel.register_comm_hook(nn::DataParallel::half_compression());
+        CHECK_TRUE(parallel.parameters_in_sync(), "check1");
+
+        // The optimizer synchronizes the gradients before it steps.
+        nn::SGD optimizer(params, 0.5);
+        optimizer.set_data_parallel(&parallel);
+        data_t old_weight[3][2], old_bias[3];
+        for(index_t i = 0; i < 3; ++i) {
+            for(index_t j = 0; j < 2; ++j)
+                old_weight[i][j] = weight[{i, j}];
+            old_bias[i] = bias[{0, i}];
+        }
+        data_t sums[2] = {36 / 3.0, 18 / 3.0};
+        for(index_t k = 0; k < 2; ++k) {
+            index_t n_samples;
+            const data_t* samples;
+            const index_t* labels;
+            std::tie(n_samples, samples, labels) = shard.get_batch(0);
+            Tensor input(samples, Shape{n_samples, 2});
+            Tensor out = linear.forward(input);
+            out.backward();
+            optimizer.step();
+
+            Tensor weight_grad = weight.grad();
+            Tensor bias_grad = bias.grad();
+            for(index_t i = 0; i < 3; ++i) {
+                for(index_t j = 0; j < 2; ++j) {
+                    data_t value = weight_grad[{i, j}];
+                    CHECK_FLOAT_EQUAL(value, sums[j], "check2");
+                }
+                data_t value = bias_grad[{0, i}];
+                CHECK_FLOAT_EQUAL(value, 3, "check2");
+            }
+            optimizer.zero_grad();
+        }
+        for(index_t i = 0; i < 3; ++i) {
+            for(index_t j = 0; j < 2; ++j) {
+                data_t value = weight[{i, j}];
+                CHECK_FLOAT_EQUAL(value, old_weight[i][j] - 2 * 0.5 * sums[j], "check3");
+            }
+            data_t value = bias[{0, i}];
+            CHECK_FLOAT_EQUAL(value, old_bias[i] - 2 * 0.5 * 3, "check3");
+        }
+        CHECK_TRUE(parallel.parameters_in_sync(), "check3");
+
+        // a process gone astray is found by all of them
+        if(rank == 1)
+            weight[{0, 0}] += 1;
+        CHECK_TRUE(!parallel.parameters_in_sync(), "check4");
+    });
+    CHECK_TRUE(success, "check all processes");
+}
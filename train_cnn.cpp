@@ -1,37 +1,85 @@
+#include <algorithm>
 #include <iostream>
 #include <chrono>
+#include <string>
+#include <vector>
 
 #include "utils/base_config.h"
 #include "utils/allocator.h"
+#include "utils/grad_mode.h"
 #include "exp/function.h"
 #include "tensor/tensor.h"
+#include "tensor/grad_engine.h"
+#include "tensor/memory_planner.h"
 #include "nn/module.h"
+#include "nn/checkpoint.h"
+#include "nn/data_parallel.h"
 #include "data/data.h"
+#include "data/data_loader.h"
+#include "data/augment.h"
+#include "data/cache.h"
+#include "data/shard.h"
+#include "dist/launch.h"
+#include "dist/shm_group.h"
 #include "nn/optim.h"
 
 using st::index_t;
 using st::data_t;
 
 
-class SimpleCNN : public st::nn::Module {
+// conv-conv-pool stage of SimpleCNN
+class Stage : public st::nn::Module {
 public:
-    SimpleCNN() = default;
-    ~SimpleCNN() = default;
+    Stage(index_t in_channels, index_t out_channels)
+            : conv1_(in_channels, out_channels, {3, 3}, {1, 1}, {1, 1}),
+              conv2_(out_channels, out_channels, {3, 3}, {1, 1}, {1, 1}),
+              pool_({2, 2}, {2, 2}, {0, 0})
+        {}
 
     st::Tensor forward(const st::Tensor& input) {
-        st::Tensor s0_x1 = conv0.forward(input);
+        st::Tensor x1 = conv1_.forward(input);
+        st::Tensor x2 = conv2_.forward(x1);
+        st::Tensor x3 = pool_.forward(x2);
+        return x3;
+    }
+
+    st::nn::ParamsDict parameters(void) {
+        return {
+            {"conv1", conv1_.parameters()},
+            {"conv2", conv2_.parameters()}
+        };
+    }
 
-        st::Tensor s1_x1 = s1_conv1.forward(s0_x1);
-        st::Tensor s1_x2 = s1_conv2.forward(s1_x1);
-        st::Tensor s1_x3 = s1_pool.forward(s1_x2);
+    void mixed_precision(bool enable, st::HalfType type) {
+        conv1_.mixed_precision(enable, type);
+        conv2_.mixed_precision(enable, type);
+    }
+private:
+    st::nn::Conv2dWithReLU conv1_;
+    st::nn::Conv2dWithReLU conv2_;
+    st::nn::MaxPool2d pool_;
+};
 
-        st::Tensor s2_x1 = s2_conv1.forward(s1_x3);
-        st::Tensor s2_x2 = s2_conv2.forward(s2_x1);
-        st::Tensor s2_x3 = s2_pool.forward(s2_x2);
+class SimpleCNN : public st::nn::Module {
+public:
+    // With checkpoint, activations inside the stages are recomputed in
+    // backward instead of being kept.
+    explicit SimpleCNN(bool checkpoint)
+            : s1_checkpoint(stage1),
+              s2_checkpoint(stage2),
+              s1(checkpoint ? static_cast<st::nn::Module&>(s1_checkpoint) : stage1),
+              s2(checkpoint ? static_cast<st::nn::Module&>(s2_checkpoint) : stage2)
+        {}
+    ~SimpleCNN() = default;
 
-        st::Tensor feat(s2_x3.size());
-        feat = s2_x3;
+    st::Tensor forward(const st::Tensor& input) {
+        st::Tensor s0_x1 = conv0.forward(input);
+        st::Tensor s1_x = s1.forward(s0_x1);
+        st::Tensor s2_x = s2.forward(s1_x);
 
+        // The stages end with a permuted view, which is copied to be
+        // flattened. The copy passes the gradient back to the stages.
+        st::Tensor feat = st::op::identity(s2_x);
         st::Tensor y1 = linear1.forward(feat.view({
             feat.size(0), 64*4*4
         }));
@@ -42,29 +90,51 @@ public:
     st::nn::ParamsDict parameters(void) {
         return {
             {"conv0", conv0.parameters()},
-            {"s1_conv1", s1_conv1.parameters()},
-            {"s1_conv2", s1_conv2.parameters()},
-            {"s2_conv1", s2_conv1.parameters()},
-            {"s2_conv2", s2_conv2.parameters()},
+            {"s1_", stage1.parameters()},
+            {"s2_", stage2.parameters()},
             {"linear1", linear1.parameters()},
             {"linear2", linear2.parameters()}
         };
     }
+
+    void mixed_precision(bool enable, st::HalfType type) {
+        conv0.mixed_precision(enable, type);
+        stage1.mixed_precision(enable, type);
+        stage2.mixed_precision(enable, type);
+        linear1.mixed_precision(enable, type);
+        linear2.mixed_precision(enable, type);
+    }
 private:
     st::nn::Conv2dWithReLU conv0{3, 32, {5, 5}, {2, 2}, {2, 2}};
-
-    st::nn::Conv2dWithReLU s1_conv1{32, 32, {3, 3}, {1, 1}, {1, 1}};
-    st::nn::Conv2dWithReLU s1_conv2{32, 32, {3, 3}, {1, 1}, {1, 1}};
-    st::nn::MaxPool2d s1_pool{{2, 2}, {2, 2}, {0, 0}};
-
-    st::nn::Conv2dWithReLU s2_conv1{32, 64, {3, 3}, {1, 1}, {1, 1}};
-    st::nn::Conv2dWithReLU s2_conv2{64, 64, {3, 3}, {1, 1}, {1, 1}};
-    st::nn::MaxPool2d s2_pool{{2, 2}, {2, 2}, {0, 0}};
+    Stage stage1{32, 32};
+    Stage stage2{32, 64};
 
     st::nn::LinearWithReLU linear1{64*4*4, 256};
     st::nn::Linear linear2{256, 10};
+
+    st::nn::Checkpoint s1_checkpoint;
+    st::nn::Checkpoint s2_checkpoint;
+    st::nn::Module& s1;
+    st::nn::Module& s2;
 };
 
+// Cifar10 is parsed into a cache at the first run, which later runs map.
+st::data::CachedDataset load_cifar10(const std::string& dataset_dir, bool train,
+                                     const std::string& cache_path,
+                                     index_t batch_size) {
+    if(!st::data::is_cache(cache_path)) {
+        st::data::Cifar10 dataset(dataset_dir, train, batch_size,
+                                  /*shuffle=*/false, /*path_sep=*/'\\',
+                                  /*memory_map=*/true);
+        st::data::write_cache(dataset,
+                              {st::data::Cifar10::Img::n_channels_,
+                               st::data::Cifar10::Img::n_rows_,
+                               st::data::Cifar10::Img::n_cols_},
+                              cache_path, st::data::CacheType::uint8);
+    }
+    return st::data::CachedDataset(cache_path, batch_size, /*shuffle=*/false);
+}
+
 int main() {
     // config
     constexpr index_t epoch = 7;
@@ -77,44 +147,106 @@ int main() {
     constexpr index_t lr_decay_epoch2 = 5;
 
     constexpr index_t print_iters = 10;
+    constexpr bool mixed_precision = false;
+    constexpr index_t backward_threads = 4;
+    constexpr bool checkpoint = false;
+    constexpr bool plan_memory = true;
+    constexpr index_t loader_workers = 2;
+    // Processes training in parallel on shards of the dataset, each with a
+    // batch of batch_size samples.
+    constexpr index_t n_processes = 1;
 
     using namespace std::chrono;
     steady_clock::time_point start_tp = steady_clock::now();
 
     // dataset
-    st::data::Cifar10 train_dataset(
+    st::data::CachedDataset train_dataset = load_cifar10(
         /*dataset_dir=*/"D:\\storehouse\\dataset\\cifar-10-batches-bin",
         /*train=*/true,
-        /*batch_size=*/batch_size,
-        /*shuffle=*/false,
-        /*path_sep=*/'\\'
+        /*cache_path=*/"D:\\storehouse\\dataset\\cifar-10-batches-bin\\train.stc",
+        /*batch_size=*/batch_size
     );
-    st::data::Cifar10 val_dataset(
+    st::data::CachedDataset val_dataset = load_cifar10(
         /*dataset_dir=*/"D:\\storehouse\\dataset\\cifar-10-batches-bin",
         /*train=*/false,
-        /*batch_size=*/batch_size,
-        /*shuffle=*/false,
-        /*path_sep=*/'\\'
+        /*cache_path=*/"D:\\storehouse\\dataset\\cifar-10-batches-bin\\test.stc",
+        /*batch_size=*/batch_size
     );
     std::cout << "train dataset length: " << train_dataset.n_samples() << std::endl;
     std::cout << "val dataset length: " << val_dataset.n_samples() << std::endl;
 
+    // The processes are forked before any thread is started. They share the
+    // pages of the mapped datasets, and each one loads its own shard.
+    st::dist::ForkedProcesses processes(n_processes);
+    const index_t rank = processes.rank();
+    st::dist::ShmProcessGroup group(processes.shm_name(), rank, n_processes);
+    st::data::DatasetShard train_shard(train_dataset, rank, n_processes,
+                                       batch_size, /*shuffle=*/false);
+    st::data::DatasetShard val_shard(val_dataset, rank, n_processes,
+                                     batch_size, /*shuffle=*/false);
+    // Only the rank 0 prints.
+    if(rank != 0)
+        std::cout.setstate(std::ios::failbit);
+
     // model and criterion
-    SimpleCNN scnn;
+    SimpleCNN scnn(checkpoint);
+    scnn.mixed_precision(mixed_precision, st::HalfType::bfloat16);
+    st::GradEngine::set_num_threads(backward_threads);
     st::nn::CrossEntropy criterion;
 
-    // optimizer
+    // optimizer. Gradients are averaged over the processes while backward
+    // goes on, and the optimizer waits for them before it steps.
+    st::nn::DataParallel parallel(scnn.parameters(), group);
     st::nn::SGDwithMomentum optimizer(
         scnn.parameters(), /*lr=*/lr, /*momentum=*/momentum
     );
+    optimizer.set_data_parallel(&parallel);
+
+    // The first full batch is traced, and later ones use the planned slab.
+    // Without the graph, activations of evaluation die layer by layer, and
+    // share much of the slab.
+    st::MemoryPlanner planner;
+    st::MemoryPlanner val_planner;
+
+    // Training images are cropped, flipped and normalized by the workers of
+    // the loader while the model computes. Evaluation only normalizes them.
+    const std::vector<data_t> cifar_mean{0.4914, 0.4822, 0.4465};
+    const std::vector<data_t> cifar_std{0.2470, 0.2435, 0.2616};
+    st::data::ImageAugment train_augment(st::data::Cifar10::Img::n_channels_,
+                                         st::data::Cifar10::Img::n_rows_,
+                                         st::data::Cifar10::Img::n_cols_);
+    train_augment.random_crop(4).horizontal_flip().normalize(cifar_mean, cifar_std);
+    st::data::ImageAugment val_augment(st::data::Cifar10::Img::n_channels_,
+                                       st::data::Cifar10::Img::n_rows_,
+                                       st::data::Cifar10::Img::n_cols_);
+    val_augment.normalize(cifar_mean, cifar_std);
+
+    st::data::DataLoader train_loader(
+        train_shard, batch_size, /*shuffle=*/true, /*drop_last=*/false,
+        /*n_workers=*/loader_workers, /*n_prefetch=*/4, /*seed=*/0,
+        /*augment=*/&train_augment
+    );
+    st::data::DataLoader val_loader(
+        val_shard, batch_size, /*shuffle=*/false, /*drop_last=*/false,
+        /*n_workers=*/loader_workers, /*n_prefetch=*/4, /*seed=*/0,
+        /*augment=*/&val_augment
+    );
 
+    // Batches are taken into the input in place. It shares the storage of a
+    // slot of the loader, while the workers fill the others, so it's empty
+    // until the first batch.
+    st::Tensor input(st::Shape{0,
+                               st::data::Cifar10::Img::n_channels_,
+                               st::data::Cifar10::Img::n_rows_,
+                               st::data::Cifar10::Img::n_cols_});
     index_t n_samples;
-    const data_t* batch_samples;
     const index_t* batch_labels;
     for(index_t i = 0; i < epoch; ++i) {
         std::cout << "Epoch " << i << " training..." << std::endl;
-        std::cout << "total iters: " << train_dataset.n_batchs() << std::endl;
-        train_dataset.shuffle();
+        std::cout << "total iters: " << train_loader.n_batchs() << std::endl;
+        duration<double> backward_time(0);
+        index_t backward_peak_memory = 0;
+        index_t backward_held_memory = 0;
 
         if(i == lr_decay_epoch1 || i == lr_decay_epoch2) {
             data_t lr = optimizer.lr();
@@ -122,52 +254,91 @@ int main() {
             std::cout << "Lr decay to " << optimizer.lr() << std::endl;
         }
 
-        for(index_t j = 0; j < train_dataset.n_batchs(); ++j) {
-            std::tie(n_samples, batch_samples, batch_labels) = 
-                train_dataset.get_batch(j);
-            st::Tensor input(
-                batch_samples, 
-                {n_samples, 
-                 st::data::Cifar10::Img::n_channels_, 
-                 st::data::Cifar10::Img::n_rows_, 
-                 st::data::Cifar10::Img::n_cols_}
-            );
-
-            st::Tensor output = scnn.forward(input);
-            st::Tensor loss = criterion.forward(output, batch_labels);
-            loss.backward();
-
-            optimizer.step();
-            optimizer.zero_grad();
-
-            if(j % print_iters == 0) {
-                std::cout << "iter " << j << " | ";
-                std::cout << "loss: " << loss.item() << std::endl;
+        for(index_t j = 0; j < train_loader.n_batchs(); ++j) {
+            batch_labels = train_loader.next_into(input);
+            n_samples = input.size(0);
+            bool planned_step = plan_memory && n_samples == batch_size;
+            bool tracing = planned_step && !planner.planned();
+            if(planned_step)
+                tracing ? planner.begin_trace() : planner.begin_step();
+
+            {
+                st::Tensor output = scnn.forward(input);
+                st::Tensor loss = criterion.forward(output, batch_labels);
+                steady_clock::time_point backward_tp = steady_clock::now();
+                st::Alloc::reset_peak_memory();
+                loss.backward();
+                backward_time += duration_cast<duration<double>>(
+                    steady_clock::now() - backward_tp);
+                backward_peak_memory = std::max(
+                    backward_peak_memory, st::Alloc::peak_memory_in_use());
+                backward_held_memory = std::max(
+                    backward_held_memory, st::Alloc::memory_in_use());
+
+                optimizer.step();
+                optimizer.zero_grad();
+
+                if(j % print_iters == 0) {
+                    std::cout << "iter " << j << " | ";
+                    std::cout << "loss: " << loss.item() << std::endl;
+                }
+            }
+
+            if(tracing) {
+                planner.end_trace();
+                std::cout << "Memory of a step: " << planner.n_blocks();
+                std::cout << " tensors, " << planner.naive_size() / 1024;
+                std::cout << " KB separately, " << planner.planned_size() / 1024;
+                std::cout << " KB planned." << std::endl;
+            } else if(planned_step) {
+                planner.end_step();
             }
         }
 
+        std::cout << "Backward with " << backward_threads << " threads took ";
+        std::cout << backward_time.count() << " seconds." << std::endl;
+        std::cout << "Peak memory in backward: ";
+        std::cout << backward_peak_memory / (1 << 20) << " MB." << std::endl;
+        std::cout << "Memory held after backward: ";
+        std::cout << backward_held_memory / (1 << 20) << " MB." << std::endl;
+
         std::cout << "Epoch " << i << " evaluating..." << std::endl;
+        st::NoGradGuard no_grad;
         index_t total_samples = 0, correct_samples = 0;
-        for(index_t j = 0; j < val_dataset.n_batchs(); ++j) {
-            std::tie(n_samples, batch_samples, batch_labels) =
-                val_dataset.get_batch(j);
-            st::Tensor input(
-                batch_samples, 
-                {n_samples,
-                 st::data::Cifar10::Img::n_channels_, 
-                 st::data::Cifar10::Img::n_rows_, 
-                 st::data::Cifar10::Img::n_cols_}
-            );
-
-            st::Tensor output = scnn.forward(input);
-            st::Tensor predict = st::op::argmax(output, 1);
-            for(index_t k = 0; k < n_samples; ++k) {
-                ++total_samples;
-                index_t pd_label = predict[{k}];
-                if(pd_label == batch_labels[k])
-                    ++correct_samples;
+        for(index_t j = 0; j < val_loader.n_batchs(); ++j) {
+            batch_labels = val_loader.next_into(input);
+            n_samples = input.size(0);
+            bool planned_step = plan_memory && n_samples == batch_size;
+            bool tracing = planned_step && !val_planner.planned();
+            if(planned_step)
+                tracing ? val_planner.begin_trace() : val_planner.begin_step();
+
+            {
+                st::Tensor output = scnn.forward(input);
+                st::Tensor predict = st::op::argmax(output, 1);
+                for(index_t k = 0; k < n_samples; ++k) {
+                    ++total_samples;
+                    index_t pd_label = predict[{k}];
+                    if(pd_label == batch_labels[k])
+                        ++correct_samples;
+                }
+            }
+
+            if(tracing) {
+                val_planner.end_trace();
+                std::cout << "Memory of evaluation: " << val_planner.naive_size() / 1024;
+                std::cout << " KB separately, " << val_planner.planned_size() / 1024;
+                std::cout << " KB planned." << std::endl;
+            } else if(planned_step) {
+                val_planner.end_step();
             }
         }
+        // Each process evaluated its shard.
+        data_t counts[2] = {static_cast<data_t>(total_samples),
+                            static_cast<data_t>(correct_samples)};
+        group.all_reduce(counts, 2);
+        total_samples = counts[0];
+        correct_samples = counts[1];
         std::cout << "total samples: " << total_samples;
         std::cout << " | correct samples: " << correct_samples;
         std::cout << " | acc: ";
@@ -178,5 +349,5 @@ int main() {
     duration<double> time_span = duration_cast<duration<double>>(end_tp - start_tp);
     std::cout << "Training finished. Training took " << time_span.count();
     std::cout << " seconds." << std::endl;
-    return 0;
+    return processes.wait() == 0 ? 0 : 1;
 }
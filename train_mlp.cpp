@@ -1,5 +1,8 @@
 #include <iostream>
 #include <chrono>
+#include <cstring>
+#include <memory>
+#include <string>
 
 // The next line will cancel CHECK_XXX macro used in header files,
 // but have no effect on these in src files.
@@ -7,11 +10,17 @@
 
 #include "utils/base_config.h"
 #include "utils/allocator.h"
+#include "utils/grad_mode.h"
 #include "exp/function.h"
+#include "exp/rewrite.h"
 #include "tensor/tensor.h"
+#include "tensor/static_graph.h"
 #include "nn/module.h"
 #include "data/data.h"
+#include "data/data_loader.h"
+#include "data/cache.h"
 #include "nn/optim.h"
+#include "nn/quantize.h"
 
 using st::index_t;
 using st::data_t;
@@ -39,12 +48,92 @@ public:
             {"linear3", linear3_.parameters()}
         };
     }
+
+    friend class QuantizedMLP;
 private:
     st::nn::LinearWithReLU linear1_;
     st::nn::LinearWithReLU linear2_;
     st::nn::Linear linear3_;
 };
 
+// int8 version of a trained MLP. Activations stay in int8 between layers.
+class QuantizedMLP : public st::nn::Module {
+public:
+    QuantizedMLP(MLP& mlp)
+            : linear1_(mlp.linear1_),
+              linear2_(mlp.linear2_),
+              linear3_(mlp.linear3_)
+        {}
+
+    st::Tensor forward(const st::Tensor& input) {
+        if(linear1_.calibrating()) {
+            st::Tensor x1 = linear1_.forward(input);
+            st::Tensor x2 = linear2_.forward(x1);
+            return linear3_.forward(x2);
+        }
+        st::nn::QTensor x1 = linear1_.forward(linear1_.quantize(input));
+        st::nn::QTensor x2 = linear2_.forward(x1);
+        return linear3_.forward(x2).dequantize();
+    }
+
+    void freeze(void) {
+        linear1_.freeze();
+        linear2_.freeze();
+        linear3_.freeze();
+    }
+
+    st::nn::ParamsDict parameters(void) { return {}; }
+private:
+    st::nn::QuantizedLinear linear1_;
+    st::nn::QuantizedLinear linear2_;
+    st::nn::QuantizedLinear linear3_;
+};
+
+// Returns the accuracy on `dataset`, and the time spent in forward().
+std::pair<data_t, data_t> evaluate(st::nn::Module& model, 
+                                   const st::data::DatasetBase& dataset) {
+    using namespace std::chrono;
+    duration<double> forward_time(0);
+    st::NoGradGuard no_grad;
+
+    index_t n_samples;
+    const data_t* batch_samples;
+    const index_t* batch_labels;
+    index_t total_samples = 0, correct_samples = 0;
+    for(index_t j = 0; j < dataset.n_batchs(); ++j) {
+        std::tie(n_samples, batch_samples, batch_labels) = dataset.get_batch(j);
+        st::Tensor input = st::Tensor::from_read_only_blob(
+            batch_samples, st::Shape{n_samples, st::data::MNIST::Img::n_pixels_});
+
+        steady_clock::time_point start_tp = steady_clock::now();
+        st::Tensor output = model.forward(input);
+        forward_time += duration_cast<duration<double>>(steady_clock::now() - start_tp);
+
+        st::Tensor predict = st::op::argmax(output, 1);
+        for(index_t k = 0; k < n_samples; ++k) {
+            ++total_samples;
+            index_t pd_label = predict[{k}];
+            if(pd_label == batch_labels[k])
+                ++correct_samples;
+        }
+    }
+    return {static_cast<data_t>(correct_samples) / total_samples,
+            forward_time.count()};
+}
+
+// MNIST is parsed into a cache at the first run, which later runs map.
+st::data::CachedDataset load_mnist(const std::string& img_path,
+                                   const std::string& label_path,
+                                   const std::string& cache_path,
+                                   index_t batch_size) {
+    if(!st::data::is_cache(cache_path)) {
+        st::data::MNIST dataset(img_path, label_path, batch_size,
+                                /*shuffle=*/false, /*memory_map=*/true);
+        st::data::write_cache(dataset, {st::data::MNIST::Img::n_pixels_},
+                              cache_path, st::data::CacheType::uint8);
+    }
+    return st::data::CachedDataset(cache_path, batch_size, /*shuffle=*/false);
+}
 
 int main() {
     // config
@@ -55,22 +144,31 @@ int main() {
     constexpr data_t lr_decay_factor = 0.1;
     constexpr index_t lr_decay_epoch = 2;
     constexpr index_t print_iters = 10;
+    constexpr index_t calibrate_batchs = 16;
+    constexpr bool static_graph = true;
+    constexpr index_t loader_workers = 2;
 
     using namespace std::chrono;
     steady_clock::time_point start_tp = steady_clock::now();
 
     // dataset
-    st::data::MNIST train_dataset(
+    st::data::CachedDataset train_dataset = load_mnist(
         /*img_path=*/"D:\\storehouse\\dataset\\MNIST\\train-images.idx3-ubyte",
         /*label_path=*/"D:\\storehouse\\dataset\\MNIST\\train-labels.idx1-ubyte",
-        /*batch_size=*/batch_size,
-        /*shuffle=*/false
+        /*cache_path=*/"D:\\storehouse\\dataset\\MNIST\\train.stc",
+        /*batch_size=*/batch_size
     );
-    st::data::MNIST val_dataset(
+    st::data::CachedDataset val_dataset = load_mnist(
         /*img_path=*/"D:\\storehouse\\dataset\\MNIST\\t10k-images.idx3-ubyte",
         /*label_path=*/"D:\\storehouse\\dataset\\MNIST\\t10k-labels.idx1-ubyte",
-        /*batch_size=*/batch_size,
-        /*shuffle=*/false
+        /*cache_path=*/"D:\\storehouse\\dataset\\MNIST\\t10k.stc",
+        /*batch_size=*/batch_size
+    );
+
+    // Training batches are assembled by workers while the model computes.
+    st::data::DataLoader train_loader(
+        train_dataset, batch_size, /*shuffle=*/true, /*drop_last=*/false,
+        /*n_workers=*/loader_workers
     );
 
     // model and criterion
@@ -82,13 +180,27 @@ int main() {
         mlp.parameters(), /*lr=*/lr, /*momentum=*/momentum
     );
 
+    // Capture a step with placeholders. Full batchs replay it, and the last
+    // batch, which may be smaller, runs eagerly.
+    st::Tensor static_input(st::Shape{batch_size, st::data::MNIST::Img::n_pixels_});
+    std::shared_ptr<index_t> static_labels = 
+        st::Alloc::shared_allocate<index_t>(batch_size * sizeof(index_t));
+    std::memset(static_labels.get(), 0, batch_size * sizeof(index_t));
+    st::StaticGraph graph;
+    graph.begin_capture();
+    st::Tensor static_output = mlp.forward(static_input);
+    st::Tensor static_loss = criterion.forward(static_output, static_labels);
+    graph.end_capture(static_loss);
+    std::cout << "Rewrites in the captured step:" << std::endl;
+    st::Rewrite::report(std::cout);
+
     index_t n_samples;
     const data_t* batch_samples;
     const index_t* batch_labels;
     for(index_t i = 0; i < epoch; ++i) {
         std::cout << "Epoch " << i << " training..." << std::endl;
-        std::cout << "total iters: " << train_dataset.n_batchs() << std::endl;
-        train_dataset.shuffle();
+        std::cout << "total iters: " << train_loader.n_batchs() << std::endl;
+        steady_clock::time_point epoch_tp = steady_clock::now();
 
         if(i == lr_decay_epoch) {
             data_t lr = optimizer.lr();
@@ -96,55 +208,61 @@ int main() {
             std::cout << "Lr decay to " << optimizer.lr() << std::endl;
         }
 
-        for(index_t j = 0; j < train_dataset.n_batchs(); ++j) {
+        for(index_t j = 0; j < train_loader.n_batchs(); ++j) {
             std::tie(n_samples, batch_samples, batch_labels) = 
-                train_dataset.get_batch(j);
-            st::Tensor input(
-                batch_samples, 
-                {n_samples, st::data::MNIST::Img::n_pixels_}
-            );
+                train_loader.next();
+            data_t loss_value;
+            if(static_graph && n_samples == batch_size) {
+                graph.feed(static_input, batch_samples);
+                std::memcpy(static_labels.get(), batch_labels, 
+                            batch_size * sizeof(index_t));
+                graph.replay();
+                graph.backward();
+                loss_value = static_loss.item();
+            } else {
+                st::Tensor input = st::Tensor::from_read_only_blob(
+                    batch_samples,
+                    st::Shape{n_samples, st::data::MNIST::Img::n_pixels_});
 
-            st::Tensor output = mlp.forward(input);
-            st::Tensor loss = criterion.forward(output, batch_labels);
-            loss.backward();
+                st::Tensor output = mlp.forward(input);
+                st::Tensor loss = criterion.forward(output, batch_labels);
+                loss.backward();
+                loss_value = loss.item();
+            }
 
             optimizer.step();
             optimizer.zero_grad();
 
             if(j % print_iters == 0) {
                 std::cout << "iter " << j << " | ";
-                std::cout << "loss: " << loss.item() << std::endl;
+                std::cout << "loss: " << loss_value << std::endl;
             }
         }
+        duration<double> epoch_time = duration_cast<duration<double>>(
+            steady_clock::now() - epoch_tp);
+        std::cout << "Training the epoch took " << epoch_time.count();
+        std::cout << " seconds." << std::endl;
 
         std::cout << "Epoch " << i << " evaluating..." << std::endl;
-        index_t total_samples = 0, correct_samples = 0;
-        for(index_t j = 0; j < val_dataset.n_batchs(); ++j) {
-            std::tie(n_samples, batch_samples, batch_labels) =
-                val_dataset.get_batch(j);
-            st::Tensor input(
-                batch_samples,
-                {n_samples, st::data::MNIST::Img::n_pixels_}
-            );
-
-            st::Tensor output = mlp.forward(input);
-            st::Tensor predict = st::op::argmax(output, 1);
-            for(index_t k = 0; k < n_samples; ++k) {
-                ++total_samples;
-                index_t pd_label = predict[{k}];
-                if(pd_label == batch_labels[k])
-                    ++correct_samples;
-            }
-        }
-        std::cout << "total samples: " << total_samples;
-        std::cout << " | correct samples: " << correct_samples;
-        std::cout << " | acc: ";
-        std::cout << static_cast<data_t>(correct_samples) / total_samples << std::endl;
+        std::cout << "acc: " << evaluate(mlp, val_dataset).first << std::endl;
     }
 
     steady_clock::time_point end_tp = steady_clock::now();
     duration<double> time_span = duration_cast<duration<double>>(end_tp - start_tp);
     std::cout << "Training finished. Training took " << time_span.count();
     std::cout << " seconds." << std::endl;
+
+    // post-training quantization
+    QuantizedMLP qmlp(mlp);
+    st::nn::calibrate(qmlp, train_dataset, 
+                      {st::data::MNIST::Img::n_pixels_}, calibrate_batchs);
+    qmlp.freeze();
+
+    auto float_result = evaluate(mlp, val_dataset);
+    auto int8_result = evaluate(qmlp, val_dataset);
+    std::cout << "data_t | acc: " << float_result.first;
+    std::cout << " | forward time: " << float_result.second << " seconds" << std::endl;
+    std::cout << "int8   | acc: " << int8_result.first;
+    std::cout << " | forward time: " << int8_result.second << " seconds" << std::endl;
     return 0;
 }